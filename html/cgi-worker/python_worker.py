@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+"""Persistent interpreter for the webserv CGI worker pool (cgi_pool).
+
+webserv starts this with one end of a socketpair as stdin and keeps it
+running. Every request is the CGI environment and the body, each prefixed
+with a 4 byte big endian length; the environment is NAME=VALUE entries
+separated by NUL bytes. The script named by SCRIPT_FILENAME runs in this
+process with that environment, the body as stdin and stdout captured, and
+the captured output goes back with the same length prefix. EOF on stdin
+means the server retired us.
+
+    cgi_pool_worker htmltest/cgi-worker/python_worker.py .py;
+"""
+import io
+import os
+import runpy
+import struct
+import sys
+import traceback
+
+channel = os.fdopen(0, "rb+", buffering=0)
+base_environ = dict(os.environ)
+
+
+def read_exact(n):
+    data = b""
+    while len(data) < n:
+        chunk = channel.read(n - len(data))
+        if not chunk:
+            raise EOFError
+        data += chunk
+    return data
+
+
+def read_frame():
+    return read_exact(struct.unpack("!I", read_exact(4))[0])
+
+
+def run_script(environ, body):
+    """Run one script like a forked CGI would and return its stdout."""
+    stdout = io.BytesIO()
+    text = io.TextIOWrapper(stdout, write_through=True)
+    saved = (sys.stdin, sys.stdout, sys.argv)
+    os.environ.clear()
+    os.environ.update(environ)
+    sys.stdin = io.TextIOWrapper(io.BytesIO(body))
+    sys.stdout = text
+    sys.argv = [environ.get("SCRIPT_FILENAME", "")]
+    try:
+        runpy.run_path(sys.argv[0], run_name="__main__")
+    except SystemExit:
+        pass
+    except Exception:
+        traceback.print_exc(file=sys.stderr)
+        return b"Status: 500 Internal Server Error\r\n\r\n"
+    finally:
+        text.flush()
+        text.detach()  # collecting the wrapper would close stdout
+        sys.stdin, sys.stdout, sys.argv = saved
+        os.environ.clear()
+        os.environ.update(base_environ)
+    return stdout.getvalue()
+
+
+def main():
+    while True:
+        try:
+            entries = read_frame().split(b"\0")
+            body = read_frame()
+        except EOFError:
+            return
+        environ = dict(entry.decode(errors="replace").split("=", 1)
+                       for entry in entries if b"=" in entry)
+        output = run_script(environ, body)
+        reply = memoryview(struct.pack("!I", len(output)) + output)
+        while reply:
+            reply = reply[channel.write(reply):]
+
+
+if __name__ == "__main__":
+    main()
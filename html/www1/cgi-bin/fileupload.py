@@ -61,7 +61,8 @@ def main():
 <body>
     <h1>File Upload</h1>
     <div class="box">
-        <form name="uploadForm" action="/cgi/upload.py" method="POST" enctype="multipart/form-data" onsubmit="return validateForm()">
+        <form name="uploadForm" action="/upload" method="POST" enctype="multipart/form-data" onsubmit="return validateForm()">
+            <input type="hidden" name="redirect" value="/cgi/fileupload.py">
             <label for="file">Select file:</label>
             <input type="file" id="file" name="file">
             <button type="submit" id="uploadButton" disabled>Upload</button>
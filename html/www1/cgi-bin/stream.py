@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Streams bytes in both directions, for the CGI pipeline tests.
+
+POST echoes the body back while it is still arriving, so a server that
+waits for the whole body before reading our output deadlocks once the pipes
+fill up. GET ?size=<bytes> answers with that many bytes of a fixed pattern.
+GET ?crash=1 starts an unframed body and then dies from SIGKILL, after
+?linger=<seconds>; ?fail=1 writes a head and exits with 3, and
+?sleep=<seconds> waits that long before answering.
+"""
+import os
+import signal
+import sys
+import time
+from urllib.parse import parse_qs
+
+PIECE = 65536
+PATTERN = bytes(range(256)) * (PIECE // 256)
+
+
+def main():
+    out = sys.stdout.buffer
+    if os.environ.get("REQUEST_METHOD") == "POST":
+        left = int(os.environ.get("CONTENT_LENGTH") or 0)
+        out.write(b"HTTP/1.1 200 OK\r\n")
+        out.write(b"Content-Type: application/octet-stream\r\n")
+        out.write(b"Content-Length: %d\r\n\r\n" % left)
+        out.flush()
+        while left > 0:
+            data = sys.stdin.buffer.read1(min(left, PIECE))
+            if not data:
+                break
+            left -= len(data)
+            out.write(data)
+            out.flush()
+        return
+
+    query = parse_qs(os.environ.get("QUERY_STRING", ""))
+    time.sleep(float(query.get("sleep", ["0"])[0]))
+    if "crash" in query:
+        out.write(b"Content-Type: text/plain\r\n\r\n")
+        out.write(b"the first half of a response")
+        out.flush()
+        time.sleep(float(query.get("linger", ["0"])[0]))
+        os.kill(os.getpid(), signal.SIGKILL)
+    if "fail" in query:
+        out.write(b"Content-Type: text/plain\r\n\r\n")
+        out.flush()
+        sys.exit(3)
+    left = int(query.get("size", ["0"])[0])
+    out.write(b"HTTP/1.1 200 OK\r\n")
+    out.write(b"Content-Type: application/octet-stream\r\n")
+    out.write(b"Content-Length: %d\r\n\r\n" % left)
+    while left > 0:
+        piece = PATTERN[:min(left, PIECE)]
+        out.write(piece)
+        left -= len(piece)
+    out.flush()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+"""Reports which process ran it, for the CGI worker pool tests.
+
+?sleep=<seconds> delays the answer, ?crash=1 kills the process without
+answering, ?max_age=<seconds> lets the answer be cached that long. The
+counter only survives between requests in a pooled worker.
+"""
+import json
+import os
+import sys
+import time
+from urllib.parse import parse_qs
+
+
+def main():
+    query = parse_qs(os.environ.get("QUERY_STRING", ""))
+    if query.get("crash"):
+        os._exit(3)
+    time.sleep(float(query.get("sleep", ["0"])[0]))
+    state = sys.modules.setdefault("worker_info_state", type(sys)("state"))
+    state.count = getattr(state, "count", 0) + 1
+
+    length = int(os.environ.get("CONTENT_LENGTH") or 0)
+    body = sys.stdin.read(length) if length > 0 else ""
+    payload = json.dumps({
+        "pid": os.getpid(),
+        "count": state.count,
+        "method": os.environ.get("REQUEST_METHOD"),
+        "body_length": len(body),
+    })
+    print("Status: 200 OK")
+    print("Content-Type: application/json")
+    if query.get("max_age"):
+        print("Cache-Control: max-age=" + query["max_age"][0])
+    print()
+    print(payload, end="")
+
+
+if __name__ == "__main__":
+    main()
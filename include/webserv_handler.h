@@ -0,0 +1,83 @@
+#ifndef WEBSERV_HANDLER_H
+# define WEBSERV_HANDLER_H
+
+# include <stddef.h>
+
+/*
+In-process request handlers, mounted on a location with
+
+    location /api/thing {
+        handler ./plugins/thing.so;
+    }
+
+The shared object exports webserv_handler() returning a static ws_handler.
+The server dlopen()s it once at startup and calls handle() for every
+request to the location, so a handler must not block: it gets a read-only
+view of the parsed request and writes its answer through the ws_api
+callbacks into the connection's output buffer. Handlers doing slow work
+set WS_HANDLER_BLOCKING and are run on the server's worker threads
+instead; they must then be thread safe.
+
+Nothing handed to handle() outlives the call, copy what you need.
+*/
+
+# ifdef __cplusplus
+extern "C" {
+# endif
+
+# define WS_HANDLER_ABI_VERSION 1
+
+/* ws_handler.flags */
+# define WS_HANDLER_BLOCKING 1
+
+typedef struct ws_header {
+	const char	*name;
+	const char	*value;
+} ws_header;
+
+typedef struct ws_request {
+	const char		*method;
+	const char		*path;		/* decoded, without the query string */
+	const char		*query;		/* "" when there is none */
+	const char		*location;	/* the location the handler is mounted on */
+	const char		*path_info;	/* path below location, "" or "/..." */
+	const char		*remote_addr;
+	const ws_header	*headers;
+	size_t			header_count;
+	const char		*body;
+	size_t			body_len;
+	int				has_session;
+} ws_request;
+
+typedef struct ws_response ws_response;
+
+typedef struct ws_api {
+	void	(*set_status)(ws_response *res, int status);
+	void	(*set_content_type)(ws_response *res, const char *type);
+	/* no CR/LF in name or value, Content-Length is added by the server */
+	void	(*add_header)(ws_response *res, const char *name,
+				const char *value);
+	void	(*write)(ws_response *res, const char *data, size_t len);
+	/* give the client a session cookie if it has none yet */
+	void	(*start_session)(ws_response *res);
+} ws_api;
+
+typedef struct ws_handler {
+	int			abi_version;	/* WS_HANDLER_ABI_VERSION */
+	const char	*name;
+	int			flags;
+	/* 0 when the response was written, else an HTTP status to answer
+	   with the server's error page */
+	int			(*handle)(const ws_request *req, ws_response *res,
+					const ws_api *api);
+} ws_handler;
+
+typedef const ws_handler *(*ws_handler_entry)(void);
+
+# define WS_HANDLER_SYMBOL "webserv_handler"
+
+# ifdef __cplusplus
+}
+# endif
+
+#endif
@@ -0,0 +1,58 @@
+/*
+Example of a blocking handler plugin, see include/webserv_handler.h
+
+It answers with what it was given: method, path_info, query string, the
+X-Echo header and the body. With ?sleep=N in the query it first sleeps N
+seconds, standing in for slow work; WS_HANDLER_BLOCKING makes the server
+run it on a worker thread so the other connections do not wait for it.
+*/
+
+#include "webserv_handler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+static void	put(ws_response *res, const ws_api *api, const char *s)
+{
+	api->write(res, s, strlen(s));
+}
+
+static int	echo(const ws_request *req, ws_response *res, const ws_api *api)
+{
+	const char	*sleep_arg;
+	size_t		i;
+
+	sleep_arg = strstr(req->query, "sleep=");
+	if (sleep_arg != NULL)
+		sleep((unsigned int)atoi(sleep_arg + 6));
+	put(res, api, req->method);
+	put(res, api, " ");
+	put(res, api, req->path_info);
+	put(res, api, "?");
+	put(res, api, req->query);
+	put(res, api, "\n");
+	for (i = 0; i < req->header_count; i++)
+	{
+		if (strcasecmp(req->headers[i].name, "X-Echo") == 0)
+		{
+			put(res, api, req->headers[i].value);
+			put(res, api, "\n");
+		}
+	}
+	api->write(res, req->body, req->body_len);
+	api->add_header(res, "X-Handler", "echo");
+	return (0);
+}
+
+static const ws_handler	g_handler = {
+	WS_HANDLER_ABI_VERSION,
+	"echo",
+	WS_HANDLER_BLOCKING,
+	echo
+};
+
+const ws_handler	*webserv_handler(void)
+{
+	return (&g_handler);
+}
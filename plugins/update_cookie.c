@@ -0,0 +1,58 @@
+/*
+Example handler plugin, see include/webserv_handler.h
+
+    location /api/update-cookie {
+        handler plugins/update_cookie.so;
+        acceptedMethods PUT
+    }
+
+PUT /api/update-cookie/<name>/<value> sets the cookie name=value for the
+whole site, making sure the client has a session, and answers
+{"status":"success"}. html/www1/cookies uses it.
+*/
+
+#include "webserv_handler.h"
+#include <string.h>
+
+#define SUCCESS "{\"status\":\"success\"}"
+
+static int	update_cookie(const ws_request *req, ws_response *res,
+				const ws_api *api)
+{
+	const char	*name;
+	const char	*separator;
+	char		cookie[1024];
+	size_t		name_len;
+
+	name = req->path_info;
+	if (*name == '/')
+		name++;
+	separator = strchr(name, '/');
+	if (separator == NULL || separator == name)
+		return (400);
+	name_len = (size_t)(separator - name);
+	if (name_len + strlen(separator + 1) + sizeof("=; Path=/") > sizeof(cookie))
+		return (414);
+	memcpy(cookie, name, name_len);
+	cookie[name_len] = '=';
+	strcpy(cookie + name_len + 1, separator + 1);
+	strcat(cookie, "; Path=/");
+
+	api->start_session(res);
+	api->add_header(res, "Set-Cookie", cookie);
+	api->set_content_type(res, "application/json");
+	api->write(res, SUCCESS, sizeof(SUCCESS) - 1);
+	return (0);
+}
+
+static const ws_handler	g_handler = {
+	WS_HANDLER_ABI_VERSION,
+	"update_cookie",
+	0,
+	update_cookie
+};
+
+const ws_handler	*webserv_handler(void)
+{
+	return (&g_handler);
+}
@@ -0,0 +1,357 @@
+#include "Autoindex.hpp"
+#include "Compression.hpp"
+#include "Constants.hpp"
+#include "Responses.hpp"
+#include "Resumable.hpp"
+#include "UploadStore.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <sys/stat.h>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace Autoindex {
+
+struct Entry {
+  ino_t ino;
+  time_t mtime;
+  long mtime_nsec;
+  string body;
+  string gzipped; // made on the first request that accepts gzip
+  unsigned long used;
+
+  Entry() : ino(0), mtime(0), mtime_nsec(0), body(""), gzipped(""), used(0) {}
+};
+
+static map<string, Entry> cache;
+static size_t cache_bytes = 0;
+static unsigned long last_use = 0;
+
+static size_t sizeOf(const Entry &entry) {
+  return entry.body.size() + entry.gzipped.size();
+}
+
+static long mtimeNsec(const struct stat &st) {
+#ifdef __APPLE__
+  return st.st_mtimespec.tv_nsec;
+#else
+  return st.st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Drop the least recently used listings until bytes more fit
+ */
+static void evictFor(size_t bytes) {
+  while (!cache.empty() &&
+         cache_bytes + bytes > Constants::autoindex_cache_size) {
+    map<string, Entry>::iterator oldest = cache.begin();
+    for (map<string, Entry>::iterator it = cache.begin(); it != cache.end();
+         ++it) {
+      if (it->second.used < oldest->second.used) {
+        oldest = it;
+      }
+    }
+    cache_bytes -= sizeOf(oldest->second);
+    cache.erase(oldest);
+  }
+}
+
+/**
+ * @brief ?format=json, or an Accept header asking for JSON
+ */
+static bool wantsJson(HTTPConnxData &conn) {
+  string query = "&" + conn.cgiData.query_string + "&";
+  if (query.find("&format=json&") != string::npos) {
+    return true;
+  }
+  string accept;
+  return conn.checkHeader("Accept", accept) &&
+         accept.find("application/json") != string::npos;
+}
+
+static string contentType(bool json) {
+  return json ? "application/json" : Constants::mimeTypes[".html"];
+}
+
+static string escapeHtml(const string &text) {
+  string out;
+  for (size_t i = 0; i < text.size(); ++i) {
+    switch (text[i]) {
+    case '&': out += "&amp;"; break;
+    case '<': out += "&lt;"; break;
+    case '>': out += "&gt;"; break;
+    case '"': out += "&quot;"; break;
+    default: out += text[i];
+    }
+  }
+  return out;
+}
+
+static string escapeJson(const string &text) {
+  string out;
+  for (size_t i = 0; i < text.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(text[i]);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      out += code;
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  return out;
+}
+
+/**
+ * @brief Percent-encode a name for an href, '/' stays
+ */
+static string encodeHref(const string &name) {
+  static const char hex[] = "0123456789ABCDEF";
+  string out;
+  for (size_t i = 0; i < name.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(name[i]);
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '-' || c == '.' || c == '_' ||
+        c == '~' || c == '/') {
+      out += static_cast<char>(c);
+    } else {
+      out += '%';
+      out += hex[c >> 4];
+      out += hex[c & 0xf];
+    }
+  }
+  return out;
+}
+
+static bool isDir(const string &name) {
+  return !name.empty() && name[name.size() - 1] == '/';
+}
+
+/**
+ * @brief Directories first, then byte order
+ */
+static bool listedBefore(const string &a, const string &b) {
+  if (isDir(a) != isDir(b)) {
+    return isDir(a);
+  }
+  return a < b;
+}
+
+static string head(const HTTPConnxData &conn, bool json) {
+  const string &target = conn.data.target;
+  if (json) {
+    return "{\"path\":\"" + escapeJson(target) + "\",\"entries\":[";
+  }
+  return "<html><head><title>Directory Listing</title>"
+         "<link rel=\"stylesheet\" type=\"text/css\" href=\"/css/style.css\">"
+         "</head><body><div style=\"text-align: left;\">"
+         "<h1 style=\"margin: 0px;\">Index of " +
+         escapeHtml(target) + "</h1><ul>";
+}
+
+static string foot(bool json) {
+  return json ? "]}" : "</ul></div></body></html>";
+}
+
+/**
+ * @brief Append the index-th entry of the listing to out
+ */
+static void appendEntry(string &out, const string &base, const string &name,
+                        size_t index, bool json) {
+  if (json) {
+    bool dir = isDir(name);
+    out += index > 0 ? ",{\"name\":\"" : "{\"name\":\"";
+    out += escapeJson(dir ? name.substr(0, name.size() - 1) : name);
+    out += dir ? "\",\"type\":\"dir\"}" : "\",\"type\":\"file\"}";
+    return;
+  }
+  out += "<li><a href=\"";
+  out += encodeHref(base + name);
+  out += "\">";
+  out += escapeHtml(name);
+  out += "</a></li>\n";
+}
+
+/**
+ * @brief The URL the entries are relative to, with a trailing slash
+ */
+static string baseOf(const HTTPConnxData &conn) {
+  string base = conn.data.target;
+  if (base.empty() || base[base.size() - 1] != '/') {
+    base += '/';
+  }
+  return base;
+}
+
+/**
+ * @brief Answer with a rendered listing, its gzip version when the client
+ * takes one (made now if the entry has none yet)
+ *
+ * The format follows Accept, so caches are told with Vary.
+ */
+static void answer(HTTPConnxData &conn, Entry &entry) {
+  string type = contentType(conn.listing.json);
+  const string *body = &entry.body;
+  string vary = "Accept";
+  if (Compression::wanted(conn, type, static_cast<long>(entry.body.size()))) {
+    if (entry.gzipped.empty() &&
+        !Compression::gzipBuffer(entry.body, conn.urlMatcherData.gzip.level,
+                                 entry.gzipped)) {
+      entry.gzipped.clear();
+    }
+    if (!entry.gzipped.empty()) {
+      body = &entry.gzipped;
+      conn.data.response_headers += "Content-Encoding: gzip\r\n";
+      vary += ", Accept-Encoding";
+    }
+  }
+  conn.data.response_headers += "Vary: " + vary + "\r\n";
+  conn.urlMatcherData.content_type = type;
+  string header;
+  Responses::addStandardHeaders(conn, header, 200, type,
+                                static_cast<long>(body->size()));
+  conn.data.response = header + *body;
+  conn.state = CONN_SIMPLE_RESPONSE;
+}
+
+/**
+ * @brief Answer from the cache if the directory did not change since its
+ * listing was rendered
+ *
+ * Otherwise remembers the directory's stamp and the cache key for
+ * respond(), which gets the freshly read names.
+ */
+bool serveCached(HTTPConnxData &conn, const string &path) {
+  HTTPConnxData::ListingData &listing = conn.listing;
+  listing.json = wantsJson(conn);
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  listing.ino = st.st_ino;
+  listing.mtime = st.st_mtime;
+  listing.mtime_nsec = mtimeNsec(st);
+  string key = string(listing.json ? "json " : "html ") + conn.data.target +
+               "\n" + path;
+  // a change in the same timestamp tick would not move the mtime
+  listing.key = std::time(NULL) - st.st_mtime > 1 ? key : "";
+
+  map<string, Entry>::iterator it = cache.find(key);
+  if (it == cache.end()) {
+    return false;
+  }
+  Entry &entry = it->second;
+  if (entry.ino != listing.ino || entry.mtime != listing.mtime ||
+      entry.mtime_nsec != listing.mtime_nsec) {
+    cache_bytes -= sizeOf(entry);
+    cache.erase(it);
+    return false;
+  }
+  entry.used = ++last_use;
+  size_t before = sizeOf(entry);
+  answer(conn, entry);
+  cache_bytes += sizeOf(entry) - before;
+  debuglog(GREEN, "Autoindex: %s from the cache", path.c_str());
+  return true;
+}
+
+/**
+ * @brief Send the headers of a chunked listing, nextChunk renders the
+ * entries as the socket takes them
+ */
+static void startStream(HTTPConnxData &conn, vector<string> &names) {
+  HTTPConnxData::ListingData &listing = conn.listing;
+  listing.names.swap(names);
+  listing.next = 0;
+  listing.streaming = true;
+  string type = contentType(listing.json);
+  conn.urlMatcherData.content_type = type;
+  conn.data.response_headers += "Vary: Accept\r\n";
+  string header;
+  Responses::addStandardHeaders(conn, header, 200, type, -1);
+  conn.data.response = header;
+  conn.state = CONN_FILE_REQUEST; // without a file, see readNewDataFromFile
+  debuglog(YELLOW, "Autoindex: streaming %zu entries",
+           listing.names.size());
+}
+
+/**
+ * @brief The upload store and resumable session files are not listed
+ */
+static bool hidden(const string &name) {
+  return UploadStore::hidden(name) || Resumable::hidden(name);
+}
+
+/**
+ * @brief Answer with the listing of the names just read from the directory
+ */
+void respond(HTTPConnxData &conn, vector<string> &names) {
+  names.erase(std::remove(names.begin(), names.end(), string("./")),
+              names.end());
+  names.erase(std::remove_if(names.begin(), names.end(), hidden),
+              names.end());
+  std::sort(names.begin(), names.end(), listedBefore);
+  if (names.size() > Constants::autoindex_stream_entries) {
+    startStream(conn, names);
+    return;
+  }
+
+  const HTTPConnxData::ListingData &listing = conn.listing;
+  Entry entry;
+  entry.ino = listing.ino;
+  entry.mtime = listing.mtime;
+  entry.mtime_nsec = listing.mtime_nsec;
+  entry.used = ++last_use;
+  string base = baseOf(conn);
+  entry.body = head(conn, listing.json);
+  for (size_t i = 0; i < names.size(); ++i) {
+    appendEntry(entry.body, base, names[i], i, listing.json);
+  }
+  entry.body += foot(listing.json);
+
+  if (listing.key.empty() ||
+      entry.body.size() > Constants::autoindex_cache_size / 4) {
+    answer(conn, entry);
+    return;
+  }
+  evictFor(entry.body.size());
+  Entry &cached = cache[listing.key];
+  cache_bytes -= sizeOf(cached); // a listing that raced us
+  cached = entry;
+  answer(conn, cached);
+  cache_bytes += sizeOf(cached);
+}
+
+/**
+ * @brief Queue the next chunk of a streamed listing in the send buffer,
+ * the last one with the end of the page and the terminating chunk
+ */
+void nextChunk(HTTPConnxData &conn) {
+  HTTPConnxData::ListingData &listing = conn.listing;
+  string piece = listing.next == 0 ? head(conn, listing.json) : "";
+  string base = baseOf(conn);
+  size_t end = std::min(listing.next + Constants::autoindex_chunk_entries,
+                        listing.names.size());
+  for (; listing.next < end; ++listing.next) {
+    appendEntry(piece, base, listing.names[listing.next], listing.next,
+                listing.json);
+  }
+  string out = Compression::chunk(piece);
+  if (listing.next == listing.names.size()) {
+    out += Compression::chunk(foot(listing.json)) + "0\r\n\r\n";
+    vector<string>().swap(listing.names);
+    listing.streaming = false;
+  }
+  conn.data.buffer.assign(out.begin(), out.end());
+}
+
+} // namespace Autoindex
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include <string>
+#include <vector>
+
+/**
+ * @brief Autoindex directory listings
+ *
+ * Entries are sorted, directories first, and rendered as HTML or, for
+ * ?format=json or an Accept of application/json, as
+ * {"path": ..., "entries": [{"name": ..., "type": "dir"|"file"}, ...]}.
+ *
+ * A rendered listing is cached per directory, URL and format, keyed on the
+ * directory's inode and mtime, so an unchanged directory is not read again;
+ * its gzip version is made on the first request that wants one and kept
+ * next to it. A directory whose mtime is less than a second old is not
+ * cached, a change within the same timestamp tick would go unnoticed. The
+ * cache holds up to Constants::autoindex_cache_size bytes, the least
+ * recently used listings go first.
+ *
+ * Directories with more than Constants::autoindex_stream_entries entries
+ * are neither cached nor rendered in one string: the page goes out with
+ * chunked encoding, Constants::autoindex_chunk_entries entries per chunk,
+ * each rendered when the socket has taken the previous one.
+ */
+namespace Autoindex {
+
+bool serveCached(HTTPConnxData &conn, const std::string &path);
+void respond(HTTPConnxData &conn, std::vector<std::string> &names);
+void nextChunk(HTTPConnxData &conn);
+
+} // namespace Autoindex
@@ -0,0 +1,424 @@
+#include "BodySpool.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "MetadataCache.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "UploadStore.hpp"
+#include "Utils.hpp"
+#include "WorkerPool.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace BodySpool {
+
+// directories with uploads published since the last syncfs()
+static std::set<string> unsynced;
+static std::time_t last_sync = 0;
+
+// flushes of upload_fsync on_complete and batched
+static WorkerPool pool("BodySpool");
+
+/**
+ * @brief Open a nameless read/write temp file in dir
+ *
+ * @return the fd, or -1 with errno set
+ */
+int open(const string &dir) {
+#ifdef O_TMPFILE
+  int fd = ::open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+    return fd; // EISDIR: a kernel without O_TMPFILE support
+  }
+#endif
+  string path = Utils::ensureTrailinSlash(dir) + "webserv-body-XXXXXX";
+  int tmp = mkstemp(&path[0]);
+  if (tmp < 0) {
+    return -1;
+  }
+  unlink(path.c_str());
+  fcntl(tmp, F_SETFD, FD_CLOEXEC);
+  return tmp;
+}
+
+/**
+ * @brief Write all of data, looping over short writes
+ */
+bool write(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd, data, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("BodySpool: write failed");
+      return false;
+    }
+    data += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+/**
+ * @brief Give the spooled body a name at path, replacing what is there
+ *
+ * Only works for an O_TMPFILE on the same filesystem as path; callers copy
+ * the body over when this returns false.
+ */
+bool linkAs(int fd, const string &path) {
+#ifdef O_TMPFILE
+  string proc = "/proc/self/fd/" + Utils::to_string(fd);
+  string part = path + ".part";
+  unlink(part.c_str());
+  fchmod(fd, 0644); // same mode as an upload written by hand
+  if (linkat(AT_FDCWD, proc.c_str(), AT_FDCWD, part.c_str(),
+             AT_SYMLINK_FOLLOW) != 0) {
+    debuglog(YELLOW, "BodySpool: cannot link into %s: %s", path.c_str(),
+             strerror(errno));
+    return false;
+  }
+  if (rename(part.c_str(), path.c_str()) != 0) {
+    unlink(part.c_str());
+    return false;
+  }
+  return true;
+#else
+  (void)fd;
+  (void)path;
+  return false;
+#endif
+}
+
+static string dirOf(const string &path) {
+  size_t slash = path.rfind('/');
+  if (slash == string::npos) {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+/**
+ * @brief Whether linkAs() can give the nameless file in fd a name at path,
+ * which needs both on the same filesystem
+ */
+bool canLink(int fd, const string &path) {
+#ifdef O_TMPFILE
+  struct stat file;
+  struct stat dir;
+  return fstat(fd, &file) == 0 && stat(dirOf(path).c_str(), &dir) == 0 &&
+         file.st_dev == dir.st_dev;
+#else
+  (void)fd;
+  (void)path;
+  return false;
+#endif
+}
+
+/**
+ * @brief Open the file an upload to path is written into until publish()
+ *
+ * @param temp set to the temp file's name, "" if it has none
+ * @return the fd, or -1 with errno set
+ */
+int openFor(const string &path, string &temp) {
+  temp.clear();
+  string dir = dirOf(path);
+#ifdef O_TMPFILE
+  int fd = ::open(dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR)) {
+    return fd;
+  }
+#endif
+  string name = Utils::ensureTrailinSlash(dir) + ".webserv-upload-XXXXXX";
+  int tmp = mkstemp(&name[0]);
+  if (tmp < 0) {
+    return -1;
+  }
+  fchmod(tmp, 0644);
+  fcntl(tmp, F_SETFD, FD_CLOEXEC);
+  temp = name;
+  return tmp;
+}
+
+static bool syncDir(const string &dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = fsync(fd) == 0;
+  close(fd);
+  return ok;
+}
+
+/**
+ * @brief Give a finished upload its name, replacing the old file at once
+ *
+ * With on_complete the data is on disk before the name appears and the
+ * name is on disk before we return; with batched the directory is left to
+ * the next syncBatch(). A store object the old file was the last name of
+ * goes with it, see UploadStore.
+ * @param temp the temp file's name from openFor(), "" for a nameless one
+ */
+bool publish(int fd, const string &temp, const string &path,
+             UploadFsync mode) {
+  if (mode == UPLOAD_FSYNC_ON_COMPLETE && fsync(fd) != 0) {
+    perror("BodySpool: fsync");
+    return false;
+  }
+  string replaced = UploadStore::objectOf(path);
+  bool ok = temp.empty() ? linkAs(fd, path)
+                         : rename(temp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    debuglog(RED, "BodySpool: cannot publish %s: %s", path.c_str(),
+             strerror(errno));
+    return false;
+  }
+  UploadStore::reclaim(replaced);
+  if (mode == UPLOAD_FSYNC_ON_COMPLETE && !syncDir(dirOf(path))) {
+    perror("BodySpool: fsync of directory");
+    return false;
+  }
+  if (mode == UPLOAD_FSYNC_BATCHED) {
+    unsynced.insert(dirOf(path));
+  }
+  return true;
+}
+
+/**
+ * @brief Drop an upload that will not be published
+ *
+ * A nameless temp file is gone with the close, a named one is unlinked.
+ */
+void discard(int fd, string &temp) {
+  close(fd);
+  if (!temp.empty()) {
+    unlink(temp.c_str());
+    temp.clear();
+  }
+}
+
+/**
+ * @brief publish() an upload, through UploadStore if it has a digest, and
+ * drop its done file
+ */
+static bool publishUpload(const Upload &upload, UploadFsync mode) {
+  bool ok = upload.digest.empty()
+                ? publish(upload.fd, upload.temp, upload.path, mode)
+                : UploadStore::publish(upload.fd, upload.temp, upload.path,
+                                       upload.digest, mode);
+  if (ok && !upload.digest.empty() && mode == UPLOAD_FSYNC_BATCHED) {
+    unsynced.insert(dirOf(upload.path)); // on the loop, batched is inline
+  }
+  if (ok && !upload.done.empty()) {
+    unlink(upload.done.c_str());
+  }
+  return ok;
+}
+
+static void syncDirs(const std::set<string> &dirs) {
+  for (std::set<string>::const_iterator it = dirs.begin(); it != dirs.end();
+       ++it) {
+#ifdef __linux__
+    int fd = ::open(it->c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+      if (syncfs(fd) != 0) {
+        perror("BodySpool: syncfs");
+      }
+      close(fd);
+    }
+#else
+    sync();
+#endif
+  }
+}
+
+struct Job : WorkerPool::Job {
+  virtual void finish() = 0; // back on the poll loop
+};
+
+/**
+ * @brief An upload published with on_complete, the connection's response
+ * waits for it
+ */
+struct PublishJob : Job {
+  Upload upload; // with a duplicate of the fd, closed by run()
+  bool ok;
+
+  PublishJob() : upload(), ok(false) {}
+
+  void run() {
+    ok = publishUpload(upload, UPLOAD_FSYNC_ON_COMPLETE);
+    if (!ok && !upload.keep && !upload.temp.empty()) {
+      unlink(upload.temp.c_str());
+    }
+    close(upload.fd);
+  }
+
+  void finish() {
+    MetadataCache::invalidate(upload.path);
+    std::map<int, HTTPConnxData>::iterator it =
+        HTTPServer::connections.find(client_fd);
+    if (it == HTTPServer::connections.end() || !flushed(it->second)) {
+      debuglog(YELLOW, "BodySpool: %s flushed, fd %d is gone",
+               upload.path.c_str(), client_fd);
+    }
+  }
+
+  /**
+   * @brief Let the connection's response go once this was its last flush
+   * @return false if the connection is not the one that waits for it
+   */
+  bool flushed(HTTPConnxData &conn) {
+    vector<unsigned long> &jobs = conn.flush_jobs;
+    vector<unsigned long>::iterator pending =
+        std::find(jobs.begin(), jobs.end(), id);
+    if (pending == jobs.end()) {
+      return false;
+    }
+    jobs.erase(pending);
+    conn.flush_failed = conn.flush_failed || !ok;
+    if (jobs.empty() && conn.client_fd != -1 &&
+        conn.state == CONN_SIMPLE_RESPONSE) {
+      SocketUtils::set_poll_events(conn.client_fd, POLLIN | POLLOUT);
+    }
+    return true;
+  }
+};
+
+/**
+ * @brief One syncfs() round of upload_fsync batched
+ */
+struct SyncJob : Job {
+  std::set<string> dirs;
+
+  void run() { syncDirs(dirs); }
+
+  void finish() {
+    debuglog(GREEN, "BodySpool: synced %zu upload directories", dirs.size());
+  }
+};
+
+/**
+ * @brief Give a finished upload its name as the server's upload_fsync asks
+ *
+ * With on_complete and the flush threads running the publish happens on
+ * one of them and this returns true at once; the connection's response is
+ * held until it is done, see holdsResponse(). The caller closes its fd and
+ * forgets the temp file either way, unless this returns false.
+ * @return false if an inline publish failed
+ */
+bool complete(HTTPConnxData &conn, const Upload &upload) {
+  UploadFsync mode = conn.config->upload_fsync;
+  if (mode == UPLOAD_FSYNC_ON_COMPLETE && pool.started()) {
+    int fd = fcntl(upload.fd, F_DUPFD_CLOEXEC, 0);
+    if (fd != -1) {
+      PublishJob *job = new PublishJob();
+      job->upload = upload;
+      job->upload.fd = fd;
+      job->client_fd = conn.client_fd;
+      conn.flush_jobs.push_back(pool.submit(job));
+      return true;
+    }
+    perror("BodySpool: fcntl, flushing inline");
+  }
+  bool ok = publishUpload(upload, mode);
+  MetadataCache::invalidate(upload.path);
+  return ok;
+}
+
+/**
+ * @brief Hold a response until the connection's flushes are done, one that
+ * failed turns it into a 500
+ * @return true while it waits, the socket is not polled meanwhile
+ */
+bool holdsResponse(HTTPConnxData &conn) {
+  if (!conn.flush_jobs.empty()) {
+    SocketUtils::set_poll_events(conn.client_fd, 0);
+    return true;
+  }
+  if (conn.flush_failed) {
+    conn.flush_failed = false;
+    conn.reset();
+    Responses::htmlErrorResponse(conn, 500);
+  }
+  return false;
+}
+
+/**
+ * @brief Whether batched uploads wait for syncBatch(), the poll loop then
+ * wakes up often enough to run it on time
+ */
+bool syncPending() { return !unsynced.empty(); }
+
+/**
+ * @brief Flush the uploads published with upload_fsync batched, at most
+ * once per Constants::upload_fsync_interval
+ *
+ * syncfs() writes back the whole filesystem of each directory, so one call
+ * covers every upload that landed there since the last one. It runs on a
+ * flush thread, inline only if none started.
+ */
+void syncBatch(std::time_t now) {
+  if (unsynced.empty() || now - last_sync < Constants::upload_fsync_interval) {
+    return;
+  }
+  last_sync = now;
+  if (pool.started()) {
+    SyncJob *job = new SyncJob();
+    job->dirs.swap(unsynced);
+    pool.submit(job);
+    return;
+  }
+  syncDirs(unsynced);
+  debuglog(GREEN, "BodySpool: synced %zu upload directories", unsynced.size());
+  unsynced.clear();
+}
+
+/**
+ * @brief Start the flush threads once some server has upload_fsync on
+ *
+ * Also called after a reload, the threads stay and their eventfd is polled
+ * again.
+ */
+void startAll(const std::vector<ServerData> &configs) {
+  bool wanted = false;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    wanted = wanted || configs[i].upload_fsync != UPLOAD_FSYNC_OFF;
+  }
+  if (wanted && !pool.started()) {
+    pool.start(Constants::upload_fsync_threads);
+  }
+  pool.startPolling();
+}
+
+void stopPolling() { pool.stopPolling(); }
+
+/**
+ * @brief Finish the flushes that are done, if pfd is the flush threads'
+ * eventfd
+ */
+bool handlePollEvent(const pollfd &pfd) {
+  if (!pool.owns(pfd)) {
+    return false;
+  }
+  vector<WorkerPool::Job *> finished;
+  pool.collect(finished);
+  for (size_t i = 0; i < finished.size(); ++i) {
+    Job *job = static_cast<Job *>(finished[i]);
+    job->finish();
+    delete job;
+  }
+  return true;
+}
+
+} // namespace BodySpool
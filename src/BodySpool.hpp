@@ -0,0 +1,64 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include "ServerData.hpp"
+#include <poll.h>
+#include <ctime>
+#include <string>
+#include <sys/types.h>
+
+using std::string;
+
+/**
+ * @brief Request bodies kept in an unlinked temp file instead of memory
+ *
+ * Once a decoded chunked body grows past client_body_buffer_size it moves
+ * to a file in client_body_temp_path. On Linux the file is opened with
+ * O_TMPFILE, so it never has a name and goes away with the last close even
+ * if we crash; elsewhere it is unlinked right after mkstemp(). CGI stdin,
+ * FastCGI, the worker pool and uploads then read the body from there.
+ *
+ * Uploads use the same kind of file: it is created next to its destination
+ * and only takes the destination's name once complete (publish), so a
+ * reader never sees half a file and an aborted upload leaves the old one
+ * in place. Where O_TMPFILE is missing the temp file has a hidden name
+ * instead, which discard() removes.
+ *
+ * The fsync()s of upload_fsync on_complete and the syncfs() of batched run
+ * on Constants::upload_fsync_threads worker threads, not on the poll loop.
+ * A connection keeps the ids of its pending flushes in flush_jobs and its
+ * response is held until they are done; if one failed it becomes a 500.
+ */
+namespace BodySpool {
+
+/**
+ * @brief A finished upload to give its name, see complete()
+ */
+struct Upload {
+  int fd;        // stays the caller's, a flush works on a duplicate
+  string temp;   // from openFor(), "" for a nameless file
+  string path;
+  string digest; // hex SHA-256 to publish through UploadStore, "" for none
+  string done;   // unlinked once published, "" for none
+  bool keep;     // the temp file outlives a failed publish (resumable)
+
+  Upload() : fd(-1), temp(""), path(""), digest(""), done(""), keep(false) {}
+};
+
+int open(const string &dir);
+bool write(int fd, const char *data, size_t len);
+bool linkAs(int fd, const string &path);
+bool canLink(int fd, const string &path);
+int openFor(const string &path, string &temp);
+bool publish(int fd, const string &temp, const string &path,
+             UploadFsync mode);
+void discard(int fd, string &temp);
+bool complete(HTTPConnxData &conn, const Upload &upload);
+bool holdsResponse(HTTPConnxData &conn);
+bool syncPending();
+void syncBatch(std::time_t now);
+void startAll(const std::vector<ServerData> &configs);
+void stopPolling();
+bool handlePollEvent(const pollfd &pfd);
+
+} // namespace BodySpool
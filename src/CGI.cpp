@@ -1,10 +1,23 @@
 #include "CGI.hpp"
 #include "Config.hpp"
+#include "Constants.hpp"
 #include "HTTPConnxData.hpp"
 #include "HTTPServer.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
 #include "URLMatcher.hpp"
 #include "Utils.hpp"
 #include "debug.h"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <fcntl.h>
+#include <spawn.h>
+#include <cstdlib>
+#include <sstream>
+#include <strings.h>
+#include <sys/wait.h>
 
 using std::string;
 using std::vector;
@@ -12,6 +25,206 @@ using std::map;
 
 namespace CGI {
 
+/**
+ * @brief Forked scripts of one cgi block: how many run and the client fds
+ * waiting for max_concurrent to let them in
+ */
+struct Slots {
+  size_t active;
+  std::deque<int> queue;
+
+  Slots() : active(0), queue() {}
+};
+
+static map<const CGIData *, Slots> slots; // by cgi block of the config
+static size_t rejected = 0;               // 503s for a full queue
+static size_t failed = 0;                 // scripts that exited non-zero
+static size_t signalled = 0;              // scripts killed by a signal
+
+/**
+ * @brief Fork the script, or answer 500 if that fails
+ */
+static void launch(HTTPConnxData &conn) {
+  conn.state = CONN_CGI_INCOMING;
+  if (prepareCGI(conn) < 0) {
+    conn.reset();
+    Responses::createResponse(conn, "text/plain",
+                              "Failed to execute CGI script", 500);
+  }
+}
+
+/**
+ * @brief Answer 503 with a Retry-After, the client is back in charge
+ */
+static void shed(HTTPConnxData &conn) {
+  ++rejected;
+  SocketUtils::set_poll_events(conn.client_fd, POLLIN | POLLOUT);
+  if (conn.data.content_length > 0) {
+    conn.closeConnection = true; // the body is still on the socket
+  }
+  conn.data.response_headers +=
+      "Retry-After: " + Utils::to_string(Constants::cgi_retry_after) + "\r\n";
+  Responses::htmlErrorResponse(conn, 503);
+}
+
+/**
+ * @brief Run the script now if its cgi block has a free slot, else queue
+ * the request or shed it with 503 when the queue is full
+ *
+ * A queued request reads nothing: its body waits on the socket (or in the
+ * spool of a chunked body) and the client fd has no poll interest until
+ * releaseSlot lets it in. Static files keep being served meanwhile.
+ */
+void startRequest(HTTPConnxData &conn) {
+  const CGIData &block = conn.config->cgiData;
+  Slots &own = slots[&block];
+  if (block.max_concurrent == 0 || own.active < block.max_concurrent) {
+    ++own.active;
+    conn.cgiData.slot = &block;
+    launch(conn);
+    return;
+  }
+  if (own.queue.size() >= block.queue_size) {
+    debuglog(YELLOW, "CGI: %zu running, %zu queued - 503 for fd %d",
+             own.active, own.queue.size(), conn.client_fd);
+    shed(conn);
+    return;
+  }
+  own.queue.push_back(conn.client_fd);
+  conn.cgiData.queued_since = std::time(NULL);
+  conn.state = CONN_CGI_QUEUED;
+  SocketUtils::set_poll_events(conn.client_fd, 0);
+  debuglog(YELLOW, "CGI: client fd %d queued (%zu waiting)", conn.client_fd,
+           own.queue.size());
+}
+
+/**
+ * @brief Give up the connection's slot or place in the queue
+ *
+ * Called from HTTPConnxData::reset. A freed slot goes to the first queued
+ * request that is still around.
+ */
+void releaseSlot(HTTPConnxData &conn) {
+  const CGIData *block = conn.cgiData.slot;
+  if (conn.cgiData.queued_since != 0) {
+    std::map<const CGIData *, Slots>::iterator it = slots.begin();
+    for (; it != slots.end(); ++it) {
+      std::deque<int> &queue = it->second.queue;
+      queue.erase(std::remove(queue.begin(), queue.end(), conn.client_fd),
+                  queue.end());
+    }
+    conn.cgiData.queued_since = 0;
+  }
+  if (block == NULL) {
+    return;
+  }
+  conn.cgiData.slot = NULL;
+  Slots &own = slots[block];
+  --own.active;
+  while (!own.queue.empty()) {
+    int fd = own.queue.front();
+    own.queue.pop_front();
+    std::map<int, HTTPConnxData>::iterator it = HTTPServer::connections.find(fd);
+    if (it == HTTPServer::connections.end() ||
+        it->second.state != CONN_CGI_QUEUED) {
+      continue;
+    }
+    HTTPConnxData &next = it->second;
+    debuglog(YELLOW, "CGI: client fd %d waited %lds for its slot", fd,
+             static_cast<long>(std::time(NULL) - next.cgiData.queued_since));
+    next.cgiData.queued_since = 0;
+    next.cgiData.slot = block;
+    ++own.active;
+    launch(next);
+    return;
+  }
+}
+
+/**
+ * @brief 503 for a request that waited cgi_queue_timeout for a slot
+ */
+bool checkQueueTimeout(HTTPConnxData &conn) {
+  if (std::time(NULL) - conn.cgiData.queued_since <=
+      Constants::cgi_queue_timeout) {
+    return false;
+  }
+  debuglog(YELLOW, "CGI: client fd %d gave up waiting for a slot",
+           conn.client_fd);
+  releaseSlot(conn);
+  shed(conn);
+  return true;
+}
+
+/**
+ * @brief Count how a reaped script ended
+ */
+void countExit(int status) {
+  if (WIFSIGNALED(status)) {
+    ++signalled;
+  } else if (WEXITSTATUS(status) != 0) {
+    ++failed;
+  }
+}
+
+/**
+ * @brief The CGI gauges as JSON: running and queued forked scripts over
+ * all cgi blocks, requests shed, scripts that failed and were killed so
+ * far
+ */
+string statusJson() {
+  size_t active = 0;
+  size_t queued = 0;
+  std::map<const CGIData *, Slots>::const_iterator it = slots.begin();
+  for (; it != slots.end(); ++it) {
+    active += it->second.active;
+    queued += it->second.queue.size();
+  }
+  return "{\"active\":" + Utils::to_string(active) +
+         ",\"queued\":" + Utils::to_string(queued) +
+         ",\"rejected\":" + Utils::to_string(rejected) +
+         ",\"failed\":" + Utils::to_string(failed) +
+         ",\"signalled\":" + Utils::to_string(signalled) + "}";
+}
+
+/**
+ * @brief Start a program with stdin_fd and stdout_fd as its stdin/stdout
+ *
+ * fork() copies the page tables of the whole server, so it gets slower the
+ * more memory our caches and buffers hold. glibc's posix_spawn runs the
+ * child with clone(CLONE_VM | CLONE_VFORK) instead, which costs the same at
+ * any server size (see tests/bench/spawn_bench.cpp). Every fd the server
+ * keeps open is close-on-exec, so the child gets only these two and
+ * stderr.
+ *
+ * @return the child's pid, -1 if it could not be started
+ */
+pid_t spawn(const string &path, char *const argv[], char *const envp[],
+            int stdin_fd, int stdout_fd) {
+  posix_spawn_file_actions_t actions;
+  if (posix_spawn_file_actions_init(&actions) != 0) {
+    perror("posix_spawn_file_actions_init");
+    return -1;
+  }
+  posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, stdout_fd, STDOUT_FILENO);
+  // we block SIGCHLD for the signalfd, the child gets a clean mask
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t mask;
+  sigemptyset(&mask);
+  posix_spawnattr_setsigmask(&attr, &mask);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  pid_t pid;
+  int err = posix_spawn(&pid, path.c_str(), &actions, &attr, argv, envp);
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+  if (err != 0) {
+    debuglog(RED, "Failed to start %s: %s", path.c_str(), strerror(err));
+    return -1;
+  }
+  return pid;
+}
+
 // Start a CGI process for a connection
 int prepareCGI(HTTPConnxData &conn) {
   // CLEAN UP PREVIOUS PIPES IF THEY EXIST
@@ -39,17 +252,22 @@ int prepareCGI(HTTPConnxData &conn) {
       SocketUtils::remove_from_poll(conn.cgiData.child_stdout_pipe[1]);
       conn.cgiData.child_stdout_pipe[1] = -1;
   }
-  // kill the previous child process if it exists
+  // forget a previous child process, the reaper still collects it
   if (conn.cgiData.child_pid != -1) {
     debuglog(YELLOW, "Found previous CGI child process - cleaning up");
-    HTTPServer::terminatedPids.insert(conn.cgiData.child_pid);
     conn.cgiData.child_pid = -1;
   }
 
   setCGIEnv(conn);
 
-  // Just get the request body - chunking already handled in URLMatcher
-  conn.cgiData.buffer = conn.data.request.substr(conn.data.headers_end);
+  // whatever of the body came with the head goes first, pumpCgi reads the
+  // rest from the socket (or the spool of a big chunked body) as the child
+  // takes it
+  size_t received = std::min(conn.data.request.size() - conn.data.headers_end,
+                             conn.data.content_length);
+  conn.cgiData.buffer = conn.data.request.substr(conn.data.headers_end,
+                                                 received);
+  conn.cgiData.request_left = conn.data.content_length - received;
 
   // Create pipes
   debug("create pipes");
@@ -67,98 +285,75 @@ int prepareCGI(HTTPConnxData &conn) {
   debug("values in the pipes now %d", conn.cgiData.child_stdin_pipe[1]);
   debug("values in the pipes now %d", conn.cgiData.child_stdout_pipe[0]);
   debug("values in the pipes now %d", conn.cgiData.child_stdout_pipe[1]);
-  // Set the pipes to non-blocking mode
-  // Create child process
-  pid_t pid = fork();
-
-  if (pid < 0) {
-    perror("Failed to fork");
-    return -1;
-  } else if (pid == 0) {
-    // Child process
+  // our ends must not leak into other CGI children, or EOF on them would
+  // wait for those to exit too; adddup2 clears the flag on stdin/stdout
+  for (int i = 0; i < 2; ++i) {
+    fcntl(conn.cgiData.child_stdin_pipe[i], F_SETFD, FD_CLOEXEC);
+    fcntl(conn.cgiData.child_stdout_pipe[i], F_SETFD, FD_CLOEXEC);
+  }
+  // and they never block the server, the child's ends stay blocking
+  fcntl(conn.cgiData.child_stdin_pipe[1], F_SETFL, O_NONBLOCK);
+  fcntl(conn.cgiData.child_stdout_pipe[0], F_SETFL, O_NONBLOCK);
 
-    // Close unused pipe ends
-    ::close(conn.cgiData.child_stdin_pipe[1]); // Close write end of stdin pipe
-    ::close(conn.cgiData.child_stdout_pipe[0]); // Close read end of stdout pipe
+  string script_path = Utils::removeLeadingSlash(Utils::ensureTrailinSlash(
+                           conn.config->root)) +
+                       Utils::removeLeadingSlash(conn.urlMatcherData.full_path);
+  debug("CGI script_path: %s", script_path.c_str());
 
-    // Redirect stdin and stdout
-    ::dup2(conn.cgiData.child_stdin_pipe[0], STDIN_FILENO);
-    ::dup2(conn.cgiData.child_stdout_pipe[1], STDOUT_FILENO);
+  // the env array is built here, the child only execs
+  vector<string> envEntries;
+  for (map<string, string>::const_iterator it = conn.cgiData.env.begin();
+       it != conn.cgiData.env.end(); ++it) {
+    envEntries.push_back(it->first + "=" + it->second);
+  }
+  vector<char *> envArray;
+  for (size_t i = 0; i < envEntries.size(); ++i) {
+    envArray.push_back(const_cast<char *>(envEntries[i].c_str()));
+  }
+  envArray.push_back(NULL);
+  char *args[] = {const_cast<char *>(script_path.c_str()), NULL};
 
-    // Close original file descriptors
-    ::close(conn.cgiData.child_stdin_pipe[0]);
-    ::close(conn.cgiData.child_stdout_pipe[1]);
-
-    // Prepare environment variables for execve - this one a bit complicate
-    // because the env expects a const char* array . the args was easier. could
-    // not use the const_cast in the same way
-    char **envArray = new char *[conn.cgiData.env.size() + 1];
-    int i = 0;
-    for (map<string, string>::const_iterator it =
-             conn.cgiData.env.begin();
-         it != conn.cgiData.env.end(); ++it, ++i) {
-      string envEntry = it->first + "=" + it->second;
-      envArray[i] = new char[envEntry.size() + 1];
-      std::strcpy(envArray[i], envEntry.c_str());
+  pid_t pid = spawn(script_path, args, &envArray[0],
+                    conn.cgiData.child_stdin_pipe[0],
+                    conn.cgiData.child_stdout_pipe[1]);
+  if (pid < 0) {
+    for (int i = 0; i < 2; ++i) {
+      ::close(conn.cgiData.child_stdin_pipe[i]);
+      ::close(conn.cgiData.child_stdout_pipe[i]);
+      conn.cgiData.child_stdin_pipe[i] = -1;
+      conn.cgiData.child_stdout_pipe[i] = -1;
     }
-    envArray[i] = NULL;
-
-    string script_path = Utils::removeLeadingSlash(Utils::ensureTrailinSlash(
-                                  conn.config->root)) +
-                              Utils::removeLeadingSlash(conn.urlMatcherData.full_path);
-    debug("CGI script_path: %s", script_path.c_str());
-
-    // Prepare arguments
-    vector<char *> args;
-    args.push_back(const_cast<char *>(script_path.c_str()));
-    args.push_back(NULL);
-
-    // Execute the Python script
-    ::execve(script_path.c_str(), args.data(), envArray);
+    return -1;
+  }
+  // Close unused pipe ends
+  ::close(conn.cgiData.child_stdout_pipe[1]);    // Close write end of stdout pipe
+  ::close(conn.cgiData.child_stdin_pipe[0]); // Close read end of stdin pipe
 
-    // If execve fails
-    ::perror("Failed to execute CGI script");
 
-    // Free allocated memory if execve fails
-    for (int j = 0; j < i; ++j) {
-      delete[] envArray[j];
-    }
-    delete[] envArray;
-    std::exit(EXIT_FAILURE);
+  // for clarity I will assign the fds to the connection data cgi
+  conn.cgiData.cgi_stdin_fd = conn.cgiData.child_stdin_pipe[1];
+  conn.cgiData.cgi_stdout_fd = conn.cgiData.child_stdout_pipe[0];
+  debug("CGI stdin fd: %d", conn.cgiData.cgi_stdin_fd);
+  debug("CGI stdout fd: %d", conn.cgiData.cgi_stdout_fd);
+  // assign the fds to the connection data
+  if (conn.data.method == "GET" || (conn.data.content_length == 0)) {
+    // No data to send to CGI stdin, close the write end of the pipe
+    debug("GET request in cgi - closing child stdin pipe[1]");
+    conn.state = CONN_CGI_SENDING;
+    ::close(conn.cgiData.child_stdin_pipe[1]);
+    conn.cgiData.cgi_stdin_fd = -1;
+    conn.cgiData.buffer.clear();
+    conn.cgiData.request_left = 0;
   } else {
-    // Parent process
-    // Close unused pipe ends
-    ::close(conn.cgiData.child_stdout_pipe[1]);    // Close write end of stdout pipe
-    ::close(conn.cgiData.child_stdin_pipe[0]); // Close read end of stdin pipe
-
-
-    // for clarity I will assign the fds to the connection data cgi
-    conn.cgiData.cgi_stdin_fd = conn.cgiData.child_stdin_pipe[1];
-    conn.cgiData.cgi_stdout_fd = conn.cgiData.child_stdout_pipe[0];
-    debug("CGI stdin fd: %d", conn.cgiData.cgi_stdin_fd);
-    debug("CGI stdout fd: %d", conn.cgiData.cgi_stdout_fd);
-    // assign the fds to the connection data
-    if (conn.data.method == "GET" || (conn.data.content_length == 0)) {
-      // No data to send to CGI stdin, close the write end of the pipe
-      debug("GET request in cgi - closing child stdin pipe[1]");
-      conn.state = CONN_CGI_SENDING;
-      SocketUtils::add_to_poll(conn.cgiData.child_stdout_pipe[0], POLLIN);
-      ::close(conn.cgiData.child_stdin_pipe[1]);
-    } else {
-      SocketUtils::add_to_poll(conn.cgiData.child_stdin_pipe[1], POLLOUT);
-      SocketUtils::add_to_poll(conn.cgiData.child_stdout_pipe[0], POLLIN);
-    }
-
-    // add the fds to the poll
-
-    // this buffer is bidirectional. in this case i use now for the req body
-    debug("CGI request body: %s", conn.cgiData.buffer.c_str());
-    conn.cgiData.child_pid = pid;
-    debug("Started CGI process with PID %d", pid);
-
-    // the rest will happen in the poll loop
-    return 0;
+    SocketUtils::add_to_poll(conn.cgiData.child_stdin_pipe[1], 0);
   }
+  SocketUtils::add_to_poll(conn.cgiData.child_stdout_pipe[0], POLLIN);
+  conn.cgiData.child_pid = pid;
+  debug("Started CGI process with PID %d", pid);
+
+  // the rest will happen in the poll loop, see HTTPConnxData::pumpCgi
+  conn.updateCgiPollEvents();
+  return 0;
 }
 
 void setCGIEnv(HTTPConnxData &conn) {
@@ -232,6 +427,95 @@ void setCGIEnv(HTTPConnxData &conn) {
   debuglog(YELLOW, "set auth type to %s", conn.cgiData.env["AUTH_TYPE"].c_str());
 }
 
+/**
+ * @brief Read a CGI header block (without the blank line)
+ *
+ * Status or an NPH status line sets the code, a Location without one makes
+ * it a 302. Framing headers are ours to decide, so Content-Length is only
+ * remembered and Transfer-Encoding and Connection are dropped; everything
+ * else ends up in head.headers ready to send.
+ *
+ * @return false when the status is not a valid HTTP status
+ */
+bool parseHead(const string &block, Head &head) {
+  head.status = 200;
+  head.type = "text/html";
+  head.location.clear();
+  head.length = -1;
+  head.headers.clear();
+  std::istringstream lines(block);
+  string line;
+  if (block.compare(0, 5, "HTTP/") == 0 && std::getline(lines, line)) {
+    // NPH style "HTTP/1.1 200 OK", like the scripts in cgi-bin print
+    size_t space = line.find(' ');
+    head.status = space == string::npos ? 0 : std::atoi(line.c_str() + space + 1);
+  }
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    if (colon == string::npos) {
+      continue;
+    }
+    string name = Utils::trim(line.substr(0, colon));
+    string value = Utils::trim(line.substr(colon + 1));
+    if (!value.empty() && value[value.size() - 1] == '\r') {
+      value.erase(value.size() - 1);
+    }
+    if (strcasecmp(name.c_str(), "Status") == 0) {
+      head.status = std::atoi(value.c_str());
+    } else if (strcasecmp(name.c_str(), "Content-Type") == 0) {
+      head.type = value;
+    } else if (strcasecmp(name.c_str(), "Location") == 0) {
+      head.location = value;
+    } else if (strcasecmp(name.c_str(), "Content-Length") == 0) {
+      char *end = NULL;
+      long length = std::strtol(value.c_str(), &end, 10);
+      if (!value.empty() && *end == '\0' && length >= 0) {
+        head.length = length;
+      }
+    } else if (strcasecmp(name.c_str(), "Transfer-Encoding") != 0 &&
+               strcasecmp(name.c_str(), "Connection") != 0) {
+      head.headers += name + ": " + value + "\r\n";
+    }
+  }
+  if (!head.location.empty() && head.status == 200) {
+    head.status = 302; // CGI rule for a Location without Status
+  }
+  return head.status >= 100 && head.status <= 599;
+}
+
+/**
+ * @brief Turn complete CGI style output into our response
+ *
+ * Used when the whole output is known before anything is sent (FastCGI,
+ * pooled workers). The body is all here and gets its own Content-Length.
+ */
+void respondWithOutput(HTTPConnxData &conn, const string &output) {
+  size_t crlf = output.find("\r\n\r\n");
+  size_t lf = output.find("\n\n");
+  size_t head_end = std::min(crlf, lf);
+  if (head_end == string::npos) {
+    debuglog(RED, "CGI: output without a header block");
+    Responses::htmlErrorResponse(conn, 502);
+    return;
+  }
+  string body = output.substr(head_end + (head_end == crlf ? 4 : 2));
+
+  Head head;
+  if (!parseHead(output.substr(0, head_end), head)) {
+    Responses::htmlErrorResponse(conn, 502);
+    return;
+  }
+  conn.data.response_headers += head.headers;
+  if (!head.location.empty()) {
+    if (head.status >= 300 && head.status < 400) {
+      Responses::createResponse(conn, head.type, head.location, head.status);
+      return;
+    }
+    conn.data.response_headers += "Location: " + head.location + "\r\n";
+  }
+  Responses::createResponse(conn, head.type, body, head.status);
+}
+
 } // namespace CGI
 
 /**
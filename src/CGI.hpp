@@ -6,8 +6,28 @@
 
 namespace CGI {
 
+/**
+ * @brief What a CGI header block asks for, see parseHead
+ */
+struct Head {
+  int status;
+  std::string type;
+  std::string location;
+  long length;         // Content-Length, -1 when the script gave none
+  std::string headers; // the rest, as "Name: value\r\n" lines
+};
+
+void startRequest(HTTPConnxData &connx);
+void releaseSlot(HTTPConnxData &connx);
+bool checkQueueTimeout(HTTPConnxData &connx);
+void countExit(int status);
+std::string statusJson();
 // Start a CGI process for a connection
 int prepareCGI(HTTPConnxData &connx);
+pid_t spawn(const std::string &path, char *const argv[], char *const envp[],
+            int stdin_fd, int stdout_fd);
 void setCGIEnv(HTTPConnxData &connx);
+bool parseHead(const std::string &block, Head &head);
+void respondWithOutput(HTTPConnxData &connx, const std::string &output);
 
 } // namespace CGI
@@ -0,0 +1,308 @@
+#include "CGICache.hpp"
+#include "CGI.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "SocketUtils.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <ctime>
+#include <map>
+#include <sstream>
+#include <strings.h>
+#include <vector>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace CGICache {
+
+/**
+ * @brief One cached CGI output, replayed through CGI::respondWithOutput
+ */
+struct Entry {
+  string output;
+  time_t stored;
+  time_t expires;
+  time_t used;
+
+  Entry() : output(""), stored(0), expires(0), used(0) {}
+};
+
+/**
+ * @brief Entries and in-flight misses of one cgi block
+ */
+struct Store {
+  map<string, Entry> entries;
+  size_t bytes;
+  map<string, vector<int> > waiting; // key of a running miss -> client fds
+
+  Store() : entries(), bytes(0), waiting() {}
+};
+
+static map<const CGIData *, Store> stores; // by cgi block of the config
+
+/**
+ * @brief Value of a request header, matched case-insensitively
+ */
+static string requestHeader(const HTTPConnxData &conn, const string &name) {
+  map<string, string>::const_iterator it = conn.data.headers.begin();
+  for (; it != conn.data.headers.end(); ++it) {
+    if (strcasecmp(it->first.c_str(), name.c_str()) == 0) {
+      return it->second;
+    }
+  }
+  return "";
+}
+
+/**
+ * @brief Script, query string and the selected request headers
+ */
+static string cacheKey(const HTTPConnxData &conn) {
+  const CGIData &block = conn.config->cgiData;
+  string key = conn.config->root + conn.urlMatcherData.full_path + "?" +
+               conn.cgiData.query_string;
+  for (size_t i = 0; i < block.cache_key_headers.size(); ++i) {
+    key += "\n" + requestHeader(conn, block.cache_key_headers[i]);
+  }
+  return key;
+}
+
+/**
+ * @brief Answer from a stored output, with its Age
+ */
+static void respond(HTTPConnxData &conn, Entry &entry, time_t now) {
+  entry.used = now;
+  SocketUtils::set_poll_events(conn.client_fd, POLLIN | POLLOUT);
+  conn.data.response_headers +=
+      "Age: " + Utils::to_string(now - entry.stored) + "\r\n";
+  CGI::respondWithOutput(conn, entry.output);
+}
+
+/**
+ * @brief Seconds the CGI head allows the output to be cached, 0 if not
+ *
+ * Only a 200 with Cache-Control: max-age and nothing that makes the
+ * response private to this client qualifies. Anything the script wrote
+ * past its Content-Length is cut off, it was not sent either.
+ */
+static long maxAge(string &output) {
+  size_t crlf = output.find("\r\n\r\n");
+  size_t end = std::min(crlf, output.find("\n\n"));
+  CGI::Head head;
+  if (end == string::npos || !CGI::parseHead(output.substr(0, end), head) ||
+      head.status != 200) {
+    return 0;
+  }
+  size_t body = end + (end == crlf ? 4 : 2);
+  if (head.length >= 0 &&
+      output.size() > body + static_cast<size_t>(head.length)) {
+    output.resize(body + static_cast<size_t>(head.length));
+  }
+  long age = 0;
+  std::istringstream lines(head.headers);
+  string line;
+  while (std::getline(lines, line)) {
+    size_t colon = line.find(':');
+    string name = line.substr(0, colon);
+    if (strcasecmp(name.c_str(), "Set-Cookie") == 0) {
+      return 0;
+    }
+    if (colon == string::npos ||
+        strcasecmp(name.c_str(), "Cache-Control") != 0) {
+      continue;
+    }
+    string value = line.substr(colon + 1);
+    std::transform(value.begin(), value.end(), value.begin(), ::tolower);
+    if (value.find("no-store") != string::npos ||
+        value.find("no-cache") != string::npos ||
+        value.find("private") != string::npos) {
+      return 0;
+    }
+    size_t pos = value.find("max-age=");
+    if (pos != string::npos) {
+      age = std::strtol(value.c_str() + pos + 8, NULL, 10);
+    }
+  }
+  return age > 0 ? age : 0;
+}
+
+/**
+ * @brief Make room for len more bytes: expired entries first, then the
+ * least recently used ones
+ */
+static void evict(Store &store, size_t limit, size_t len, time_t now) {
+  map<string, Entry>::iterator it = store.entries.begin();
+  while (it != store.entries.end()) {
+    if (it->second.expires <= now) {
+      store.bytes -= it->second.output.size();
+      store.entries.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  while (!store.entries.empty() && store.bytes + len > limit) {
+    map<string, Entry>::iterator oldest = store.entries.begin();
+    for (it = store.entries.begin(); it != store.entries.end(); ++it) {
+      if (it->second.used < oldest->second.used) {
+        oldest = it;
+      }
+    }
+    store.bytes -= oldest->second.output.size();
+    store.entries.erase(oldest);
+  }
+}
+
+/**
+ * @brief Answer a GET from the cache, or park it behind the running miss
+ * for the same key
+ *
+ * @return true if the request is taken care of; false if a child has to
+ * run, with the connection marked to capture its output for the cache
+ */
+bool serve(HTTPConnxData &conn) {
+  const CGIData &block = conn.config->cgiData;
+  if (block.cache_size == 0 || conn.data.method != "GET" ||
+      conn.data.content_length > 0) {
+    return false;
+  }
+  Store &store = stores[&block];
+  string key = cacheKey(conn);
+  time_t now = std::time(NULL);
+  map<string, Entry>::iterator hit = store.entries.find(key);
+  if (hit != store.entries.end() && hit->second.expires > now) {
+    debuglog(GREEN, "CGI cache hit for fd %d", conn.client_fd);
+    respond(conn, hit->second, now);
+    return true;
+  }
+  map<string, vector<int> >::iterator running = store.waiting.find(key);
+  if (running != store.waiting.end()) {
+    running->second.push_back(conn.client_fd);
+    conn.cgiData.cache_key = key;
+    conn.cgiData.cache_wait_since = now;
+    conn.state = CONN_CGI_CACHE_WAIT;
+    SocketUtils::set_poll_events(conn.client_fd, 0);
+    debuglog(YELLOW, "CGI cache: fd %d waits for the running miss",
+             conn.client_fd);
+    return true;
+  }
+  store.waiting[key];
+  conn.cgiData.cache_key = key;
+  conn.cgiData.caching = true;
+  return false;
+}
+
+/**
+ * @brief Keep a copy of the raw CGI output while it fits an entry
+ */
+void capture(HTTPConnxData &conn, const char *data, size_t len) {
+  if (!conn.cgiData.caching) {
+    return;
+  }
+  size_t limit = std::min(conn.config->cgiData.cache_size,
+                          Constants::cgi_cache_max_entry);
+  if (conn.cgiData.capture.size() + len > limit) {
+    conn.cgiData.caching = false;
+    string().swap(conn.cgiData.capture);
+    return;
+  }
+  conn.cgiData.capture.append(data, len);
+}
+
+/**
+ * @brief Store the captured output if its head allows it
+ *
+ * Called once the output ended cleanly, before the connection is reset.
+ */
+void store(HTTPConnxData &conn) {
+  if (!conn.cgiData.caching) {
+    return;
+  }
+  conn.cgiData.caching = false;
+  long age = maxAge(conn.cgiData.capture);
+  if (age == 0) {
+    return;
+  }
+  const CGIData &block = conn.config->cgiData;
+  Store &own = stores[&block];
+  time_t now = std::time(NULL);
+  size_t len = conn.cgiData.capture.size();
+  evict(own, block.cache_size, len, now);
+  Entry &entry = own.entries[conn.cgiData.cache_key];
+  own.bytes -= entry.output.size();
+  entry.output.swap(conn.cgiData.capture);
+  entry.stored = now;
+  entry.expires = now + age;
+  entry.used = now;
+  own.bytes += len;
+  debuglog(GREEN, "CGI cache: stored %zu bytes for %lds (%zu in store)", len,
+           age, own.bytes);
+}
+
+/**
+ * @brief Drop the connection's part in the cache bookkeeping
+ *
+ * Called from HTTPConnxData::reset. When the request that ran the child
+ * goes, its waiters get the stored answer, or run their own child if there
+ * is none.
+ */
+void release(HTTPConnxData &conn) {
+  if (conn.cgiData.cache_key.empty() || conn.config == NULL) {
+    return;
+  }
+  string key = conn.cgiData.cache_key;
+  conn.cgiData.cache_key.clear();
+  Store &own = stores[&conn.config->cgiData];
+  map<string, vector<int> >::iterator running = own.waiting.find(key);
+  if (running == own.waiting.end()) {
+    return;
+  }
+  if (conn.cgiData.cache_wait_since != 0) {
+    vector<int> &fds = running->second;
+    fds.erase(std::remove(fds.begin(), fds.end(), conn.client_fd), fds.end());
+    conn.cgiData.cache_wait_since = 0;
+    return;
+  }
+  vector<int> waiters;
+  waiters.swap(running->second);
+  own.waiting.erase(running);
+
+  time_t now = std::time(NULL);
+  for (size_t i = 0; i < waiters.size(); ++i) {
+    map<int, HTTPConnxData>::iterator it =
+        HTTPServer::connections.find(waiters[i]);
+    if (it == HTTPServer::connections.end() ||
+        it->second.state != CONN_CGI_CACHE_WAIT) {
+      continue;
+    }
+    HTTPConnxData &next = it->second;
+    next.cgiData.cache_key.clear();
+    next.cgiData.cache_wait_since = 0;
+    map<string, Entry>::iterator hit = own.entries.find(key);
+    if (hit != own.entries.end() && hit->second.expires > now) {
+      respond(next, hit->second, now);
+    } else {
+      CGI::startRequest(next);
+    }
+  }
+}
+
+/**
+ * @brief Run a waiter itself once it waited cgi_queue_timeout
+ */
+bool checkWaitTimeout(HTTPConnxData &conn) {
+  if (std::time(NULL) - conn.cgiData.cache_wait_since <=
+      Constants::cgi_queue_timeout) {
+    return false;
+  }
+  debuglog(YELLOW, "CGI cache: fd %d stops waiting, runs the script",
+           conn.client_fd);
+  release(conn);
+  CGI::startRequest(conn);
+  return true;
+}
+
+} // namespace CGICache
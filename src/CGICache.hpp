@@ -0,0 +1,27 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include <string>
+
+/**
+ * @brief Microcache of forked CGI GET responses (cgi_cache directive)
+ *
+ * The key is the script, the query string and the request headers named
+ * on cgi_cache. A response is kept when the script sends a 200 with
+ * Cache-Control: max-age=N (and no no-store, no-cache, private or
+ * Set-Cookie), for N seconds, in a store of the configured size per cgi
+ * block; expired entries go first, then the least recently used ones.
+ *
+ * Misses are coalesced: while one child runs for a key, later requests for
+ * the same key wait in CONN_CGI_CACHE_WAIT and are answered from its
+ * output. If that output cannot be cached they run their own child.
+ */
+namespace CGICache {
+
+bool serve(HTTPConnxData &conn);
+void capture(HTTPConnxData &conn, const char *data, size_t len);
+void store(HTTPConnxData &conn);
+void release(HTTPConnxData &conn);
+bool checkWaitTimeout(HTTPConnxData &conn);
+
+} // namespace CGICache
@@ -0,0 +1,524 @@
+#include "CGIPool.hpp"
+#include "CGI.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <deque>
+#include <fcntl.h>
+#include <fstream>
+#include <map>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using std::map;
+using std::string;
+
+namespace CGIPool {
+
+// stop reading the client body while this much is still queued for a worker
+static const size_t MAX_QUEUED = 65536;
+static const size_t LENGTH_LEN = 4;
+
+/**
+ * @brief One worker process and the request it is busy with
+ */
+struct Worker {
+  pid_t pid;
+  string program; // pool it belongs to
+  int client_fd;  // connection being served, -1 when idle
+  string out;     // request bytes not written yet
+  string in;      // response bytes read so far
+  size_t served;
+
+  Worker()
+      : pid(-1), program(""), client_fd(-1), out(""), in(""), served(0) {}
+};
+
+/**
+ * @brief Settings and waiting requests of one cgi_pool_worker program
+ */
+struct Pool {
+  CGIPoolSettings settings;
+  std::deque<int> queue; // client fds waiting for a worker
+
+  Pool() : settings(), queue() {}
+};
+
+static map<int, Worker> workers; // by socket fd
+static map<string, Pool> pools;  // by worker program
+
+static void appendLength(string &out, size_t len) {
+  out += static_cast<char>((len >> 24) & 0xff);
+  out += static_cast<char>((len >> 16) & 0xff);
+  out += static_cast<char>((len >> 8) & 0xff);
+  out += static_cast<char>(len & 0xff);
+}
+
+static size_t readLength(const string &in) {
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(in.data());
+  return (static_cast<size_t>(p[0]) << 24) | (static_cast<size_t>(p[1]) << 16) |
+         (static_cast<size_t>(p[2]) << 8) | static_cast<size_t>(p[3]);
+}
+
+/**
+ * @brief Resident set size of a process, 0 where /proc is not available
+ */
+static size_t residentSize(pid_t pid) {
+  std::ifstream statm(("/proc/" + Utils::to_string(pid) + "/statm").c_str());
+  size_t pages = 0;
+  size_t resident = 0;
+  if (!(statm >> pages >> resident)) {
+    return 0;
+  }
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+/**
+ * @brief Start a worker with one end of a socketpair as its stdin, the
+ * server's environment and stderr as its stdout
+ * @return our end of the socket, -1 on failure
+ */
+static int spawnWorker(const string &program) {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    perror("CGIPool: socketpair");
+    return -1;
+  }
+  // other workers must not inherit either end
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+  char *args[] = {const_cast<char *>(program.c_str()), NULL};
+  pid_t pid = CGI::spawn(program, args, environ, sv[1], STDERR_FILENO);
+  close(sv[1]);
+  if (pid < 0) {
+    close(sv[0]);
+    return -1;
+  }
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  SocketUtils::add_to_poll(sv[0], POLLIN);
+  Worker &worker = workers[sv[0]];
+  worker.pid = pid;
+  worker.program = program;
+  debuglog(GREEN, "CGIPool: started worker %d (%s) on fd %d", pid,
+           program.c_str(), sv[0]);
+  return sv[0];
+}
+
+static size_t poolSize(const string &program) {
+  size_t count = 0;
+  for (map<int, Worker>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    if (it->second.program == program) {
+      ++count;
+    }
+  }
+  return count;
+}
+
+static int idleWorker(const string &program) {
+  for (map<int, Worker>::const_iterator it = workers.begin();
+       it != workers.end(); ++it) {
+    if (it->second.program == program && it->second.client_fd == -1) {
+      return it->first;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief The client connection still waiting for this worker, or NULL
+ */
+static HTTPConnxData *waitingClient(int fd, const Worker &worker) {
+  map<int, HTTPConnxData>::iterator it =
+      HTTPServer::connections.find(worker.client_fd);
+  if (it == HTTPServer::connections.end()) {
+    return NULL;
+  }
+  HTTPConnxData &conn = it->second;
+  if (conn.state != CONN_CGI_POOL || conn.poolData.worker_fd != fd) {
+    return NULL;
+  }
+  return &conn;
+}
+
+static void failRequest(HTTPConnxData &conn, int status) {
+  if (conn.poolData.body_left > 0) {
+    conn.closeConnection = true; // rest of the body is still on the socket
+  }
+  conn.poolData = HTTPConnxData::CGIPoolData();
+  Responses::htmlErrorResponse(conn, status);
+}
+
+/**
+ * @brief Close a worker's socket, failing the request it had with status
+ *
+ * A worker reads EOF on its stdin and exits by itself; sig is for the ones
+ * that are stuck or misbehaving. SIGCHLD reaps them either way.
+ */
+static void removeWorker(int fd, int sig, int status) {
+  map<int, Worker>::iterator it = workers.find(fd);
+  if (it == workers.end()) {
+    return;
+  }
+  HTTPConnxData *conn = waitingClient(fd, it->second);
+  pid_t pid = it->second.pid;
+  workers.erase(it);
+  SocketUtils::remove_from_poll(fd);
+  close(fd);
+  if (sig != 0) {
+    kill(pid, sig);
+  }
+  if (conn != NULL) {
+    failRequest(*conn, status);
+  }
+}
+
+/**
+ * @brief Write queued request bytes, POLLOUT interest only while some are
+ * left
+ * @return false if the worker was removed
+ */
+static bool flush(int fd) {
+  Worker &worker = workers[fd];
+  while (!worker.out.empty()) {
+    ssize_t n = ::send(fd, worker.out.data(), worker.out.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      perror("CGIPool: send");
+      removeWorker(fd, SIGKILL, 502);
+      return false;
+    }
+    worker.out.erase(0, static_cast<size_t>(n));
+  }
+  SocketUtils::set_poll_events(
+      fd, static_cast<short>(worker.out.empty() ? POLLIN : POLLIN | POLLOUT));
+  return true;
+}
+
+/**
+ * @brief Send the environment and the body received so far to a worker
+ */
+static void dispatch(HTTPConnxData &conn, int fd) {
+  Worker &worker = workers[fd];
+  CGI::setCGIEnv(conn);
+  // same path prepareCGI executes, relative to our working directory
+  conn.cgiData.env["SCRIPT_FILENAME"] =
+      Utils::removeLeadingSlash(Utils::ensureTrailinSlash(conn.config->root)) +
+      Utils::removeLeadingSlash(conn.urlMatcherData.full_path);
+  string env;
+  for (map<string, string>::const_iterator it = conn.cgiData.env.begin();
+       it != conn.cgiData.env.end(); ++it) {
+    env += it->first + "=" + it->second;
+    env += '\0';
+  }
+  appendLength(worker.out, env.size());
+  worker.out += env;
+
+  string body = conn.data.request.substr(conn.data.headers_end);
+  if (body.size() > conn.data.content_length) {
+    body.resize(conn.data.content_length);
+  }
+  appendLength(worker.out, conn.data.content_length);
+  worker.out += body;
+
+  worker.client_fd = conn.client_fd;
+  conn.poolData.worker_fd = fd;
+  conn.poolData.body_left = conn.data.content_length - body.size();
+  conn.poolData.queued = false;
+  conn.poolData.started = std::time(NULL);
+  conn.state = CONN_CGI_POOL;
+  debuglog(GREEN, "CGIPool: %s for client fd %d on worker %d",
+           conn.data.target.c_str(), conn.client_fd, worker.pid);
+  flush(fd);
+}
+
+/**
+ * @brief Start workers up to the pool minimum and hand queued requests to
+ * whatever is idle
+ */
+static void refill(const string &program) {
+  Pool &pool = pools[program];
+  for (size_t n = poolSize(program); n < pool.settings.min_workers; ++n) {
+    if (spawnWorker(program) < 0) {
+      break;
+    }
+  }
+  while (!pool.queue.empty()) {
+    int fd = idleWorker(program);
+    if (fd < 0 && poolSize(program) < pool.settings.max_workers) {
+      fd = spawnWorker(program);
+    }
+    if (fd < 0) {
+      return;
+    }
+    int client_fd = pool.queue.front();
+    pool.queue.pop_front();
+    map<int, HTTPConnxData>::iterator it =
+        HTTPServer::connections.find(client_fd);
+    if (it != HTTPServer::connections.end() &&
+        it->second.state == CONN_CGI_POOL && it->second.poolData.queued) {
+      dispatch(it->second, fd);
+    }
+  }
+}
+
+/**
+ * @brief A whole response came back: answer the client and recycle the
+ * worker if it is due
+ */
+static void finishRequest(int fd, const string &output) {
+  Worker &worker = workers[fd];
+  HTTPConnxData *conn = waitingClient(fd, worker);
+  string program = worker.program;
+  const CGIPoolSettings &settings = pools[program].settings;
+  // a worker that answered before reading the whole body is out of step
+  bool out_of_step = !worker.out.empty();
+  worker.client_fd = -1;
+  ++worker.served;
+  if (conn != NULL) {
+    if (conn->poolData.body_left > 0) {
+      out_of_step = true;
+      conn->closeConnection = true;
+    }
+    conn->poolData = HTTPConnxData::CGIPoolData();
+    CGI::respondWithOutput(*conn, output);
+  }
+
+  size_t rss = settings.max_memory > 0 ? residentSize(worker.pid) : 0;
+  if (out_of_step || worker.served >= settings.max_requests ||
+      rss > settings.max_memory) {
+    debuglog(YELLOW, "CGIPool: recycling worker %d after %zu requests "
+                     "(%zu bytes resident)",
+             worker.pid, worker.served, rss);
+    removeWorker(fd, out_of_step ? SIGKILL : 0, 0);
+  }
+  refill(program);
+}
+
+/**
+ * @brief Whether the request goes to the cgi block's worker pool
+ */
+bool handles(const HTTPConnxData &conn) {
+  const CGIPoolSettings &settings = conn.config->cgiData.pool;
+  if (settings.max_workers == 0 || settings.worker.empty()) {
+    return false;
+  }
+  if (settings.extensions.empty()) {
+    return true;
+  }
+  const string &path = conn.urlMatcherData.full_path;
+  size_t dot = path.rfind('.');
+  string extension = dot == string::npos ? "" : path.substr(dot);
+  return std::find(settings.extensions.begin(), settings.extensions.end(),
+                   extension) != settings.extensions.end();
+}
+
+/**
+ * @brief Give the request to an idle worker, or queue it, and wait in
+ * CONN_CGI_POOL
+ *
+ * The part of the body that came with the headers goes out with the
+ * environment, the rest is forwarded by readRequestBody as it arrives.
+ * Queued requests leave their body on the socket until they get a worker.
+ */
+void startRequest(HTTPConnxData &conn) {
+  if (conn.data.content_length > conn.config->maxBodySize) {
+    Responses::htmlErrorResponse(conn, 413);
+    return;
+  }
+  const CGIPoolSettings &settings = conn.config->cgiData.pool;
+  if (pools.find(settings.worker) == pools.end()) {
+    pools[settings.worker].settings = settings;
+  }
+  Pool &pool = pools[settings.worker];
+  size_t received = std::min(conn.data.request.size() - conn.data.headers_end,
+                             conn.data.content_length);
+  conn.poolData.body_left = conn.data.content_length - received;
+
+  int fd = idleWorker(settings.worker);
+  if (fd < 0 && poolSize(settings.worker) < pool.settings.max_workers) {
+    fd = spawnWorker(settings.worker);
+  }
+  if (fd >= 0) {
+    dispatch(conn, fd);
+    return;
+  }
+  if (pool.queue.size() >= pool.settings.queue_size) {
+    debuglog(YELLOW, "CGIPool: queue for %s is full", settings.worker.c_str());
+    failRequest(conn, 503);
+    return;
+  }
+  pool.queue.push_back(conn.client_fd);
+  conn.poolData.queued = true;
+  conn.poolData.started = std::time(NULL);
+  conn.state = CONN_CGI_POOL;
+  debuglog(YELLOW, "CGIPool: client fd %d queued (%zu waiting)",
+           conn.client_fd, pool.queue.size());
+}
+
+/**
+ * @brief Forward more of the request body to the worker
+ *
+ * Nothing is read while a lot is still queued for the worker, so a slow
+ * script slows the client down instead of filling our memory.
+ */
+void readRequestBody(HTTPConnxData &conn) {
+  int fd = conn.poolData.worker_fd;
+  map<int, Worker>::iterator worker = workers.find(fd);
+  if (worker == workers.end() || worker->second.out.size() > MAX_QUEUED) {
+    return;
+  }
+  char buffer[Constants::BUFFER_SIZE];
+  size_t want = std::min(conn.poolData.body_left, sizeof(buffer));
+  ssize_t n = conn.readRequestBody(buffer, want, 0);
+  if (n <= 0) {
+    debuglog(YELLOW, "CGIPool: client fd %d gone during the body",
+             conn.client_fd);
+    conn.reset(); // stops the worker
+    SocketUtils::remove_from_poll(conn.client_fd);
+    close(conn.client_fd);
+    conn.client_fd = -1; // Mark as closed
+    return;
+  }
+  worker->second.out.append(buffer, static_cast<size_t>(n));
+  conn.poolData.body_left -= static_cast<size_t>(n);
+  flush(fd);
+}
+
+/**
+ * @brief Handle poll events of a worker socket
+ * @return false if the fd is not one of ours
+ */
+bool handlePollEvent(const pollfd &pfd) {
+  if (workers.find(pfd.fd) == workers.end()) {
+    return false;
+  }
+  // pfd lives in pollfds, which removeWorker reorders
+  int fd = pfd.fd;
+  short revents = pfd.revents;
+  if ((revents & POLLOUT) && !flush(fd)) {
+    return true;
+  }
+  if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+    return true;
+  }
+  char buffer[Constants::BUFFER_SIZE];
+  ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return true;
+  }
+  Worker &worker = workers[fd];
+  if (n <= 0) {
+    debuglog(RED, "CGIPool: worker %d exited", worker.pid);
+    // one that dies before doing anything most likely cannot start at all,
+    // replacing it right away would just loop
+    bool replace = worker.client_fd != -1 || worker.served > 0;
+    string program = worker.program;
+    removeWorker(fd, 0, 502);
+    if (replace) {
+      refill(program);
+    }
+    return true;
+  }
+  worker.in.append(buffer, static_cast<size_t>(n));
+  if (worker.in.size() < LENGTH_LEN) {
+    return true;
+  }
+  size_t len = readLength(worker.in);
+  if (len > Constants::cgi_pool_max_response || worker.client_fd == -1) {
+    debuglog(RED, "CGIPool: bad response from worker %d", worker.pid);
+    string program = worker.program;
+    removeWorker(fd, SIGKILL, 502);
+    refill(program);
+    return true;
+  }
+  if (worker.in.size() < LENGTH_LEN + len) {
+    return true;
+  }
+  string output = worker.in.substr(LENGTH_LEN, len);
+  worker.in.clear();
+  finishRequest(fd, output);
+  return true;
+}
+
+/**
+ * @brief 504 when a request waited or ran longer than
+ * Constants::cgi_child_timeout, the worker running it is killed
+ */
+bool checkTimeout(HTTPConnxData &conn) {
+  if (std::time(NULL) - conn.poolData.started <= Constants::cgi_child_timeout) {
+    return false;
+  }
+  debuglog(RED, "CGIPool: request on client fd %d timed out", conn.client_fd);
+  abortRequest(conn);
+  conn.closeConnection = true;
+  Responses::htmlErrorResponse(conn, 504);
+  return true;
+}
+
+/**
+ * @brief Drop the client's request from the queue or kill the worker
+ * running it (the protocol has no way to cancel a request)
+ *
+ * Called from HTTPConnxData::reset, so it is a no-op for anything that is
+ * not waiting on the pool.
+ */
+void abortRequest(HTTPConnxData &conn) {
+  HTTPConnxData::CGIPoolData pending = conn.poolData;
+  conn.poolData = HTTPConnxData::CGIPoolData();
+  if (pending.queued) {
+    for (map<string, Pool>::iterator it = pools.begin(); it != pools.end();
+         ++it) {
+      std::deque<int> &queue = it->second.queue;
+      queue.erase(std::remove(queue.begin(), queue.end(), conn.client_fd),
+                  queue.end());
+    }
+    return;
+  }
+  map<int, Worker>::iterator worker = workers.find(pending.worker_fd);
+  if (worker == workers.end() || worker->second.client_fd != conn.client_fd) {
+    return;
+  }
+  string program = worker->second.program;
+  removeWorker(pending.worker_fd, SIGKILL, 0);
+  refill(program);
+}
+
+/**
+ * @brief Pre-fork the minimum number of workers of every configured pool
+ */
+void startAll(const std::vector<ServerData> &configs) {
+  for (size_t i = 0; i < configs.size(); ++i) {
+    const CGIPoolSettings &settings = configs[i].cgiData.pool;
+    if (!configs[i].hasCGI() || settings.max_workers == 0 ||
+        settings.worker.empty() || pools.count(settings.worker)) {
+      continue;
+    }
+    pools[settings.worker].settings = settings;
+    refill(settings.worker);
+  }
+}
+
+/**
+ * @brief Stop all workers, used on shutdown
+ */
+void closeAll() {
+  for (map<int, Worker>::iterator it = workers.begin(); it != workers.end();
+       ++it) {
+    SocketUtils::remove_from_poll(it->first);
+    close(it->first);
+    kill(it->second.pid, SIGTERM);
+  }
+  workers.clear();
+  pools.clear();
+}
+
+} // namespace CGIPool
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include "ServerData.hpp"
+#include <poll.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Pre-forked CGI workers for cgi blocks with cgi_pool
+ *
+ * Instead of fork() + execve() per request the server keeps a pool of
+ * long running worker processes (cgi_pool_worker) and hands them one
+ * request at a time over a socketpair. Both directions use 4 byte big
+ * endian length prefixes:
+ *
+ *   request:  <len> NAME=VALUE\0NAME=VALUE\0...  <len> body
+ *   response: <len> CGI output (Status or NPH head, blank line, body)
+ *
+ * The socket is the worker's stdin, its stdout goes to our stderr so a
+ * stray print cannot break the framing. SCRIPT_FILENAME in the environment
+ * names the script to run.
+ *
+ * A request goes to an idle worker, or a new one while the pool is under
+ * max; otherwise it waits in a queue of cgi_pool_queue entries and is
+ * answered 503 when that is full. Workers are replaced after
+ * cgi_pool_max_requests requests or when their RSS passes
+ * cgi_pool_max_memory, and the pool is topped up to its minimum whenever
+ * one goes away.
+ */
+namespace CGIPool {
+
+bool handles(const HTTPConnxData &conn);
+void startRequest(HTTPConnxData &conn);
+bool handlePollEvent(const pollfd &pfd);
+void readRequestBody(HTTPConnxData &conn);
+bool checkTimeout(HTTPConnxData &conn);
+void abortRequest(HTTPConnxData &conn);
+void startAll(const std::vector<ServerData> &configs);
+void closeAll();
+
+} // namespace CGIPool
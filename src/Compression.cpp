@@ -0,0 +1,121 @@
+#include "Compression.hpp"
+#include "URLMatcher.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace Compression {
+
+/**
+ * @brief Whether the matched location/cgi block has gzip on and the client
+ * takes gzip at all
+ */
+bool clientAccepts(HTTPConnxData &conn) {
+  string accept_encoding;
+  return conn.urlMatcherData.gzip.enabled &&
+         conn.checkHeader("Accept-Encoding", accept_encoding) &&
+         URLMatcher::acceptsEncoding(accept_encoding, "gzip");
+}
+
+/**
+ * @brief Decide if a generated body should be compressed
+ *
+ * @param conn The connection data
+ * @param contentType Content-Type of the body, parameters are ignored
+ * @param length Body length, or -1 if not known yet
+ */
+bool wanted(HTTPConnxData &conn, const string &contentType, long length) {
+  if (!clientAccepts(conn)) {
+    return false;
+  }
+  const GzipSettings &gzip = conn.urlMatcherData.gzip;
+  if (length >= 0 && static_cast<size_t>(length) < gzip.min_length) {
+    return false;
+  }
+  string type = Utils::trim(contentType.substr(0, contentType.find(';')));
+  return std::find(gzip.types.begin(), gzip.types.end(), type) !=
+         gzip.types.end();
+}
+
+/**
+ * @brief Start a gzip stream (deflate with the gzip wrapper)
+ * @return NULL if zlib could not allocate its state
+ */
+Stream *begin(int level) {
+  Stream *stream = new Stream();
+  stream->zs.zalloc = Z_NULL;
+  stream->zs.zfree = Z_NULL;
+  stream->zs.opaque = Z_NULL;
+  // 15 bits window + 16 selects the gzip header and trailer
+  if (deflateInit2(&stream->zs, level, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    debuglog(RED, "Compression: deflateInit2 failed");
+    delete stream;
+    return NULL;
+  }
+  return stream;
+}
+
+/**
+ * @brief Feed bytes into the stream and append whatever zlib produced
+ *
+ * With finish set the gzip trailer is written too and the stream must be
+ * released afterwards.
+ */
+bool deflateData(Stream *stream, const char *data, size_t len, bool finish,
+                 string &out) {
+  char buffer[16384];
+  stream->zs.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  stream->zs.avail_in = static_cast<uInt>(len);
+  int flush = finish ? Z_FINISH : Z_NO_FLUSH;
+  int ret;
+  do {
+    stream->zs.next_out = reinterpret_cast<Bytef *>(buffer);
+    stream->zs.avail_out = sizeof(buffer);
+    ret = deflate(&stream->zs, flush);
+    if (ret == Z_STREAM_ERROR) {
+      debuglog(RED, "Compression: deflate failed");
+      return false;
+    }
+    out.append(buffer, sizeof(buffer) - stream->zs.avail_out);
+  } while (stream->zs.avail_out == 0 || (finish && ret != Z_STREAM_END));
+  return true;
+}
+
+void release(Stream *&stream) {
+  if (stream == NULL) {
+    return;
+  }
+  deflateEnd(&stream->zs);
+  delete stream;
+  stream = NULL;
+}
+
+/**
+ * @brief Compress a whole body at once
+ */
+bool gzipBuffer(const string &in, int level, string &out) {
+  Stream *stream = begin(level);
+  if (stream == NULL) {
+    return false;
+  }
+  out.clear();
+  out.reserve(in.size() / 3 + 64);
+  bool ok = deflateData(stream, in.data(), in.size(), true, out);
+  release(stream);
+  return ok;
+}
+
+/**
+ * @brief Frame a payload as one HTTP/1.1 chunk
+ */
+string chunk(const string &payload) {
+  char size[32];
+  snprintf(size, sizeof(size), "%lx\r\n",
+           static_cast<unsigned long>(payload.size()));
+  return size + payload + "\r\n";
+}
+
+} // namespace Compression
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include <string>
+#include <zlib.h>
+
+using std::string;
+
+/**
+ * @brief On-the-fly gzip for bodies we generate ourselves
+ *
+ * A body that is complete in memory (createResponse) is compressed in one
+ * go and keeps its Content-Length. CGI output is compressed while it streams
+ * through, so its length is unknown and it goes out chunked.
+ */
+namespace Compression {
+
+struct Stream {
+  z_stream zs;
+};
+
+bool clientAccepts(HTTPConnxData &conn);
+bool wanted(HTTPConnxData &conn, const string &contentType, long length);
+Stream *begin(int level);
+bool deflateData(Stream *stream, const char *data, size_t len, bool finish,
+                 string &out);
+void release(Stream *&stream);
+bool gzipBuffer(const string &in, int level, string &out);
+string chunk(const string &payload);
+
+} // namespace Compression
@@ -1,6 +1,7 @@
 #include "Config.hpp"
 #include "Constants.hpp"
 #include "HTTPServer.hpp"
+#include "Responses.hpp"
 #include "ServerData.hpp"
 #include "debug.h"
 #include <cstdlib>
@@ -36,6 +37,7 @@ Config::Config(std::string filename) {
     debuglog(RED, "Configuration validation failed");
     throw std::runtime_error("Invalid configuration");
   }
+  Responses::precompileReturnDirectives(servers);
   debuglog(GREEN, "Config initialized with %zu servers\n\n",
            servers.size());
 }
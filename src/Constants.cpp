@@ -14,7 +14,37 @@ int responseTimeout = 10;
 int keepalive_timeout = 15;
 bool autoReload = false;
 time_t cgi_child_timeout = 1; // this is in case of an endless loop - all our cgi are faster
+time_t cgi_queue_timeout = 10; // seconds a request waits for a CGI slot
+time_t cgi_retry_after = 1;    // Retry-After of a 503 for a full CGI queue
+size_t cgi_cache_max_entry = 1024 * 1024; // larger CGI output is not cached
 time_t client_timeout = 15;
+time_t metadata_cache_ttl = 1; // seconds a cached stat() is trusted
+size_t metadata_cache_max_entries = 4096;
+size_t max_byte_ranges = 16; // more than this and we send the whole file
+size_t sendfile_chunk_size = 65536; // per POLLOUT on the zero-copy path
+size_t upload_chunk_size = 262144; // per POLLIN of an upload, splice pipe size
+time_t upload_fsync_interval = 1; // seconds between syncfs() with upload_fsync batched
+size_t upload_fsync_threads = 2; // threads that flush uploads with upload_fsync on
+size_t multipart_header_max = 8192; // headers of one form-data part
+size_t multipart_field_max = 65536; // a form field that is not a file
+size_t fastcgi_max_connections = 4; // pooled sockets per fastcgi_pass
+size_t fastcgi_max_requests = 8; // multiplexed requests per socket
+time_t fastcgi_timeout = 10; // seconds until the app must have answered
+size_t fastcgi_max_response = 16 * 1024 * 1024; // stdout buffered per request
+size_t cgi_pool_max_response = 16 * 1024 * 1024; // one pooled worker's output
+size_t cgi_pipe_buffer = 65536; // per direction between client and CGI child
+size_t handler_threads = 4; // worker threads for blocking handler plugins
+size_t handler_queue_size = 64; // waiting blocking handler requests, then 503
+size_t disk_io_threads = 4; // worker threads with disk_io threads|uncached
+size_t disk_io_queue_size = 256; // waiting disk jobs, then the loop does them itself
+size_t autoindex_cache_size = 8 * 1024 * 1024; // rendered listings kept, gzip included
+size_t autoindex_stream_entries = 10000; // larger directories are streamed, not cached
+size_t autoindex_chunk_entries = 256; // entries per chunk of a streamed listing
+size_t manifest_threads = 4; // roots indexed in parallel at startup
+size_t manifest_max_entries = 200000; // files and directories, later ones are stat()ed
+off_t readahead_min_size = 1048576; // smaller files get no file_cache_hints
+off_t readahead_window = 2097152; // WILLNEED ahead of the send cursor, DONTNEED this far behind
+size_t page_cache_probe_interval = 16; // file chunks per mincore() probe, except with file_cache_hints stats
 
 void initStatusMessageMap() {
   debuglog(YELLOW, "Initializing status code to status text mapping");
@@ -3,6 +3,7 @@
 #include <map>
 #include <string>
 #include <ctime>
+#include <sys/types.h>
 
 namespace Constants {
 
@@ -16,7 +17,37 @@ extern int responseTimeout;
 extern int keepalive_timeout;
 extern bool autoReload;
 extern time_t cgi_child_timeout;
+extern time_t cgi_queue_timeout;
+extern time_t cgi_retry_after;
+extern size_t cgi_cache_max_entry;
 extern time_t client_timeout;
+extern time_t metadata_cache_ttl;
+extern size_t metadata_cache_max_entries;
+extern size_t max_byte_ranges;
+extern size_t sendfile_chunk_size;
+extern size_t upload_chunk_size;
+extern time_t upload_fsync_interval;
+extern size_t upload_fsync_threads;
+extern size_t multipart_header_max;
+extern size_t multipart_field_max;
+extern size_t fastcgi_max_connections;
+extern size_t fastcgi_max_requests;
+extern time_t fastcgi_timeout;
+extern size_t fastcgi_max_response;
+extern size_t cgi_pool_max_response;
+extern size_t cgi_pipe_buffer;
+extern size_t handler_threads;
+extern size_t handler_queue_size;
+extern size_t disk_io_threads;
+extern size_t disk_io_queue_size;
+extern size_t autoindex_cache_size;
+extern size_t autoindex_stream_entries;
+extern size_t autoindex_chunk_entries;
+extern size_t manifest_threads;
+extern size_t manifest_max_entries;
+extern off_t readahead_min_size;
+extern off_t readahead_window;
+extern size_t page_cache_probe_interval;
 
 void initStatusMessageMap();
 void initMimeTypes();
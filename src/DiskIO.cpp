@@ -0,0 +1,399 @@
+#include "DiskIO.hpp"
+#include "Autoindex.hpp"
+#include "BodySpool.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "PageCache.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "URLMatcher.hpp"
+#include "UploadStore.hpp"
+#include "Utils.hpp"
+#include "WorkerPool.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::map;
+using std::string;
+using std::vector;
+
+namespace DiskIO {
+
+enum Op { DISK_READ, DISK_WRITE, DISK_LIST, DISK_UNLINK, DISK_OPS };
+
+static const char *const op_names[DISK_OPS] = {"read", "write", "list",
+                                               "unlink"};
+
+struct Job : WorkerPool::Job {
+  Op op;
+  int fd; // close-on-exec dup of the connection's file, closed by the worker
+  off_t offset;
+  size_t count;
+  string path;
+  vector<char> data; // read into / written from
+  vector<string> names;
+  PageCache::Probe probe; // of a read, taken on the loop
+  ssize_t result;
+  int error;
+  long queued_at, started_at, finished_at; // microseconds, monotonic
+
+  void run();
+};
+
+/**
+ * @brief Per operation counters, only touched by the poll loop
+ */
+struct Stats {
+  size_t jobs;     // finished on a worker
+  size_t cached;   // file chunks sent inline as they were in the page cache
+  size_t overflow; // done inline because the queue was full
+  size_t wait_us;  // queued until a worker took it, summed
+  size_t run_us;   // on the worker, summed
+  size_t max_us;   // slowest run
+};
+
+static Stats stats[DISK_OPS];
+static WorkerPool pool("DiskIO");
+
+static long now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief The names in a directory, in readdir() order, those of
+ * directories (symlinks to them too) with a trailing '/'
+ *
+ * Touches no connection, the workers call it too.
+ */
+bool readDirectory(const string &path, vector<string> &names) {
+  DIR *dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return false;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    names.push_back(entry->d_name);
+    bool is_dir = entry->d_type == DT_DIR;
+    struct stat st;
+    if ((entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) &&
+        fstatat(dirfd(dir), entry->d_name, &st, 0) == 0) {
+      is_dir = S_ISDIR(st.st_mode);
+    }
+    if (is_dir) {
+      names.back() += '/';
+    }
+  }
+  closedir(dir);
+  return true;
+}
+
+void Job::run() {
+  started_at = now();
+  switch (op) {
+  case DISK_READ:
+    data.resize(count);
+    result = pread(fd, &data[0], count, offset);
+    data.resize(result > 0 ? static_cast<size_t>(result) : 0);
+    break;
+  case DISK_WRITE:
+    result = BodySpool::write(fd, &data[0], data.size())
+                 ? static_cast<ssize_t>(data.size())
+                 : -1;
+    break;
+  case DISK_LIST:
+    result = readDirectory(path, names) ? 0 : -1;
+    break;
+  case DISK_UNLINK:
+    result = UploadStore::remove(path);
+    break;
+  default:
+    break;
+  }
+  error = errno;
+  if (fd != -1) {
+    close(fd);
+  }
+  finished_at = now();
+}
+
+/**
+ * @brief Start the workers once some server has disk_io on
+ *
+ * Also called after a reload, the workers stay and their eventfd is polled
+ * again.
+ */
+void startAll(const std::vector<ServerData> &configs) {
+  bool wanted = false;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    wanted = wanted || configs[i].disk_io != DISK_IO_OFF;
+  }
+  if (wanted && !pool.started()) {
+    pool.start(Constants::disk_io_threads);
+  }
+  pool.startPolling();
+}
+
+void stopPolling() { pool.stopPolling(); }
+
+/**
+ * @brief Whether a job for this connection can be queued now
+ *
+ * Only the loop queues, so a yes stays true until it queues the next one.
+ */
+static bool room(const HTTPConnxData &conn, Op op) {
+  if (conn.config == NULL || conn.config->disk_io == DISK_IO_OFF ||
+      !pool.started()) {
+    return false;
+  }
+  if (pool.queued() >= Constants::disk_io_queue_size) {
+    ++stats[op].overflow;
+    return false;
+  }
+  return true;
+}
+
+static Job *newJob(const HTTPConnxData &conn, Op op) {
+  Job *job = new Job();
+  job->client_fd = conn.client_fd;
+  job->op = op;
+  job->fd = -1;
+  job->offset = 0;
+  job->count = 0;
+  job->result = -1;
+  job->error = 0;
+  job->queued_at = now();
+  job->started_at = job->finished_at = 0;
+  return job;
+}
+
+/**
+ * @brief Hand the job to the workers, the connection waits without poll
+ * interest until handlePollEvent has its result
+ */
+static void submit(HTTPConnxData &conn, Job *job) {
+  SocketUtils::set_poll_events(conn.client_fd, 0);
+  conn.urlMatcherData.disk_job = pool.submit(job);
+}
+
+/**
+ * @brief Read the next chunk of the current file range on a worker
+ * @return false if the caller reads or sends it inline
+ */
+bool readChunk(HTTPConnxData &conn) {
+  if (!room(conn, DISK_READ)) {
+    return false;
+  }
+  size_t count = Constants::sendfile_chunk_size;
+  if (static_cast<off_t>(count) > conn.fileData.remaining) {
+    count = static_cast<size_t>(conn.fileData.remaining);
+  }
+  bool uncached = conn.config->disk_io == DISK_IO_UNCACHED;
+  PageCache::Probe probe = PageCache::probe(conn, count, uncached);
+  if (uncached && probe.resident()) {
+    ++stats[DISK_READ].cached; // sendfile() reuses the probe
+    return false;
+  }
+  int fd = fcntl(conn.file_fd, F_DUPFD_CLOEXEC, 0);
+  if (fd == -1) {
+    return false;
+  }
+  Job *job = newJob(conn, DISK_READ);
+  job->fd = fd;
+  job->offset = conn.fileData.offset;
+  job->count = count;
+  job->probe = probe;
+  submit(conn, job);
+  return true;
+}
+
+/**
+ * @brief Take the next piece of an upload body off the socket (or spool)
+ * and write it to the file on a worker
+ *
+ * data.bytes_sent only moves on once it is written, so the upload cannot
+ * complete early.
+ * @param in what read() returned, the piece was queued if it is > 0
+ * @return false if the caller moves the piece inline
+ */
+bool writeUpload(HTTPConnxData &conn, int from, size_t count, ssize_t &in) {
+  if (!room(conn, DISK_WRITE)) {
+    return false;
+  }
+  vector<char> piece(std::min(count, Constants::upload_chunk_size));
+  in = ::read(from, &piece[0], piece.size());
+  if (in <= 0) {
+    return true;
+  }
+  int fd = fcntl(conn.file_fd, F_DUPFD_CLOEXEC, 0);
+  if (fd == -1) {
+    in = -1;
+    return true;
+  }
+  piece.resize(static_cast<size_t>(in));
+  if (conn.urlMatcherData.upload_dedup) {
+    conn.upload_digest.update(&piece[0], piece.size());
+  }
+  Job *job = newJob(conn, DISK_WRITE);
+  job->fd = fd;
+  job->data.swap(piece);
+  submit(conn, job);
+  return true;
+}
+
+/**
+ * @brief Scan the directory of an autoindex listing on a worker
+ * @return false if the caller scans it inline
+ */
+bool listDirectory(HTTPConnxData &conn, const string &path) {
+  if (!room(conn, DISK_LIST)) {
+    return false;
+  }
+  Job *job = newJob(conn, DISK_LIST);
+  job->path = path;
+  conn.state = CONN_DISK_IO;
+  submit(conn, job);
+  return true;
+}
+
+/**
+ * @brief Remove the file of a DELETE on a worker
+ * @return false if the caller unlinks it inline
+ */
+bool unlinkFile(HTTPConnxData &conn, const string &path) {
+  if (!room(conn, DISK_UNLINK)) {
+    return false;
+  }
+  Job *job = newJob(conn, DISK_UNLINK);
+  job->path = path;
+  conn.state = CONN_DISK_IO;
+  submit(conn, job);
+  return true;
+}
+
+static void finishRead(HTTPConnxData &conn, Job &job) {
+  if (job.result < 0) {
+    errno = job.error;
+    perror("DiskIO: read failed");
+    conn.close_conn_after_error();
+  } else if (job.result == 0) {
+    // file shrank under us - the Content-Length we sent is now a lie
+    debuglog(RED, "File truncated while sending to client %d",
+             conn.client_fd);
+    close(conn.file_fd);
+    conn.file_fd = -1;
+    conn.closeConnection = true;
+  } else {
+    conn.data.buffer.insert(conn.data.buffer.end(), job.data.begin(),
+                            job.data.end());
+    conn.fileData.offset += job.result;
+    conn.fileData.remaining -= job.result;
+    PageCache::consumed(conn, job.probe, job.count, job.result);
+  }
+}
+
+static void finishWrite(HTTPConnxData &conn, Job &job) {
+  if (job.result < 0) {
+    errno = job.error;
+    perror("DiskIO: upload write failed");
+    conn.reset();
+    conn.closeConnection = true; // the rest of the body is still coming
+    Responses::htmlErrorResponse(conn, 500);
+    return;
+  }
+  conn.data.bytes_sent += static_cast<size_t>(job.result);
+  debug("total bytes written %zu/%zu", conn.data.bytes_sent,
+        conn.data.content_length);
+  conn.uploadComplete();
+}
+
+static void finish(HTTPConnxData &conn, Job &job) {
+  conn.urlMatcherData.disk_job = 0;
+  conn.data.lastActivityTime = std::time(NULL);
+  SocketUtils::set_poll_events(conn.client_fd, POLLIN | POLLOUT);
+  switch (job.op) {
+  case DISK_READ:
+    finishRead(conn, job);
+    break;
+  case DISK_WRITE:
+    finishWrite(conn, job);
+    break;
+  case DISK_LIST:
+    if (job.result < 0) {
+      Responses::htmlErrorResponse(conn, 500);
+    } else {
+      Autoindex::respond(conn, job.names);
+    }
+    break;
+  case DISK_UNLINK:
+    URLMatcher::finishDELETERequest(conn, job.result == 0 ? 0 : job.error);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Collect finished jobs and carry on with their connections
+ * @return true if pfd was the completion eventfd
+ */
+bool handlePollEvent(const pollfd &pfd) {
+  if (!pool.owns(pfd)) {
+    return false;
+  }
+  vector<WorkerPool::Job *> finished;
+  pool.collect(finished);
+
+  for (size_t i = 0; i < finished.size(); ++i) {
+    Job *job = static_cast<Job *>(finished[i]);
+    Stats &s = stats[job->op];
+    size_t run = static_cast<size_t>(job->finished_at - job->started_at);
+    ++s.jobs;
+    s.wait_us += static_cast<size_t>(job->started_at - job->queued_at);
+    s.run_us += run;
+    s.max_us = std::max(s.max_us, run);
+
+    map<int, HTTPConnxData>::iterator it =
+        HTTPServer::connections.find(job->client_fd);
+    if (it != HTTPServer::connections.end() &&
+        it->second.urlMatcherData.disk_job == job->id) {
+      finish(it->second, *job);
+    } else {
+      debuglog(YELLOW, "DiskIO: dropping %s job %lu, fd %d is gone",
+               op_names[job->op], job->id, job->client_fd);
+    }
+    delete job;
+  }
+  return true;
+}
+
+/**
+ * @brief The pool and its per operation latencies as JSON
+ */
+string statusJson() {
+  string json = "{\"threads\":" + Utils::to_string(pool.size()) +
+                ",\"queued\":" + Utils::to_string(pool.queued());
+  for (int op = 0; op < DISK_OPS; ++op) {
+    const Stats &s = stats[op];
+    size_t jobs = std::max<size_t>(s.jobs, 1);
+    json += ",\"" + string(op_names[op]) +
+            "\":{\"jobs\":" + Utils::to_string(s.jobs) +
+            ",\"cached\":" + Utils::to_string(s.cached) +
+            ",\"overflow\":" + Utils::to_string(s.overflow) +
+            ",\"avg_wait_us\":" + Utils::to_string(s.wait_us / jobs) +
+            ",\"avg_run_us\":" + Utils::to_string(s.run_us / jobs) +
+            ",\"max_run_us\":" + Utils::to_string(s.max_us) + "}";
+  }
+  return json + "}";
+}
+
+} // namespace DiskIO
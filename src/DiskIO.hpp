@@ -0,0 +1,47 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include "ServerData.hpp"
+#include <poll.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Disk I/O off the poll loop, for servers with disk_io threads or
+ * uncached
+ *
+ * One cold page cache miss or a slow disk otherwise stalls every
+ * connection. These calls run on Constants::disk_io_threads worker threads
+ * instead:
+ *
+ *   - reading the next chunk of a file being served (into the send buffer)
+ *   - writing the next piece of an upload body, read from the socket on the
+ *     loop
+ *   - the directory scan of an autoindex listing
+ *   - the unlink of a DELETE
+ *
+ * The connection has no poll interest while its job runs; the workers hand
+ * finished jobs back through the WorkerPool's eventfd that handlePollEvent
+ * reads. A job works on a dup() of the connection's file, so a
+ * connection that closes meanwhile is no problem; its result is dropped.
+ *
+ * With disk_io uncached a file chunk whose pages are all resident (mincore)
+ * is still sent inline with sendfile(), there is nothing to wait for. With
+ * Constants::disk_io_queue_size jobs waiting the loop does the call itself.
+ * Counts and latencies per operation are served at /api/disk-io-status.
+ */
+namespace DiskIO {
+
+void startAll(const std::vector<ServerData> &configs);
+void stopPolling();
+bool handlePollEvent(const pollfd &pfd);
+
+bool readChunk(HTTPConnxData &conn);
+bool writeUpload(HTTPConnxData &conn, int from, size_t count, ssize_t &in);
+bool listDirectory(HTTPConnxData &conn, const std::string &path);
+bool unlinkFile(HTTPConnxData &conn, const std::string &path);
+
+bool readDirectory(const std::string &path, std::vector<std::string> &names);
+std::string statusJson();
+
+} // namespace DiskIO
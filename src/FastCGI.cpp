@@ -0,0 +1,541 @@
+#include "FastCGI.hpp"
+#include "CGI.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::map;
+using std::string;
+
+namespace FastCGI {
+
+// record types and flags from the FastCGI 1.0 specification
+enum RecordType {
+  BEGIN_REQUEST = 1,
+  ABORT_REQUEST = 2,
+  END_REQUEST = 3,
+  PARAMS = 4,
+  STDIN = 5,
+  STDOUT = 6,
+  STDERR = 7
+};
+static const unsigned char VERSION_1 = 1;
+static const unsigned char ROLE_RESPONDER = 1;
+static const unsigned char FLAG_KEEP_CONN = 1;
+static const unsigned char STATUS_CANT_MPX_CONN = 1;
+static const size_t HEADER_LEN = 8;
+static const size_t MAX_CONTENT = 65535;
+// stop reading the client body while this much is still queued upstream
+static const size_t MAX_QUEUED = 65536;
+
+/**
+ * @brief A request in flight on an upstream connection
+ */
+struct Pending {
+  int client_fd;
+  string output; // FCGI_STDOUT collected so far
+
+  Pending() : client_fd(-1), output("") {}
+};
+
+/**
+ * @brief One pooled connection to a FastCGI app
+ */
+struct Upstream {
+  string path;
+  string in;  // bytes read that do not make a whole record yet
+  string out; // records not written yet
+  map<uint16_t, Pending> requests;
+  uint16_t last_id;
+
+  Upstream() : path(""), in(""), out(""), requests(), last_id(0) {}
+};
+
+static map<int, Upstream> upstreams; // by socket fd
+// apps that answered FCGI_CANT_MPX_CONN get one request per connection
+static std::set<string> no_multiplexing;
+
+/**
+ * @brief Append a record, split in several if longer than 64k
+ *
+ * An empty record is the end of a PARAMS or STDIN stream.
+ */
+static void appendRecord(string &out, RecordType type, uint16_t id,
+                         const char *data, size_t len) {
+  do {
+    size_t n = std::min(len, MAX_CONTENT);
+    size_t padding = (8 - n % 8) % 8;
+    char header[HEADER_LEN] = {
+        static_cast<char>(VERSION_1),     static_cast<char>(type),
+        static_cast<char>(id >> 8),       static_cast<char>(id & 0xff),
+        static_cast<char>(n >> 8),        static_cast<char>(n & 0xff),
+        static_cast<char>(padding),       0};
+    out.append(header, HEADER_LEN);
+    out.append(data, n);
+    out.append(padding, '\0');
+    data += n;
+    len -= n;
+  } while (len > 0);
+}
+
+static void appendLength(string &out, size_t len) {
+  if (len < 128) {
+    out += static_cast<char>(len);
+    return;
+  }
+  out += static_cast<char>(((len >> 24) & 0x7f) | 0x80);
+  out += static_cast<char>((len >> 16) & 0xff);
+  out += static_cast<char>((len >> 8) & 0xff);
+  out += static_cast<char>(len & 0xff);
+}
+
+static void appendNameValue(string &out, const string &name,
+                            const string &value) {
+  appendLength(out, name.size());
+  appendLength(out, value.size());
+  out += name;
+  out += value;
+}
+
+/**
+ * @brief The CGI environment plus the headers as HTTP_* variables
+ */
+static string buildParams(HTTPConnxData &conn) {
+  conn.cgiData.script_name = conn.data.target;
+  CGI::setCGIEnv(conn);
+  map<string, string> &env = conn.cgiData.env;
+  env["SCRIPT_FILENAME"] = conn.urlMatcherData.full_path;
+  env["DOCUMENT_ROOT"] = conn.config->root;
+  env["REQUEST_URI"] = conn.data.target;
+  if (!conn.cgiData.query_string.empty()) {
+    env["REQUEST_URI"] += "?" + conn.cgiData.query_string;
+  }
+  for (map<string, string>::const_iterator it = conn.data.headers.begin();
+       it != conn.data.headers.end(); ++it) {
+    if (strcasecmp(it->first.c_str(), "Content-Type") == 0 ||
+        strcasecmp(it->first.c_str(), "Content-Length") == 0) {
+      continue;
+    }
+    string name = "HTTP_";
+    for (size_t i = 0; i < it->first.size(); ++i) {
+      char c = it->first[i];
+      name += c == '-' ? '_' : static_cast<char>(std::toupper(c));
+    }
+    env[name] = it->second;
+  }
+
+  string params;
+  for (map<string, string>::const_iterator it = env.begin(); it != env.end();
+       ++it) {
+    appendNameValue(params, it->first, it->second);
+  }
+  return params;
+}
+
+/**
+ * @brief Connect to the app, non blocking so a full backlog does not stall
+ * the server
+ * @return the socket, or -1 with status set to the error to answer
+ */
+static int openUpstream(const string &path, int &status) {
+  struct sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    debuglog(RED, "FastCGI: socket path too long: %s", path.c_str());
+    status = 500;
+    return -1;
+  }
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    perror("FastCGI: socket");
+    status = 500;
+    return -1;
+  }
+  // CGI children must not inherit the pool
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  if (::connect(fd, reinterpret_cast<struct sockaddr *>(&addr),
+                sizeof(addr)) < 0) {
+    // a Unix socket connects at once, EAGAIN means the app's backlog is full
+    status = errno == EAGAIN ? 503 : 502;
+    debuglog(RED, "FastCGI: cannot connect to %s: %s", path.c_str(),
+             strerror(errno));
+    close(fd);
+    return -1;
+  }
+  SocketUtils::add_to_poll(fd, POLLIN);
+  upstreams[fd].path = path;
+  debuglog(GREEN, "FastCGI: opened connection %d to %s", fd, path.c_str());
+  return fd;
+}
+
+/**
+ * @brief Pick the least busy pooled connection with room for a request,
+ * opening a new one while the pool is not full
+ */
+static int pickUpstream(const string &path, int &status) {
+  size_t limit = no_multiplexing.count(path) ? 1
+                                             : Constants::fastcgi_max_requests;
+  size_t open = 0;
+  int best = -1;
+  size_t best_load = limit;
+  for (map<int, Upstream>::iterator it = upstreams.begin();
+       it != upstreams.end(); ++it) {
+    if (it->second.path != path) {
+      continue;
+    }
+    ++open;
+    if (it->second.requests.size() < best_load) {
+      best = it->first;
+      best_load = it->second.requests.size();
+    }
+  }
+  if (best != -1 && (best_load == 0 || open >= Constants::fastcgi_max_connections)) {
+    return best;
+  }
+  if (open < Constants::fastcgi_max_connections) {
+    int fd = openUpstream(path, status);
+    return fd != -1 ? fd : best;
+  }
+  debuglog(YELLOW, "FastCGI: pool for %s is full", path.c_str());
+  status = 503;
+  return -1;
+}
+
+/**
+ * @brief Next id not in use on this connection (0 is for management)
+ */
+static uint16_t nextRequestId(Upstream &up) {
+  do {
+    ++up.last_id;
+  } while (up.last_id == 0 || up.requests.count(up.last_id));
+  return up.last_id;
+}
+
+/**
+ * @brief The client connection still waiting for this request, or NULL
+ */
+static HTTPConnxData *waitingClient(int fd, uint16_t id,
+                                    const Pending &pending) {
+  map<int, HTTPConnxData>::iterator it =
+      HTTPServer::connections.find(pending.client_fd);
+  if (it == HTTPServer::connections.end()) {
+    return NULL;
+  }
+  HTTPConnxData &conn = it->second;
+  if (conn.state != CONN_FASTCGI || conn.fcgiData.upstream_fd != fd ||
+      conn.fcgiData.request_id != id) {
+    return NULL;
+  }
+  return &conn;
+}
+
+static void failRequest(HTTPConnxData &conn, int status) {
+  if (conn.fcgiData.body_left > 0) {
+    conn.closeConnection = true; // rest of the body is still on the socket
+  }
+  conn.fcgiData = HTTPConnxData::FastCGIData();
+  Responses::htmlErrorResponse(conn, status);
+}
+
+/**
+ * @brief Drop a connection, failing whatever was still in flight on it
+ */
+static void closeUpstream(int fd, int status) {
+  map<int, Upstream>::iterator up = upstreams.find(fd);
+  if (up == upstreams.end()) {
+    return;
+  }
+  debuglog(YELLOW, "FastCGI: closing connection %d to %s (%zu in flight)", fd,
+           up->second.path.c_str(), up->second.requests.size());
+  for (map<uint16_t, Pending>::iterator it = up->second.requests.begin();
+       it != up->second.requests.end(); ++it) {
+    HTTPConnxData *conn = waitingClient(fd, it->first, it->second);
+    if (conn != NULL) {
+      failRequest(*conn, status);
+    }
+  }
+  upstreams.erase(up);
+  SocketUtils::remove_from_poll(fd);
+  close(fd);
+}
+
+/**
+ * @brief Write queued records, POLLOUT interest only while some are left
+ * @return false if the connection was closed
+ */
+static bool flush(int fd) {
+  Upstream &up = upstreams[fd];
+  while (!up.out.empty()) {
+    ssize_t n = ::send(fd, up.out.data(), up.out.size(), MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      perror("FastCGI: send");
+      closeUpstream(fd, 502);
+      return false;
+    }
+    up.out.erase(0, static_cast<size_t>(n));
+  }
+  SocketUtils::set_poll_events(
+      fd, static_cast<short>(up.out.empty() ? POLLIN : POLLIN | POLLOUT));
+  return true;
+}
+
+/**
+ * @brief Act on one complete record from the app
+ */
+static void handleRecord(int fd, unsigned char type, uint16_t id,
+                         const string &content) {
+  Upstream &up = upstreams[fd];
+  map<uint16_t, Pending>::iterator req = up.requests.find(id);
+  if (req == up.requests.end()) {
+    return; // management record or a request we aborted
+  }
+  HTTPConnxData *conn = waitingClient(fd, id, req->second);
+  switch (type) {
+  case STDOUT:
+    req->second.output += content;
+    if (req->second.output.size() > Constants::fastcgi_max_response) {
+      debuglog(RED, "FastCGI: response for request %d too large", id);
+      appendRecord(up.out, ABORT_REQUEST, id, "", 0);
+      up.requests.erase(req);
+      if (conn != NULL) {
+        failRequest(*conn, 502);
+      }
+    }
+    break;
+  case STDERR:
+    debuglog(RED, "FastCGI stderr: %s", content.c_str());
+    break;
+  case END_REQUEST:
+    if (conn != NULL) {
+      if (content.size() >= 5 &&
+          static_cast<unsigned char>(content[4]) == STATUS_CANT_MPX_CONN) {
+        debuglog(YELLOW, "FastCGI: %s does not multiplex", up.path.c_str());
+        no_multiplexing.insert(up.path);
+        failRequest(*conn, 503);
+      } else {
+        conn->fcgiData = HTTPConnxData::FastCGIData();
+        CGI::respondWithOutput(*conn, req->second.output);
+      }
+    }
+    up.requests.erase(req);
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * @brief Split what was read into records
+ * @return false if the connection was closed
+ */
+static bool parseRecords(int fd) {
+  Upstream &up = upstreams[fd];
+  while (up.in.size() >= HEADER_LEN) {
+    const unsigned char *h =
+        reinterpret_cast<const unsigned char *>(up.in.data());
+    if (h[0] != VERSION_1) {
+      debuglog(RED, "FastCGI: bad record version from %s", up.path.c_str());
+      closeUpstream(fd, 502);
+      return false;
+    }
+    uint16_t id = static_cast<uint16_t>((h[2] << 8) | h[3]);
+    size_t len = static_cast<size_t>((h[4] << 8) | h[5]);
+    size_t total = HEADER_LEN + len + h[6];
+    if (up.in.size() < total) {
+      break;
+    }
+    unsigned char type = h[1];
+    string content = up.in.substr(HEADER_LEN, len);
+    up.in.erase(0, total);
+    handleRecord(fd, type, id, content);
+  }
+  return true;
+}
+
+/**
+ * @brief Send the request to a pooled connection and wait in CONN_FASTCGI
+ *
+ * The part of the body that came with the headers goes out right away, the
+ * rest is forwarded by readRequestBody as it arrives.
+ */
+bool startRequest(HTTPConnxData &conn) {
+  if (conn.data.content_length > conn.config->maxBodySize) {
+    Responses::htmlErrorResponse(conn, 413);
+    return false;
+  }
+  int status = 502;
+  int fd = pickUpstream(conn.urlMatcherData.fastcgi_pass, status);
+  if (fd < 0) {
+    if (conn.data.request.size() - conn.data.headers_end <
+        conn.data.content_length) {
+      conn.closeConnection = true; // rest of the body is still on the socket
+    }
+    Responses::htmlErrorResponse(conn, status);
+    return false;
+  }
+  Upstream &up = upstreams[fd];
+  uint16_t id = nextRequestId(up);
+  up.requests[id].client_fd = conn.client_fd;
+
+  const char begin[8] = {0, static_cast<char>(ROLE_RESPONDER),
+                         static_cast<char>(FLAG_KEEP_CONN), 0, 0, 0, 0, 0};
+  appendRecord(up.out, BEGIN_REQUEST, id, begin, sizeof(begin));
+  string params = buildParams(conn);
+  appendRecord(up.out, PARAMS, id, params.data(), params.size());
+  appendRecord(up.out, PARAMS, id, "", 0);
+
+  string body = conn.data.request.substr(conn.data.headers_end);
+  if (body.size() > conn.data.content_length) {
+    body.resize(conn.data.content_length);
+  }
+  if (!body.empty()) {
+    appendRecord(up.out, STDIN, id, body.data(), body.size());
+  }
+  conn.fcgiData.body_left = conn.data.content_length - body.size();
+  if (conn.fcgiData.body_left == 0) {
+    appendRecord(up.out, STDIN, id, "", 0);
+  }
+  conn.fcgiData.upstream_fd = fd;
+  conn.fcgiData.request_id = id;
+  conn.fcgiData.started = std::time(NULL);
+  conn.state = CONN_FASTCGI;
+  debuglog(GREEN, "FastCGI: request %d for %s on connection %d", id,
+           conn.data.target.c_str(), fd);
+  flush(fd);
+  return true;
+}
+
+/**
+ * @brief Forward more of the request body as FCGI_STDIN
+ *
+ * Nothing is read while the upstream still has a lot queued, so a slow app
+ * slows the client down instead of filling our memory.
+ */
+void readRequestBody(HTTPConnxData &conn) {
+  int fd = conn.fcgiData.upstream_fd;
+  map<int, Upstream>::iterator up = upstreams.find(fd);
+  if (up == upstreams.end() || up->second.out.size() > MAX_QUEUED) {
+    return;
+  }
+  char buffer[Constants::BUFFER_SIZE];
+  size_t want = std::min(conn.fcgiData.body_left, sizeof(buffer));
+  ssize_t n = conn.readRequestBody(buffer, want, 0);
+  if (n <= 0) {
+    debuglog(YELLOW, "FastCGI: client fd %d gone during the body",
+             conn.client_fd);
+    conn.reset(); // aborts the request upstream
+    SocketUtils::remove_from_poll(conn.client_fd);
+    close(conn.client_fd);
+    conn.client_fd = -1; // Mark as closed
+    return;
+  }
+  uint16_t id = conn.fcgiData.request_id;
+  appendRecord(up->second.out, STDIN, id, buffer, static_cast<size_t>(n));
+  conn.fcgiData.body_left -= static_cast<size_t>(n);
+  if (conn.fcgiData.body_left == 0) {
+    appendRecord(up->second.out, STDIN, id, "", 0);
+  }
+  flush(fd);
+}
+
+/**
+ * @brief Handle poll events of an upstream socket
+ * @return false if the fd is not one of ours
+ */
+bool handlePollEvent(const pollfd &pfd) {
+  if (upstreams.find(pfd.fd) == upstreams.end()) {
+    return false;
+  }
+  // pfd lives in pollfds, which closeUpstream reorders
+  int fd = pfd.fd;
+  short revents = pfd.revents;
+  if ((revents & POLLOUT) && !flush(fd)) {
+    return true;
+  }
+  if (!(revents & (POLLIN | POLLHUP | POLLERR))) {
+    return true;
+  }
+  char buffer[Constants::BUFFER_SIZE];
+  ssize_t n = ::recv(fd, buffer, sizeof(buffer), 0);
+  if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+    // an idle connection the app closed is fine, in-flight requests are not
+    closeUpstream(fd, 502);
+    return true;
+  }
+  if (n > 0) {
+    upstreams[fd].in.append(buffer, static_cast<size_t>(n));
+    if (parseRecords(fd) && upstreams.count(fd)) {
+      flush(fd); // aborts queued while parsing
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief 504 when the app took longer than Constants::fastcgi_timeout
+ */
+bool checkTimeout(HTTPConnxData &conn) {
+  if (conn.fcgiData.upstream_fd == -1 ||
+      std::time(NULL) - conn.fcgiData.started <= Constants::fastcgi_timeout) {
+    return false;
+  }
+  debuglog(RED, "FastCGI: request %d timed out", conn.fcgiData.request_id);
+  abortRequest(conn);
+  conn.closeConnection = true;
+  Responses::htmlErrorResponse(conn, 504);
+  return true;
+}
+
+/**
+ * @brief Forget the client's request and tell the app to stop working on it
+ *
+ * Called from HTTPConnxData::reset, so it is a no-op for anything that is
+ * not waiting on a FastCGI app.
+ */
+void abortRequest(HTTPConnxData &conn) {
+  int fd = conn.fcgiData.upstream_fd;
+  uint16_t id = conn.fcgiData.request_id;
+  conn.fcgiData = HTTPConnxData::FastCGIData();
+  map<int, Upstream>::iterator up = upstreams.find(fd);
+  if (fd == -1 || up == upstreams.end() || !up->second.requests.count(id)) {
+    return;
+  }
+  up->second.requests.erase(id);
+  appendRecord(up->second.out, ABORT_REQUEST, id, "", 0);
+  flush(fd);
+}
+
+/**
+ * @brief Close the whole pool, used on shutdown
+ */
+void closeAll() {
+  for (map<int, Upstream>::iterator it = upstreams.begin();
+       it != upstreams.end(); ++it) {
+    SocketUtils::remove_from_poll(it->first);
+    close(it->first);
+  }
+  upstreams.clear();
+  no_multiplexing.clear();
+}
+
+} // namespace FastCGI
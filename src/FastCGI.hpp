@@ -0,0 +1,33 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include <poll.h>
+#include <string>
+
+using std::string;
+
+/**
+ * @brief FastCGI client for locations with fastcgi_pass
+ *
+ * Instead of fork() + execve() per request, the request goes to a long
+ * lived application over its Unix socket. Connections to each socket are
+ * kept open (FCGI_KEEP_CONN) and pooled, and up to
+ * Constants::fastcgi_max_requests requests share one connection, told apart
+ * by their request id. The upstream sockets sit in the same pollfds as the
+ * clients; HTTPServer::run gives their events to handlePollEvent before it
+ * looks for a client connection.
+ *
+ * The app's stdout is collected until FCGI_END_REQUEST and then sent as a
+ * normal generated response (Content-Length, keep-alive and gzip work like
+ * for any other page).
+ */
+namespace FastCGI {
+
+bool startRequest(HTTPConnxData &conn);
+bool handlePollEvent(const pollfd &pfd);
+void readRequestBody(HTTPConnxData &conn);
+bool checkTimeout(HTTPConnxData &conn);
+void abortRequest(HTTPConnxData &conn);
+void closeAll();
+
+} // namespace FastCGI
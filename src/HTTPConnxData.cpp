@@ -13,9 +13,28 @@
 #include "SocketUtils.hpp"
 #include "HTTPServer.hpp"
 #include "Constants.hpp"
+#include "PageCache.hpp"
 #include <cassert>
 #include <dirent.h> 
 #include "Responses.hpp"
+#include "Compression.hpp"
+#include "Autoindex.hpp"
+#include "BodySpool.hpp"
+#include "CGI.hpp"
+#include "CGICache.hpp"
+#include "CGIPool.hpp"
+#include "DiskIO.hpp"
+#include "FastCGI.hpp"
+#include "Multipart.hpp"
+#include "Resumable.hpp"
+#include <algorithm>
+#include <errno.h>
+#include <strings.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
 
 using std::map;
 using std::string;
@@ -23,121 +42,146 @@ using std::vector;
 
 
 /**
- * @brief Dechunk the data from the string
- * 
- * This function processes the buffer to remove chunked transfer encoding.
- * It will be called once we have the final chunk (0\r\n\r\n).
- * returns the dechunked string
+ * @brief Decode the chunked body received so far
+ *
+ * Runs on every read while the body comes in. Decoded bytes are moved
+ * down right behind the headers, the raw bytes of an incomplete chunk stay
+ * behind them for the next call. When the decoded body grows past
+ * client_body_buffer_size it moves to a temp file and from then on decoded
+ * bytes go straight there, so memory stays bounded by the buffer size and
+ * one read. Everything after the last chunk is dropped.
+ *
+ * @return HEADERS_PARSE_SUCCESS once the last chunk is in, HEADERS_PARSE_ERROR
+ * with errorStatus set for a malformed or too large body
  */
-string HTTPConnxData::dechunkData(string chunked_string) {
-  std::string dechunked;
-  size_t pos = 0;
-  
-  if (chunked_string.empty() || chunked_string.find("0\r\n\r\n", 0) == string::npos ) {
-    debug("ERROR End of chunking not found");
-    return dechunked; // Return empty string if end of chunking not found
-  }
-
-  while (pos < chunked_string.length()) {
-      // Find chunk size line
-      size_t chunk_size_end = chunked_string.find("\r\n", pos);
-      if (chunk_size_end == std::string::npos) break;
-      
-      // Parse hex chunk size
-      std::string hex_size = chunked_string.substr(pos, chunk_size_end - pos);
-      unsigned int chunk_size;
-      std::istringstream iss(hex_size);
-      iss >> std::hex >> chunk_size;
-      
-      if (chunk_size == 0) break;  // Last chunk
-      
-      // Move to chunk data start
-      pos = chunk_size_end + 2;
-      if (pos + chunk_size > chunked_string.length()) break;
-      
-      // Append chunk data
-      dechunked.append(chunked_string.substr(pos, chunk_size));
-      
-      // Move to next chunk
-      pos += chunk_size + 2;
+ParseStatus HTTPConnxData::decodeChunks() {
+  string &request = data.request;
+  if (data.chunk_pos == 0) {
+    data.chunk_pos = data.headers_end;
   }
-  
-  // Update buffer and headers
-  data.headers["Content-Length"] = Utils::to_string(cgiData.buffer.size());
-  data.headers.erase("Transfer-Encoding");  // Remove chunked header
-  return dechunked;
+  size_t out = data.chunk_pos; // decoded bytes end here
+  size_t pos = data.chunk_pos; // raw bytes start here
+  bool done = false;
+  while (!done) {
+    if (data.chunk_left > 0) {
+      size_t len = std::min(data.chunk_left, request.size() - pos);
+      if (len == 0) {
+        break;
+      }
+      if (!keepDecodedBody(out, pos, len)) {
+        return HEADERS_PARSE_ERROR;
+      }
+      pos += len;
+      data.chunk_left -= len;
+      data.chunk_crlf = data.chunk_left == 0;
+    } else if (data.chunk_crlf) {
+      if (request.size() - pos < 2) {
+        break;
+      }
+      if (request.compare(pos, 2, "\r\n") != 0) {
+        errorStatus = 400;
+        return HEADERS_PARSE_ERROR;
+      }
+      pos += 2;
+      data.chunk_crlf = false;
+    } else {
+      size_t eol = request.find("\r\n", pos);
+      if (eol == string::npos) {
+        if (request.size() - pos > 1024) {
+          errorStatus = 400; // no sane chunk size line is that long
+          return HEADERS_PARSE_ERROR;
+        }
+        break;
+      }
+      string size_line = request.substr(pos, eol - pos);
+      size_line = size_line.substr(0, size_line.find(';')); // extensions
+      char *end = NULL;
+      unsigned long size = strtoul(size_line.c_str(), &end, 16);
+      if (size_line.empty() || *end != '\0') {
+        debuglog(RED, "Invalid chunk size line: %s", size_line.c_str());
+        errorStatus = 400;
+        return HEADERS_PARSE_ERROR;
+      }
+      if (size > 0) {
+        data.chunk_left = size;
+        pos = eol + 2;
+        continue;
+      }
+      // last chunk, then optional trailers and an empty line
+      size_t trailer_end = request.compare(eol + 2, 2, "\r\n") == 0
+                               ? eol
+                               : request.find("\r\n\r\n", eol + 2);
+      if (trailer_end == string::npos) {
+        break; // the size line is read again next time
+      }
+      pos = trailer_end + 4;
+      done = true;
+    }
+  }
+  request.erase(out, done ? string::npos : pos - out);
+  data.chunk_pos = out;
+
+  const ServerData *conf = config;
+  if (!done && data.body_fd == -1 && conf != NULL &&
+      data.body_size > conf->client_body_buffer_size) {
+    // too big for memory: the body so far moves to the spool
+    data.body_fd = BodySpool::open(conf->client_body_temp_path);
+    if (data.body_fd < 0 ||
+        !BodySpool::write(data.body_fd, request.data() + data.headers_end,
+                          out - data.headers_end)) {
+      perror("Failed to spool the request body");
+      errorStatus = 500;
+      return HEADERS_PARSE_ERROR;
+    }
+    debuglog(YELLOW, "Spooling the body of fd %d to a temp file", client_fd);
+    request.erase(data.headers_end, out - data.headers_end);
+    data.chunk_pos = data.headers_end;
+  }
+  if (!done) {
+    return HEADERS_PARSE_INCOMPLETE;
+  }
+  if (data.body_fd != -1) {
+    lseek(data.body_fd, 0, SEEK_SET);
+  }
+  debuglog(GREEN, "Decoded chunked body of %zu bytes%s", data.body_size,
+           data.body_fd != -1 ? " (spooled)" : "");
+  return HEADERS_PARSE_SUCCESS;
 }
 
-
 /**
- * @brief Read data from the client into the buffer
- *
- * @param conn The connection data
- * @param current_fd The current file descriptor
+ * @brief Keep len decoded bytes found at pos: moved down to out, or
+ * written to the spool once there is one
  */
-void HTTPConnxData::read_from_client_into_buffer() {
-  cgiData.buffer.resize(Constants::BUFFER_SIZE);
-  ssize_t bytes_read =
-      ::recv(client_fd, &cgiData.buffer[0], Constants::BUFFER_SIZE, 0);
-  if (bytes_read < 0) {
-    perror("Failed to read from client");
-    state = CONN_CGI_FINISHED;
-  } else if (bytes_read == 0) {
-    debug("Client closed connection - giving EOF to CGI stdin");
-    close(cgiData.cgi_stdin_fd);
-    SocketUtils::remove_from_poll(cgiData.cgi_stdin_fd);
-    cgiData.cgi_stdin_fd = -1; // Mark as closed
-    state = CONN_CGI_SENDING;
+bool HTTPConnxData::keepDecodedBody(size_t &out, size_t pos, size_t len) {
+  data.body_size += len;
+  if (config != NULL && data.body_size > config->maxBodySize) {
+    debuglog(RED, "Chunked body over maxBodySize");
+    errorStatus = 413;
+    return false;
+  }
+  if (data.body_fd != -1) {
+    if (!BodySpool::write(data.body_fd, data.request.data() + pos, len)) {
+      errorStatus = 500;
+      return false;
+    }
+    return true;
   }
-  debug("Received %ld bytes from client", bytes_read);
+  if (out != pos) {
+    memmove(&data.request[out], &data.request[pos], len);
+  }
+  out += len;
+  return true;
 }
 
 /**
- * @brief Write the buffer to the client from CGI
- *
- * @param conn The connection data
- * @param current_fd The current file descriptor
+ * @brief Read more of the request body, from the spool when it has one,
+ * from the client socket otherwise
  */
-void HTTPConnxData::write_to_client_from_cgi() {
-  if (!cgiData.buffer.empty()) {
-    debug("leftover buffer from cgiData");
-    // write to cgi the buffer if any remaining from the
-    // initialisation
-    ssize_t bytes_written = ::send(client_fd, cgiData.buffer.c_str(),
-                                    cgiData.buffer.size(), MSG_NOSIGNAL);
-    debug("Wrote %ld bytes to client", bytes_written);
-
-    if (bytes_written < 0) {
-      perror("Failed to write to client");
-      debug("Failed to write to client");
-      state = CONN_CGI_FINISHED;
-    } else if (bytes_written == 0) {
-      // Should not happen with blocking write unless size was 0
-      debuglog(YELLOW, "Wrote 0 bytes to client (buffer size: %zu)",
-               cgiData.buffer.size());
-      debuglog(RED, "Wrote 0 bytes to client unexpectedly.");
-      state = CONN_CGI_FINISHED;
-    } else if (static_cast<size_t>(bytes_written) <
-               cgiData.buffer.size()) {
-      // Partial write: Remove written data and wait for next POLLOUT
-      debug("Partial write: Wrote %ld bytes to client (buffer size: %zu)",
-            bytes_written, cgiData.buffer.size());
-      cgiData.buffer.erase(
-          0, static_cast<std::string::size_type>(bytes_written));
-      // stay in the same state, poll will trigger again
-    } else {
-      // Full write (bytes_written == cgiData.buffer.size())
-      debugcolor(MAGENTA, "wrote request buffer to client: %s",
-                 cgiData.buffer.c_str()); // Log data before clearing
-      // TODO check the bytes received
-      cgiData.bytes_received += static_cast<size_t>(bytes_written);
-      if (cgiData.bytes_received >= data.content_length) {
-        debug("Full write: Wrote %ld bytes to CGI stdin", bytes_written);
-        // If we have written all data, clear the buffer
-        cgiData.buffer.clear();
-      }
-    }
+ssize_t HTTPConnxData::readRequestBody(char *buffer, size_t len, int flags) {
+  if (data.body_fd != -1) {
+    return ::read(data.body_fd, buffer, len);
   }
+  return ::recv(client_fd, buffer, len, flags);
 }
 
 /**
@@ -146,19 +190,28 @@ void HTTPConnxData::write_to_client_from_cgi() {
  * It does NOT close the socket clientfd
  */
 void HTTPConnxData::reset() {
+  Compression::release(cgiData.gzip);
+  FastCGI::abortRequest(*this);
+  CGIPool::abortRequest(*this);
+  CGI::releaseSlot(*this);
+  CGICache::release(*this);
+  Multipart::abort(*this);
   state = CONN_INCOMING;
+  if (data.body_fd != -1) {
+    close(data.body_fd);
+  }
   data = ConnectionData();
-  cgiData = CGIData();
   urlMatcherData = URLMatcherData();
+  PageCache::release(*this);
+  fileData = FileTransferData();
+  listing = ListingData();
   headers_set = false;
   bytes_received = 0;
 
   // Close open file descriptors
   if (file_fd != -1) {
-    close(file_fd);
-    unlink(filename); // Remove partial upload
+    BodySpool::discard(file_fd, upload_temp); // an unfinished upload too
     file_fd = -1;
-    filename[0] = '\0';
   }
 
   if (writeto_fd != -1) {
@@ -168,10 +221,12 @@ void HTTPConnxData::reset() {
 
   //check for cgi and reset
   if (cgiData.cgi_stdin_fd != -1) {
+    SocketUtils::remove_from_poll(cgiData.cgi_stdin_fd);
     close(cgiData.cgi_stdin_fd);
     cgiData.cgi_stdin_fd = -1;
   }
   if (cgiData.cgi_stdout_fd != -1) {
+    SocketUtils::remove_from_poll(cgiData.cgi_stdout_fd);
     close(cgiData.cgi_stdout_fd);
     cgiData.cgi_stdout_fd = -1;
   }
@@ -179,6 +234,7 @@ void HTTPConnxData::reset() {
     ::kill(cgiData.child_pid, SIGTERM);
     cgiData.child_pid = -1;
   }
+  cgiData = CGIData();
 
 }
 
@@ -233,7 +289,7 @@ ParseStatus HTTPConnxData::parseRequestLine(const string &line) {
   }
 
   // Validate method
-  const char *methods[] = {"GET", "POST", "PUT", "DELETE", "HEAD"};
+  const char *methods[] = {"GET", "POST", "PUT", "PATCH", "DELETE", "HEAD"};
   bool valid = false;
   for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); ++i) {
     if (data.method == methods[i]) {
@@ -375,6 +431,14 @@ ParseStatus HTTPConnxData::processContentHeaders() {
     debuglog(YELLOW, "Content-Length: %ld", data.content_length);
   }
 
+  // Process Expect, the client holds the body back until validateRequest
+  // says it is wanted
+  string expect;
+  if (checkHeader("Expect", expect)) {
+    data.expect_continue = data.version == "HTTP/1.1" &&
+                           strcasecmp(expect.c_str(), "100-continue") == 0;
+  }
+
   // Process Transfer-Encoding
   string transfer_encoding;
   if (checkHeader("Transfer-Encoding", transfer_encoding)) {
@@ -398,7 +462,13 @@ ParseStatus HTTPConnxData::processContentHeaders() {
       }
 
       boundary_pos += 9; // Skip "boundary="
-      data.boundary = "--" + content_type.substr(boundary_pos);
+      string boundary = trim(content_type.substr(
+          boundary_pos, content_type.find(';', boundary_pos) - boundary_pos));
+      if (boundary.size() >= 2 && boundary[0] == '"' &&
+          boundary[boundary.size() - 1] == '"') {
+        boundary = boundary.substr(1, boundary.size() - 2);
+      }
+      data.boundary = "--" + boundary;
       data.multipart = true;
       data.headers["boundary"] = data.boundary;
     }
@@ -711,6 +781,27 @@ bool HTTPConnxData::retrieveSession() {
 bool HTTPConnxData::uploadComplete() {
   if (data.bytes_sent >= data.content_length) {
     debug("Upload complete");
+    if (urlMatcherData.resumable) {
+      Resumable::finish(*this);
+      return true;
+    }
+    if (file_fd != -1) {
+      BodySpool::Upload upload;
+      upload.fd = file_fd;
+      upload.temp = upload_temp;
+      upload.path = urlMatcherData.full_path;
+      if (urlMatcherData.upload_dedup) {
+        upload.digest = upload_digest.hexDigest();
+      }
+      if (!BodySpool::complete(*this, upload)) {
+        reset();
+        Responses::htmlErrorResponse(*this, 500);
+        return true;
+      }
+      close(file_fd);
+      file_fd = -1;
+      upload_temp.clear();
+    }
     reset();
     Responses::createResponse(*this, "text/plain", "File uploaded successfully.",
                               201);
@@ -745,6 +836,10 @@ bool HTTPConnxData::writingFirstPayloadCompletesUpload() {
       client_fd = -1; // Mark as closed
       return true;
     }
+    if (urlMatcherData.upload_dedup) {
+      upload_digest.update(data.response.data(),
+                           static_cast<size_t>(bytes_written));
+    }
     data.bytes_sent += static_cast<size_t>(bytes_written);
     data.response.clear();
 
@@ -756,50 +851,155 @@ bool HTTPConnxData::writingFirstPayloadCompletesUpload() {
   return false;
 }
 
+// one pipe and one buffer serve every upload, each call empties them again
+static int upload_pipe[2] = {-1, -1};
+static size_t upload_pipe_size = 0;
+static bool splice_works = true;
+static std::vector<char> upload_buffer;
+static const ssize_t NOT_SPLICED = -2;
+
+static void closeUploadPipe() {
+  if (upload_pipe[0] != -1) {
+    close(upload_pipe[0]);
+    close(upload_pipe[1]);
+    upload_pipe[0] = upload_pipe[1] = -1;
+  }
+}
+
 /**
- * @brief Read data from the client for upload
+ * @brief Read up to count bytes of body from fd and write them to file
+ * through the reusable buffer, hashing them on the way when digest is given
+ * @return bytes moved, 0 at EOF, -1 on error
  */
-bool HTTPConnxData::readFromClientForUpload() {
-  data.buffer.resize(Constants::BUFFER_SIZE);
-  ssize_t bytes_read = ::recv(client_fd, data.buffer.data(),
-                              data.buffer.size(), 0);
-  if (bytes_read <= 0) {
-    if (bytes_read == 0) {
-      debug("Client disconnected during upload");
-    } 
-    perror("recv failed during upload");
-    reset();
-    close(client_fd);
-    SocketUtils::remove_from_poll(client_fd);
-    client_fd = -1; // Mark as closed
+static ssize_t copyToFile(int from, int to, size_t count,
+                          Sha256 *digest = NULL) {
+  if (upload_buffer.empty()) {
+    upload_buffer.resize(Constants::upload_chunk_size);
+  }
+  count = std::min(count, upload_buffer.size());
+  ssize_t in = ::read(from, &upload_buffer[0], count);
+  if (in <= 0) {
+    return in;
+  }
+  if (digest != NULL) {
+    digest->update(&upload_buffer[0], static_cast<size_t>(in));
+  }
+  if (!BodySpool::write(to, &upload_buffer[0], static_cast<size_t>(in))) {
+    return -1;
+  }
+  return in;
+}
+
+#ifdef __linux__
+static bool openUploadPipe() {
+  if (pipe2(upload_pipe, O_CLOEXEC | O_NONBLOCK) != 0) {
+    perror("upload pipe");
     return false;
   }
-  // Resize the buffer to the actual amount of data read
-  data.buffer.resize(static_cast<size_t>(bytes_read));
-  debug("Received %ld bytes from client", bytes_read);
+  fcntl(upload_pipe[1], F_SETPIPE_SZ,
+        static_cast<int>(Constants::upload_chunk_size));
+  int size = fcntl(upload_pipe[1], F_GETPIPE_SZ);
+  upload_pipe_size = size > 0 ? static_cast<size_t>(size) : 4096;
   return true;
 }
+#endif
 
 /**
- * @brief Write the upload data to the file
+ * @brief Move up to count bytes of body from fd to file with splice(),
+ * socket -> pipe -> file without a copy through user space
+ *
+ * @return bytes moved, 0 at EOF, -1 on error, NOT_SPLICED when splice does
+ * not work for these files (then it is never tried again)
  */
-bool HTTPConnxData::writeUploadToFile() {
-  ssize_t bytes_written =
-      write(file_fd, data.buffer.data(), data.buffer.size());
-  if (bytes_written <= 0) {
-    perror(bytes_written < 0 ? "Failed to write to file"
-                             : "No data written to file");
+static ssize_t spliceToFile(int from, int to, size_t count) {
+#ifdef __linux__
+  if (upload_pipe[0] == -1 && !openUploadPipe()) {
+    splice_works = false;
+    return NOT_SPLICED;
+  }
+  count = std::min(count, upload_pipe_size);
+  ssize_t in = ::splice(from, NULL, upload_pipe[1], NULL, count,
+                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (in < 0 && (errno == EINVAL || errno == ENOSYS)) {
+    debuglog(YELLOW, "splice not supported, uploads go through a buffer");
+    splice_works = false;
+    closeUploadPipe();
+    return NOT_SPLICED;
+  }
+  size_t left = in > 0 ? static_cast<size_t>(in) : 0;
+  while (left > 0) {
+    ssize_t out = ::splice(upload_pipe[0], NULL, to, NULL, left,
+                           SPLICE_F_MOVE);
+    if (out < 0 && errno == EINTR) {
+      continue;
+    }
+    if (out < 0 && (errno == EINVAL || errno == ENOSYS)) {
+      // the target filesystem does not take splice, copy what is in the pipe
+      debuglog(YELLOW, "splice to file not supported, using a buffer");
+      splice_works = false;
+      while (left > 0 && (out = copyToFile(upload_pipe[0], to, left)) > 0) {
+        left -= static_cast<size_t>(out);
+      }
+      closeUploadPipe();
+      return left == 0 ? in : -1;
+    }
+    if (out <= 0) {
+      closeUploadPipe(); // whatever is left in it is lost anyway
+      return -1;
+    }
+    left -= static_cast<size_t>(out);
+  }
+  return in;
+#else
+  (void)from;
+  (void)to;
+  (void)count;
+  splice_works = false;
+  return NOT_SPLICED;
+#endif
+}
+
+/**
+ * @brief Move the next piece of the upload body into its file
+ *
+ * Uses splice() where it works and one large reusable buffer elsewhere;
+ * upload_dedup needs to see the bytes, so it always takes the buffer.
+ * Never reads past Content-Length, so a pipelined request behind the body
+ * stays on the socket.
+ *
+ * @return false if the connection was closed
+ */
+bool HTTPConnxData::receiveUpload() {
+  int from = data.body_fd != -1 ? data.body_fd : client_fd;
+  size_t left = data.content_length - data.bytes_sent;
+  bool hash = urlMatcherData.upload_dedup;
+  ssize_t moved = NOT_SPLICED;
+  if (DiskIO::writeUpload(*this, from, left, moved) && moved > 0) {
+    return true; // data.bytes_sent moves on once the worker wrote it
+  }
+  if (moved == NOT_SPLICED && splice_works && !hash) {
+    moved = spliceToFile(from, file_fd, left);
+  }
+  if (moved == NOT_SPLICED) {
+    moved = copyToFile(from, file_fd, left, hash ? &upload_digest : NULL);
+  }
+  if (moved < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return true;
+  }
+  if (moved <= 0) {
+    if (moved == 0) {
+      debug("Client disconnected during upload");
+    } else {
+      perror("upload failed");
+    }
     reset();
     close(client_fd);
     SocketUtils::remove_from_poll(client_fd);
     client_fd = -1; // Mark as closed
     return false;
   }
-  data.bytes_sent += static_cast<size_t>(bytes_written);
-  debug("Wrote %ld bytes to file", bytes_written);
-  debug("total bytes sent %zu/%zu", data.bytes_sent,
-        data.content_length);
-  data.buffer.clear();
+  data.bytes_sent += static_cast<size_t>(moved);
+  debug("total bytes written %zu/%zu", data.bytes_sent, data.content_length);
   return true;
 }
 
@@ -809,6 +1009,9 @@ bool HTTPConnxData::writeUploadToFile() {
  * @return true if the response was sent successfully, false otherwise
  */
 bool HTTPConnxData::finishedSendingSimpleResponse() {
+  if (data.prebuilt_response != NULL) {
+    return finishedSendingPrebuiltResponse();
+  }
   data.response.reserve(Constants::BUFFER_SIZE);
   ssize_t bytes_sent = ::send(client_fd, data.response.c_str(),
                               data.response.size(), 0);
@@ -838,6 +1041,33 @@ bool HTTPConnxData::finishedSendingSimpleResponse() {
   return true;
 }
 
+/**
+ * @brief Send a response that was serialized at config load
+ *
+ * The blob is shared between connections so it is never modified. Instead
+ * of erasing what went out we keep the offset in bytes_sent.
+ */
+bool HTTPConnxData::finishedSendingPrebuiltResponse() {
+  const string &blob = *data.prebuilt_response;
+  ssize_t bytes_sent = ::send(client_fd, blob.data() + data.bytes_sent,
+                              blob.size() - data.bytes_sent, 0);
+  if (bytes_sent < 0) {
+    perror("Failed to send prebuilt response");
+    close_conn_after_error();
+    return false;
+  }
+  data.bytes_sent += static_cast<size_t>(bytes_sent);
+  if (data.bytes_sent < blob.size()) {
+    debug("Still %zu bytes of prebuilt response to send",
+          blob.size() - data.bytes_sent);
+    return false;
+  }
+  debug("Finished sending prebuilt response to client %d", client_fd);
+  state = CONN_INCOMING;
+  reset();
+  return true;
+}
+
 /**
  * @brief Util function to close the connection after an error
  * mostly used in case of failed send or read
@@ -876,30 +1106,84 @@ bool HTTPConnxData::settingHeadersIfNeeded() {
 /**
  * @brief Read new data from the file if the buffer is empty
  *
+ * Reads with pread() at fileData.offset and never past the current range.
+ * On Linux the file bytes are left to sendfile() and only part headers go
+ * through the buffer.
  */
 bool HTTPConnxData::readNewDataFromFile() {
-  // 1. Read new data if buffer is empty (and file not fully read)
-  if (data.buffer.empty() && file_fd != -1) {
-    char read_buf[Constants::BUFFER_SIZE];
-    ssize_t bytes_read = read(file_fd, read_buf, sizeof(read_buf));
+  if (data.buffer.empty() && listing.streaming) {
+    Autoindex::nextChunk(*this);
+    return true;
+  }
+  if (!data.buffer.empty() || file_fd == -1) {
+    return true;
+  }
+  if (fileData.remaining <= 0 && !startNextFileRange()) {
+    debug("End of file data reached for connection %d", client_fd);
+    close(file_fd);
+    file_fd = -1;
+    // keep going, there might be more data in the buffer to send to client
+    return true;
+  }
+  if (!data.buffer.empty()) {
+    return true; // part header goes out before the range data
+  }
+  if (DiskIO::readChunk(*this)) {
+    return true; // the chunk lands in the buffer when the worker is done
+  }
+#ifdef __linux__
+  return true;
+#else
+  char read_buf[Constants::BUFFER_SIZE];
+  size_t to_read = sizeof(read_buf);
+  if (static_cast<off_t>(to_read) > fileData.remaining) {
+    to_read = static_cast<size_t>(fileData.remaining);
+  }
+  PageCache::Probe probe = PageCache::probe(*this, to_read);
+  ssize_t bytes_read = pread(file_fd, read_buf, to_read, fileData.offset);
 
-    if (bytes_read < 0) {
-      perror("Failed to read file");
-      close_conn_after_error();
-      return false;
-    } else if (bytes_read == 0) {
-      debug("End of file reached for connection %d", client_fd);
-      close(file_fd);
-      file_fd = -1;
-      // keep going, there might be more data in the buffer to send to
-      // client
-    } else {
-      // Append new data to buffer
-      data.buffer.insert(data.buffer.end(), read_buf,
-                              read_buf + bytes_read);
-    }
+  if (bytes_read < 0) {
+    perror("Failed to read file");
+    close_conn_after_error();
+    return false;
+  } else if (bytes_read == 0) {
+    // file shrank under us - the Content-Length we sent is now a lie
+    debuglog(RED, "File truncated while sending to client %d", client_fd);
+    close(file_fd);
+    file_fd = -1;
+    closeConnection = true;
+  } else {
+    data.buffer.insert(data.buffer.end(), read_buf, read_buf + bytes_read);
+    fileData.offset += bytes_read;
+    fileData.remaining -= bytes_read;
+    PageCache::consumed(*this, probe, to_read, bytes_read);
   }
   return true;
+#endif
+}
+
+/**
+ * @brief Move on to the next range of a multipart/byteranges response
+ *
+ * Queues the part header (or the closing boundary after the last range) in
+ * the buffer.
+ * @return false when there is no more file data to send
+ */
+bool HTTPConnxData::startNextFileRange() {
+  if (fileData.next_range < fileData.ranges.size()) {
+    const ByteRange &range = fileData.ranges[fileData.next_range];
+    const string &part_header = fileData.part_headers[fileData.next_range];
+    data.buffer.assign(part_header.begin(), part_header.end());
+    fileData.offset = range.first;
+    fileData.remaining = range.second - range.first + 1;
+    ++fileData.next_range;
+    return true;
+  }
+  if (!fileData.closing.empty()) {
+    data.buffer.assign(fileData.closing.begin(), fileData.closing.end());
+    fileData.closing.clear();
+  }
+  return false;
 }
 
 bool HTTPConnxData::sendNewDataFromFileToClient() {
@@ -925,7 +1209,92 @@ bool HTTPConnxData::sendNewDataFromFileToClient() {
       debug("Sent %zd bytes (%zu remaining in buffer)", bytes_sent,
             data.buffer.size());
     }
+    return true;
   }
+#ifdef __linux__
+  if (file_fd != -1 && fileData.remaining > 0 && urlMatcherData.disk_job == 0) {
+    return fileData.map != NULL ? sendFileMapped() : sendFileZeroCopy();
+  }
+#endif
+  return true;
+}
+
+/**
+ * @brief Send the next piece of the current range straight from the page cache
+ *
+ * sendfile() copies from the file to the socket inside the kernel, so the
+ * data never passes through our buffer. The chunk is capped so one large
+ * file does not hold the loop for too long on a blocking socket.
+ */
+bool HTTPConnxData::sendFileZeroCopy() {
+#ifdef __linux__
+  size_t count = Constants::sendfile_chunk_size;
+  if (static_cast<off_t>(count) > fileData.remaining) {
+    count = static_cast<size_t>(fileData.remaining);
+  }
+  off_t offset = fileData.offset;
+  PageCache::Probe probe = PageCache::probe(*this, count);
+  ssize_t bytes_sent = ::sendfile(client_fd, file_fd, &offset, count);
+  if (bytes_sent < 0) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return true;
+    }
+    perror("sendfile failed");
+    debuglog(RED, "Error during file transfer for connection %d", client_fd);
+    close_conn_after_error();
+    return false;
+  } else if (bytes_sent == 0) {
+    debuglog(RED, "File truncated while sending to client %d", client_fd);
+    close(file_fd);
+    file_fd = -1;
+    closeConnection = true;
+    return true;
+  }
+  fileData.offset = offset;
+  fileData.remaining -= bytes_sent;
+  data.bytes_sent += static_cast<size_t>(bytes_sent);
+  PageCache::consumed(*this, probe, count, bytes_sent);
+  debug("sendfile sent %zd bytes (%ld left in range)", bytes_sent,
+        static_cast<long>(fileData.remaining));
+#endif
+  return true;
+}
+
+/**
+ * @brief Send the next piece of the current range from the file's mapping,
+ * with file_cache_hints mmap
+ *
+ * A page the file no longer has makes send() fail with EFAULT instead of
+ * raising SIGBUS, the copy happens in the kernel; the file was truncated.
+ */
+bool HTTPConnxData::sendFileMapped() {
+  size_t count = Constants::sendfile_chunk_size;
+  if (static_cast<off_t>(count) > fileData.remaining) {
+    count = static_cast<size_t>(fileData.remaining);
+  }
+  PageCache::Probe probe = PageCache::probe(*this, count);
+  ssize_t bytes_sent =
+      ::send(client_fd, fileData.map + fileData.offset, count, 0);
+  if (bytes_sent < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return true;
+  } else if (bytes_sent < 0 && errno != EFAULT) {
+    perror("send failed");
+    debuglog(RED, "Error during file transfer for connection %d", client_fd);
+    close_conn_after_error();
+    return false;
+  } else if (bytes_sent <= 0) {
+    debuglog(RED, "File truncated while sending to client %d", client_fd);
+    close(file_fd);
+    file_fd = -1;
+    closeConnection = true;
+    return true;
+  }
+  fileData.offset += bytes_sent;
+  fileData.remaining -= bytes_sent;
+  data.bytes_sent += static_cast<size_t>(bytes_sent);
+  PageCache::consumed(*this, probe, count, bytes_sent);
+  debug("send sent %zd mapped bytes (%ld left in range)", bytes_sent,
+        static_cast<long>(fileData.remaining));
   return true;
 }
 
@@ -940,7 +1309,7 @@ bool HTTPConnxData::sendNewDataFromFileToClient() {
  * updates the state to INCOMING.
  */
 void HTTPConnxData::checkCompletionConditions() {
-  if (file_fd == -1 && data.buffer.empty()) {
+  if (file_fd == -1 && data.buffer.empty() && !listing.streaming) {
     debug("File sent completely for connection %d", client_fd);
     debug("File transfer complete for connection %d sent %lu bytes",
           client_fd, data.bytes_sent);
@@ -996,6 +1365,12 @@ bool HTTPConnxData::check_for_child_timeout() {
     debug("child timeout %ld", cgiData.child_timeout);
     if (std::time(NULL) - cgiData.child_timeout >
         Constants::cgi_child_timeout) {
+      if (cgiData.stdout_eof) {
+        // closed stdout but lingers: end the body without its status
+        cgiData.child_pid = -1;
+        pumpCgi(-1, 0);
+        return true;
+      }
       debug("CGI timeout reached");
       debuglog(YELLOW, "Child timeout reached for connection %d", client_fd);
       errorStatus = 504;
@@ -1007,104 +1382,453 @@ bool HTTPConnxData::check_for_child_timeout() {
 }
 
 /**
- * @brief Sends data (read from CGI stdout) to the client socket.
+ * @brief Record how the CGI child ended
  *
- * @param bytes_read The number of bytes previously read from CGI stdout.
- * @return false if state changes to CONN_CGI_FINISHED or a critical error occurs,
- *         true if the send was successful (fully or partially) and state remains CONN_CGI_SENDING.
+ * Called by the reaper, or from finishCgiOutput when the child is already
+ * a zombie at EOF. A child that crashed or failed must not have its output
+ * passed off as a complete response.
  */
-bool HTTPConnxData::sendCgiDataToClient(ssize_t bytes_read) {
-  // Ensure there's actually data to send (bytes_read should be > 0)
-  if (bytes_read <= 0) {
-      debuglog(RED, "sendCgiDataToClient called with bytes_read <= 0");
-      state = CONN_CGI_FINISHED; 
-      return false;
+void HTTPConnxData::cgiExited(int status) {
+  cgiData.child_pid = -1;
+  cgiData.exit_status = status;
+  CGI::countExit(status);
+  if (WIFSIGNALED(status)) {
+    debuglog(RED, "CGI for client fd %d killed by signal %d", client_fd,
+             WTERMSIG(status));
+  } else if (WEXITSTATUS(status) != 0) {
+    debuglog(YELLOW, "CGI for client fd %d exited with %d", client_fd,
+             WEXITSTATUS(status));
   }
-  ssize_t bytes_written =
-      ::send(client_fd, cgiData.buffer.c_str(),
-             static_cast<size_t>(bytes_read), MSG_NOSIGNAL);
-  if (bytes_written < 0) {
-    // Handle send error (e.g., client disconnected)
-    perror("Failed to send data to client");
-    debuglog(RED, "Failed to send data to client fd %d", client_fd);
+}
+
+/**
+ * @brief Move data between the client, the CGI child and back
+ *
+ * Called for any event on the client socket or on one of the CGI pipes.
+ * Every step is non-blocking and only works on what is buffered, so the
+ * request body and the output flow at the same time and each direction
+ * holds at most about cgi_pipe_buffer bytes. Poll interest then follows the
+ * buffers: a full one stops us reading from its source until the other side
+ * has drained it.
+ *
+ * @return true when the CGI is over (its pipes left pollfds)
+ */
+bool HTTPConnxData::pumpCgi(int fd, short revents) {
+  if (fd != -1 && fd == cgiData.cgi_stdin_fd &&
+      (revents & (POLLERR | POLLHUP))) {
+    // the child stopped reading, whatever is left of the body is dropped
+    debug("CGI stdin pipe %d closed by the child", fd);
+    if (!cgiData.buffer.empty() || cgiData.request_left > 0) {
+      closeConnection = true;
+    }
+    cgiData.buffer.clear();
+    cgiData.request_left = 0;
+    closeCgiStdin();
+  }
+  readCgiRequestBody();
+  writeCgiRequestBody();
+  readCgiOutput();
+  writeCgiOutput();
+  if (state != CONN_CGI_FINISHED && cgiData.output_done &&
+      cgiData.output.empty()) {
+    debuglog(YELLOW, "CGI response complete for client fd %d", client_fd);
     state = CONN_CGI_FINISHED;
-    return false; 
-  } else  if (bytes_written == 0) {
-    // Should generally not happen with blocking sockets unless client closed connection cleanly?
-    debuglog(YELLOW, "Wrote 0 bytes to client fd %d (client likely closed connection)", client_fd);
+  }
+  if (state == CONN_CGI_FINISHED) {
+    endCgi();
+    return true;
+  }
+  updateCgiPollEvents();
+  return false;
+}
+
+/**
+ * @brief Read more of the request body while the stdin buffer has room,
+ * from the socket or from the spool of a large chunked body
+ */
+void HTTPConnxData::readCgiRequestBody() {
+  if (cgiData.request_left == 0 ||
+      cgiData.buffer.size() >= Constants::cgi_pipe_buffer) {
+    return;
+  }
+  size_t used = cgiData.buffer.size();
+  size_t want = std::min(cgiData.request_left, Constants::BUFFER_SIZE);
+  cgiData.buffer.resize(used + want);
+  ssize_t n = readRequestBody(&cgiData.buffer[used], want, MSG_DONTWAIT);
+  cgiData.buffer.resize(used + (n > 0 ? static_cast<size_t>(n) : 0));
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n <= 0) {
+    debuglog(YELLOW, "Client fd %d gone during the CGI request body",
+             client_fd);
+    closeConnection = true;
     state = CONN_CGI_FINISHED;
-    return false;
+    return;
+  }
+  cgiData.request_left -= static_cast<size_t>(n);
+  debug("Received %ld body bytes for CGI, %zu left", n,
+        cgiData.request_left);
+}
+
+/**
+ * @brief Write buffered body to the child, EOF once all of it is through
+ */
+void HTTPConnxData::writeCgiRequestBody() {
+  if (cgiData.cgi_stdin_fd == -1) {
+    return;
+  }
+  if (!cgiData.buffer.empty()) {
+    ssize_t n = ::write(cgiData.cgi_stdin_fd, cgiData.buffer.data(),
+                        cgiData.buffer.size());
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      // EPIPE: the child exited without reading all of it
+      debuglog(YELLOW, "CGI stdin write failed: %s", strerror(errno));
+      closeConnection = true;
+      cgiData.buffer.clear();
+      cgiData.request_left = 0;
+      closeCgiStdin();
+      return;
+    }
+    cgiData.buffer.erase(0, static_cast<size_t>(n));
+    cgiData.child_timeout = 0;
+    debug("Wrote %ld bytes to CGI stdin", n);
+  }
+  if (cgiData.buffer.empty() && cgiData.request_left == 0) {
+    closeCgiStdin();
+  }
+}
+
+/**
+ * @brief Close our end of the child's stdin, the child sees EOF
+ */
+void HTTPConnxData::closeCgiStdin() {
+  if (cgiData.cgi_stdin_fd == -1) {
+    return;
+  }
+  debuglog(YELLOW, "Closing write end of pipe");
+  SocketUtils::remove_from_poll(cgiData.cgi_stdin_fd);
+  close(cgiData.cgi_stdin_fd);
+  cgiData.cgi_stdin_fd = -1; // Mark as closed
+  if (state == CONN_CGI_INCOMING) {
+    state = CONN_CGI_SENDING;
+  }
+}
+
+/**
+ * @brief Read CGI output while the client buffer has room
+ */
+void HTTPConnxData::readCgiOutput() {
+  if (cgiData.stdout_eof && !cgiData.output_done && cgiData.child_pid == -1) {
+    finishCgiOutput(); // the reaper came through
+    return;
+  }
+  if (cgiData.cgi_stdout_fd == -1 || cgiData.output_done ||
+      cgiData.output.size() >= Constants::cgi_pipe_buffer) {
+    return;
+  }
+  string chunk(Constants::BUFFER_SIZE, '\0');
+  ssize_t n = ::read(cgiData.cgi_stdout_fd, &chunk[0], chunk.size());
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+    perror("Failed to read from CGI stdout");
+    errorStatus = 500;
+    closeConnection = true;
+    state = CONN_CGI_FINISHED;
+    return;
+  }
+  cgiData.child_timeout = 0;
+  if (n == 0) {
+    debug("CGI process finished");
+    SocketUtils::remove_from_poll(cgiData.cgi_stdout_fd);
+    close(cgiData.cgi_stdout_fd);
+    cgiData.cgi_stdout_fd = -1;
+    cgiData.stdout_eof = true;
+    // with a signalfd the exit status follows in a moment, and it decides
+    // whether the body ends cleanly
+    if (cgiData.child_pid == -1 || SocketUtils::childEventFd() == -1) {
+      finishCgiOutput();
+    }
+    return;
+  }
+  debug("Received %ld bytes from CGI stdout", n);
+  CGICache::capture(*this, chunk.data(), static_cast<size_t>(n));
+  appendCgiOutput(chunk.data(), static_cast<size_t>(n));
+}
+
+/**
+ * @brief Send as much of the buffered output as the client takes
+ */
+void HTTPConnxData::writeCgiOutput() {
+  if (cgiData.output.empty() || state == CONN_CGI_FINISHED) {
+    return;
   }
-  debug("Sent %ld bytes to client fd %d", bytes_written, client_fd);  
-  // TODO revisit this logic. without it does not work properly at school?
-  if (static_cast<size_t>(bytes_written) < Constants::BUFFER_SIZE) {
-    debuglog(YELLOW, "Finished sending data chunk to client fd %d", client_fd);
+  ssize_t n = ::send(client_fd, cgiData.output.data(), cgiData.output.size(),
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    }
+    perror("Failed to send data to client");
+    closeConnection = true;
     state = CONN_CGI_FINISHED;
-    return false; // to mean we are done sending
-  }
-  return true; // Indicate send occurred, state remains CONN_CGI_SENDING
-  // TODO: Handle partial writes (bytes_written < bytes_read) if using non-blocking sockets
-  // For now, assume full write or error based on original code structure.
-  // if (static_cast<size_t>(bytes_written) < static_cast<size_t>(bytes_read)) {
-  //     debuglog(YELLOW, "Partial send to client fd %d (%ld / %ld bytes). Needs handling!",
-  //              bytes_written, bytes_read);
-  //     // State remains CONN_CGI_SENDING, but buffer needs adjustment for next POLLOUT
-  //     // This requires more complex buffer management not present in original code.
-  //     // For now, returning true, but this is incomplete for robust partial sends.
-  // }
+    return;
+  }
+  cgiData.output.erase(0, static_cast<size_t>(n));
+  cgiData.output_started = true;
+  cgiData.child_timeout = 0;
+  debug("Sent %ld bytes to client fd %d", n, client_fd);
+}
+
+/**
+ * @brief Ask poll only for what the buffers can take or give right now
+ */
+void HTTPConnxData::updateCgiPollEvents() {
+  short client = 0;
+  bool spooled = data.body_fd != -1;
+  if (!spooled && cgiData.request_left > 0 &&
+      cgiData.buffer.size() < Constants::cgi_pipe_buffer) {
+    client = static_cast<short>(client | POLLIN);
+  }
+  if (!cgiData.output.empty()) {
+    client = static_cast<short>(client | POLLOUT);
+  }
+  SocketUtils::set_poll_events(client_fd, client);
+  if (cgiData.cgi_stdin_fd != -1) {
+    // a spool is always readable, so the pipe is all we wait for
+    bool more = !cgiData.buffer.empty() ||
+                (spooled && cgiData.request_left > 0);
+    SocketUtils::set_poll_events(cgiData.cgi_stdin_fd, more ? POLLOUT : 0);
+  }
+  if (cgiData.cgi_stdout_fd != -1) {
+    bool room = cgiData.output.size() < Constants::cgi_pipe_buffer;
+    SocketUtils::set_poll_events(cgiData.cgi_stdout_fd,
+                                 !cgiData.output_done && room ? POLLIN : 0);
+  }
+}
+
+/**
+ * @brief Tear the CGI down and get the client ready for what comes next
+ *
+ * An error becomes an error page unless part of the response went out
+ * already, then all that is left is to cut the connection.
+ */
+void HTTPConnxData::endCgi() {
+  SocketUtils::set_poll_events(client_fd, POLLIN | POLLOUT);
+  if (errorStatus == 0 && cgiData.output_done) {
+    CGICache::store(*this); // before reset hands it to the waiters
+  }
+  if (errorStatus != 0 && cgiData.output_started) {
+    errorStatus = 0;
+    closeConnection = true;
+  }
+  bool close_client = closeConnection && errorStatus == 0;
+  reset(); // takes the pipes out of poll and stops the child
+  if (errorStatus != 0) {
+    debug("Will send error response %d", errorStatus);
+    Responses::htmlErrorResponse(*this, errorStatus);
+    errorStatus = 0;
+    closeConnection = true;
+  } else if (close_client) {
+    debug("Closing connection %d after CGI", client_fd);
+    SocketUtils::remove_from_poll(client_fd);
+    close(client_fd);
+    client_fd = -1; // Mark as closed
+  } else {
+    debug("CGI finished but kept alive %d", client_fd);
+  }
 }
 
+/**
+ * @brief Queue output read from the CGI for the client
+ *
+ * The head is held back until it is complete, then the body is framed the
+ * way startCgiResponse decided: gzip and chunked, counted against the
+ * script's Content-Length, or chunked as it comes.
+ */
+void HTTPConnxData::appendCgiOutput(const char *data, size_t len) {
+  if (!cgiData.head_done) {
+    bufferCgiHead(data, len);
+  } else if (cgiData.gzip != NULL) {
+    compressCgiBody(data, len);
+  } else if (cgiData.body_left >= 0) {
+    // anything past the announced length would corrupt the next response
+    len = std::min(len, static_cast<size_t>(cgiData.body_left));
+    cgiData.output.append(data, len);
+    cgiData.body_left -= static_cast<long>(len);
+    if (cgiData.body_left == 0) {
+      cgiData.output_done = true;
+    }
+  } else if (len > 0) {
+    cgiData.output += Compression::chunk(string(data, len));
+  }
+}
 
 /**
- * @brief Write data to the child process stdin
+ * @brief Hold CGI output back until its head is complete
  */
-void HTTPConnxData::write_to_child_stdin(int current_fd, int pollfd) {
-  ssize_t bytes_written =
-      ::write(cgiData.cgi_stdin_fd, cgiData.buffer.c_str(),
-              cgiData.buffer.size());
-  debug("Wrote %ld bytes to CGI stdin", bytes_written);
-
-  if (bytes_written < 0) {
-    perror("Failed to write to CGI stdin");
-    debug("Failed to write to CGI stdin");
+void HTTPConnxData::bufferCgiHead(const char *data, size_t len) {
+  cgiData.head.append(data, len);
+
+  size_t crlf = cgiData.head.find("\r\n\r\n");
+  size_t lf = cgiData.head.find("\n\n");
+  size_t head_end = std::min(crlf, lf);
+  if (head_end == string::npos) {
+    if (cgiData.head.size() > Constants::BUFFER_SIZE) {
+      debuglog(RED, "CGI: no end of the header block in %zu bytes",
+               cgiData.head.size());
+      errorStatus = 502;
+      state = CONN_CGI_FINISHED;
+    }
+    return; // wait for the rest of the head
+  }
+  string body = cgiData.head.substr(head_end + (head_end == crlf ? 4 : 2));
+  cgiData.head.erase(head_end);
+  startCgiResponse(body);
+}
+
+/**
+ * @brief Turn the CGI head into our response head and pick the framing
+ *
+ * The script's Content-Length frames the body when it gave one, otherwise
+ * the body goes out chunked, so the connection can stay open either way.
+ * With gzip the body is always chunked and Content-Length only tells when
+ * the script is done.
+ */
+void HTTPConnxData::startCgiResponse(const string &body) {
+  CGI::Head head;
+  bool valid = CGI::parseHead(cgiData.head, head);
+  cgiData.head.clear();
+  cgiData.head_done = true;
+  if (!valid) {
+    debuglog(RED, "CGI: invalid status %d in the header block", head.status);
+    errorStatus = 502;
     state = CONN_CGI_FINISHED;
-    errorStatus = 500;
-  } else if (bytes_written == 0) {
-    // Should not happen with blocking write unless size was 0
-    debuglog(YELLOW, "Wrote 0 bytes to CGI stdin (buffer size: %zu)",
-             cgiData.buffer.size());
-    debuglog(RED, "Wrote 0 bytes to CGI stdin unexpectedly.");
+    return;
+  }
+  data.response_headers += head.headers;
+  if (!head.location.empty()) {
+    data.response_headers += "Location: " + head.location + "\r\n";
+  }
+
+  bool no_body = data.method == "HEAD" || head.status < 200 ||
+                 head.status == 204 || head.status == 304;
+  long length = head.length;
+  if (no_body) {
+    length = std::max(length, 0L);
+  } else if (Compression::wanted(*this, head.type, length)) {
+    cgiData.gzip = Compression::begin(urlMatcherData.gzip.level);
+    if (cgiData.gzip != NULL) {
+      data.response_headers += "Content-Encoding: gzip\r\n";
+      data.response_headers += "Vary: Accept-Encoding\r\n";
+      length = -1;
+    }
+  }
+  cgiData.body_left = head.length;
+
+  string header;
+  Responses::addStandardHeaders(*this, header, head.status, head.type,
+                                length);
+  debuglog(GREEN, "CGI response head:\n%s", header.c_str());
+  // the head goes out together with the first part of the body: separate
+  // small writes stall on Nagle + delayed ACK
+  cgiData.output += header;
+  if (no_body) {
+    cgiData.body_left = 0;
+    cgiData.output_done = true;
+    return;
+  }
+  appendCgiOutput(body.data(), body.size());
+}
+
+/**
+ * @brief Compress CGI body bytes, finishing as soon as the declared
+ * Content-Length is complete instead of waiting for the script to exit
+ */
+void HTTPConnxData::compressCgiBody(const char *data, size_t len) {
+  bool finish = false;
+  if (cgiData.body_left >= 0) {
+    len = std::min(len, static_cast<size_t>(cgiData.body_left));
+    cgiData.body_left -= static_cast<long>(len);
+    finish = cgiData.body_left == 0;
+  }
+  queueCompressedCgiData(data, len, finish);
+  if (finish) {
+    cgiData.output_done = true;
+  }
+}
+
+/**
+ * @brief Compress a piece of CGI body and queue it as a chunk
+ *
+ * @param finish Flush the gzip trailer and queue the last chunk
+ */
+void HTTPConnxData::queueCompressedCgiData(const char *data, size_t len,
+                                           bool finish) {
+  string out;
+  if (!Compression::deflateData(cgiData.gzip, data, len, finish, out)) {
+    Compression::release(cgiData.gzip);
+    closeConnection = true; // the chunked body cannot be completed
+    cgiData.output_done = true;
+    return;
+  }
+  if (!out.empty()) {
+    cgiData.output += Compression::chunk(out);
+  }
+  if (finish) {
+    cgiData.output += "0\r\n\r\n";
+    Compression::release(cgiData.gzip);
+  }
+}
+
+/**
+ * @brief End the body once stdout hit EOF
+ */
+void HTTPConnxData::finishCgiOutput() {
+  int status;
+  if (cgiData.child_pid != -1 &&
+      waitpid(cgiData.child_pid, &status, WNOHANG) == cgiData.child_pid) {
+    cgiExited(status);
+  }
+  if (!cgiData.head_done) {
+    debuglog(RED, "CGI: exited without a complete header block");
+    errorStatus = 502;
     state = CONN_CGI_FINISHED;
-    errorStatus = 500;
-    cgiData.buffer.clear();
-  } else if (bytes_written < cgiData.buffer.size()) {
-    // Partial write: Remove written data and wait for next POLLOUT
-    debug("Partial write: Wrote %ld bytes to CGI stdin (buffer size: %zu)",
-          bytes_written, cgiData.buffer.size());
-    cgiData.buffer.erase(
-        0, static_cast<std::string::size_type>(bytes_written));
-    cgiData.bytes_received += static_cast<size_t>(bytes_written);
-    // stay in the same state, poll will trigger again
-  } else if (bytes_written == cgiData.buffer.size()) {
-    // Full write (bytes_written == cgiData.buffer.size())
-    debugcolor(MAGENTA, "wrote request buffer to CGI: %s",
-               cgiData.buffer.c_str()); // Log data before clearing
-    cgiData.bytes_received += static_cast<size_t>(bytes_written);
-    cgiData.buffer.clear();
-    debug("Full write: Wrote %ld bytes to CGI stdin", bytes_written);
+    return;
   }
-  if (cgiData.bytes_received >= data.content_length) {
-    debug("Full write: Wrote %ld bytes to CGI stdin", bytes_written);
-    // If we have written all data, clear the buffer
-    cgiData.buffer.clear();
-    cgiData.bytes_received = 0;
-    // close the write end of the pipe to signal EOF to the CGI
-    debuglog(YELLOW, "Closing write end of pipe");
-    SocketUtils::remove_from_poll(cgiData.cgi_stdin_fd);
-    close(cgiData.cgi_stdin_fd);
-    cgiData.cgi_stdin_fd = -1; // Mark as closed
-    state = CONN_CGI_SENDING;
+  int exit_status = cgiData.exit_status;
+  bool failed = exit_status != -1 && (WIFSIGNALED(exit_status) ||
+                                      WEXITSTATUS(exit_status) != 0);
+  if (failed && !cgiData.output_started) {
+    // nothing went out yet, the client can still be told
+    debuglog(RED, "CGI: failed before its response was sent, answering 502");
+    Compression::release(cgiData.gzip);
+    errorStatus = 502;
+    state = CONN_CGI_FINISHED;
+    return;
+  }
+  if (failed) {
+    // the body may be cut short, a clean end would hide that
+    debuglog(YELLOW, "CGI: failed after its head, closing the connection");
+    Compression::release(cgiData.gzip);
+    closeConnection = true;
+    cgiData.caching = false;
+  } else if (cgiData.gzip != NULL) {
+    queueCompressedCgiData(NULL, 0, true);
+  } else if (cgiData.body_left > 0) {
+    // shorter than announced, only closing tells the client
+    debuglog(YELLOW, "CGI: body ended %ld bytes short", cgiData.body_left);
+    closeConnection = true;
+    cgiData.caching = false;
+  } else if (cgiData.body_left < 0) {
+    cgiData.output += "0\r\n\r\n";
   }
+  cgiData.output_done = true;
 }
 
 /**
@@ -1118,45 +1842,13 @@ bool HTTPConnxData::getDIRListing(string full_path) {
     debuglog(RED, "Invalid target path: %s", data.target.c_str());
     return false;
   }
-  // Check if directory exists
-  DIR *dir = opendir(full_path.c_str());
-  if (dir == NULL)
-    return false;
-  std::string dirString;
-  // Read directory contents
-  struct dirent *entry;
-  // Ensure target path ends with a slash for proper URL construction
-  std::string target_path = data.target;
-  if (target_path.length() > 1 &&
-      target_path[target_path.length() - 1] != '/') {
-    target_path += '/';
-  }
-  debuglog(YELLOW, "Directory Listing using URL base: %s", target_path.c_str());
-  while ((entry = readdir(dir)) != NULL) {
-    dirString += "<li><a href=\"";
-    dirString += target_path;
-    // Skip adding target path if we're at root and it's already "/"
-    if (target_path != "/" || entry->d_name[0] != '\0') {
-      dirString += entry->d_name;
-    }
-    dirString += "\">";
-    dirString += entry->d_name;
-    dirString += "</a></li>\n";
+  if (Autoindex::serveCached(*this, full_path) ||
+      DiskIO::listDirectory(*this, full_path)) {
+    return true; // Autoindex::respond answers once the worker read it
   }
-  closedir(dir);
-
-  std::string htmlCode;
-  htmlCode = "<html><head><title>Directory Listing</title>";
-  htmlCode += "<link rel=\"stylesheet\" type=\"text/css\" href=\"/css/style.css\">";
-  htmlCode += "</head><body><div style=\"text-align: left;\"><h1 style=\"margin: 0px;\">Index of " + data.target +
-              "</h1><ul>" + dirString + "</ul></div></body></html>";
-
-  debuglog(GREEN, "Directory contents: \n%s", dirString.c_str());
-  urlMatcherData.content_type = Constants::mimeTypes[".html"];
-  state = CONN_SIMPLE_RESPONSE;
-
-  // generate HTTP header and include html payload using the stored content type
-  Responses::createResponse(*this, urlMatcherData.content_type,
-                            htmlCode, 200);
+  std::vector<string> names;
+  if (!DiskIO::readDirectory(full_path, names))
+    return false;
+  Autoindex::respond(*this, names);
   return true;
-}
\ No newline at end of file
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Config.hpp"
+#include "Sha256.hpp"
 #include <cstring>
 #include <iomanip>
 #include <map>
@@ -15,6 +16,10 @@ using std::map;
 using std::string;
 using std::vector;
 
+namespace Compression {
+struct Stream;
+}
+
 /**
  * @brief Connection state enum
  *
@@ -29,9 +34,20 @@ enum ConnectionState {
   CONN_FILE_REQUEST,   // Serving a file
   CONN_SIMPLE_RESPONSE,
   CONN_UPLOAD, 
-  CONN_RECV_CHUNKS // Receiving chunked data
+  CONN_RECV_CHUNKS, // Receiving chunked data
+  CONN_FASTCGI,     // Waiting for a FastCGI app (fastcgi_pass)
+  CONN_CGI_POOL,    // Waiting for a pooled CGI worker (cgi_pool)
+  CONN_CGI_QUEUED,  // Waiting for a free max_concurrent slot
+  CONN_CGI_CACHE_WAIT, // Waiting for another request's run of the script
+  CONN_HANDLER,       // A blocking handler plugin runs on a worker thread
+  CONN_DISK_IO        // A directory scan or unlink runs on a DiskIO thread
 };
 
+/**
+ * @brief Inclusive [first, last] byte range of a file
+ */
+typedef std::pair<off_t, off_t> ByteRange;
+
 /**
  * @brief Tracks the state of the header parsing
  */
@@ -68,15 +84,25 @@ struct HTTPConnxData {
     vector<char> buffer;
     bool chunked;
     string chunkedBody;
+    // chunked bodies are decoded as they arrive (decodeChunks): the
+    // decoded part sits right after the headers, the raw rest behind it
+    size_t chunk_pos;  // first raw byte in request, 0 before decoding
+    size_t chunk_left; // data bytes left in the current chunk
+    bool chunk_crlf;   // the CRLF closing a chunk's data comes next
+    size_t body_size;  // decoded so far
+    int body_fd;       // body spooled to a temp file (BodySpool), or -1
     
     bool multipart;
     string boundary;
     size_t headers_end;
+    bool expect_continue; // Expect: 100-continue from an HTTP/1.1 client
+    bool continue_sent;
     
     // Response data
     int response_status;
     string response;
     string response_headers;
+    const string *prebuilt_response; // shared blob, sent from bytes_sent
     size_t bytes_sent;
     bool sending_response;
     bool response_sent;
@@ -99,8 +125,11 @@ struct HTTPConnxData {
         : method(""), target(""), version(""), host(""), port(4244),
           request(""), content_length(0), headers(), cookies(),
           headers_received(false), chunked(false), chunkedBody(""),
-          multipart(false), boundary(""), headers_end(0), response_status(200),
-          response_headers(""), bytes_sent(0),
+          chunk_pos(0), chunk_left(0), chunk_crlf(false), body_size(0),
+          body_fd(-1),
+          multipart(false), boundary(""), headers_end(0),
+          expect_continue(false), continue_sent(false), response_status(200),
+          response_headers(""), prebuilt_response(NULL), bytes_sent(0),
           sending_response(false), response_sent(false),
           parse_status(HEADERS_PARSE_INCOMPLETE), session_id(""),
           has_session(false), // for session management
@@ -117,16 +146,35 @@ struct HTTPConnxData {
     string full_path;     // Full path to the requested resource
     string path_for_stat; // Path adjusted for stat() calls
     string content_type;  // Content type (MIME type) for the response
+    string content_encoding; // "gzip" or "br" when a sidecar is served
     long file_size; // not size_t because of stat() return type
     bool autoindex;
+    bool gzip_static;
+    GzipSettings gzip; // on-the-fly compression of generated bodies
+    string fastcgi_pass; // socket of the location's FastCGI app
+    string upload_dir;   // where multipart file parts are stored
+    string handler;      // plugin of the location's handler directive
+    string location;     // prefix of the location block that matched
+    unsigned long handler_job; // worker pool job in CONN_HANDLER, 0 if none
+    unsigned long disk_job;    // DiskIO job in flight, 0 if none
+    bool resumable;        // an append to a Resumable upload session
+    size_t upload_offset;  // where its body starts in the file
+    size_t upload_length;  // the session's total length
     bool return_directive; // Flag for return directive
+    bool cgi;              // the cgi_path_alias matched and the script may run
     bool file_upload;
+    bool upload_dedup; // uploads go through UploadStore
     bool cookie; // Flag for file upload
 
     std::vector<std::string> acceptedMethods;
     URLMatcherData()
-        : full_path(""), path_for_stat(""), content_type(""), file_size(0),
-          autoindex(false), return_directive(false), file_upload(false),
+        : full_path(""), path_for_stat(""), content_type(""),
+          content_encoding(""), file_size(0), autoindex(false),
+          gzip_static(false), gzip(), fastcgi_pass(""),
+          upload_dir(""), handler(""), location(""), handler_job(0),
+          disk_job(0), resumable(false), upload_offset(0), upload_length(0),
+          return_directive(false), cgi(false),
+          file_upload(false), upload_dedup(false),
           cookie(false), acceptedMethods() {}
   };
 
@@ -136,6 +184,16 @@ struct HTTPConnxData {
     string path_info;
     string query_string;
     pid_t child_pid;
+    int exit_status; // waitpid() status once reaped, -1 until then
+    const ::CGIData *slot;    // cgi block whose max_concurrent we count in
+    std::time_t queued_since; // waiting for a slot since, 0 if not queued
+
+    // cgi_cache: the key this request runs or waits for, and the raw
+    // output kept while caching is still possible
+    string cache_key;
+    std::time_t cache_wait_since; // 0 unless in CONN_CGI_CACHE_WAIT
+    bool caching;
+    string capture;
     std::map<std::string, std::string> env;
 
     // CGI processing
@@ -143,13 +201,31 @@ struct HTTPConnxData {
     int child_stdout_pipe[2];
     int cgi_stdin_fd;
     int cgi_stdout_fd;
-    size_t bytes_received;
     std::time_t child_timeout;
 
+    // the pump: buffer holds request body on its way to stdin, output holds
+    // CGI output on its way to the client, both capped at cgi_pipe_buffer
+    size_t request_left; // request body still on the client socket
+    string output;
+    bool output_done;     // stdout hit EOF or the declared length is complete
+    bool stdout_eof;      // EOF seen, the body ends once the child is reaped
+    bool output_started;  // something went out, too late for an error page
+
+    // the CGI head is held back until it is complete, then it becomes our
+    // head and the body is framed by its Content-Length, chunked or gzip
+    string head;
+    bool head_done;
+    Compression::Stream *gzip;
+    long body_left; // declared Content-Length not sent yet, -1 unknown
+
     CGIData()
         : buffer(""), script_name(""), path_info(""), query_string(),
-          child_pid(-1), env(), cgi_stdin_fd(-1), cgi_stdout_fd(-1), 
-          bytes_received(0), child_timeout(0) {
+          child_pid(-1), exit_status(-1), slot(NULL), queued_since(0),
+          cache_key(""), cache_wait_since(0), caching(false), capture(""),
+          env(), cgi_stdin_fd(-1), cgi_stdout_fd(-1), child_timeout(0),
+          request_left(0), output(""),
+          output_done(false), stdout_eof(false), output_started(false),
+          head(""), head_done(false), gzip(NULL), body_left(-1) {
 
       child_stdin_pipe[0] = -1;
       child_stdin_pipe[1] = -1;
@@ -158,10 +234,128 @@ struct HTTPConnxData {
     }
   };
 
+  /**
+   * @brief What is left to send of the file in CONN_FILE_REQUEST
+   *
+   * A plain 200 is a single span over the whole file. For a 206 with
+   * multipart/byteranges every range has its part header queued before it
+   * and the closing boundary goes out after the last one. Reads are offset
+   * based so bytes outside the ranges are never touched.
+   */
+  struct FileTransferData {
+    off_t offset;    // next file offset to send
+    off_t remaining; // bytes left in the current span
+    vector<ByteRange> ranges;
+    vector<string> part_headers;
+    size_t next_range;
+    string closing; // final boundary, empty unless multipart
+    int cache_class; // see PageCache, -1 without file_cache_hints
+    off_t advised;   // readahead asked for up to here
+    off_t dropped;   // pages below here dropped from the page cache
+    char *map;       // the whole file with file_cache_hints mmap
+    size_t map_len;
+    off_t probe_offset; // last PageCache probe, -1 if none
+    size_t probe_count, probe_pages, probe_missing;
+
+    FileTransferData()
+        : offset(0), remaining(0), ranges(), part_headers(), next_range(0),
+          closing(""), cache_class(-1), advised(0), dropped(0), map(NULL),
+          map_len(0), probe_offset(-1), probe_count(0), probe_pages(0),
+          probe_missing(0) {}
+  };
+
+  /**
+   * @brief An autoindex listing on its way, see Autoindex
+   *
+   * The directory's stamp is taken before it is read, so a listing is
+   * never cached under a newer mtime than it shows. A streamed listing
+   * keeps its names here and goes out in CONN_FILE_REQUEST without a file.
+   */
+  struct ListingData {
+    bool json;
+    string key; // in the listing cache, empty if it is not to be cached
+    ino_t ino;
+    time_t mtime;
+    long mtime_nsec;
+    vector<string> names; // sorted, directories end in '/'
+    size_t next;          // first name not streamed yet
+    bool streaming;
+
+    ListingData()
+        : json(false), key(""), ino(0), mtime(0), mtime_nsec(0),
+          names(), next(0), streaming(false) {}
+  };
+
+  /**
+   * @brief A request handed to a FastCGI app in CONN_FASTCGI
+   *
+   * The upstream socket is shared with other requests (see FastCGI), this
+   * only remembers which one we went out on and under which request id.
+   */
+  struct FastCGIData {
+    int upstream_fd;      // -1 when no request is in flight
+    uint16_t request_id;
+    size_t body_left;     // request body not yet read from the client
+    std::time_t started;
+
+    FastCGIData()
+        : upstream_fd(-1), request_id(0), body_left(0), started(0) {}
+  };
+
+  /**
+   * @brief A request given to (or queued for) a pooled CGI worker in
+   * CONN_CGI_POOL, see CGIPool
+   */
+  struct CGIPoolData {
+    int worker_fd;        // -1 while queued or when nothing is in flight
+    size_t body_left;     // request body not yet read from the client
+    bool queued;
+    std::time_t started;  // when it was dispatched or queued
+
+    CGIPoolData() : worker_fd(-1), body_left(0), queued(false), started(0) {}
+  };
+
+  /**
+   * @brief A multipart/form-data upload being parsed in CONN_UPLOAD, see
+   * Multipart
+   */
+  struct MultipartData {
+    enum Stage { PREAMBLE, AFTER_DELIMITER, PART_HEADERS, PART_BODY, DONE };
+
+    bool active;
+    Stage stage;
+    string delimiter;   // CRLF "--" boundary
+    size_t skip[256];   // Horspool shift per byte for delimiter
+    string carry;       // unparsed tail of the last read
+    string dir;         // upload_dir the file parts go to
+    string name;        // form field of the current part
+    string filename;    // sanitized file name, "" for a field
+    bool field;         // no filename: kept in value, not stored
+    string path;        // file of the current part, "" if not a file
+    string temp;        // its named temp file, "" if nameless, see BodySpool
+    int fd;
+    size_t size;        // bytes of the current part so far
+    string value;       // the current field's value
+    vector<std::pair<string, string> > fields;
+    string files;       // JSON objects of the stored files, comma separated
+    bool dedup;         // file parts go through UploadStore
+    Sha256 digest;      // of the current file part, with dedup
+
+    MultipartData()
+        : active(false), stage(PREAMBLE), delimiter(""), carry(""),
+          dir(""), name(""), filename(""), field(false), path(""), temp(""), fd(-1), size(0),
+          value(""), fields(), files(""), dedup(false), digest() {}
+  };
+
   ConnectionState state;
   ConnectionData data;
   URLMatcherData urlMatcherData;
   CGIData cgiData;
+  FileTransferData fileData;
+  ListingData listing;
+  FastCGIData fcgiData;
+  CGIPoolData poolData;
+  MultipartData formData;
   const ServerData *config;
 
   int client_fd;
@@ -173,9 +367,13 @@ struct HTTPConnxData {
 
   // Upload handling
   int writeto_fd;
-  char filename[256];
+  string upload_temp; // named temp file of the upload in file_fd, see BodySpool
+  Sha256 upload_digest; // of the body so far with upload_dedup
   bool upload_completed;
   size_t bytes_received;
+  vector<unsigned long> flush_jobs; // BodySpool flushes the response waits
+                                    // for, reset() keeps them
+  bool flush_failed;                // one of them could not publish
 
   int errorStatus;
   bool closeConnection;
@@ -183,8 +381,7 @@ struct HTTPConnxData {
   HTTPConnxData()
       : state(CONN_INCOMING), data(), client_fd(-1), headers_set(false),
         file_fd(-1), writeto_fd(-1), upload_completed(false), bytes_received(0), 
-        config(NULL), errorStatus(0), closeConnection(false) {
-    filename[0] = '\0';
+        flush_jobs(), flush_failed(false), config(NULL), errorStatus(0), closeConnection(false) {
     memset(client_ip, 0, sizeof(client_ip));
     config = NULL;  
   }
@@ -197,22 +394,38 @@ struct HTTPConnxData {
   string generateSessionId();
   void createSession();
   bool retrieveSession();
-  string dechunkData(string chunked_string);
+  ParseStatus decodeChunks();
+  bool keepDecodedBody(size_t &out, size_t pos, size_t len);
+  ssize_t readRequestBody(char *buffer, size_t len, int flags);
   bool uploadComplete(); 
   bool writingFirstPayloadCompletesUpload();
-  bool readFromClientForUpload();
-  bool writeUploadToFile();
+  bool receiveUpload();
   bool finishedSendingSimpleResponse();
-  void write_to_child_stdin(int current_fd, int pollfd);
+  bool finishedSendingPrebuiltResponse();
   bool settingHeadersIfNeeded(); 
   bool readNewDataFromFile();
+  bool startNextFileRange();
   bool sendNewDataFromFileToClient();
+  bool sendFileZeroCopy();
+  bool sendFileMapped();
   void checkCompletionConditions();
-  void read_from_client_into_buffer(); 
-  void write_to_client_from_cgi();
   void check_for_client_timeout();
   bool check_for_child_timeout();
-  bool sendCgiDataToClient(ssize_t bytes_read);
+  void cgiExited(int status);
+  bool pumpCgi(int fd, short revents);
+  void readCgiRequestBody();
+  void writeCgiRequestBody();
+  void closeCgiStdin();
+  void readCgiOutput();
+  void writeCgiOutput();
+  void updateCgiPollEvents();
+  void endCgi();
+  void appendCgiOutput(const char *data, size_t len);
+  void bufferCgiHead(const char *data, size_t len);
+  void startCgiResponse(const string &body);
+  void compressCgiBody(const char *data, size_t len);
+  void queueCompressedCgiData(const char *data, size_t len, bool finish);
+  void finishCgiOutput();
   void close_conn_after_error();
   bool getDIRListing(string full_path);
   ParseStatus parseRequestLine(const string &line);
@@ -1,6 +1,15 @@
 
 #include "HTTPServer.hpp"
+#include "BodySpool.hpp"
 #include "Constants.hpp"
+#include "CGI.hpp"
+#include "CGICache.hpp"
+#include "CGIPool.hpp"
+#include "FastCGI.hpp"
+#include "DiskIO.hpp"
+#include "Handlers.hpp"
+#include "Manifest.hpp"
+#include "Multipart.hpp"
 #include "Parser.hpp"
 #include "Responses.hpp"
 #include "SocketUtils.hpp"
@@ -11,6 +20,7 @@
 #include <ctime>
 #include <poll.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 using std::map;
@@ -48,7 +58,6 @@ PollfdsVector pollfds;
 vector<int> serverSockets;
 map<int, HTTPConnxData> connections;
 vector<ServerData> configs_;
-std::set<pid_t> terminatedPids;
 
 // I will keep them into a map because they are being stored only at the
 // beginning of a connection static map<int, string> remoteAddresses;
@@ -73,6 +82,14 @@ int run(std::string configFile) {
   }
 
   createServerSockets(configs_, serverSockets);
+  if (SocketUtils::childEventFd() != -1) {
+    SocketUtils::add_to_poll(SocketUtils::childEventFd(), POLLIN);
+  }
+  CGIPool::startAll(configs_);
+  Handlers::loadAll(configs_);
+  DiskIO::startAll(configs_);
+  BodySpool::startAll(configs_);
+  Manifest::build(configs_);
 
   while (true) {
 
@@ -84,8 +101,17 @@ int run(std::string configFile) {
     //   }
     // }
 
+    // CGI pipes only wake us when there is data to move, so while children
+    // run poll comes back often enough to catch cgi_child_timeout
+    int timeout = checkCgiTimeouts() ? 100 : 10000;
+    // uploads published with upload_fsync batched wait for the next syncfs
+    BodySpool::syncBatch(std::time(NULL));
+    if (BodySpool::syncPending()) {
+      timeout = std::min(
+          timeout, static_cast<int>(Constants::upload_fsync_interval) * 1000);
+    }
     int poll_result =
-        poll(&pollfds[0], static_cast<nfds_t>(pollfds.size()), 10000);
+        poll(&pollfds[0], static_cast<nfds_t>(pollfds.size()), timeout);
 
     if (poll_result < 0) {
       if (errno != EINTR) {
@@ -102,10 +128,38 @@ int run(std::string configFile) {
     }
 
     SocketUtils::checkForIdleConnections();
+    Manifest::sync();
 
     // Process events on file descriptors
     for (size_t i = 0; i < pollfds.size(); i++) {
 
+      // child exits, the CGI they belong to may be torn down
+      if (pollfds[i].revents && reapChildren(pollfds[i])) {
+        break;
+      }
+
+      // pooled FastCGI and CGI worker sockets and the handler and disk I/O
+      // pools' eventfds and the manifest's inotify fd do not belong to a
+      // client
+      if (pollfds[i].revents && (FastCGI::handlePollEvent(pollfds[i]) ||
+                                 CGIPool::handlePollEvent(pollfds[i]) ||
+                                 Handlers::handlePollEvent(pollfds[i]) ||
+                                 DiskIO::handlePollEvent(pollfds[i]) ||
+                                 BodySpool::handlePollEvent(pollfds[i]) ||
+                                 Manifest::handlePollEvent(pollfds[i]))) {
+        continue;
+      }
+
+      // CGI pipes, also for the bare POLLHUP of a child that is gone
+      HTTPConnxData *cgi_conn = NULL;
+      if (pollfds[i].revents &&
+          getConnectionByCgiPipe(pollfds[i].fd, cgi_conn)) {
+        if (cgi_conn->pumpCgi(pollfds[i].fd, pollfds[i].revents)) {
+          break; // the pipes left pollfds
+        }
+        continue;
+      }
+
       if (checkPollErrors(pollfds[i])) {
         continue; // Skip to next iteration if no poll or minor errors
       }
@@ -178,7 +232,9 @@ int run(std::string configFile) {
         debug("CONN_SIMPLE_RESPONSE fd %d", conn.client_fd);
         debuglog(YELLOW, "Connection fd %d in state SIMPLE_RESPONSE",
                  conn.client_fd);
-        if (!conn.finishedSendingSimpleResponse()) {
+        // an upload's 201 goes out once its flush is done
+        if (BodySpool::holdsResponse(conn) ||
+            !conn.finishedSendingSimpleResponse()) {
           continue;
         }
         if (conn.closeConnection) {
@@ -229,149 +285,43 @@ int run(std::string configFile) {
         uploadLoop(conn, pollfds[i]);
       }
 
-      /*    -------- CGI FINISHED -----------      */
-      if (conn.state == CONN_CGI_FINISHED) {
-        conn.cgiData.buffer.clear();
-        conn.cgiData.buffer.resize(0);
-        if (conn.cgiData.cgi_stdin_fd != -1) {
-          SocketUtils::remove_from_poll(conn.cgiData.cgi_stdin_fd);
-        }
-        if (conn.cgiData.cgi_stdout_fd != -1) {
-          SocketUtils::remove_from_poll(conn.cgiData.cgi_stdout_fd);
-        }
-        conn.reset(); // todo check if pid not reset
-        // SocketUtils::remove_from_poll(conn.client_fd);
-        if (conn.errorStatus != 0) {
-          debug("Will send error response %d", conn.errorStatus);
-          Responses::htmlErrorResponse(conn, conn.errorStatus);
-          conn.errorStatus = 0;
-          conn.closeConnection = true;
+      /*    -------- FASTCGI -----------      */
+      if (conn.state == CONN_FASTCGI) {
+        bool body = pollfds[i].revents & POLLIN || conn.data.body_fd != -1;
+        if (body && conn.fcgiData.body_left > 0) {
+          FastCGI::readRequestBody(conn);
         } else {
-          debug("CGI finished but kept alive %d", conn.client_fd);
+          FastCGI::checkTimeout(conn);
         }
-        break;
+        continue;
       }
 
-      /*    -------- CONN_CGI_INCOMING -----------      */
-      if (conn.state == CONN_CGI_INCOMING) {
-        debuglog(YELLOW, "Connection fd %d in state CGI", conn.client_fd);
-        debug("CONN_CGI_INCOMING; - current fd %d and is %s", current_fd,
-              (pollfds[i].revents & POLLOUT) ? "POLLOUT" : "POLLIN");
-        debug("poll_result %d", poll_result);
-        debug("CONN_CGI_INCOMING; fd %d", conn.client_fd);
-        debug("CGI fd in %d", conn.cgiData.cgi_stdin_fd);
-        debug("CGI fd out %d", conn.cgiData.cgi_stdout_fd);
-
-        if (current_fd == conn.client_fd && (pollfds[i].revents & POLLIN) &&
-            conn.cgiData.buffer.empty()) {
-          // first read from the client
-          debug("POLLIN event on client fd %d", conn.client_fd);
-          for (size_t j = 0; j < pollfds.size(); j++) {
-            if (pollfds[j].fd == conn.cgiData.cgi_stdin_fd &&
-                (pollfds[j].revents & POLLOUT)) {
-              debug("POLLOUT event on CGI stdin fd %d",
-                    conn.cgiData.cgi_stdin_fd);
-              // found! reset the timeout
-              conn.cgiData.child_timeout = 0;
-              // read from client
-              conn.read_from_client_into_buffer();
-              break;
-            }
-          }
-          // set the timeout because not found
-          //              conn.cgiData.child_timeout = 0;
-          if (conn.check_for_child_timeout()) {
-            break;
-          }
+      /*    -------- CGI POOL -----------      */
+      if (conn.state == CONN_CGI_POOL) {
+        bool body = pollfds[i].revents & POLLIN || conn.data.body_fd != -1;
+        if (body && !conn.poolData.queued && conn.poolData.body_left > 0) {
+          CGIPool::readRequestBody(conn);
+        } else {
+          CGIPool::checkTimeout(conn);
         }
+        continue;
+      }
 
-        // check if the child process is pollout ready to be written to
-        // and i have data in buffer from the preparecgi function
-        if (!conn.cgiData.buffer.empty()) {
-          debug("cgiData is receiving");
-          for (size_t j = 0; j < pollfds.size(); j++) {
-            if (pollfds[j].fd == conn.cgiData.cgi_stdin_fd &&
-                (pollfds[j].revents & POLLOUT)) {
-              // found! reset the timeout
-              conn.cgiData.child_timeout = 0;
-              debug("POLLOUT event on CGI stdin fd %d",
-                    conn.cgiData.cgi_stdin_fd);
-              conn.cgiData.child_timeout = 0;
-              // write to cgi the buffer if not empty
-              conn.write_to_child_stdin(current_fd, pollfds[j].fd);
-              break; // whatever happens to the state we break the for loop
-                     // because we found the fd we were looking for
-            } // end -> if (pollfds[j].fd == conn.cgiData.cgi_stdin_fd &&
-          } // end for loop
-          if (conn.check_for_child_timeout()) {
-            break;
-          }
-        }
+      /*    -------- CGI FINISHED -----------      */
+      if (conn.state == CONN_CGI_FINISHED) {
+        conn.endCgi();
+        break;
       }
 
-      /*    -------- CGI SENDING -----------      */
-      if (conn.state == CONN_CGI_SENDING) {
-        // Handle data FROM CGI process (ready to write to client from cgi)
-        // my client is ready to be written to
-        if (current_fd == conn.client_fd && (pollfds[i].revents & POLLOUT)) {
-          debuglog(YELLOW, "Connection fd %d in state CGI SENDING",
-                   conn.client_fd);
-          debug("CONN_CGI_SENDING fd %d", conn.client_fd);
-          debug("cgiData is sending  and client fd %d is POLLOUT",
-                conn.client_fd);
-          // before to read from child i check if i have a buffer leftover
-          conn.write_to_client_from_cgi();
-
-          // after writing the excess buffer i need to read from the cgi
-          for (size_t j = 0; j < pollfds.size(); j++) {
-            // and the cgi process is ready to be read from
-            if (pollfds[j].fd == conn.cgiData.cgi_stdout_fd &&
-                (pollfds[j].revents & POLLIN)) {
-              debug("POLLIN event on CGI stdout fd %d",
-                    conn.cgiData.cgi_stdout_fd);
-              // reset timeout
-              conn.cgiData.child_timeout = 0;
-              // read-write to client from cgi
-              conn.cgiData.buffer.resize(Constants::BUFFER_SIZE);
-              ssize_t bytes_read =
-                  ::read(conn.cgiData.cgi_stdout_fd, &conn.cgiData.buffer[0],
-                         conn.cgiData.buffer.size());
-              if (bytes_read < 0) {
-                perror("Failed to read from CGI stdout");
-                conn.state = CONN_CGI_FINISHED;
-                conn.errorStatus = 500;
-                conn.closeConnection = true;
-                break;
-              } else if (bytes_read == 0) {
-                debug("CGI process finished");
-                conn.state = CONN_CGI_FINISHED;
-                break;
-              }
-              debug("Received %ld bytes from CGI stdout", bytes_read);
-              debuglog(MAGENTA, "response from CGI: %s",
-                         conn.cgiData.buffer.c_str());
-              
-              if (conn.sendCgiDataToClient(bytes_read) == false) {
-                debug("Failed/finished to send data to client");
-                conn.state = CONN_CGI_FINISHED;
-              }
-              // if (pollfds[j].fd == conn.cgiData.cgi_stdout_fd &&
-              //   (pollfds[j].revents & POLLHUP)) {
-              //     throw std::runtime_error(
-              //         "POLLHUP event on CGI stdout fd " +
-              //         Utils::to_string(conn.cgiData.cgi_stdout_fd));
-              //   debug("POLLHUP event on CGI stdout fd %d",
-              //         conn.cgiData.cgi_stdout_fd);
-              //     conn.state = CONN_CGI_FINISHED;
-              //   }
-              break;
-            }
-          }
-          if (conn.check_for_child_timeout()) {
-            break;
-          }
+      /*    -------- CGI INCOMING / SENDING -----------      */
+      if (conn.state == CONN_CGI_INCOMING || conn.state == CONN_CGI_SENDING) {
+        debug("CGI pump for client fd %d (%s)", conn.client_fd,
+              (pollfds[i].revents & POLLOUT) ? "POLLOUT" : "POLLIN");
+        if (conn.pumpCgi(current_fd, pollfds[i].revents)) {
+          break; // the pipes left pollfds
         }
-      } // end of the state cgi_sending check
+        continue;
+      }
       conn.check_for_client_timeout();
     } // end of the main for loop in pollfds
     cleanupClosedConnections();
@@ -429,6 +379,14 @@ void reloadConfigFile(std::string configFile, vector<int> &serverSockets,
   }
 
   createServerSockets(configs_, serverSockets);
+  if (SocketUtils::childEventFd() != -1) {
+    SocketUtils::add_to_poll(SocketUtils::childEventFd(), POLLIN);
+  }
+  CGIPool::startAll(configs_);
+  Handlers::loadAll(configs_);
+  DiskIO::startAll(configs_);
+  BodySpool::startAll(configs_);
+  Manifest::build(configs_);
 
   debuglog(GREEN, "Configuration reload complete with %zu servers",
            Config::getServerData().size());
@@ -460,7 +418,8 @@ bool reload(string configFile, long currentTime) {
  * return true will continue to the next iteration of the loop
  */
 bool checkPollErrors(pollfd currentfd) {
-  if (!(currentfd.revents & (POLLIN | POLLOUT))) {
+  // a hangup alone counts too, fds can be parked without poll interest
+  if (!(currentfd.revents & (POLLIN | POLLOUT | POLLHUP | POLLERR))) {
     return true; // No events on this fd
   }
   if (SocketUtils::gotPollhupShouldSkip(currentfd) ||
@@ -508,6 +467,8 @@ void acceptNewClient(int server_fd) {
       }
       break;
     }
+    // spawned CGI scripts and workers must not hold client connections open
+    fcntl(client_fd, F_SETFD, FD_CLOEXEC);
     // max connection check!
     if (!maxConnectionsCheck(client_fd)) {
       debug("Max connections reached, rejecting new connection");
@@ -615,11 +576,19 @@ bool maxConnectionsCheck(int clientfd) {
  * If the upload is complete, it calls the uploadComplete function.
  */
 void uploadLoop(HTTPConnxData &conn, pollfd currentfd) {
-  if (currentfd.revents & POLLIN) {
+  if (conn.urlMatcherData.disk_job != 0) {
+    return; // the last piece is still being written
+  }
+  // a spooled body is read from its file, no need to wait for the client
+  if (currentfd.revents & POLLIN || conn.data.body_fd != -1) {
     debug("POLLIN event on upload connection %d", conn.client_fd);
     debuglog(YELLOW, "Handling upload event for connection %d", conn.client_fd);
 
-    if (!conn.readFromClientForUpload() || !conn.writeUploadToFile()) {
+    if (conn.formData.active) {
+      Multipart::receive(conn);
+      return;
+    }
+    if (!conn.receiveUpload()) {
       return;
     }
     conn.uploadComplete();
@@ -681,6 +650,94 @@ bool getConnectionDataByFD(int fd, HTTPConnxData*& out_conn_ptr) {
   return false;
 }
 
+/**
+ * @brief Find the connection a CGI pipe of a running child belongs to
+ */
+bool getConnectionByCgiPipe(int fd, HTTPConnxData *&out_conn_ptr) {
+  for (std::map<int, HTTPConnxData>::iterator it = connections.begin();
+       it != connections.end(); ++it) {
+    HTTPConnxData &conn = it->second;
+    if ((conn.state == CONN_CGI_INCOMING || conn.state == CONN_CGI_SENDING) &&
+        (conn.cgiData.cgi_stdin_fd == fd || conn.cgiData.cgi_stdout_fd == fd)) {
+      out_conn_ptr = &conn;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Enforce cgi_child_timeout on every running CGI child and
+ * cgi_queue_timeout on requests waiting for one
+ *
+ * @return true while any CGI child is running or waited for
+ */
+bool checkCgiTimeouts() {
+  bool running = false;
+  for (std::map<int, HTTPConnxData>::iterator it = connections.begin();
+       it != connections.end(); ++it) {
+    HTTPConnxData &conn = it->second;
+    if (conn.client_fd != -1 && conn.state == CONN_CGI_QUEUED) {
+      if (!CGI::checkQueueTimeout(conn)) {
+        running = true;
+      }
+      continue;
+    }
+    if (conn.client_fd != -1 && conn.state == CONN_CGI_CACHE_WAIT) {
+      CGICache::checkWaitTimeout(conn);
+      running = true;
+      continue;
+    }
+    if (conn.client_fd == -1 || (conn.state != CONN_CGI_INCOMING &&
+                                 conn.state != CONN_CGI_SENDING)) {
+      continue;
+    }
+    conn.check_for_child_timeout();
+    if (conn.state == CONN_CGI_FINISHED) {
+      conn.endCgi(); // 504
+    } else {
+      running = true;
+    }
+  }
+  return running;
+}
+
+/**
+ * @brief Reap exited children and tell their connections
+ *
+ * A CGI learns its child is gone here rather than from pipe EOF or a
+ * timeout alone; whatever output is still in the pipe is pumped right away.
+ * Pool workers are only collected, CGIPool notices them on their socket.
+ *
+ * @return false if pfd is not the child event fd
+ */
+bool reapChildren(const pollfd &pfd) {
+  if (pfd.fd != SocketUtils::childEventFd()) {
+    return false;
+  }
+  SocketUtils::drainChildEvents();
+  int status;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    std::map<int, HTTPConnxData>::iterator it = connections.begin();
+    for (; it != connections.end(); ++it) {
+      if (it->second.client_fd != -1 && it->second.cgiData.child_pid == pid) {
+        break;
+      }
+    }
+    if (it == connections.end()) {
+      debug("Reaped child %d (status %d)", pid, status);
+      continue;
+    }
+    HTTPConnxData &conn = it->second;
+    conn.cgiExited(status);
+    if (conn.state == CONN_CGI_INCOMING || conn.state == CONN_CGI_SENDING) {
+      conn.pumpCgi(-1, 0);
+    }
+  }
+  return true;
+}
+
 /**
  * @brief Iterates through the connections map and erases entries marked for removal.
  *
@@ -47,7 +47,6 @@ extern PollfdsVector pollfds;
 extern vector<int> serverSockets;
 extern map<int, HTTPConnxData> connections;
 extern vector<ServerData> configs_;
-extern set<pid_t> terminatedPids;
 
 int run(string configFile);
 void createServerSockets(const vector<ServerData> &configs,
@@ -63,6 +62,9 @@ bool maxConnectionsCheck(int clientfd);
 void send_critical_error(int fd, int code); 
 void uploadLoop(HTTPConnxData &conn, pollfd currentfd);
 bool getConnectionDataByFD(int fd, HTTPConnxData*& out_conn_ptr);
+bool getConnectionByCgiPipe(int fd, HTTPConnxData *&out_conn_ptr);
+bool checkCgiTimeouts();
+bool reapChildren(const pollfd &pfd);
 void cleanupClosedConnections();
 
 } // namespace HTTPServer
@@ -0,0 +1,311 @@
+#include "Handlers.hpp"
+#include "Constants.hpp"
+#include "HTTPServer.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "Utils.hpp"
+#include "WorkerPool.hpp"
+#include "debug.h"
+#include "webserv_handler.h"
+#include <algorithm>
+#include <cstring>
+#include <dlfcn.h>
+#include <map>
+#include <string>
+
+using std::map;
+using std::string;
+using std::vector;
+
+/**
+ * @brief What a handler writes through ws_api, applied to the connection
+ * once handle() returned
+ */
+struct ws_response {
+  int status;
+  string content_type;
+  string headers;
+  string body;
+  bool session;
+
+  ws_response()
+      : status(200), content_type("text/plain"), headers(), body(),
+        session(false) {}
+};
+
+namespace Handlers {
+
+/**
+ * @brief Copy of the request that the ws_request points into
+ *
+ * Built in place and never copied, the pointers would go stale.
+ */
+struct View {
+  string method, path, query, location, path_info, remote_addr, body;
+  vector<string> names, values;
+  vector<ws_header> headers;
+  ws_request req;
+
+  View() : req() {}
+};
+
+struct Job : WorkerPool::Job {
+  const ws_handler *handler;
+  View view;
+  ws_response response;
+  int result;
+
+  Job() : handler(NULL), view(), response(), result(0) {}
+  void run();
+};
+
+static map<string, const ws_handler *> plugins; // NULL if it did not load
+
+// only started when some plugin is blocking
+static WorkerPool pool("Handlers");
+
+extern "C" {
+
+static void apiSetStatus(ws_response *res, int status) {
+  if (status >= 100 && status <= 599) {
+    res->status = status;
+  }
+}
+
+static void apiSetContentType(ws_response *res, const char *type) {
+  if (type != NULL && std::strpbrk(type, "\r\n") == NULL) {
+    res->content_type = type;
+  }
+}
+
+static void apiAddHeader(ws_response *res, const char *name,
+                         const char *value) {
+  if (name == NULL || value == NULL || *name == '\0' ||
+      std::strpbrk(name, "\r\n:") != NULL ||
+      std::strpbrk(value, "\r\n") != NULL) {
+    return;
+  }
+  res->headers += string(name) + ": " + value + "\r\n";
+}
+
+static void apiWrite(ws_response *res, const char *data, size_t len) {
+  if (data != NULL) {
+    res->body.append(data, len);
+  }
+}
+
+static void apiStartSession(ws_response *res) { res->session = true; }
+
+} // extern "C"
+
+static const ws_api api = {apiSetStatus, apiSetContentType, apiAddHeader,
+                           apiWrite, apiStartSession};
+
+void Job::run() { result = handler->handle(&view.req, &response, &api); }
+
+
+/**
+ * @brief dlopen a plugin and check its ABI version
+ */
+static const ws_handler *load(const string &path) {
+  void *dl = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (dl == NULL) {
+    debuglog(RED, "Handlers: %s", dlerror());
+    return NULL;
+  }
+  ws_handler_entry entry;
+  void *symbol = dlsym(dl, WS_HANDLER_SYMBOL);
+  // the detour through memcpy keeps -pedantic quiet about casting
+  // between object and function pointers
+  std::memcpy(&entry, &symbol, sizeof(entry));
+  const ws_handler *handler = entry != NULL ? entry() : NULL;
+  if (handler == NULL || handler->handle == NULL ||
+      handler->abi_version != WS_HANDLER_ABI_VERSION) {
+    debuglog(RED, "Handlers: %s is not a handler plugin (abi %d)",
+             path.c_str(), handler != NULL ? handler->abi_version : -1);
+    dlclose(dl);
+    return NULL;
+  }
+  debuglog(GREEN, "Handlers: loaded '%s' from %s%s",
+           handler->name != NULL ? handler->name : "?", path.c_str(),
+           (handler->flags & WS_HANDLER_BLOCKING) ? " (blocking)" : "");
+  return handler;
+}
+
+/**
+ * @brief Load the plugin of every location with a handler directive
+ *
+ * A plugin that fails to load answers its requests with 500.
+ */
+void loadAll(const std::vector<ServerData> &configs) {
+  bool blocking = false;
+  for (size_t i = 0; i < configs.size(); ++i) {
+    const map<string, Location> &locations = configs[i].location_blocks;
+    for (map<string, Location>::const_iterator it = locations.begin();
+         it != locations.end(); ++it) {
+      const string &path = it->second.handler;
+      if (path.empty() || plugins.count(path)) {
+        continue;
+      }
+      plugins[path] = load(path);
+      if (plugins[path] != NULL &&
+          (plugins[path]->flags & WS_HANDLER_BLOCKING)) {
+        blocking = true;
+      }
+    }
+  }
+  if (blocking && !pool.started()) {
+    pool.start(Constants::handler_threads);
+  }
+  pool.startPolling();
+}
+
+/**
+ * @brief The workers may be inside a handler and cannot be stopped, so
+ * they stay; loadAll polls them again after a reload
+ */
+void stopPolling() { pool.stopPolling(); }
+
+static void buildView(const HTTPConnxData &conn, View &view) {
+  const HTTPConnxData::ConnectionData &data = conn.data;
+  view.method = data.method;
+  view.path = conn.urlMatcherData.target;
+  view.query = conn.cgiData.query_string;
+  view.location = conn.urlMatcherData.location;
+  view.path_info = data.target.substr(
+      std::min(view.location.size(), data.target.size()));
+  view.remote_addr = conn.client_ip;
+  view.body = data.request.substr(data.headers_end, data.content_length);
+  for (map<string, string>::const_iterator it = data.headers.begin();
+       it != data.headers.end(); ++it) {
+    view.names.push_back(it->first);
+    view.values.push_back(it->second);
+  }
+  for (size_t i = 0; i < view.names.size(); ++i) {
+    ws_header header = {view.names[i].c_str(), view.values[i].c_str()};
+    view.headers.push_back(header);
+  }
+
+  ws_request &req = view.req;
+  req.method = view.method.c_str();
+  req.path = view.path.c_str();
+  req.query = view.query.c_str();
+  req.location = view.location.c_str();
+  req.path_info = view.path_info.c_str();
+  req.remote_addr = view.remote_addr.c_str();
+  req.headers = view.headers.empty() ? NULL : &view.headers[0];
+  req.header_count = view.headers.size();
+  req.body = view.body.data();
+  req.body_len = view.body.size();
+  req.has_session = data.has_session ? 1 : 0;
+}
+
+/**
+ * @brief Turn what the handler wrote (or the status it failed with) into
+ * the connection's response
+ */
+static void respond(HTTPConnxData &conn, ws_response &res, int result) {
+  if (result != 0) {
+    debuglog(YELLOW, "Handlers: handler answered %d for %s", result,
+             conn.data.target.c_str());
+    Responses::htmlErrorResponse(conn, result >= 400 && result <= 599 ? result
+                                                                      : 500);
+    return;
+  }
+  if (res.session && !conn.data.has_session) {
+    conn.createSession();
+  }
+  conn.data.response_headers += res.headers;
+  Responses::createResponse(conn, res.content_type, res.body, res.status);
+}
+
+/**
+ * @brief Run the location's handler, inline or on the worker pool
+ *
+ * The request body has to be complete first; until then the connection
+ * goes back to CONN_PARSING_HEADER and validateRequest comes by again with
+ * more of it.
+ */
+void startRequest(HTTPConnxData &conn) {
+  const HTTPConnxData::ConnectionData &data = conn.data;
+  if (data.body_fd != -1 || data.content_length > conn.config->maxBodySize ||
+      data.content_length > conn.config->client_body_buffer_size) {
+    if (data.body_fd == -1) {
+      conn.closeConnection = true; // the body is still on the socket
+    }
+    Responses::htmlErrorResponse(conn, 413);
+    return;
+  }
+  if (data.request.size() - data.headers_end < data.content_length) {
+    debuglog(YELLOW, "Handlers: waiting for the rest of the body on fd %d",
+             conn.client_fd);
+    conn.state = CONN_PARSING_HEADER;
+    return;
+  }
+
+  const ws_handler *handler = plugins[conn.urlMatcherData.handler];
+  if (handler == NULL) {
+    Responses::htmlErrorResponse(conn, 500);
+    return;
+  }
+  if (!(handler->flags & WS_HANDLER_BLOCKING)) {
+    View view;
+    buildView(conn, view);
+    ws_response res;
+    int result = handler->handle(&view.req, &res, &api);
+    respond(conn, res, result);
+    return;
+  }
+
+  if (!pool.started()) {
+    Responses::htmlErrorResponse(conn, 500);
+    return;
+  }
+  if (pool.queued() >= Constants::handler_queue_size) {
+    conn.data.response_headers += "Retry-After: " +
+                                  Utils::to_string(Constants::cgi_retry_after) +
+                                  "\r\n";
+    Responses::htmlErrorResponse(conn, 503);
+    return;
+  }
+  Job *job = new Job();
+  job->client_fd = conn.client_fd;
+  job->handler = handler;
+  buildView(conn, job->view);
+  conn.state = CONN_HANDLER;
+  SocketUtils::set_poll_events(conn.client_fd, 0);
+  conn.urlMatcherData.handler_job = pool.submit(job);
+}
+
+/**
+ * @brief Collect finished blocking jobs and answer their connections
+ * @return true if pfd was the completion eventfd
+ */
+bool handlePollEvent(const pollfd &pfd) {
+  if (!pool.owns(pfd)) {
+    return false;
+  }
+  vector<WorkerPool::Job *> finished;
+  pool.collect(finished);
+
+  for (size_t i = 0; i < finished.size(); ++i) {
+    Job *job = static_cast<Job *>(finished[i]);
+    map<int, HTTPConnxData>::iterator it =
+        HTTPServer::connections.find(job->client_fd);
+    if (it != HTTPServer::connections.end() &&
+        it->second.state == CONN_HANDLER &&
+        it->second.urlMatcherData.handler_job == job->id) {
+      HTTPConnxData &conn = it->second;
+      conn.urlMatcherData.handler_job = 0;
+      SocketUtils::set_poll_events(conn.client_fd, POLLIN | POLLOUT);
+      respond(conn, job->response, job->result);
+    } else {
+      debuglog(YELLOW, "Handlers: dropping job %lu, fd %d is gone", job->id,
+               job->client_fd);
+    }
+    delete job;
+  }
+  return true;
+}
+
+} // namespace Handlers
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include "ServerData.hpp"
+#include <poll.h>
+#include <vector>
+
+/**
+ * @brief In-process handler plugins for locations with a handler directive
+ *
+ * The plugins are shared objects implementing the C ABI of
+ * include/webserv_handler.h. They are dlopen()ed once at startup, each path
+ * only once however many locations mount it.
+ *
+ * A plain handler runs right in the poll loop: it sees a read-only view of
+ * the parsed request and its response is built like any generated page
+ * (Content-Length, keep-alive, gzip, session cookie). Handlers flagged
+ * WS_HANDLER_BLOCKING run on Constants::handler_threads worker threads
+ * instead; the connection waits in CONN_HANDLER without poll interest until
+ * a worker signals the eventfd that handlePollEvent reads. A result whose
+ * connection went away meanwhile is dropped.
+ *
+ * The whole body must be in memory: it waits for up to
+ * client_body_buffer_size bytes of it, larger (or spooled) bodies get 413.
+ */
+namespace Handlers {
+
+void loadAll(const std::vector<ServerData> &configs);
+void startRequest(HTTPConnxData &conn);
+bool handlePollEvent(const pollfd &pfd);
+void stopPolling();
+
+} // namespace Handlers
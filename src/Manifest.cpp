@@ -0,0 +1,681 @@
+#include "Manifest.hpp"
+#include "Constants.hpp"
+#include "SocketUtils.hpp"
+#include "WorkerPool.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <map>
+#include <set>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace Manifest {
+
+typedef MetadataCache::Entry Entry;
+
+static map<string, Entry> entries;
+static set<string> listed;       // directories that were read completely
+static set<string> links;        // symlinks in them, left to stat()
+static map<int, string> watches; // inotify watch -> directory
+static vector<string> roots;
+static int inotify_fd = -1;
+
+// the walks run on these, the loop merges what they found
+static WorkerPool pool("Manifest");
+static unsigned long generation = 0; // bumped by reindex(), older walks are
+                                     // dropped
+static size_t walking = 0;    // walks of this generation not merged yet
+static set<string> unsettled; // changed while a walk was out, see settle()
+static std::multiset<string> walked; // roots of the walks that are out
+static long started = 0;      // of the reindex() being walked, 0 for none
+
+/**
+ * @brief An event on a watch a walk added but has not handed over yet
+ */
+struct EarlyEvent {
+  int wd;
+  uint32_t mask;
+  string name;
+};
+
+// kept until the walk is merged and its watches are known, see replay()
+static vector<EarlyEvent> early;
+
+/**
+ * @brief What walking one directory tree found, merged into the index by
+ * the loop
+ */
+struct Walk {
+  string root;
+  int inotify;   // the fd to add the watches to
+  size_t budget; // entries it may add
+  vector<std::pair<string, Entry> > found;
+  vector<std::pair<int, string> > watched;
+  vector<string> complete;
+  vector<string> links;
+
+  Walk()
+      : root(""), inotify(-1), budget(0), found(), watched(), complete(),
+        links() {}
+};
+
+/**
+ * @brief Drop empty and "." components and duplicate slashes
+ * @return false for a path with "..", it is left to stat()
+ */
+static bool normalize(const string &path, string &out) {
+  out = !path.empty() && path[0] == '/' ? "/" : "";
+  size_t i = 0;
+  while (i <= path.size()) {
+    size_t end = path.find('/', i);
+    if (end == string::npos) {
+      end = path.size();
+    }
+    string part = path.substr(i, end - i);
+    i = end + 1;
+    if (part.empty() || part == ".") {
+      continue;
+    }
+    if (part == "..") {
+      return false;
+    }
+    if (!out.empty() && out[out.size() - 1] != '/') {
+      out += '/';
+    }
+    out += part;
+  }
+  if (out.empty()) {
+    out = ".";
+  }
+  return true;
+}
+
+static string join(const string &dir, const string &name) {
+  if (dir == ".") {
+    return name;
+  }
+  return dir[dir.size() - 1] == '/' ? dir + name : dir + "/" + name;
+}
+
+static string parentOf(const string &path) {
+  size_t slash = path.rfind('/');
+  if (slash == string::npos) {
+    return ".";
+  }
+  return slash == 0 ? "/" : path.substr(0, slash);
+}
+
+static bool under(const string &path, const string &dir) {
+  return path == dir || (path.size() > dir.size() &&
+                         path.compare(0, dir.size(), dir) == 0 &&
+                         (path[dir.size()] == '/' || dir == "/"));
+}
+
+static void fill(Entry &entry) {
+  entry.exists = true;
+  entry.checked = std::time(NULL);
+  MetadataCache::buildValidators(entry);
+}
+
+#ifdef __linux__
+static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY |
+                                   IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_DELETE_SELF |
+                                   IN_MOVE_SELF | IN_ONLYDIR;
+
+/**
+ * @brief Watch and read a directory, then its subdirectories
+ *
+ * The watch comes first, so whatever changes while we read shows up as an
+ * event. Entries are lstat()ed: a symlink is only noted, its target can
+ * change without an event for it. Runs on a walk thread, it only touches w.
+ */
+static void walk(Walk &w, const string &dir) {
+  if (w.found.size() >= w.budget) {
+    return;
+  }
+  int wd = inotify_add_watch(w.inotify, dir.c_str(), WATCH_MASK);
+  if (wd < 0) {
+    perror("Manifest: inotify_add_watch");
+    return;
+  }
+  w.watched.push_back(std::make_pair(wd, dir));
+  DIR *handle = opendir(dir.c_str());
+  if (handle == NULL) {
+    return;
+  }
+  vector<string> subdirs;
+  bool complete = true;
+  struct dirent *item;
+  while ((item = readdir(handle)) != NULL) {
+    string name = item->d_name;
+    if (name == "." || name == "..") {
+      continue;
+    }
+    if (w.found.size() >= w.budget) {
+      complete = false;
+      break;
+    }
+    Entry entry;
+    if (fstatat(dirfd(handle), item->d_name, &entry.st,
+                AT_SYMLINK_NOFOLLOW) != 0) {
+      continue; // gone already
+    }
+    string path = join(dir, name);
+    if (S_ISLNK(entry.st.st_mode)) {
+      w.links.push_back(path);
+      continue;
+    }
+    fill(entry);
+    w.found.push_back(std::make_pair(path, entry));
+    if (S_ISDIR(entry.st.st_mode)) {
+      subdirs.push_back(path);
+    }
+  }
+  closedir(handle);
+  if (complete) {
+    w.complete.push_back(dir);
+  }
+  for (size_t i = 0; i < subdirs.size(); ++i) {
+    walk(w, subdirs[i]);
+  }
+}
+
+static void walkRoot(Walk &w) {
+  Entry entry;
+  if (stat(w.root.c_str(), &entry.st) != 0 || !S_ISDIR(entry.st.st_mode)) {
+    return;
+  }
+  fill(entry);
+  w.found.push_back(std::make_pair(w.root, entry));
+  walk(w, w.root);
+}
+
+static void merge(const Walk &w) {
+  for (size_t i = 0; i < w.found.size(); ++i) {
+    entries[w.found[i].first] = w.found[i].second;
+  }
+  for (size_t i = 0; i < w.watched.size(); ++i) {
+    watches[w.watched[i].first] = w.watched[i].second;
+  }
+  listed.insert(w.complete.begin(), w.complete.end());
+  links.insert(w.links.begin(), w.links.end());
+}
+
+/**
+ * @brief Walking a configured root, or a directory that appeared under a
+ * watched one
+ */
+struct WalkJob : WorkerPool::Job {
+  Walk w;
+  unsigned long generation;
+  bool root;
+
+  WalkJob() : w(), generation(0), root(false) {}
+
+  void run() {
+    if (root) {
+      walkRoot(w);
+    } else {
+      walk(w, w.root);
+    }
+  }
+};
+
+static void finishWalk(const WalkJob &job);
+
+/**
+ * @brief Walk dir on a walk thread, lookups under it use stat() until it
+ * is merged
+ */
+static void startWalk(const string &dir, size_t budget, bool root) {
+  WalkJob *job = new WalkJob();
+  job->w.root = dir;
+  job->w.inotify = inotify_fd;
+  job->w.budget = budget;
+  job->generation = generation;
+  job->root = root;
+  ++walking;
+  walked.insert(dir);
+  if (pool.started()) {
+    pool.submit(job);
+    return;
+  }
+  job->run(); // no thread could start
+  finishWalk(*job);
+  delete job;
+}
+
+static long millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/**
+ * @brief Throw the index away and walk all roots again, in parallel
+ *
+ * The loop goes on meanwhile, the roots are answered with stat() until
+ * their walk is merged.
+ * @param forget drop the watches too, for a reload whose roots may differ
+ */
+static void reindex(bool forget) {
+  stopPolling();
+  if (inotify_fd == -1) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+      perror("Manifest: inotify_init1");
+      return;
+    }
+  }
+  if (forget) {
+    for (map<int, string>::iterator it = watches.begin(); it != watches.end();
+         ++it) {
+      inotify_rm_watch(inotify_fd, it->first);
+    }
+    watches.clear();
+  }
+  entries.clear();
+  listed.clear();
+  links.clear();
+  unsettled.clear();
+  walked.clear();
+  early.clear();
+  ++generation;
+  walking = 0;
+  started = millis();
+  if (!pool.started()) {
+    pool.start(Constants::manifest_threads);
+  }
+  for (size_t i = 0; i < roots.size(); ++i) {
+    startWalk(roots[i], Constants::manifest_max_entries / roots.size(), true);
+  }
+  SocketUtils::add_to_poll(inotify_fd, POLLIN);
+  pool.startPolling();
+}
+
+/**
+ * @brief Forget a directory and everything under it
+ */
+static void dropTree(const string &dir) {
+  map<string, Entry>::iterator it = entries.lower_bound(dir);
+  while (it != entries.end() && it->first.compare(0, dir.size(), dir) == 0) {
+    if (under(it->first, dir)) {
+      entries.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  set<string>::iterator dirs = listed.lower_bound(dir);
+  while (dirs != listed.end() && dirs->compare(0, dir.size(), dir) == 0) {
+    if (under(*dirs, dir)) {
+      listed.erase(dirs++);
+    } else {
+      ++dirs;
+    }
+  }
+  set<string>::iterator link = links.lower_bound(dir);
+  while (link != links.end() && link->compare(0, dir.size(), dir) == 0) {
+    if (under(*link, dir)) {
+      links.erase(link++);
+    } else {
+      ++link;
+    }
+  }
+  map<int, string>::iterator watch = watches.begin();
+  while (watch != watches.end()) {
+    if (under(watch->second, dir)) {
+      inotify_rm_watch(inotify_fd, watch->first);
+      watches.erase(watch++);
+    } else {
+      ++watch;
+    }
+  }
+}
+
+/**
+ * @brief Walk a directory that appeared under a watched one
+ */
+static void addTree(const string &dir) {
+  startWalk(dir,
+            entries.size() < Constants::manifest_max_entries
+                ? Constants::manifest_max_entries - entries.size()
+                : 0,
+            false);
+}
+
+/**
+ * @brief Note what one event changed, the entries are stat()ed once the
+ * whole batch is read
+ * @param name the entry in the watched directory, "" for the directory
+ */
+static void handleEvent(int wd, uint32_t mask, const string &name,
+                        set<string> &changed, bool &overflow) {
+  if (mask & IN_Q_OVERFLOW) {
+    overflow = true;
+    return;
+  }
+  map<int, string>::iterator watch = watches.find(wd);
+  if (watch == watches.end()) {
+    if (walking > 0) {
+      EarlyEvent event = {wd, mask, name};
+      early.push_back(event);
+    }
+    return;
+  }
+  string dir = watch->second;
+  if (mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+    dropTree(dir);
+    return;
+  }
+  if (name.empty()) {
+    changed.insert(dir);
+    return;
+  }
+  string path = join(dir, name);
+  if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+    dropTree(path);
+    changed.erase(path);
+    changed.insert(dir);
+    if (walking > 0) {
+      unsettled.insert(path);
+    }
+    return;
+  }
+  if (mask & (IN_CREATE | IN_MOVED_TO)) {
+    changed.insert(dir);
+    if (mask & IN_ISDIR) {
+      addTree(path);
+    }
+  }
+  changed.insert(path);
+}
+
+static void restat(const string &path) {
+  if (!listed.count(parentOf(path)) && !listed.count(path)) {
+    return;
+  }
+  Entry entry;
+  if (lstat(path.c_str(), &entry.st) != 0) {
+    entries.erase(path);
+    links.erase(path);
+    return;
+  }
+  if (S_ISLNK(entry.st.st_mode)) {
+    entries.erase(path);
+    links.insert(path);
+    return;
+  }
+  fill(entry);
+  entries[path] = entry;
+  links.erase(path);
+}
+
+/**
+ * @brief Look again at what changed under dir while it was walked, the
+ * walk may have read it before the change
+ */
+static void settle(const string &dir) {
+  set<string>::iterator it = unsettled.lower_bound(dir);
+  while (it != unsettled.end() && it->compare(0, dir.size(), dir) == 0) {
+    if (!under(*it, dir)) {
+      ++it;
+      continue;
+    }
+    struct stat st;
+    if (lstat(it->c_str(), &st) != 0) {
+      dropTree(*it); // with what the walk found in it
+    } else {
+      restat(*it);
+    }
+    unsettled.erase(it++);
+  }
+}
+
+/**
+ * @brief Apply the early events whose watch is known now; the others wait
+ * for the walks still out
+ */
+static void replay() {
+  vector<EarlyEvent> waiting;
+  waiting.swap(early);
+  set<string> changed;
+  bool overflow = false;
+  for (size_t i = 0; i < waiting.size(); ++i) {
+    handleEvent(waiting[i].wd, waiting[i].mask, waiting[i].name, changed,
+                overflow);
+  }
+  for (set<string>::iterator it = changed.begin(); it != changed.end();
+       ++it) {
+    restat(*it);
+  }
+  if (walking > 0) {
+    unsettled.insert(changed.begin(), changed.end());
+  }
+}
+
+/**
+ * @brief Merge a walk that is done, unless the index was thrown away since
+ */
+static void finishWalk(const WalkJob &job) {
+  if (job.generation != generation) {
+    return;
+  }
+  merge(job.w);
+  walked.erase(walked.find(job.w.root));
+  --walking;
+  replay();
+  settle(job.w.root);
+  if (walking > 0) {
+    return;
+  }
+  early.clear();
+  unsettled.clear();
+  if (started != 0) {
+    debuglog(GREEN,
+             "Manifest: %zu entries in %zu directories under %zu roots, "
+             "indexed in %ld ms on %zu threads",
+             entries.size(), listed.size(), roots.size(), millis() - started,
+             pool.size());
+    started = 0;
+  }
+}
+#endif
+
+/**
+ * @brief Index the roots of the servers with static_manifest on
+ *
+ * Nested roots are covered by the one around them. Called again after a
+ * reload.
+ */
+void build(const std::vector<ServerData> &configs) {
+#ifdef __linux__
+  roots.clear();
+  for (size_t i = 0; i < configs.size(); ++i) {
+    if (!configs[i].static_manifest) {
+      continue;
+    }
+    string root;
+    if (normalize(configs[i].root, root)) {
+      roots.push_back(root);
+    }
+    const map<string, Location> &locations = configs[i].location_blocks;
+    for (map<string, Location>::const_iterator it = locations.begin();
+         it != locations.end(); ++it) {
+      if (!it->second.root.empty() && normalize(it->second.root, root)) {
+        roots.push_back(root);
+      }
+    }
+  }
+  std::sort(roots.begin(), roots.end());
+  vector<string> outer;
+  for (size_t i = 0; i < roots.size(); ++i) {
+    bool covered = !outer.empty() &&
+                   (outer.back() == "." ? roots[i][0] != '/'
+                                        : under(roots[i], outer.back()));
+    if (!covered) {
+      outer.push_back(roots[i]);
+    }
+  }
+  roots.swap(outer);
+  if (roots.empty()) {
+    stopPolling();
+    return;
+  }
+  reindex(true);
+#else
+  (void)configs;
+#endif
+}
+
+/**
+ * @brief Whether path is a symlink, or under a walk that is not merged
+ * yet; those are not cached anywhere
+ */
+static bool unindexed(const string &path) {
+  for (std::multiset<string>::const_iterator it = walked.begin();
+       it != walked.end(); ++it) {
+    if (under(path, *it)) {
+      return true;
+    }
+  }
+  return links.count(path) > 0;
+}
+
+/**
+ * @brief Answer a stat() from the index
+ * @return false if the index does not cover the path, otherwise
+ * out.exists tells whether it is there
+ */
+bool find(const string &path, Entry &out) {
+  string key;
+  if (inotify_fd == -1 || !normalize(path, key)) {
+    return false;
+  }
+  if (unindexed(key)) {
+    out = Entry();
+    out.checked = std::time(NULL);
+    if (stat(path.c_str(), &out.st) == 0) {
+      fill(out);
+    }
+    return true;
+  }
+  if (!listed.count(key) && !listed.count(parentOf(key))) {
+    return false;
+  }
+  map<string, Entry>::const_iterator it = entries.find(key);
+  // "file/" is not there, stat() would say ENOTDIR
+  if (it == entries.end() || (path[path.size() - 1] == '/' &&
+                              !S_ISDIR(it->second.st.st_mode))) {
+    out = Entry();
+    out.checked = std::time(NULL);
+    return true;
+  }
+  out = it->second;
+  return true;
+}
+
+/**
+ * @brief stat() a path we just changed ourselves, so requests in the same
+ * poll round see it before its event is read
+ */
+void refresh(const string &path) {
+#ifdef __linux__
+  string key;
+  if (inotify_fd != -1 && normalize(path, key)) {
+    restat(key);
+  }
+#else
+  (void)path;
+#endif
+}
+
+/**
+ * @brief Apply the pending inotify events, called each time poll returns
+ *
+ * The queue overflowing means events were lost, then everything is
+ * indexed again. What changes while a walk is out is looked at again once
+ * it is merged.
+ */
+void sync() {
+#ifdef __linux__
+  if (inotify_fd == -1) {
+    return;
+  }
+  union {
+    struct inotify_event event; // for the alignment
+    char bytes[65536];
+  } buf;
+  set<string> changed;
+  bool overflow = false;
+  ssize_t n;
+  while ((n = ::read(inotify_fd, buf.bytes, sizeof(buf.bytes))) > 0) {
+    for (ssize_t pos = 0; pos < n;) {
+      const struct inotify_event *event =
+          reinterpret_cast<const struct inotify_event *>(buf.bytes + pos);
+      handleEvent(event->wd, event->mask,
+                  event->len > 0 ? string(event->name) : string(), changed,
+                  overflow);
+      pos += static_cast<ssize_t>(sizeof(struct inotify_event) + event->len);
+    }
+  }
+  if (overflow) {
+    debuglog(YELLOW, "Manifest: inotify queue overflowed, indexing again");
+    reindex(false);
+    return;
+  }
+  for (set<string>::iterator it = changed.begin(); it != changed.end();
+       ++it) {
+    restat(*it);
+  }
+  if (walking > 0) {
+    unsettled.insert(changed.begin(), changed.end());
+  }
+#endif
+}
+
+/**
+ * @brief Merge the walks that are done; the inotify fd only wakes the
+ * loop, sync() already read it
+ * @return true if pfd was the walk threads' eventfd or the inotify fd
+ */
+bool handlePollEvent(const pollfd &pfd) {
+#ifdef __linux__
+  if (pool.owns(pfd)) {
+    vector<WorkerPool::Job *> finished;
+    pool.collect(finished);
+    for (size_t i = 0; i < finished.size(); ++i) {
+      WalkJob *job = static_cast<WalkJob *>(finished[i]);
+      finishWalk(*job);
+      delete job;
+    }
+    return true;
+  }
+#endif
+  return inotify_fd != -1 && pfd.fd == inotify_fd;
+}
+
+/**
+ * @brief Take the inotify fd and the walk threads' eventfd out of poll
+ * before a shutdown or reload
+ */
+void stopPolling() {
+  if (inotify_fd != -1) {
+    SocketUtils::remove_from_poll(inotify_fd);
+  }
+  pool.stopPolling();
+}
+
+} // namespace Manifest
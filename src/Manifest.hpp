@@ -0,0 +1,39 @@
+#pragma once
+
+#include "MetadataCache.hpp"
+#include "ServerData.hpp"
+#include <poll.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Index of the static files under the roots of servers with
+ * static_manifest on
+ *
+ * At startup every server and location root is walked, on up to
+ * Constants::manifest_threads threads, and each file and directory's stat()
+ * result and validators are kept. Every directory gets an inotify watch
+ * before it is read, so a change during the walk is not missed; the events
+ * are read whenever the poll loop wakes up (sync) and the changed entries
+ * are stat()ed again, removed directories dropped. New directories, and
+ * everything after the inotify queue overflowed, are walked on the same
+ * threads while the loop goes on; until a walk is merged the paths under
+ * it fall back to stat().
+ *
+ * MetadataCache::lookup asks here first. A path in a directory that was
+ * walked completely is answered from the index without a system call, a
+ * path that is not in it does not exist; so the target, index file and
+ * gzip_static sidecar lookups of a GET cost nothing. Anything else (outside
+ * the roots, past Constants::manifest_max_entries, a symlink or through
+ * one, or on a system without inotify) falls back to stat().
+ */
+namespace Manifest {
+
+void build(const std::vector<ServerData> &configs);
+bool find(const std::string &path, MetadataCache::Entry &out);
+void refresh(const std::string &path);
+void sync();
+bool handlePollEvent(const pollfd &pfd);
+void stopPolling();
+
+} // namespace Manifest
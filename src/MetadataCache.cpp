@@ -0,0 +1,129 @@
+#include "MetadataCache.hpp"
+#include "Constants.hpp"
+#include "Manifest.hpp"
+#include "debug.h"
+#include <cstring>
+#include <map>
+#include <sstream>
+
+using std::map;
+using std::string;
+
+namespace MetadataCache {
+
+static map<string, Entry> entries;
+
+/**
+ * @brief Build the validators for a freshly stat()ed entry
+ *
+ * The ETag changes whenever the file is replaced (inode), resized or
+ * touched (mtime), which is what the browser needs to know.
+ */
+void buildValidators(Entry &entry) {
+  std::ostringstream oss;
+  oss << "\"" << std::hex << static_cast<unsigned long>(entry.st.st_ino) << "-"
+      << static_cast<unsigned long>(entry.st.st_size) << "-"
+      << static_cast<unsigned long>(entry.st.st_mtime) << "\"";
+  entry.etag = oss.str();
+  entry.last_modified = formatHTTPDate(entry.st.st_mtime);
+}
+
+/**
+ * @brief Drop stale entries, or everything if the cache is still full
+ */
+static void evictIfFull(time_t now) {
+  if (entries.size() < Constants::metadata_cache_max_entries) {
+    return;
+  }
+  map<string, Entry>::iterator it = entries.begin();
+  while (it != entries.end()) {
+    if (now - it->second.checked > Constants::metadata_cache_ttl) {
+      entries.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (entries.size() >= Constants::metadata_cache_max_entries) {
+    debuglog(YELLOW, "Metadata cache full - clearing %zu entries",
+             entries.size());
+    entries.clear();
+  }
+}
+
+/**
+ * @brief Get the metadata for a path, calling stat() only when stale
+ *
+ * @param path The filesystem path
+ * @param out Copy of the cached entry
+ * @return true if the path exists
+ *
+ * The entry is copied out so the caller can keep it while other lookups
+ * evict entries from the map.
+ */
+bool lookup(const string &path, Entry &out) {
+  if (Manifest::find(path, out)) {
+    return out.exists;
+  }
+  time_t now = std::time(NULL);
+  map<string, Entry>::iterator it = entries.find(path);
+  if (it != entries.end() &&
+      now - it->second.checked <= Constants::metadata_cache_ttl) {
+    out = it->second;
+    return out.exists;
+  }
+
+  Entry entry;
+  entry.checked = now;
+  if (::stat(path.c_str(), &entry.st) == 0) {
+    entry.exists = true;
+    buildValidators(entry);
+  }
+  if (it != entries.end()) {
+    it->second = entry;
+  } else {
+    evictIfFull(now);
+    entries[path] = entry;
+  }
+  out = entry;
+  return out.exists;
+}
+
+/**
+ * @brief Forget a path after we changed it ourselves (upload, delete)
+ */
+void invalidate(const string &path) {
+  entries.erase(path);
+  Manifest::refresh(path);
+}
+
+void clear() { entries.clear(); }
+
+/**
+ * @brief Format a time as an HTTP date (IMF-fixdate, always GMT)
+ */
+string formatHTTPDate(time_t t) {
+  char buf[64];
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  strftime(buf, sizeof(buf), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  return buf;
+}
+
+/**
+ * @brief Parse an IMF-fixdate as sent in If-Modified-Since
+ *
+ * Only the format we emit ourselves is accepted, which is what browsers send
+ * back. Anything else makes the condition be ignored.
+ */
+bool parseHTTPDate(const string &value, time_t &out) {
+  struct tm tm;
+  std::memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(value.c_str(), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') {
+    return false;
+  }
+  out = timegm(&tm);
+  return true;
+}
+
+} // namespace MetadataCache
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <ctime>
+#include <string>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+using std::string;
+
+/**
+ * @brief Cache of stat() results and the HTTP validators built from them
+ *
+ * handleGETRequest used to stat() the target and then the index file on every
+ * request. An entry here is trusted for Constants::metadata_cache_ttl seconds
+ * before it is checked again, so a hot file costs one stat() per second at
+ * most. Missing paths are cached too (exists == false), which is how the
+ * gzip_static lookups of absent .gz/.br sidecars stay free.
+ */
+namespace MetadataCache {
+
+struct Entry {
+  bool exists;
+  struct stat st;
+  string etag;          // "inode-size-mtime" in hex, strong validator
+  string last_modified; // IMF-fixdate of st_mtime
+  time_t checked;       // when we last called stat() for this path
+
+  Entry() : exists(false), st(), etag(""), last_modified(""), checked(0) {}
+};
+
+bool lookup(const string &path, Entry &out);
+void buildValidators(Entry &entry);
+void invalidate(const string &path);
+void clear();
+string formatHTTPDate(time_t t);
+bool parseHTTPDate(const string &value, time_t &out);
+
+} // namespace MetadataCache
@@ -0,0 +1,435 @@
+#include "Multipart.hpp"
+#include "BodySpool.hpp"
+#include "Constants.hpp"
+#include "Responses.hpp"
+#include "SocketUtils.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sstream>
+#include <strings.h>
+#include <unistd.h>
+#include <vector>
+
+typedef HTTPConnxData::MultipartData Form;
+
+namespace Multipart {
+
+static std::vector<char> buffer; // carry + one read, shared by all uploads
+
+/**
+ * @brief Only form-data is split up, other multipart bodies are stored as
+ * they are
+ */
+bool handles(const HTTPConnxData &conn) {
+  std::map<string, string>::const_iterator it =
+      conn.data.headers.find("Content-Type");
+  return conn.data.method == "POST" && conn.data.multipart &&
+         it != conn.data.headers.end() &&
+         strncasecmp(it->second.c_str(), "multipart/form-data", 19) == 0;
+}
+
+static string jsonString(const string &s) {
+  string out = "\"";
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(s[i]);
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += static_cast<char>(c);
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out += esc;
+    } else {
+      out += static_cast<char>(c);
+    }
+  }
+  return out + "\"";
+}
+
+/**
+ * @brief Offset of the delimiter in buf, or npos (Horspool)
+ */
+static size_t findDelimiter(const Form &form, const char *buf, size_t len) {
+  const string &d = form.delimiter;
+  size_t m = d.size();
+  for (size_t i = 0; i + m <= len;) {
+    unsigned char last = static_cast<unsigned char>(buf[i + m - 1]);
+    if (last == static_cast<unsigned char>(d[m - 1]) &&
+        std::memcmp(buf + i, d.data(), m - 1) == 0) {
+      return i;
+    }
+    i += form.skip[last];
+  }
+  return string::npos;
+}
+
+/**
+ * @brief The name part of a client's file name, "" if nothing safe is left
+ */
+static string safeFilename(const string &raw) {
+  size_t slash = raw.find_last_of("/\\");
+  string name = slash == string::npos ? raw : raw.substr(slash + 1);
+  if (name == "." || name == "..") {
+    return "";
+  }
+  for (size_t i = 0; i < name.size(); ++i) {
+    if (static_cast<unsigned char>(name[i]) < 0x20 || name[i] == 0x7f) {
+      return "";
+    }
+  }
+  return name;
+}
+
+/**
+ * @brief name="..." and filename="..." of a Content-Disposition value
+ */
+static void dispositionParams(const string &value, std::map<string, string> &params) {
+  size_t i = value.find(';');
+  while (i != string::npos && i < value.size()) {
+    i = value.find_first_not_of("; \t", i);
+    if (i == string::npos) {
+      break;
+    }
+    size_t eq = value.find_first_of("=;", i);
+    if (eq == string::npos || value[eq] == ';') {
+      i = eq;
+      continue;
+    }
+    string key = value.substr(i, eq - i);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    string param;
+    i = eq + 1;
+    if (i < value.size() && value[i] == '"') {
+      for (++i; i < value.size() && value[i] != '"'; ++i) {
+        if (value[i] == '\\' && i + 1 < value.size()) {
+          ++i;
+        }
+        param += value[i];
+      }
+      i = value.find(';', i);
+    } else {
+      size_t end = value.find(';', i);
+      param = value.substr(i, end == string::npos ? string::npos : end - i);
+      i = end;
+    }
+    params[key] = param;
+  }
+}
+
+/**
+ * @brief Set up the part from its headers: open its file or prepare to
+ * collect a field
+ * @return 0 or the status to fail with
+ */
+static int beginPart(Form &form, const string &head) {
+  std::istringstream lines(head);
+  string line;
+  std::map<string, string> params;
+  while (std::getline(lines, line)) {
+    if (!line.empty() && line[line.size() - 1] == '\r') {
+      line.erase(line.size() - 1);
+    }
+    size_t colon = line.find(':');
+    if (colon != string::npos &&
+        strncasecmp(line.c_str(), "Content-Disposition", colon) == 0 &&
+        colon == 19) {
+      dispositionParams(line.substr(colon + 1), params);
+    }
+  }
+  if (params.find("name") == params.end()) {
+    debuglog(RED, "Multipart: part without a name");
+    return 400;
+  }
+  form.name = params["name"];
+  form.size = 0;
+  form.value.clear();
+  form.field = params.find("filename") == params.end();
+  form.filename = form.field ? "" : safeFilename(params["filename"]);
+  if (form.field || form.filename.empty()) {
+    return 0; // an empty file input sends filename="", skip its part
+  }
+  form.path = form.dir + form.filename;
+  form.fd = BodySpool::openFor(form.path, form.temp);
+  form.digest.reset();
+  if (form.fd < 0) {
+    perror("Multipart: open");
+    form.path.clear();
+    return 500;
+  }
+  debuglog(GREEN, "Multipart: field '%s' -> %s", form.name.c_str(),
+           form.path.c_str());
+  return 0;
+}
+
+static int partData(Form &form, const char *data, size_t len) {
+  form.size += len;
+  if (form.fd != -1) {
+    if (form.dedup) {
+      form.digest.update(data, len);
+    }
+    return BodySpool::write(form.fd, data, len) ? 0 : 500;
+  }
+  if (form.field) {
+    if (form.size > Constants::multipart_field_max) {
+      return 413;
+    }
+    form.value.append(data, len);
+  }
+  return 0;
+}
+
+/**
+ * @return 0 or the status to fail with
+ */
+static int endPart(HTTPConnxData &conn) {
+  Form &form = conn.formData;
+  if (form.fd != -1) {
+    BodySpool::Upload upload;
+    upload.fd = form.fd;
+    upload.temp = form.temp;
+    upload.path = form.path;
+    if (form.dedup) {
+      upload.digest = form.digest.hexDigest();
+    }
+    if (!BodySpool::complete(conn, upload)) {
+      return 500; // abort() discards the temp file
+    }
+    close(form.fd);
+    form.fd = -1;
+    form.temp.clear();
+    form.files += string(form.files.empty() ? "" : ",") +
+                  "{\"field\":" + jsonString(form.name) +
+                  ",\"filename\":" + jsonString(form.filename) +
+                  ",\"size\":" + Utils::to_string(form.size) + "}";
+    form.path.clear();
+  } else if (form.field) {
+    form.fields.push_back(std::make_pair(form.name, form.value));
+  }
+  form.value.clear();
+  return 0;
+}
+
+/**
+ * @brief Run the parser over buf, which starts with the carry
+ * @param used set to the bytes consumed, the rest is the new carry
+ * @return 0 or the status to fail with
+ */
+static int parse(HTTPConnxData &conn, const char *buf, size_t len,
+                 size_t &used) {
+  Form &form = conn.formData;
+  size_t pos = 0;
+  size_t keep = form.delimiter.size() - 1;
+  while (pos < len) {
+    const char *at = buf + pos;
+    size_t left = len - pos;
+    if (form.stage == Form::PREAMBLE || form.stage == Form::PART_BODY) {
+      size_t hit = findDelimiter(form, at, left);
+      bool body = form.stage == Form::PART_BODY;
+      if (hit == string::npos) {
+        // the tail could be the start of a delimiter, keep it for later
+        size_t safe = left > keep ? left - keep : 0;
+        int status = body ? partData(form, at, safe) : 0;
+        used = pos + safe;
+        return status;
+      }
+      if (body) {
+        int status = partData(form, at, hit);
+        if (status == 0) {
+          status = endPart(conn);
+        }
+        if (status != 0) {
+          return status;
+        }
+      }
+      pos += hit + form.delimiter.size();
+      form.stage = Form::AFTER_DELIMITER;
+    } else if (form.stage == Form::AFTER_DELIMITER) {
+      if (left < 2) {
+        break;
+      }
+      if (at[0] == '-' && at[1] == '-') {
+        form.stage = Form::DONE;
+      } else if (at[0] == '\r' && at[1] == '\n') {
+        form.stage = Form::PART_HEADERS;
+      } else {
+        return 400;
+      }
+      pos += 2;
+    } else if (form.stage == Form::PART_HEADERS) {
+      const char *end = static_cast<const char *>(memmem(at, left, "\r\n\r\n", 4));
+      if (end == NULL) {
+        if (left > Constants::multipart_header_max) {
+          return 400;
+        }
+        break;
+      }
+      int status = beginPart(form, string(at, end));
+      if (status != 0) {
+        return status;
+      }
+      pos += static_cast<size_t>(end - at) + 4;
+      form.stage = Form::PART_BODY;
+    } else {
+      pos = len; // epilogue
+    }
+  }
+  used = pos;
+  return 0;
+}
+
+/**
+ * @brief Drop the part being written, the file it would replace stays
+ */
+void abort(HTTPConnxData &conn) {
+  Form &form = conn.formData;
+  if (form.fd != -1) {
+    BodySpool::discard(form.fd, form.temp);
+  }
+  form = Form();
+}
+
+static void fail(HTTPConnxData &conn, int status) {
+  debuglog(RED, "Multipart: upload failed with %d", status);
+  if (conn.data.bytes_sent < conn.data.content_length) {
+    conn.closeConnection = true; // the rest of the body is on the socket
+  }
+  abort(conn);
+  Responses::htmlErrorResponse(conn, status);
+}
+
+/**
+ * @brief All of the body is in: 201 with what was stored, or 303 to the
+ * redirect field
+ */
+static void finish(HTTPConnxData &conn) {
+  Form &form = conn.formData;
+  if (form.stage != Form::DONE) {
+    debuglog(RED, "Multipart: body ended before the closing delimiter");
+    fail(conn, 400);
+    return;
+  }
+  string redirect;
+  string fields;
+  for (size_t i = 0; i < form.fields.size(); ++i) {
+    const string &name = form.fields[i].first;
+    const string &value = form.fields[i].second;
+    if (name == "redirect" && value.size() > 1 && value[0] == '/' &&
+        value[1] != '/' && value.find_first_of("\r\n") == string::npos) {
+      redirect = value;
+    }
+    fields += string(fields.empty() ? "" : ",") + jsonString(name) + ":" +
+              jsonString(value);
+  }
+  string body = "{\"files\":[" + form.files + "],\"fields\":{" + fields + "}}";
+  conn.reset();
+  if (!redirect.empty()) {
+    Responses::createResponse(conn, "text/html", redirect, 303);
+  } else {
+    Responses::createResponse(conn, "application/json", body, 201);
+  }
+}
+
+/**
+ * @brief Parse what is in the buffer, keep the carry, finish at the end
+ */
+static void process(HTTPConnxData &conn, size_t len) {
+  Form &form = conn.formData;
+  size_t used = 0;
+  int status = parse(conn, &buffer[0], len, used);
+  if (status != 0) {
+    fail(conn, status);
+    return;
+  }
+  form.carry.assign(&buffer[used], len - used);
+  if (conn.data.bytes_sent >= conn.data.content_length) {
+    finish(conn);
+  }
+}
+
+/**
+ * @brief Start parsing with the part of the body that came with the headers
+ */
+void start(HTTPConnxData &conn) {
+  string boundary = conn.data.boundary.substr(2); // "--" in front
+  if (boundary.empty() || boundary.size() > 70) {
+    conn.closeConnection = true;
+    Responses::htmlErrorResponse(conn, 400);
+    return;
+  }
+  if (conn.urlMatcherData.upload_dir.empty()) {
+    debuglog(RED, "Multipart: no upload_dir for %s", conn.data.target.c_str());
+    conn.closeConnection = true; // the body is still on the socket
+    Responses::htmlErrorResponse(conn, 500);
+    return;
+  }
+  Form &form = conn.formData;
+  form = Form();
+  form.active = true;
+  form.delimiter = "\r\n--" + boundary;
+  size_t m = form.delimiter.size();
+  for (size_t c = 0; c < 256; ++c) {
+    form.skip[c] = m;
+  }
+  for (size_t j = 0; j + 1 < m; ++j) {
+    form.skip[static_cast<unsigned char>(form.delimiter[j])] = m - 1 - j;
+  }
+  form.carry = "\r\n"; // the first delimiter has no line break before it
+  form.dir = Utils::ensureTrailinSlash(conn.urlMatcherData.upload_dir);
+  form.dedup = conn.urlMatcherData.upload_dedup;
+  if (buffer.empty()) {
+    buffer.resize(Constants::upload_chunk_size +
+                  Constants::multipart_header_max);
+  }
+
+  conn.state = CONN_UPLOAD;
+  conn.data.bytes_sent = 0;
+  debuglog(MAGENTA, "Multipart: form upload of %zu bytes into %s",
+           conn.data.content_length, form.dir.c_str());
+
+  // a small chunked body is all here, feed it in buffer sized pieces
+  const char *payload = conn.data.request.data() + conn.data.headers_end;
+  size_t total = std::min(conn.data.request.size() - conn.data.headers_end,
+                          conn.data.content_length);
+  size_t done = 0;
+  while (form.active && done < total) {
+    size_t keep = form.carry.size();
+    size_t piece = std::min(total - done, buffer.size() - keep);
+    std::memcpy(&buffer[0], form.carry.data(), keep);
+    std::memcpy(&buffer[keep], payload + done, piece);
+    done += piece;
+    conn.data.bytes_sent += piece;
+    process(conn, keep + piece);
+  }
+}
+
+/**
+ * @brief Read the next piece of the body into the buffer behind the carry
+ */
+void receive(HTTPConnxData &conn) {
+  Form &form = conn.formData;
+  size_t keep = form.carry.size();
+  std::memcpy(&buffer[0], form.carry.data(), keep);
+  size_t room = std::min(buffer.size() - keep,
+                         conn.data.content_length - conn.data.bytes_sent);
+  ssize_t n = conn.readRequestBody(&buffer[keep], room, 0);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+    return;
+  }
+  if (n <= 0) {
+    perror("Multipart: body read failed");
+    conn.reset();
+    close(conn.client_fd);
+    SocketUtils::remove_from_poll(conn.client_fd);
+    conn.client_fd = -1; // Mark as closed
+    return;
+  }
+  conn.data.bytes_sent += static_cast<size_t>(n);
+  process(conn, keep + static_cast<size_t>(n));
+}
+
+} // namespace Multipart
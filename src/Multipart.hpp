@@ -0,0 +1,27 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+
+/**
+ * @brief Native multipart/form-data uploads for file_upload locations
+ *
+ * The body is parsed as it arrives, in the same CONN_UPLOAD loop as a plain
+ * upload. Each file part streams straight to its own file in the
+ * location's upload_dir (named after its sanitized filename, and only once
+ * the part is complete, see BodySpool::publish); other fields
+ * are small and kept in memory. The delimiter is found with a Horspool
+ * search over one reusable buffer; the few bytes at its end that could be
+ * the start of a delimiter are carried over to the front of the next read,
+ * so a boundary split between two reads is still found.
+ *
+ * The answer is 201 with a JSON summary of the stored files and fields, or
+ * 303 to the form's "redirect" field when that is a local path.
+ */
+namespace Multipart {
+
+bool handles(const HTTPConnxData &conn);
+void start(HTTPConnxData &conn);
+void receive(HTTPConnxData &conn);
+void abort(HTTPConnxData &conn);
+
+} // namespace Multipart
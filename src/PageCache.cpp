@@ -0,0 +1,273 @@
+#include "PageCache.hpp"
+#include "Constants.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cstdio>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+namespace PageCache {
+
+enum RequestClass { CLASS_SMALL, CLASS_SEQUENTIAL, CLASS_DROP_BEHIND, CLASSES };
+
+static const char *class_names[CLASSES] = {"small", "sequential",
+                                           "drop_behind"};
+
+/**
+ * @brief Per request class counters, only touched by the poll loop
+ */
+struct Stats {
+  size_t requests;
+  size_t bytes;  // read or sent
+  size_t pages;  // probed before they were read or sent
+  size_t misses; // of them, not in the page cache
+};
+
+static Stats stats[CLASSES];
+static size_t chunks = 0; // seen by probe(), for the sampling
+
+static off_t pageSize() {
+  static off_t page = static_cast<off_t>(sysconf(_SC_PAGESIZE));
+  return page;
+}
+
+static bool hinted(const HTTPConnxData &conn) {
+  return conn.fileData.cache_class > CLASS_SMALL &&
+         conn.config->file_cache_hints >= FILE_HINTS_FADVISE;
+}
+
+/**
+ * @brief Pass advice on [from, to) of the file, to the mapping too if
+ * there is one
+ */
+static void advise(HTTPConnxData &conn, off_t from, off_t to, int advice,
+                   int madvice) {
+  from -= from % pageSize();
+  if (to <= from) {
+    return;
+  }
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  if (file.map != NULL) {
+    size_t end = std::min(static_cast<size_t>(to), file.map_len);
+    if (static_cast<size_t>(from) < end) {
+      madvise(file.map + from, end - static_cast<size_t>(from), madvice);
+    }
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(conn.file_fd, from, to - from, advice);
+#else
+  (void)advice;
+#endif
+}
+
+/**
+ * @brief Ask for the window after the cursor, as far as it was not asked
+ * for yet
+ */
+static void readAhead(HTTPConnxData &conn, off_t cursor) {
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  off_t end = std::min(cursor + Constants::readahead_window,
+                       static_cast<off_t>(conn.urlMatcherData.file_size));
+  off_t from = std::max(cursor, file.advised);
+  if (from < end) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    advise(conn, from, end, POSIX_FADV_WILLNEED, MADV_WILLNEED);
+#else
+    advise(conn, from, end, 0, MADV_WILLNEED);
+#endif
+    file.advised = end;
+  }
+}
+
+/**
+ * @brief Let go of the pages more than a window behind the cursor
+ */
+static void dropBehind(HTTPConnxData &conn, off_t cursor) {
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  if (cursor < file.dropped) {
+    file.dropped = cursor - cursor % pageSize(); // the next range is earlier
+    return;
+  }
+  off_t end = cursor - Constants::readahead_window;
+  end -= end % pageSize();
+  if (end - file.dropped < Constants::readahead_window) {
+    return;
+  }
+#ifdef POSIX_FADV_SEQUENTIAL
+  advise(conn, file.dropped, end, POSIX_FADV_DONTNEED, MADV_DONTNEED);
+#else
+  advise(conn, file.dropped, end, 0, MADV_DONTNEED);
+#endif
+  file.dropped = end;
+}
+
+static bool mapFile(HTTPConnxData &conn) {
+  size_t len = static_cast<size_t>(conn.urlMatcherData.file_size);
+  void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, conn.file_fd, 0);
+  if (map == MAP_FAILED) {
+    perror("PageCache: mmap failed, using sendfile");
+    return false;
+  }
+  conn.fileData.map = static_cast<char *>(map);
+  conn.fileData.map_len = len;
+  madvise(map, len, MADV_SEQUENTIAL);
+  return true;
+}
+
+/**
+ * @brief Classify a file that was just opened for sending and give the
+ * first hints
+ */
+void opened(HTTPConnxData &conn) {
+  if (conn.config->file_cache_hints == FILE_HINTS_OFF) {
+    return;
+  }
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  off_t size = static_cast<off_t>(conn.urlMatcherData.file_size);
+  size_t drop_behind = conn.config->file_drop_behind;
+  file.cache_class =
+      size < Constants::readahead_min_size ? CLASS_SMALL
+      : drop_behind > 0 && size >= static_cast<off_t>(drop_behind)
+          ? CLASS_DROP_BEHIND
+          : CLASS_SEQUENTIAL;
+  ++stats[file.cache_class].requests;
+  if (!hinted(conn)) {
+    return;
+  }
+  if (conn.config->file_cache_hints != FILE_HINTS_MMAP || !mapFile(conn)) {
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(conn.file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  }
+  off_t start = file.ranges.empty() ? 0 : file.ranges[0].first;
+  file.dropped = start - start % pageSize();
+  file.advised = start;
+  readAhead(conn, start);
+  debuglog(YELLOW, "PageCache: %s file of %ld bytes, %s",
+           class_names[file.cache_class], static_cast<long>(size),
+           file.map != NULL ? "mapped" : "fadvised");
+}
+
+/**
+ * @brief Count the pages of the next count bytes at the cursor that are
+ * not in the page cache, for a sampled chunk or when needed
+ *
+ * Without a mapping of the file one is made for the chunk only; mapping
+ * without touching faults nothing in. The result is kept, so asking again
+ * for the same chunk costs nothing.
+ */
+Probe probe(HTTPConnxData &conn, size_t count, bool needed) {
+  Probe result;
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  if (count == 0 || (file.cache_class < 0 && !needed)) {
+    return result;
+  }
+  if (file.probe_offset == file.offset && file.probe_count == count) {
+    result.taken = true;
+    result.pages = file.probe_pages;
+    result.missing = file.probe_missing;
+    return result;
+  }
+  if (!needed && conn.config->file_cache_hints != FILE_HINTS_STATS &&
+      ++chunks % Constants::page_cache_probe_interval != 0) {
+    return result;
+  }
+  off_t start = file.offset - file.offset % pageSize();
+  size_t len = count + static_cast<size_t>(file.offset - start);
+  void *map = file.map != NULL ? file.map + start
+                               : mmap(NULL, len, PROT_READ, MAP_SHARED,
+                                      conn.file_fd, start);
+  if (map == MAP_FAILED) {
+    return result;
+  }
+#ifdef __linux__
+  vector<unsigned char> pages((len + pageSize() - 1) / pageSize());
+#else
+  vector<char> pages((len + pageSize() - 1) / pageSize());
+#endif
+  if (mincore(map, len, &pages[0]) == 0) {
+    result.taken = true;
+    result.pages = pages.size();
+    for (size_t i = 0; i < pages.size(); ++i) {
+      result.missing += (pages[i] & 1) == 0;
+    }
+    file.probe_offset = file.offset;
+    file.probe_count = count;
+    file.probe_pages = result.pages;
+    file.probe_missing = result.missing;
+  }
+  if (file.map == NULL) {
+    munmap(map, len);
+  }
+  return result;
+}
+
+/**
+ * @brief Account for bytes of a probed chunk of count bytes having been
+ * read or sent, the cursor already moved past them; then keep the window
+ * ahead filled and drop what is behind
+ *
+ * A short send counts its share of the probed pages and misses.
+ */
+void consumed(HTTPConnxData &conn, const Probe &probe, size_t count,
+              ssize_t bytes) {
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  if (bytes <= 0) {
+    return;
+  }
+  file.probe_offset = -1; // the cursor moved
+  if (file.cache_class < 0) {
+    return;
+  }
+  Stats &s = stats[file.cache_class];
+  size_t done = std::min(static_cast<size_t>(bytes), count);
+  s.bytes += done;
+  if (probe.taken && count > 0) {
+    s.pages += (probe.pages * done + count - 1) / count;
+    s.misses += (probe.missing * done + count - 1) / count;
+  }
+  if (!hinted(conn)) {
+    return;
+  }
+  if (file.offset + Constants::readahead_window / 2 > file.advised) {
+    readAhead(conn, file.offset);
+  }
+  if (file.cache_class == CLASS_DROP_BEHIND) {
+    dropBehind(conn, file.offset);
+  }
+}
+
+/**
+ * @brief Unmap the file, before the connection's transfer data goes
+ */
+void release(HTTPConnxData &conn) {
+  HTTPConnxData::FileTransferData &file = conn.fileData;
+  if (file.map != NULL) {
+    munmap(file.map, file.map_len);
+    file.map = NULL;
+    file.map_len = 0;
+  }
+}
+
+/**
+ * @brief Requests and page cache misses per request class, as JSON
+ */
+string statusJson() {
+  string json = "{";
+  for (int c = 0; c < CLASSES; ++c) {
+    const Stats &s = stats[c];
+    json += (c > 0 ? ",\"" : "\"") + string(class_names[c]) +
+            "\":{\"requests\":" + Utils::to_string(s.requests) +
+            ",\"bytes\":" + Utils::to_string(s.bytes) +
+            ",\"pages\":" + Utils::to_string(s.pages) +
+            ",\"misses\":" + Utils::to_string(s.misses) + "}";
+  }
+  return json + "}";
+}
+
+} // namespace PageCache
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+#include <string>
+
+/**
+ * @brief Page cache hints and miss counts for the files that are sent, for
+ * servers with file_cache_hints
+ *
+ * Each file transfer gets a request class by size: small files (under
+ * Constants::readahead_min_size) are left alone, larger ones are sequential,
+ * and those of file_drop_behind bytes or more are drop_behind.
+ *
+ * With fadvise a sequential file is opened with POSIX_FADV_SEQUENTIAL and
+ * the next Constants::readahead_window bytes after the send cursor are
+ * asked for with WILLNEED, so the disk keeps ahead of the socket. For
+ * drop_behind files the pages more than a window behind the cursor are let
+ * go with DONTNEED, so a few large downloads do not push the small hot
+ * assets out of the cache. mmap maps the file instead, gives the same
+ * hints with madvise() and sends from the mapping.
+ *
+ * Before a chunk is read or sent, mincore() may tell how many of its pages
+ * are not in the page cache; the misses per class are served at
+ * /api/page-cache-status. With stats every chunk is probed and no hints
+ * are given, otherwise one chunk in Constants::page_cache_probe_interval.
+ * disk_io uncached probes each chunk for its residency check, the result
+ * is kept on the connection and counted once.
+ */
+namespace PageCache {
+
+/**
+ * @brief Residency of a chunk, taken just before it is read or sent
+ */
+struct Probe {
+  bool taken;     // false if the chunk was not sampled
+  size_t pages;   // in the chunk
+  size_t missing; // of them, not in the page cache
+
+  Probe() : taken(false), pages(0), missing(0) {}
+  bool resident() const { return taken && pages > 0 && missing == 0; }
+};
+
+void opened(HTTPConnxData &conn);
+Probe probe(HTTPConnxData &conn, size_t count, bool needed = false);
+void consumed(HTTPConnxData &conn, const Probe &probe, size_t count,
+              ssize_t bytes);
+void release(HTTPConnxData &conn);
+std::string statusJson();
+
+} // namespace PageCache
@@ -117,6 +117,24 @@ void parseGlobalSettings(const std::string &globalContent, BaseConf &baseConfig)
     if (trimmedLine.find("maxBodySize") == 0) {
         parseMaxBodySize(trimmedLine, baseConfig);
     } 
+    else if (trimmedLine.find("client_body_") == 0) {
+        parseClientBodyDirective(trimmedLine, baseConfig);
+    }
+    else if (trimmedLine.find("upload_fsync") == 0) {
+        parseUploadFsync(trimmedLine, baseConfig);
+    }
+    else if (trimmedLine.find("disk_io") == 0) {
+        parseDiskIO(trimmedLine, baseConfig);
+    }
+    else if (trimmedLine.find("static_manifest") == 0) {
+        parseStaticManifest(trimmedLine, baseConfig);
+    }
+    else if (trimmedLine.find("file_cache_hints") == 0) {
+        parseFileCacheHints(trimmedLine, baseConfig);
+    }
+    else if (trimmedLine.find("file_drop_behind") == 0) {
+        parseFileDropBehind(trimmedLine, baseConfig);
+    }
     else if (trimmedLine.find("autoindex") == 0) {
         parseAutoIndex(trimmedLine, baseConfig);
     }
@@ -144,6 +162,200 @@ void parseMaxBodySize(std::string &trimmedLine, BaseConf &baseConfig)
       }
 }
 
+/**
+ * @brief Read "<n>[k|m|g]" (the unit may also be a separate word)
+ */
+static bool readSize(std::istringstream &values, size_t &size) {
+  std::string unit;
+  if (!(values >> size)) {
+    return false;
+  }
+  values >> unit;
+  if (unit == "k" || unit == "K") {
+    size *= 1024;
+  } else if (unit == "m" || unit == "M") {
+    size *= 1024 * 1024;
+  } else if (unit == "g" || unit == "G") {
+    size *= 1024 * 1024 * 1024;
+  }
+  return true;
+}
+
+/**
+ * @brief Parse client_body_buffer_size <size>; or client_body_temp_path <dir>;
+ *
+ * Request bodies bigger than the buffer size are spooled to an unlinked
+ * file in the temp path instead of being kept in memory.
+ */
+void parseClientBodyDirective(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t nameEnd = trimmedLine.find_first_of(" \t");
+  size_t valueEnd = trimmedLine.find(';');
+  if (nameEnd == std::string::npos || valueEnd == std::string::npos ||
+      valueEnd < nameEnd) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::string name = trimmedLine.substr(0, nameEnd);
+  std::istringstream values(trimmedLine.substr(nameEnd, valueEnd - nameEnd));
+
+  if (name == "client_body_buffer_size") {
+    size_t size = 0;
+    if (!readSize(values, size) || size == 0) {
+      debuglog(YELLOW, "Warning: Invalid client_body_buffer_size: %s",
+               trimmedLine.c_str());
+      return;
+    }
+    baseConfig.client_body_buffer_size = size;
+    debuglog(GREEN, "client_body_buffer_size: %zu bytes", size);
+  } else if (name == "client_body_temp_path") {
+    std::string dir;
+    values >> dir;
+    if (!dir.empty()) {
+      baseConfig.client_body_temp_path = dir;
+      debuglog(GREEN, "client_body_temp_path: %s", dir.c_str());
+    }
+  } else {
+    debuglog(YELLOW, "Warning: Unknown directive: %s", name.c_str());
+  }
+}
+
+/**
+ * @brief Parse upload_fsync off|on_complete|batched;
+ *
+ * on_complete fsyncs each upload and its directory before answering,
+ * batched flushes all of them with one syncfs() per
+ * Constants::upload_fsync_interval.
+ */
+void parseUploadFsync(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t valueEnd = trimmedLine.find(';');
+  if (valueEnd == std::string::npos || valueEnd < 12) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::istringstream values(trimmedLine.substr(12, valueEnd - 12));
+  std::string mode;
+  values >> mode;
+  if (mode == "off") {
+    baseConfig.upload_fsync = UPLOAD_FSYNC_OFF;
+  } else if (mode == "on_complete") {
+    baseConfig.upload_fsync = UPLOAD_FSYNC_ON_COMPLETE;
+  } else if (mode == "batched") {
+    baseConfig.upload_fsync = UPLOAD_FSYNC_BATCHED;
+  } else {
+    debuglog(YELLOW, "Warning: Invalid upload_fsync: %s", trimmedLine.c_str());
+    return;
+  }
+  debuglog(GREEN, "upload_fsync: %s", mode.c_str());
+}
+
+/**
+ * @brief Parse disk_io off|threads|uncached;
+ *
+ * threads moves file reads, upload writes, directory scans and unlinks to
+ * the DiskIO worker pool, uncached does too but keeps sending file data
+ * that is already in the page cache inline.
+ */
+void parseDiskIO(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t valueEnd = trimmedLine.find(';');
+  if (valueEnd == std::string::npos || valueEnd < 7) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::istringstream values(trimmedLine.substr(7, valueEnd - 7));
+  std::string mode;
+  values >> mode;
+  if (mode == "off") {
+    baseConfig.disk_io = DISK_IO_OFF;
+  } else if (mode == "threads") {
+    baseConfig.disk_io = DISK_IO_THREADS;
+  } else if (mode == "uncached") {
+    baseConfig.disk_io = DISK_IO_UNCACHED;
+  } else {
+    debuglog(YELLOW, "Warning: Invalid disk_io: %s", trimmedLine.c_str());
+    return;
+  }
+  debuglog(GREEN, "disk_io: %s", mode.c_str());
+}
+
+/**
+ * @brief Parse static_manifest on|off;
+ *
+ * With on the roots are indexed at startup and kept fresh with inotify,
+ * file lookups then need no stat(), see Manifest.
+ */
+void parseStaticManifest(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t valueEnd = trimmedLine.find(';');
+  if (valueEnd == std::string::npos || valueEnd < 15) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::istringstream values(trimmedLine.substr(15, valueEnd - 15));
+  std::string mode;
+  values >> mode;
+  if (mode != "on" && mode != "off") {
+    debuglog(YELLOW, "Warning: Invalid static_manifest: %s",
+             trimmedLine.c_str());
+    return;
+  }
+  baseConfig.static_manifest = mode == "on";
+  debuglog(GREEN, "static_manifest: %s", mode.c_str());
+}
+
+/**
+ * @brief Parse file_cache_hints off|stats|fadvise|mmap;
+ *
+ * stats only counts page cache misses of the files sent, fadvise also
+ * tells the kernel large files are read sequentially, mmap sends them
+ * from a mapping with the same hints given through madvise().
+ */
+void parseFileCacheHints(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t valueEnd = trimmedLine.find(';');
+  if (valueEnd == std::string::npos || valueEnd < 16) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::istringstream values(trimmedLine.substr(16, valueEnd - 16));
+  std::string mode;
+  values >> mode;
+  if (mode == "off") {
+    baseConfig.file_cache_hints = FILE_HINTS_OFF;
+  } else if (mode == "stats") {
+    baseConfig.file_cache_hints = FILE_HINTS_STATS;
+  } else if (mode == "fadvise") {
+    baseConfig.file_cache_hints = FILE_HINTS_FADVISE;
+  } else if (mode == "mmap") {
+    baseConfig.file_cache_hints = FILE_HINTS_MMAP;
+  } else {
+    debuglog(YELLOW, "Warning: Invalid file_cache_hints: %s",
+             trimmedLine.c_str());
+    return;
+  }
+  debuglog(GREEN, "file_cache_hints: %s", mode.c_str());
+}
+
+/**
+ * @brief Parse file_drop_behind <size>;
+ *
+ * The pages of a file at least this large are dropped from the page cache
+ * once they are sent, 0 keeps them all.
+ */
+void parseFileDropBehind(std::string &trimmedLine, BaseConf &baseConfig) {
+  size_t valueEnd = trimmedLine.find(';');
+  if (valueEnd == std::string::npos || valueEnd < 16) {
+    debuglog(YELLOW, "Warning: Invalid directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::istringstream values(trimmedLine.substr(16, valueEnd - 16));
+  size_t size = 0;
+  if (!readSize(values, size)) {
+    debuglog(YELLOW, "Warning: Invalid file_drop_behind: %s",
+             trimmedLine.c_str());
+    return;
+  }
+  baseConfig.file_drop_behind = size;
+  debuglog(GREEN, "file_drop_behind: %zu bytes", size);
+}
+
 void parseAutoIndex(std::string &trimmedLine, BaseConf &baseConfig){
   
   size_t valueStart = trimmedLine.find_first_not_of(" \t", 9);
@@ -563,8 +775,18 @@ void parseLocationBlock(const std::string &locationContent, Location &location,
       parseLocationFileUpload(trimmedLine, location);
     else if (trimmedLine.find("upload_dir") == 0)
       parseLocationUploadDir(trimmedLine, location);
+    else if (trimmedLine.find("upload_dedup") == 0)
+      parseLocationUploadDedup(trimmedLine, location);
     else if (trimmedLine.find("acceptedMethods") == 0)
       parseLocationAccceptedMethods(trimmedLine, location);
+    else if (trimmedLine.find("gzip_static") == 0)
+      parseLocationGzipStatic(trimmedLine, location);
+    else if (trimmedLine.find("gzip") == 0)
+      parseGzipDirective(trimmedLine, location.gzip);
+    else if (trimmedLine.find("fastcgi_pass") == 0)
+      parseLocationFastcgiPass(trimmedLine, location);
+    else if (trimmedLine.find("handler") == 0)
+      parseLocationHandler(trimmedLine, location);
   }
 }
 
@@ -660,6 +882,140 @@ void parseLocationUploadDir(std::string trimmedLine, Location &location){
       }
 }
 
+/**
+ * @brief upload_dedup on|off; store each distinct upload body only once
+ */
+void parseLocationUploadDedup(std::string &trimmedLine, Location &location) {
+  size_t valueStart = trimmedLine.find_first_not_of(" \t", 12);
+  size_t valueEnd = trimmedLine.find(';', valueStart);
+
+  if (valueEnd != std::string::npos) {
+    std::string value = trimmedLine.substr(valueStart, valueEnd - valueStart);
+    if (value == "on" || value == "off") {
+      location.upload_dedup = value == "on";
+      debuglog(GREEN, "Location upload_dedup: %s", value.c_str());
+    } else {
+      debuglog(YELLOW, "Warning: Invalid upload_dedup value: %s",
+               value.c_str());
+    }
+  }
+}
+
+void parseLocationGzipStatic(std::string &trimmedLine, Location &location) {
+  size_t valueStart = trimmedLine.find_first_not_of(" \t", 11);
+  size_t valueEnd = trimmedLine.find(';', valueStart);
+
+  if (valueEnd != std::string::npos) {
+    std::string value = trimmedLine.substr(valueStart, valueEnd - valueStart);
+    if (value == "on") {
+      location.gzip_static = true;
+      debuglog(GREEN, "Location gzip_static: on");
+    } else if (value == "off") {
+      location.gzip_static = false;
+      debuglog(GREEN, "Location gzip_static: off");
+    } else {
+      debuglog(YELLOW, "Warning: Invalid gzip_static value: %s", value.c_str());
+    }
+  }
+}
+
+/**
+ * @brief fastcgi_pass [unix:]/path/to/app.sock;
+ *
+ * Only Unix sockets are supported, the unix: prefix is optional.
+ */
+void parseLocationFastcgiPass(std::string &trimmedLine, Location &location) {
+  size_t valueStart = trimmedLine.find_first_not_of(" \t", 12);
+  size_t valueEnd = trimmedLine.find(';', valueStart);
+
+  if (valueStart == std::string::npos || valueEnd == std::string::npos) {
+    debuglog(YELLOW, "Warning: Invalid fastcgi_pass: %s", trimmedLine.c_str());
+    return;
+  }
+  std::string value = trimLine(trimmedLine.substr(valueStart, valueEnd - valueStart));
+  if (value.find("unix:") == 0) {
+    value = value.substr(5);
+  }
+  if (value.empty()) {
+    debuglog(YELLOW, "Warning: Empty fastcgi_pass socket path");
+    return;
+  }
+  location.fastcgi_pass = value;
+  debuglog(GREEN, "Location fastcgi_pass: %s", value.c_str());
+}
+
+/**
+ * @brief handler /path/to/plugin.so;
+ *
+ * The plugin is loaded at startup (Handlers::loadAll), a relative path is
+ * taken from the server's working directory like the other paths.
+ */
+void parseLocationHandler(std::string &trimmedLine, Location &location) {
+  size_t valueStart = trimmedLine.find_first_not_of(" \t", 7);
+  size_t valueEnd = trimmedLine.find(';', valueStart);
+
+  if (valueStart == std::string::npos || valueEnd == std::string::npos) {
+    debuglog(YELLOW, "Warning: Invalid handler: %s", trimmedLine.c_str());
+    return;
+  }
+  std::string value = trimLine(trimmedLine.substr(valueStart, valueEnd - valueStart));
+  if (value.empty()) {
+    debuglog(YELLOW, "Warning: Empty handler path");
+    return;
+  }
+  location.handler = value;
+  debuglog(GREEN, "Location handler: %s", value.c_str());
+}
+
+/**
+ * @brief Parse one of gzip, gzip_types, gzip_min_length, gzip_comp_level
+ *
+ * Used by location blocks and the cgi block. gzip_types replaces the default
+ * list (text/html).
+ */
+void parseGzipDirective(std::string &trimmedLine, GzipSettings &gzip) {
+  size_t nameEnd = trimmedLine.find_first_of(" \t");
+  size_t valueEnd = trimmedLine.find(';');
+  if (nameEnd == std::string::npos || valueEnd == std::string::npos ||
+      valueEnd < nameEnd) {
+    debuglog(YELLOW, "Warning: Invalid gzip directive: %s", trimmedLine.c_str());
+    return;
+  }
+  std::string name = trimmedLine.substr(0, nameEnd);
+  std::string value = trimLine(trimmedLine.substr(nameEnd, valueEnd - nameEnd));
+
+  if (name == "gzip") {
+    if (value == "on" || value == "off") {
+      gzip.enabled = (value == "on");
+      debuglog(GREEN, "gzip: %s", value.c_str());
+    } else {
+      debuglog(YELLOW, "Warning: Invalid gzip value: %s", value.c_str());
+    }
+  } else if (name == "gzip_types") {
+    std::istringstream typeStream(value);
+    std::string type;
+    gzip.types.clear();
+    while (typeStream >> type) {
+      gzip.types.push_back(type);
+      debuglog(GREEN, "gzip_types: %s", type.c_str());
+    }
+  } else if (name == "gzip_min_length") {
+    gzip.min_length = static_cast<size_t>(atol(value.c_str()));
+    debuglog(GREEN, "gzip_min_length: %zu", gzip.min_length);
+  } else if (name == "gzip_comp_level") {
+    int level = atoi(value.c_str());
+    if (level >= 1 && level <= 9) {
+      gzip.level = level;
+      debuglog(GREEN, "gzip_comp_level: %d", level);
+    } else {
+      debuglog(YELLOW, "Warning: gzip_comp_level must be 1-9: %s",
+               value.c_str());
+    }
+  } else {
+    debuglog(YELLOW, "Warning: Unknown gzip directive: %s", name.c_str());
+  }
+}
+
 void parseLocationAccceptedMethods(std::string &trimmedLine, Location &location){
   size_t methodsStart = trimmedLine.find_first_not_of(" \t", 15);
   size_t openBrace = trimmedLine.find("{");
@@ -747,6 +1103,15 @@ void parseCgiBlock(const std::string &cgiContent, CGIData &cgiConfig) {
       parseCgiFileExtension(trimmedLine, cgiConfig);
     else if (trimmedLine.find("acceptedMethods") == 0)
       parseCGIAcceptedMethods(trimmedLine, cgiConfig);
+    else if (trimmedLine.find("gzip") == 0)
+      parseGzipDirective(trimmedLine, cgiConfig.gzip);
+    else if (trimmedLine.find("cgi_pool") == 0)
+      parseCgiPoolDirective(trimmedLine, cgiConfig.pool);
+    else if (trimmedLine.find("cgi_cache") == 0)
+      parseCgiCacheDirective(trimmedLine, cgiConfig);
+    else if (trimmedLine.find("max_concurrent") == 0 ||
+             trimmedLine.find("queue_size") == 0)
+      parseCgiLimitDirective(trimmedLine, cgiConfig);
   }
 }
 
@@ -839,6 +1204,119 @@ void parseCGIAcceptedMethods(std::string &trimmedLine,CGIData &cgiConfig){
 }
 
 
+/**
+ * @brief Parse one of cgi_pool, cgi_pool_worker, cgi_pool_queue,
+ * cgi_pool_max_requests, cgi_pool_max_memory
+ *
+ * cgi_pool <min> <max>; turns the pool on, cgi_pool_worker <program>
+ * [.ext ...]; names the program and the script extensions it serves (all
+ * of them if none are given). cgi_pool_max_memory takes a k, m or g suffix.
+ */
+void parseCgiPoolDirective(std::string &trimmedLine, CGIPoolSettings &pool) {
+  size_t nameEnd = trimmedLine.find_first_of(" \t");
+  size_t valueEnd = trimmedLine.find(';');
+  if (nameEnd == std::string::npos || valueEnd == std::string::npos ||
+      valueEnd < nameEnd) {
+    debuglog(YELLOW, "Warning: Invalid cgi_pool directive: %s",
+             trimmedLine.c_str());
+    return;
+  }
+  std::string name = trimmedLine.substr(0, nameEnd);
+  std::istringstream values(trimmedLine.substr(nameEnd, valueEnd - nameEnd));
+
+  if (name == "cgi_pool") {
+    long min = -1;
+    long max = -1;
+    values >> min >> max;
+    if (min < 0 || max < 1 || min > max) {
+      debuglog(YELLOW, "Warning: cgi_pool needs <min> <max>, 0 <= min <= max "
+                       "and max >= 1: %s", trimmedLine.c_str());
+      return;
+    }
+    pool.min_workers = static_cast<size_t>(min);
+    pool.max_workers = static_cast<size_t>(max);
+    debuglog(GREEN, "cgi_pool: %zu-%zu workers", pool.min_workers,
+             pool.max_workers);
+  } else if (name == "cgi_pool_worker") {
+    std::string ext;
+    values >> pool.worker;
+    pool.extensions.clear();
+    while (values >> ext) {
+      pool.extensions.push_back(ext);
+    }
+    debuglog(GREEN, "cgi_pool_worker: %s (%zu extensions)",
+             pool.worker.c_str(), pool.extensions.size());
+  } else if (name == "cgi_pool_queue") {
+    values >> pool.queue_size;
+    debuglog(GREEN, "cgi_pool_queue: %zu", pool.queue_size);
+  } else if (name == "cgi_pool_max_requests") {
+    values >> pool.max_requests;
+    debuglog(GREEN, "cgi_pool_max_requests: %zu", pool.max_requests);
+  } else if (name == "cgi_pool_max_memory") {
+    size_t size = 0;
+    readSize(values, size);
+    pool.max_memory = size;
+    debuglog(GREEN, "cgi_pool_max_memory: %zu bytes", pool.max_memory);
+  } else {
+    debuglog(YELLOW, "Warning: Unknown cgi_pool directive: %s", name.c_str());
+  }
+}
+
+/**
+ * @brief Parse max_concurrent <n>; or queue_size <n>; of the cgi block
+ *
+ * At most max_concurrent forked scripts run at once, queue_size more
+ * requests wait for a slot and the rest get 503 right away.
+ */
+void parseCgiLimitDirective(std::string &trimmedLine, CGIData &cgiConfig) {
+  std::istringstream values(trimmedLine.substr(0, trimmedLine.find(';')));
+  std::string name;
+  long value = -1;
+  values >> name >> value;
+  if (value < 0) {
+    debuglog(YELLOW, "Warning: %s needs a number >= 0: %s", name.c_str(),
+             trimmedLine.c_str());
+    return;
+  }
+  if (name == "max_concurrent") {
+    cgiConfig.max_concurrent = static_cast<size_t>(value);
+  } else if (name == "queue_size") {
+    cgiConfig.queue_size = static_cast<size_t>(value);
+  } else {
+    debuglog(YELLOW, "Warning: Unknown cgi directive: %s", name.c_str());
+    return;
+  }
+  debuglog(GREEN, "CGI %s: %ld", name.c_str(), value);
+}
+
+/**
+ * @brief Parse cgi_cache <size>[k|m|g] [header ...]; of the cgi block
+ *
+ * Turns the microcache on with a store of size bytes; the named request
+ * headers become part of the key next to the script and query string.
+ */
+void parseCgiCacheDirective(std::string &trimmedLine, CGIData &cgiConfig) {
+  std::istringstream values(trimmedLine.substr(0, trimmedLine.find(';')));
+  std::string name;
+  std::string token;
+  size_t size = 0;
+  values >> name >> token;
+  std::istringstream sizeToken(token); // headers may follow the size
+  if (name != "cgi_cache" || !readSize(sizeToken, size)) {
+    debuglog(YELLOW, "Warning: cgi_cache needs <size>[k|m|g]: %s",
+             trimmedLine.c_str());
+    return;
+  }
+  cgiConfig.cache_size = size;
+  cgiConfig.cache_key_headers.clear();
+  std::string header;
+  while (values >> header) {
+    cgiConfig.cache_key_headers.push_back(header);
+  }
+  debuglog(GREEN, "CGI cache: %zu bytes, %zu key headers", size,
+           cgiConfig.cache_key_headers.size());
+}
+
 size_t findClosingBrace(const string &content, size_t start) {
   int braceCount = 1;
   for (size_t i = start; i < content.length(); ++i) {
@@ -35,6 +35,12 @@ void parsePortToServer(std::vector<ServerData> &servers,
 
 void parseGlobalSettings(const std::string &httpContent, BaseConf &baseConfig);
 void parseMaxBodySize(std::string &trimmedLine, BaseConf &baseConfig);
+void parseClientBodyDirective(std::string &trimmedLine, BaseConf &baseConfig);
+void parseUploadFsync(std::string &trimmedLine, BaseConf &baseConfig);
+void parseDiskIO(std::string &trimmedLine, BaseConf &baseConfig);
+void parseStaticManifest(std::string &trimmedLine, BaseConf &baseConfig);
+void parseFileCacheHints(std::string &trimmedLine, BaseConf &baseConfig);
+void parseFileDropBehind(std::string &trimmedLine, BaseConf &baseConfig);
 void parseAutoIndex(std::string &trimmedLine, BaseConf &baseConfig);
 int getAutoindexCode(const std::string &value);
 std::string abstractErrorPageBlock(std::string &trimmedLine, const std::string &httpContent, BaseConf &baseConfig);
@@ -67,6 +73,11 @@ void parseLocationRoot(std::string trimmedLine, Location &location);
 void parseLocationFileUpload(std::string &trimmedLine, Location &location);
 void parseLocationUploadDir(std::string trimmedLine, Location &location);
 void parseLocationAccceptedMethods(std::string &trimmedLine, Location &location);
+void parseLocationGzipStatic(std::string &trimmedLine, Location &location);
+void parseLocationUploadDedup(std::string &trimmedLine, Location &location);
+void parseGzipDirective(std::string &trimmedLine, GzipSettings &gzip);
+void parseLocationFastcgiPass(std::string &trimmedLine, Location &location);
+void parseLocationHandler(std::string &trimmedLine, Location &location);
 
 void parseCgiConfig(const std::string &trimmedLine, const std::string &serverBlockContent, ServerData &serverData);
 std::string extractCgiBlockContent(const std::string &line, const std::string &serverContent);
@@ -75,6 +86,9 @@ void parseCgiPathAlias(std::string &trimmedLine, CGIData &cgiConfig);
 void parseCgiUploadDir(std::string &trimmedLine, CGIData &cgiConfig);
 void parseCgiFileExtension(std::string &trimmedLine, CGIData &cgiConfig);
 void parseCGIAcceptedMethods(std::string &trimmedLine,CGIData &cgiConfig);
+void parseCgiPoolDirective(std::string &trimmedLine, CGIPoolSettings &pool);
+void parseCgiLimitDirective(std::string &trimmedLine, CGIData &cgiConfig);
+void parseCgiCacheDirective(std::string &trimmedLine, CGIData &cgiConfig);
 
 template <typename T>
 bool parseNumericValue(const std::string &line, const std::string &param, size_t paramLen, T &outValue);
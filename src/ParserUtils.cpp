@@ -60,6 +60,23 @@ debuglog(BLUE, "Server Names: None defined");
 debuglog(BLUE, "Root: %s", server.root.c_str());
 debuglog(BLUE, "Index: %s", server.index.c_str());
 debuglog(BLUE, "Max Body Size: %lu bytes", server.maxBodySize);
+debuglog(BLUE, "Body Buffer: %zu bytes, then %s", server.client_body_buffer_size,
+         server.client_body_temp_path.c_str());
+debuglog(BLUE, "Upload fsync: %s",
+         server.upload_fsync == UPLOAD_FSYNC_ON_COMPLETE ? "on_complete"
+         : server.upload_fsync == UPLOAD_FSYNC_BATCHED   ? "batched"
+                                                         : "off");
+debuglog(BLUE, "Disk I/O: %s",
+         server.disk_io == DISK_IO_THREADS    ? "threads"
+         : server.disk_io == DISK_IO_UNCACHED ? "uncached"
+                                              : "off");
+debuglog(BLUE, "Static manifest: %s", server.static_manifest ? "on" : "off");
+debuglog(BLUE, "File cache hints: %s, drop behind from %zu bytes",
+         server.file_cache_hints == FILE_HINTS_STATS     ? "stats"
+         : server.file_cache_hints == FILE_HINTS_FADVISE ? "fadvise"
+         : server.file_cache_hints == FILE_HINTS_MMAP    ? "mmap"
+                                                         : "off",
+         server.file_drop_behind);
 debuglog(BLUE, "Autoindex: %s", server.autoindex ? "on" : "off");
 debuglog(BLUE, "File Server: %s", server.file_server ? "on" : "off");
 debuglog(BLUE, "Upload Directory: %s", server.upload_dir.c_str());
@@ -89,6 +106,8 @@ debuglog(BLUE, "  Location: %s", path.c_str());
 debuglog(BLUE, "    Autoindex: %s", loc.autoindex ? "on" : "off");
 debuglog(BLUE, "    File Upload: %s", loc.file_upload ? "on" : "off");
 debuglog(BLUE, "    Upload Dir: %s", loc.upload_dir.c_str());
+if (loc.upload_dedup)
+debuglog(BLUE, "    Upload Dedup: on");
 
 debuglog(BLUE, "    root : %s", loc.root.c_str());
 
@@ -131,6 +150,9 @@ debuglog(BLUE, "  Path Alias: %s -> %s",
 server.cgiData.cgi_path_alias.first.c_str(),
 server.cgiData.cgi_path_alias.second.c_str());
 debuglog(BLUE, "  Upload Dir: %s", server.cgiData.upload_dir.c_str());
+debuglog(BLUE, "  Max Concurrent: %zu (queue %zu)",
+server.cgiData.max_concurrent, server.cgiData.queue_size);
+debuglog(BLUE, "  Cache: %zu bytes", server.cgiData.cache_size);
 
 if (!server.cgiData.cgi_extensions.empty()) {
 std::string exts;
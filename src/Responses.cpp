@@ -1,4 +1,5 @@
 #include "Responses.hpp"
+#include "Compression.hpp"
 #include "Config.hpp"
 #include "Constants.hpp"
 #include "HTTPConnxData.hpp"
@@ -10,6 +11,7 @@
 #include <fcntl.h>
 #include <sstream>
 #include <string>
+#include <unistd.h>
 
 using std::string;
 
@@ -34,6 +36,7 @@ string addSessionCookieHeaders(HTTPConnxData &conn) {
 }
 
 // Create a more comprehensive function that handles all headers
+// contentLength -1 means the body is streamed and goes out chunked
 void addStandardHeaders(HTTPConnxData &conn, string &header, int statusCode,
                         const string &contentType, long contentLength) {
   // Status line
@@ -55,9 +58,11 @@ void addStandardHeaders(HTTPConnxData &conn, string &header, int statusCode,
   }
 
   // Content length
-  header +=
-      "Content-Length: " + Utils::to_string(static_cast<int>(contentLength)) +
-      "\r\n";
+  if (contentLength < 0) {
+    header += "Transfer-Encoding: chunked\r\n";
+  } else {
+    header += "Content-Length: " + Utils::to_string(contentLength) + "\r\n";
+  }
   header += "\r\n";
 }
 
@@ -156,9 +161,22 @@ void createResponse(HTTPConnxData &conn, std::string contentType,
     contentType = "text/html";
   }
 
+  // the whole body is here, so it keeps a Content-Length when compressed
+  string packed;
+  if (Compression::wanted(conn, contentType,
+                          static_cast<long>(response.size())) &&
+      Compression::gzipBuffer(response, conn.urlMatcherData.gzip.level,
+                              packed)) {
+    debuglog(GREEN, "Compressed response body %zu -> %zu bytes",
+             response.size(), packed.size());
+    response.swap(packed);
+    conn.data.response_headers += "Content-Encoding: gzip\r\n";
+    conn.data.response_headers += "Vary: Accept-Encoding\r\n";
+  }
+
   string header;
   addStandardHeaders(conn, header, statusCode, contentType,
-                     static_cast<int>(response.size()));
+                     static_cast<long>(response.size()));
 
   conn.data.response = header + response;
   conn.state = CONN_SIMPLE_RESPONSE;
@@ -166,6 +184,83 @@ void createResponse(HTTPConnxData &conn, std::string contentType,
   debuglog(GREEN, "Response headers:\n%s", header.c_str());
 }
 
+/**
+ * @brief Serialize the return directives of all locations at config load
+ *
+ * A return directive always produces the same bytes, so the status line,
+ * headers and body are built once here and stored in the Location. The only
+ * per-connection part is the session cookie, which goes in at
+ * return_splice_pos (right after Content-Type, same as addStandardHeaders).
+ */
+void precompileReturnDirectives(std::vector<ServerData> &servers) {
+  // the parser runs before SocketUtils::initialize() fills the map
+  if (Constants::statusMessages.empty()) {
+    Constants::initStatusMessageMap();
+  }
+  for (size_t i = 0; i < servers.size(); ++i) {
+    for (std::map<std::string, Location>::iterator it =
+             servers[i].location_blocks.begin();
+         it != servers[i].location_blocks.end(); ++it) {
+      Location &location = it->second;
+      int statusCode = location.return_directive.first;
+      if (statusCode == 0) {
+        continue;
+      }
+      string target = location.return_directive.second;
+      string contentType = "text/plain";
+      string body = target;
+      string locationHeader;
+      if ((statusCode == 301 || statusCode == 302 || statusCode == 303 ||
+           statusCode == 307 || statusCode == 308) &&
+          !target.empty()) {
+        locationHeader = "Location: " + target + "\r\n";
+        body = "<html><body>Redirecting to " + target + "</body></html>";
+        contentType = "text/html";
+      }
+
+      string blob = "HTTP/1.1 " + Utils::to_string(statusCode) + " " +
+                    Constants::statusMessages[statusCode] + "\r\n";
+      blob += "Content-Type: " + contentType + "\r\n";
+      location.return_splice_pos = blob.size();
+      blob += locationHeader;
+      blob += "Content-Length: " + Utils::to_string(body.size()) + "\r\n";
+      blob += "\r\n";
+      blob += body;
+      location.return_response = blob;
+      debuglog(GREEN, "Precompiled return %d for location %s (%zu bytes)",
+               statusCode, it->first.c_str(), blob.size());
+    }
+  }
+}
+
+/**
+ * @brief Serve a return directive from its precompiled blob
+ *
+ * Without a session or extra headers the shared blob is sent as is. Otherwise
+ * we copy it once and splice the per-connection headers in.
+ */
+void precompiledReturnResponse(HTTPConnxData &conn, const Location &location) {
+  if (location.return_response.empty()) {
+    createResponse(conn, "text/plain", location.return_directive.second,
+                   location.return_directive.first);
+    return;
+  }
+  conn.data.bytes_sent = 0;
+  conn.state = CONN_SIMPLE_RESPONSE;
+  if (!conn.data.has_session && conn.data.response_headers.empty()) {
+    conn.data.prebuilt_response = &location.return_response;
+    return;
+  }
+  string extra;
+  if (conn.data.has_session) {
+    extra = "Set-Cookie: sessionid=" + conn.data.session_id +
+            "; Path=/; HttpOnly\r\n";
+  }
+  extra += conn.data.response_headers;
+  conn.data.response = location.return_response;
+  conn.data.response.insert(location.return_splice_pos, extra);
+}
+
 /**
  * @brief generate a simple text response
  */
@@ -183,9 +278,13 @@ void simpleStatusResponse(HTTPConnxData &conn, int statusCode) {
 void prepareFileResponse(HTTPConnxData &conn, long fileSize) {
   // Use the content type already stored in the conn
   string header;
+  conn.data.response_headers += "Accept-Ranges: bytes\r\n";
   addStandardHeaders(conn, header, 200, conn.urlMatcherData.content_type,
                      fileSize);
 
+  conn.fileData = HTTPConnxData::FileTransferData();
+  conn.fileData.remaining = fileSize;
+
   conn.data.response = header;
   conn.headers_set = false;
   conn.data.bytes_sent = 0;
@@ -196,6 +295,128 @@ void prepareFileResponse(HTTPConnxData &conn, long fileSize) {
       conn.urlMatcherData.content_type.c_str(), conn.data.response.c_str());
 }
 
+/**
+ * @brief Add ETag, Last-Modified and the encoding of the served file to the
+ * extra response headers
+ *
+ * With gzip_static the answer depends on Accept-Encoding even when the
+ * original is sent, so caches are told with Vary.
+ */
+void addValidatorHeaders(HTTPConnxData &conn,
+                         const MetadataCache::Entry &meta) {
+  conn.data.response_headers += "ETag: " + meta.etag + "\r\n";
+  conn.data.response_headers +=
+      "Last-Modified: " + meta.last_modified + "\r\n";
+  if (!conn.urlMatcherData.content_encoding.empty()) {
+    conn.data.response_headers +=
+        "Content-Encoding: " + conn.urlMatcherData.content_encoding + "\r\n";
+  }
+  if (conn.urlMatcherData.gzip_static) {
+    conn.data.response_headers += "Vary: Accept-Encoding\r\n";
+  }
+}
+
+/**
+ * @brief 304 answer to a conditional GET whose validators still match
+ *
+ * No body and no Content-Length: the client keeps its cached copy. The
+ * validators are repeated so the cache can refresh its stored headers.
+ */
+void notModifiedResponse(HTTPConnxData &conn, const MetadataCache::Entry &meta) {
+  string header = "HTTP/1.1 304 " + Constants::statusMessages[304] + "\r\n";
+  if (conn.data.has_session) {
+    header += "Set-Cookie: sessionid=" + conn.data.session_id +
+              "; Path=/; HttpOnly\r\n";
+  }
+  addValidatorHeaders(conn, meta);
+  header += conn.data.response_headers;
+  header += "\r\n";
+
+  conn.data.response = header;
+  conn.data.bytes_sent = 0;
+  conn.state = CONN_SIMPLE_RESPONSE;
+  debuglog(GREEN, "Response headers:\n%s", header.c_str());
+}
+
+/**
+ * @brief A multipart/byteranges boundary from /dev/urandom
+ *
+ * It must not be guessable from earlier responses, a file holding it
+ * would break the client's part parsing.
+ */
+static string newBoundary() {
+  unsigned char bytes[16];
+  int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+  ssize_t got = fd < 0 ? -1 : read(fd, bytes, sizeof(bytes));
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (got != static_cast<ssize_t>(sizeof(bytes))) {
+    return Utils::generateRandomFilename("webserv_byteranges_");
+  }
+  static const char hex[] = "0123456789abcdef";
+  string boundary = "webserv_byteranges_";
+  for (size_t i = 0; i < sizeof(bytes); ++i) {
+    boundary += hex[bytes[i] >> 4];
+    boundary += hex[bytes[i] & 0xf];
+  }
+  return boundary;
+}
+
+/**
+ * @brief 206 headers for the satisfiable ranges of the opened file
+ *
+ * One range is sent as is with a Content-Range header. Several ranges become
+ * a multipart/byteranges body: the part headers and closing boundary are
+ * built here so the exact Content-Length is known up front.
+ */
+void preparePartialFileResponse(HTTPConnxData &conn,
+                                const std::vector<ByteRange> &ranges) {
+  long fileSize = conn.urlMatcherData.file_size;
+  HTTPConnxData::FileTransferData &fileData = conn.fileData;
+  fileData = HTTPConnxData::FileTransferData();
+
+  string header;
+  conn.data.response_headers += "Accept-Ranges: bytes\r\n";
+  if (ranges.size() == 1) {
+    const ByteRange &range = ranges[0];
+    conn.data.response_headers +=
+        "Content-Range: bytes " + Utils::to_string(static_cast<long>(range.first)) +
+        "-" + Utils::to_string(static_cast<long>(range.second)) + "/" +
+        Utils::to_string(fileSize) + "\r\n";
+    fileData.offset = range.first;
+    fileData.remaining = range.second - range.first + 1;
+    addStandardHeaders(conn, header, 206, conn.urlMatcherData.content_type,
+                       static_cast<long>(fileData.remaining));
+  } else {
+    string boundary = newBoundary();
+    long contentLength = 0;
+    fileData.ranges = ranges;
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      string part = "\r\n--" + boundary + "\r\n";
+      part += "Content-Type: " + conn.urlMatcherData.content_type + "\r\n";
+      part += "Content-Range: bytes " +
+              Utils::to_string(static_cast<long>(ranges[i].first)) + "-" +
+              Utils::to_string(static_cast<long>(ranges[i].second)) + "/" +
+              Utils::to_string(fileSize) + "\r\n\r\n";
+      fileData.part_headers.push_back(part);
+      contentLength += static_cast<long>(part.size()) +
+                       static_cast<long>(ranges[i].second - ranges[i].first + 1);
+    }
+    fileData.closing = "\r\n--" + boundary + "--\r\n";
+    contentLength += static_cast<long>(fileData.closing.size());
+    addStandardHeaders(conn, header, 206,
+                       "multipart/byteranges; boundary=" + boundary,
+                       contentLength);
+  }
+
+  conn.data.response = header;
+  conn.headers_set = false;
+  conn.data.bytes_sent = 0;
+  debuglog(GREEN, "Partial file response headers prepared:\n%s",
+           conn.data.response.c_str());
+}
+
 bool serveCustomErrorPage(HTTPConnxData &conn, const string &errorPagePath,
                           int statusCode) {
   struct stat path_stat;
@@ -212,7 +433,7 @@ bool serveCustomErrorPage(HTTPConnxData &conn, const string &errorPagePath,
   URLMatcher::determineContentType(conn, errorPagePath);
 
   // Open the file
-  int fd = open(errorPagePath.c_str(), O_RDONLY);
+  int fd = open(errorPagePath.c_str(), O_RDONLY | O_CLOEXEC);
   if (fd < 0) {
     debuglog(RED, "URLMatcher: Failed to open custom error page: %s",
              errorPagePath.c_str());
@@ -223,6 +444,8 @@ bool serveCustomErrorPage(HTTPConnxData &conn, const string &errorPagePath,
   conn.file_fd = fd;
   conn.urlMatcherData.file_size = path_stat.st_size;
   conn.state = CONN_FILE_REQUEST;
+  conn.fileData = HTTPConnxData::FileTransferData();
+  conn.fileData.remaining = path_stat.st_size;
 
   // Prepare headers with the error status code
   string header;
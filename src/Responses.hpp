@@ -1,6 +1,9 @@
 #pragma once
 
 #include "HTTPConnxData.hpp"
+#include "MetadataCache.hpp"
+#include "ServerData.hpp"
+#include <vector>
 
 using std::string;
 
@@ -8,11 +11,20 @@ namespace Responses {
 
 void createResponse(HTTPConnxData &connections, string contentType,
                     std::string response, int statusCode);
+void addStandardHeaders(HTTPConnxData &conn, string &header, int statusCode,
+                        const string &contentType, long contentLength);
 void prepareFileResponse(HTTPConnxData &conn, long fileSize);
+void preparePartialFileResponse(HTTPConnxData &conn,
+                                const std::vector<ByteRange> &ranges);
 void htmlErrorResponse(HTTPConnxData &connections, int statusCode);
 void generatedHTMLResponse(HTTPConnxData &connection, int statusCode);
 void simpleStatusResponse(HTTPConnxData &connections, int statusCode);
 bool serveCustomErrorPage(HTTPConnxData &conn, const string &errorPagePath,
                           int statusCode);
+void addValidatorHeaders(HTTPConnxData &conn,
+                         const MetadataCache::Entry &meta);
+void notModifiedResponse(HTTPConnxData &conn, const MetadataCache::Entry &meta);
+void precompileReturnDirectives(std::vector<ServerData> &servers);
+void precompiledReturnResponse(HTTPConnxData &conn, const Location &location);
 
 } // namespace Responses
\ No newline at end of file
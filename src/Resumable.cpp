@@ -0,0 +1,345 @@
+#include "Resumable.hpp"
+#include "BodySpool.hpp"
+#include "Responses.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace Resumable {
+
+/**
+ * @brief The session's data file next to path, "" if path names no file
+ */
+static string partPath(const string &path) {
+  size_t slash = path.rfind('/');
+  string name = path.substr(slash == string::npos ? 0 : slash + 1);
+  if (name.empty()) {
+    return "";
+  }
+  return path.substr(0, path.size() - name.size()) + "." + name + ".resume";
+}
+
+static string lengthPath(const string &part) { return part + "-length"; }
+
+static bool endsWith(const string &s, const string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+/**
+ * @brief Whether path names a session's data or length file, those are
+ * not served, listed, uploaded to or deleted by their own name
+ */
+bool hidden(const string &path) {
+  size_t slash = path.rfind('/');
+  string name = path.substr(slash == string::npos ? 0 : slash + 1);
+  return name.size() > 1 && name[0] == '.' &&
+         (endsWith(name, ".resume") || endsWith(name, ".resume-length"));
+}
+
+/**
+ * @brief A plain decimal number, nothing before or after it
+ */
+static bool parseNumber(const string &s, size_t &value) {
+  if (s.empty() || s.size() > 19 ||
+      s.find_first_not_of("0123456789") != string::npos) {
+    return false;
+  }
+  value = static_cast<size_t>(std::strtoull(s.c_str(), NULL, 10));
+  return true;
+}
+
+static bool header(const HTTPConnxData &conn, const char *name,
+                   string &value) {
+  std::map<string, string>::const_iterator it = conn.data.headers.find(name);
+  if (it == conn.data.headers.end()) {
+    return false;
+  }
+  value = it->second;
+  return true;
+}
+
+/**
+ * @brief Content-Range: bytes <first>-<last>/<total|*> of an append
+ */
+static bool parseContentRange(const string &range, size_t &offset,
+                              size_t &last, string &total) {
+  if (range.compare(0, 6, "bytes ") != 0) {
+    return false;
+  }
+  size_t dash = range.find('-', 6);
+  size_t slash = range.find('/', 6);
+  if (dash == string::npos || slash == string::npos || slash < dash) {
+    return false;
+  }
+  total = range.substr(slash + 1);
+  return parseNumber(range.substr(6, dash - 6), offset) &&
+         parseNumber(range.substr(dash + 1, slash - dash - 1), last) &&
+         last >= offset;
+}
+
+static bool readLength(const string &part, size_t &length) {
+  FILE *f = std::fopen(lengthPath(part).c_str(), "r");
+  if (f == NULL) {
+    return false;
+  }
+  char buf[32] = {0};
+  size_t n = std::fread(buf, 1, sizeof(buf) - 1, f);
+  std::fclose(f);
+  return parseNumber(Utils::trim(string(buf, n)), length);
+}
+
+static bool writeLength(const string &part, size_t length) {
+  string path = lengthPath(part);
+  FILE *f = std::fopen(path.c_str(), "w");
+  if (f == NULL) {
+    return false;
+  }
+  bool ok = std::fprintf(f, "%zu\n", length) > 0;
+  return std::fclose(f) == 0 && ok;
+}
+
+/**
+ * @brief Answer before the body was read, with the offset the client
+ * should continue from when there is one
+ */
+static void refuse(HTTPConnxData &conn, int status, int fd = -1) {
+  struct stat st;
+  if (fd != -1 && fstat(fd, &st) == 0) {
+    conn.data.response_headers += "Upload-Offset: " +
+                                  Utils::to_string(static_cast<long>(st.st_size)) +
+                                  "\r\n";
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  if (conn.data.content_length > 0 && conn.data.body_fd == -1) {
+    conn.closeConnection = true; // the body is still on the socket
+  }
+  Responses::htmlErrorResponse(conn, status);
+}
+
+/**
+ * @brief Append requests carry Upload-Offset or Content-Range, creation
+ * requests Upload-Length
+ */
+bool handles(const HTTPConnxData &conn) {
+  const string &method = conn.data.method;
+  const std::map<string, string> &headers = conn.data.headers;
+  if (method == "POST") {
+    return headers.count("Upload-Length") != 0;
+  }
+  return (method == "PATCH" || method == "PUT") &&
+         (headers.count("Upload-Offset") != 0 ||
+          headers.count("Content-Range") != 0);
+}
+
+/**
+ * @brief Start a fresh session, dropping an old one for the same file
+ * @return the data file, locked, or -1 if the request was answered
+ */
+static int create(HTTPConnxData &conn, const string &part, size_t &length) {
+  string value;
+  if (!header(conn, "Upload-Length", value) || !parseNumber(value, length)) {
+    refuse(conn, 400);
+    return -1;
+  }
+  int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    perror("Resumable: open");
+    refuse(conn, 500);
+    return -1;
+  }
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    refuse(conn, 409, fd); // an append is still running
+    return -1;
+  }
+  if (ftruncate(fd, 0) != 0 || !writeLength(part, length)) {
+    perror("Resumable: create");
+    unlink(part.c_str());
+    refuse(conn, 500, fd);
+    return -1;
+  }
+#ifdef __linux__
+  // reserve the whole file now, so a full disk shows up before the first
+  // byte instead of at 95%
+  if (length > 0 && fallocate(fd, FALLOC_FL_KEEP_SIZE, 0,
+                              static_cast<off_t>(length)) != 0 &&
+      (errno == ENOSPC || errno == EFBIG)) {
+    int status = errno == ENOSPC ? 507 : 413;
+    unlink(part.c_str());
+    unlink(lengthPath(part).c_str());
+    refuse(conn, status, fd);
+    return -1;
+  }
+#endif
+  debuglog(GREEN, "Resumable: new session %s for %zu bytes", part.c_str(),
+           length);
+  return fd;
+}
+
+/**
+ * @brief Open an existing session for an append at the offset the request
+ * names
+ * @return the data file, locked, or -1 if the request was answered
+ */
+static int resume(HTTPConnxData &conn, const string &part, size_t &length,
+                  size_t &offset) {
+  if (!readLength(part, length)) {
+    refuse(conn, 404);
+    return -1;
+  }
+  string value, range;
+  if (header(conn, "Upload-Offset", value)) {
+    if (!parseNumber(value, offset)) {
+      refuse(conn, 400);
+      return -1;
+    }
+  } else if (header(conn, "Content-Range", range)) {
+    size_t last = 0;
+    string total;
+    if (!parseContentRange(range, offset, last, total) ||
+        last - offset + 1 != conn.data.content_length ||
+        (total != "*" && total != Utils::to_string(length))) {
+      refuse(conn, 400);
+      return -1;
+    }
+  }
+  int fd = open(part.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    refuse(conn, 404);
+    return -1;
+  }
+  struct stat st;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &st) != 0 ||
+      static_cast<size_t>(st.st_size) != offset) {
+    debuglog(YELLOW, "Resumable: append at %zu refused for %s", offset,
+             part.c_str());
+    refuse(conn, 409, fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Create a session or append to one, the body then arrives in
+ * CONN_UPLOAD like any upload and finish() answers
+ */
+void start(HTTPConnxData &conn) {
+  HTTPConnxData::URLMatcherData &match = conn.urlMatcherData;
+  string part = partPath(match.full_path);
+  if (part.empty()) {
+    refuse(conn, 400);
+    return;
+  }
+  size_t length = 0, offset = 0;
+  int fd = conn.data.method == "POST" ? create(conn, part, length)
+                                      : resume(conn, part, length, offset);
+  if (fd < 0) {
+    return;
+  }
+  if (offset + conn.data.content_length > length) {
+    refuse(conn, 413, fd);
+    return;
+  }
+  lseek(fd, static_cast<off_t>(offset), SEEK_SET);
+  conn.file_fd = fd;
+  match.resumable = true;
+  match.upload_offset = offset;
+  match.upload_length = length;
+  conn.data.bytes_sent = 0;
+  if (conn.data.content_length == 0) {
+    finish(conn);
+    return;
+  }
+  size_t buffered = std::min(conn.data.request.size() - conn.data.headers_end,
+                             conn.data.content_length);
+  conn.data.response = conn.data.request.substr(conn.data.headers_end, buffered);
+  conn.state = CONN_UPLOAD;
+}
+
+/**
+ * @brief All of this request's bytes are in: 204 with the new offset (201
+ * for the request that created the session), or publish the file and 201
+ * once it is complete
+ */
+void finish(HTTPConnxData &conn) {
+  string path = conn.urlMatcherData.full_path;
+  string part = partPath(path);
+  size_t offset = conn.urlMatcherData.upload_offset + conn.data.bytes_sent;
+  string created = conn.data.method == "POST" ? conn.data.target : "";
+  int status = created.empty() ? 204 : 201;
+  if (offset >= conn.urlMatcherData.upload_length) {
+    BodySpool::Upload upload;
+    upload.fd = conn.file_fd;
+    upload.temp = part;
+    upload.path = path;
+    upload.done = lengthPath(part);
+    upload.keep = true; // the client may retry the last request
+    status = BodySpool::complete(conn, upload) ? 201 : 500;
+    if (status == 201) {
+      debuglog(GREEN, "Resumable: %s complete", path.c_str());
+    }
+  }
+  close(conn.file_fd); // also releases the lock
+  conn.file_fd = -1;
+  conn.reset();
+  if (status == 500) {
+    Responses::htmlErrorResponse(conn, 500);
+    return;
+  }
+  if (!created.empty()) {
+    conn.data.response_headers += "Location: " + created + "\r\n";
+  }
+  conn.data.response_headers +=
+      "Upload-Offset: " + Utils::to_string(offset) + "\r\n";
+  Responses::createResponse(
+      conn, "text/plain", status == 201 ? "File uploaded successfully." : "",
+      status);
+}
+
+/**
+ * @brief HEAD on a file with an open session: where to continue
+ * @return false if there is no session, the request is not answered then
+ */
+bool query(HTTPConnxData &conn) {
+  string part = partPath(conn.urlMatcherData.full_path);
+  size_t length = 0;
+  struct stat st;
+  if (!conn.urlMatcherData.file_upload || part.empty() ||
+      !readLength(part, length) || stat(part.c_str(), &st) != 0) {
+    return false;
+  }
+  conn.data.response_headers +=
+      "Upload-Offset: " + Utils::to_string(static_cast<long>(st.st_size)) +
+      "\r\nUpload-Length: " + Utils::to_string(length) +
+      "\r\nCache-Control: no-store\r\n";
+  Responses::createResponse(conn, "text/plain", "", 200);
+  return true;
+}
+
+/**
+ * @brief DELETE on a file with an open session drops the session, the
+ * file itself stays
+ * @return false if there is no session, the request is not answered then
+ */
+bool cancel(HTTPConnxData &conn) {
+  string part = partPath(conn.urlMatcherData.full_path);
+  if (part.empty() || unlink(lengthPath(part).c_str()) != 0) {
+    return false;
+  }
+  unlink(part.c_str());
+  debuglog(YELLOW, "Resumable: session %s dropped", part.c_str());
+  Responses::createResponse(conn, "text/plain", "", 204);
+  return true;
+}
+
+} // namespace Resumable
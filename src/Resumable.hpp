@@ -0,0 +1,34 @@
+#pragma once
+
+#include "HTTPConnxData.hpp"
+
+/**
+ * @brief Resumable uploads to file_upload locations
+ *
+ * The upload is addressed by its destination URL:
+ *
+ *   POST  /upload/big.iso   Upload-Length: <total>        -> 201, offset 0
+ *   PATCH /upload/big.iso   Upload-Offset: <n>   + bytes  -> 204, new offset
+ *   PUT   /upload/big.iso   Content-Range: bytes n-m/<total> (same thing)
+ *   HEAD  /upload/big.iso                                 -> Upload-Offset
+ *   DELETE /upload/big.iso                                -> session dropped
+ *
+ * The bytes so far live in a hidden ".<name>.resume" file next to the
+ * destination, the total length in ".<name>.resume-length", so a session
+ * survives a dropped connection and a server restart alike; the offset is
+ * simply the size of the file. An append must start exactly at that
+ * offset (409 with the current one otherwise). The append that reaches the
+ * total publishes the file under its real name, like any upload, and gets
+ * 201 instead of 204. The session files themselves are answered 404 and
+ * left out of listings (hidden).
+ */
+namespace Resumable {
+
+bool hidden(const string &path);
+bool handles(const HTTPConnxData &conn);
+void start(HTTPConnxData &conn);
+bool query(HTTPConnxData &conn);
+bool cancel(HTTPConnxData &conn);
+void finish(HTTPConnxData &conn);
+
+} // namespace Resumable
@@ -8,6 +8,44 @@
 
 /* ---- All data structs here are used to contain the parsed config */
 
+/**
+ * @brief On-the-fly gzip settings of a location or of the cgi block
+ *
+ * Only generated bodies (directory listings, generated error pages, CGI
+ * output) are compressed this way. Files on disk use gzip_static instead.
+ */
+struct GzipSettings {
+  bool enabled;
+  int level;                      // zlib level 1-9
+  size_t min_length;              // smaller known bodies are sent as is
+  std::vector<std::string> types; // MIME types to compress
+
+  GzipSettings() : enabled(false), level(6), min_length(256), types() {
+    types.push_back("text/html");
+  }
+};
+
+/**
+ * @brief Pre-forked worker pool of the cgi block (cgi_pool directives)
+ *
+ * Off while max_workers is 0, scripts are then forked per request. The
+ * worker program stays running and gets requests over a socketpair, see
+ * CGIPool for the protocol.
+ */
+struct CGIPoolSettings {
+  std::string worker;                  // program started for each worker
+  std::vector<std::string> extensions; // scripts it runs, empty for all
+  size_t min_workers;                  // kept running even when idle
+  size_t max_workers;
+  size_t queue_size;   // requests waiting for a worker before 503
+  size_t max_requests; // a worker is replaced after this many
+  size_t max_memory;   // or once its RSS grows past this, 0 for never
+
+  CGIPoolSettings()
+      : worker(), extensions(), min_workers(0), max_workers(0),
+        queue_size(16), max_requests(1000), max_memory(0) {}
+};
+
 /**
  * @brief CGIData struct for the cgi location in the server block
  *
@@ -18,12 +56,21 @@ struct CGIData {
   std::string upload_dir;
   std::vector<std::string> cgi_extensions;
   std::vector<std::string> acceptedMethods;
+  GzipSettings gzip;
+  CGIPoolSettings pool;
+  size_t max_concurrent; // forked scripts running at once, 0 for no limit
+  size_t queue_size;     // requests waiting for a free slot before 503
+  size_t cache_size;     // cgi_cache store in bytes, 0 when off
+  std::vector<std::string> cache_key_headers; // request headers in the key
 
-  CGIData() : cgi_path_alias(), upload_dir() {
+  CGIData()
+      : cgi_path_alias(), upload_dir(), gzip(), pool(), max_concurrent(0),
+        queue_size(16), cache_size(0), cache_key_headers() {
     acceptedMethods.push_back("GET");
     acceptedMethods.push_back("POST");
     acceptedMethods.push_back("DELETE");
     acceptedMethods.push_back("PUT");
+    acceptedMethods.push_back("PATCH");
   }
 };
 
@@ -39,20 +86,62 @@ struct Location {
   bool autoindex;
   bool file_upload;
   bool internal;
+  bool gzip_static; // serve file.gz / file.br next to the original if present
+  bool upload_dedup; // store uploads once per content, see UploadStore
+  GzipSettings gzip;
+  std::string fastcgi_pass; // unix socket of a FastCGI app, empty if none
+  std::string handler;      // in-process handler plugin (.so), see Handlers
   std::string root;
   std::vector<std::string> acceptedMethods;
   std::pair<int, std::string> return_directive;
   std::map<int, std::string> error_pages;
+  // return directive serialized once at config load (see Responses)
+  std::string return_response;
+  size_t return_splice_pos;
 
   Location()
       : upload_dir(""),            // 5
         autoindex(false),          // 4 same priority because different
         file_upload(false),        // 4 same priority because different
-        internal(false), root(""), // 5 check for new root yes no
+        internal(false), gzip_static(false), upload_dedup(false), gzip(),
+        fastcgi_pass(""),
+        handler(""),
+        root(""),           // 5 check for new root yes no
         acceptedMethods(),  // 2 if post then could be upload - if not could be
                             // autoindex
         return_directive(), // 1st - return immediately
-        error_pages() {}
+        error_pages(), return_response(), return_splice_pos(0) {}
+};
+
+/**
+ * @brief When a finished upload is flushed to disk, see upload_fsync
+ */
+enum UploadFsync {
+  UPLOAD_FSYNC_OFF,         // left to the kernel's writeback
+  UPLOAD_FSYNC_ON_COMPLETE, // file and directory before the 201
+  UPLOAD_FSYNC_BATCHED      // one syncfs() per interval for all uploads
+};
+
+/**
+ * @brief Where file reads, upload writes, directory scans and unlinks run,
+ * see disk_io and DiskIO
+ */
+enum DiskIOMode {
+  DISK_IO_OFF,     // inline in the poll loop
+  DISK_IO_THREADS, // all of them on the disk I/O worker threads
+  DISK_IO_UNCACHED // the same, but file data already in the page cache is
+                   // still sent inline with sendfile()
+};
+
+/**
+ * @brief Access-pattern hints for the files that are sent, see
+ * file_cache_hints and PageCache
+ */
+enum FileCacheHints {
+  FILE_HINTS_OFF,
+  FILE_HINTS_STATS,   // only count page cache misses
+  FILE_HINTS_FADVISE, // posix_fadvise() readahead and drop-behind
+  FILE_HINTS_MMAP     // the same with madvise(), sent from a mapping
 };
 
 /**
@@ -64,6 +153,13 @@ struct Location {
  */
 struct BaseConf {
   size_t maxBodySize;
+  size_t client_body_buffer_size; // larger request bodies go to a temp file
+  std::string client_body_temp_path;
+  UploadFsync upload_fsync;
+  DiskIOMode disk_io;
+  bool static_manifest; // roots indexed at startup, see Manifest
+  FileCacheHints file_cache_hints;
+  size_t file_drop_behind; // files this large leave no pages behind, 0: none
   std::map<std::string, std::string> defaultheaders;
   bool autoindex;
   bool file_server;
@@ -72,7 +168,10 @@ struct BaseConf {
   std::string upload_dir;
 
   BaseConf()
-      : maxBodySize(10000000), autoindex(false), 
+      : maxBodySize(10000000), client_body_buffer_size(16384),
+        client_body_temp_path("/tmp"), upload_fsync(UPLOAD_FSYNC_OFF),
+        disk_io(DISK_IO_OFF), static_manifest(false),
+        file_cache_hints(FILE_HINTS_OFF), file_drop_behind(0), autoindex(false),
       file_server(true),
        upload_dir("./html/www1/upload") {
     defaultheaders["Content-Type"] = "text/html";
@@ -82,6 +181,7 @@ struct BaseConf {
     acceptedMethods.push_back("POST");
     acceptedMethods.push_back("DELETE");
     acceptedMethods.push_back("PUT");
+    acceptedMethods.push_back("PATCH");
   }
 };
 
@@ -0,0 +1,199 @@
+#include "Sha256.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+/**
+ * @brief The FIPS 180-4 compression function over count 64 byte blocks
+ */
+static void compressPortable(uint32_t state[8], const unsigned char *p,
+                             size_t count) {
+  for (; count > 0; --count, p += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = static_cast<uint32_t>(p[4 * i]) << 24 |
+             static_cast<uint32_t>(p[4 * i + 1]) << 16 |
+             static_cast<uint32_t>(p[4 * i + 2]) << 8 |
+             static_cast<uint32_t>(p[4 * i + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) +
+                    ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+
+#ifdef SHA256_X86
+/**
+ * @brief The same with the SHA extensions: the state is kept as ABEF/CDGH
+ * halves, each sha256rnds2 does two rounds and sha256msg1/2 extend the
+ * message schedule four words at a time
+ */
+__attribute__((target("sha,sse4.1,ssse3"))) static void
+compressSha(uint32_t state[8], const unsigned char *p, size_t count) {
+  const __m128i MASK =
+      _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+  __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0]));
+  __m128i state1 =
+      _mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4]));
+  tmp = _mm_shuffle_epi32(tmp, 0xB1);                // CDAB
+  state1 = _mm_shuffle_epi32(state1, 0x1B);          // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8);  // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);       // CDGH
+
+  for (; count > 0; --count, p += 64) {
+    __m128i abef = state0, cdgh = state1;
+    __m128i w[4];
+    for (int i = 0; i < 4; ++i) {
+      w[i] = _mm_shuffle_epi8(
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i)),
+          MASK);
+    }
+    for (int g = 0; g < 16; ++g) {
+      __m128i cur = w[g & 3];
+      __m128i msg = _mm_add_epi32(
+          cur, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&K[4 * g])));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+      if (g >= 3 && g <= 14) {
+        __m128i &next = w[(g + 1) & 3];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(cur, w[(g + 3) & 3], 4));
+        next = _mm_sha256msg2_epu32(next, cur);
+      }
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+      if (g >= 1 && g <= 12) {
+        w[(g + 3) & 3] = _mm_sha256msg1_epu32(w[(g + 3) & 3], cur);
+      }
+    }
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);        // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1);     // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);  // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8);     // ABEF
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+}
+
+static bool cpuHasSha() {
+  unsigned int a, b, c, d;
+  if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & bit_SSE4_1) ||
+      !(c & bit_SSSE3)) {
+    return false;
+  }
+  return __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & (1u << 29));
+}
+#endif
+
+static void compress(uint32_t state[8], const unsigned char *p,
+                     size_t count) {
+#ifdef SHA256_X86
+  static const bool sha_ni = cpuHasSha();
+  if (sha_ni) {
+    compressSha(state, p, count);
+    return;
+  }
+#endif
+  compressPortable(state, p, count);
+}
+
+Sha256::Sha256() { reset(); }
+
+void Sha256::reset() {
+  static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+  std::memcpy(state, init, sizeof(state));
+  length = 0;
+  used = 0;
+}
+
+void Sha256::update(const void *data, size_t len) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  length += len;
+  if (used > 0) {
+    size_t take = std::min(len, sizeof(block) - used);
+    std::memcpy(block + used, p, take);
+    used += take;
+    p += take;
+    len -= take;
+    if (used < sizeof(block)) {
+      return;
+    }
+    compress(state, block, 1);
+    used = 0;
+  }
+  compress(state, p, len / 64); // whole blocks straight from the caller
+  p += len - len % 64;
+  used = len % 64;
+  std::memcpy(block, p, used);
+}
+
+std::string Sha256::hexDigest() {
+  uint64_t bits = length * 8;
+  unsigned char pad[72] = {0x80};
+  size_t padlen = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i < 8; ++i) {
+    pad[padlen + static_cast<size_t>(i)] =
+        static_cast<unsigned char>(bits >> (56 - 8 * i));
+  }
+  update(pad, padlen + 8);
+
+  static const char hex[] = "0123456789abcdef";
+  std::string out;
+  for (int i = 0; i < 8; ++i) {
+    for (int shift = 28; shift >= 0; shift -= 4) {
+      out += hex[(state[i] >> shift) & 0xf];
+    }
+  }
+  return out;
+}
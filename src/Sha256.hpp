@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * @brief Incremental SHA-256, fed piece by piece as a body streams by
+ *
+ * On x86 CPUs with the SHA extensions the blocks go through the
+ * sha256rnds2/sha256msg instructions (checked once at runtime), four rounds
+ * per instruction pair; elsewhere a plain C++ implementation is used.
+ */
+struct Sha256 {
+  static const size_t DIGEST_SIZE = 32;
+
+  Sha256();
+  void reset();
+  void update(const void *data, size_t len);
+  std::string hexDigest(); // finishes the hash, reset() before reuse
+
+private:
+  uint32_t state[8];
+  uint64_t length; // bytes fed so far
+  unsigned char block[64];
+  size_t used; // bytes waiting in block
+};
@@ -1,6 +1,12 @@
 #include "SocketUtils.hpp"
+#include "BodySpool.hpp"
 #include "Config.hpp"
 #include "Constants.hpp"
+#include "CGIPool.hpp"
+#include "FastCGI.hpp"
+#include "DiskIO.hpp"
+#include "Handlers.hpp"
+#include "Manifest.hpp"
 #include "HTTPServer.hpp"
 #include "ServerData.hpp"
 #include "debug.h"
@@ -15,6 +21,9 @@
 #include <stdlib.h>
 #include <string>
 #include <sys/socket.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -23,6 +32,9 @@ using std::signal;
 
 namespace SocketUtils {
 
+// SIGCHLD as a readable fd, -1 where exits are reaped by handleChild
+static int child_event_fd = -1;
+
 // Add a file descriptor to the poll array
 void add_to_poll(int fd, short events) {
   struct pollfd pfd;
@@ -44,6 +56,17 @@ void remove_from_poll(int fd) {
   }
 }
 
+// Change what we wait for on a fd that is already in the poll vector
+void set_poll_events(int fd, short events) {
+  for (HTTPServer::PollfdsVector::iterator it = HTTPServer::pollfds.begin();
+       it != HTTPServer::pollfds.end(); ++it) {
+    if (it->fd == fd) {
+      it->events = events;
+      return;
+    }
+  }
+}
+
 /**
  * @brief Initialize the webserver
  *
@@ -77,6 +100,21 @@ void setSignalHandlers() {
   signal(SIGHUP, handleHangup);
   signal(SIGPIPE, handlePipe);
 
+#ifdef __linux__
+  // blocked, SIGCHLD queues up on a signalfd that poll watches like any
+  // socket, so a child exit reaches its connection in the same loop pass
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) == 0) {
+    child_event_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (child_event_fd != -1) {
+      return;
+    }
+    perror("signalfd");
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+  }
+#endif
   struct sigaction sa;
   sa.sa_handler = handleChild;
   sigemptyset(&sa.sa_mask);
@@ -110,26 +148,50 @@ void handleSignal(int signal) {
 /**
  * @brief Handle child process termination
  *
+ * Only installed where there is no signalfd; otherwise HTTPServer reaps
+ * from the poll loop and hands the exit status to the connection.
  * This function is called when a child process terminates
  * waitpid might change errno so I save it and restore it
  * the WNOHANG option is used to return immediately if no
  * child has exited
+ * Only async-signal-safe calls in here: logging or inserting into a set
+ * allocates, and if the signal lands while the main loop is inside malloc
+ * (zlib does that a lot) the server deadlocks on the allocator lock
  */
 void handleChild(int signal) {
-  debuglog(YELLOW, "Received SIGCHLD signal %d, reaping child ...", signal);
+  (void)signal;
   int savedErrno;
-  pid_t pid;
 
   savedErrno = errno;
-  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
-    HTTPServer::terminatedPids.insert(pid);
-    debuglog(YELLOW, "Child process %d terminated", pid);
-    debug("Child process %d terminated", pid);
+  while (waitpid(-1, NULL, WNOHANG) > 0) {
     continue;
   }
   errno = savedErrno;
 }
 
+/**
+ * @brief The fd that becomes readable when a child exited
+ *
+ * @return the signalfd, -1 when SIGCHLD goes to handleChild instead
+ */
+int childEventFd() { return child_event_fd; }
+
+/**
+ * @brief Drain the pending SIGCHLD notifications
+ *
+ * Several exits can collapse into one notification, so the caller reaps
+ * with waitpid(WNOHANG) until nothing is left either way.
+ */
+void drainChildEvents() {
+#ifdef __linux__
+  struct signalfd_siginfo info;
+  while (::read(child_event_fd, &info, sizeof(info)) ==
+         static_cast<ssize_t>(sizeof(info))) {
+    continue;
+  }
+#endif
+}
+
 /**
  * @brief Handle SIGHUP signal
  *
@@ -168,6 +230,12 @@ void handleAlarm(int signal) {
  * sockets.
  */
 void shutdownServer() {
+  FastCGI::closeAll();
+  CGIPool::closeAll();
+  Handlers::stopPolling();
+  DiskIO::stopPolling();
+  BodySpool::stopPolling();
+  Manifest::stopPolling();
   // Close all server sockets first
   for (std::vector<int>::const_iterator it = HTTPServer::serverSockets.begin();
        it != HTTPServer::serverSockets.end(); ++it) {
@@ -200,7 +268,7 @@ void shutdownServer() {
   pollfds_copy.clear();
   HTTPServer::serverSockets.clear();
   HTTPServer::connections.clear();
-  HTTPServer::terminatedPids.clear();
+  child_event_fd = -1; // closed with the pollfds above
   debuglog(YELLOW, "Server shutdown complete.");
 }
 
@@ -219,7 +287,8 @@ int createBindSocket(uint16_t port) {
   sa.sin_port = htons(port);
 
 #ifdef __linux__
-  int server_socket = ::socket(sa.sin_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int server_socket = ::socket(sa.sin_family,
+                             SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (server_socket == -1) {
     debug("Error - server socket: %s\n", strerror(errno));
     return -1;
@@ -232,6 +301,7 @@ int createBindSocket(uint16_t port) {
     debug("Error - server socket: %s\n", strerror(errno));
     return -1;
   }
+  fcntl(server_socket, F_SETFD, FD_CLOEXEC);
 #endif
 
   // avoiding the address already in use error with SO_REUSEADDR
@@ -437,10 +507,12 @@ bool gotPollhupShouldSkip(pollfd &currentfd) {
         }
       }
       // Still not found in connections? remove it
-      debug("FD %d not found in connections - removing", currentfd.fd);
-      SocketUtils::remove_from_poll(currentfd.fd);
-      close(currentfd.fd);
-      return true;
+      if (conn_it == HTTPServer::connections.end()) {
+        debug("FD %d not found in connections - removing", currentfd.fd);
+        SocketUtils::remove_from_poll(currentfd.fd);
+        close(currentfd.fd);
+        return true;
+      }
     }
 
     HTTPConnxData &conn = conn_it->second;
@@ -459,7 +531,20 @@ bool gotPollhupShouldSkip(pollfd &currentfd) {
     }
 
     // non fatal pollhups
-    if (currentfd.fd == conn.cgiData.cgi_stdout_fd) {
+    if (currentfd.fd == conn.cgiData.cgi_stdin_fd) {
+      // the child stopped reading, whatever is left of the body is dropped
+      debug("POLLHUP on CGI stdin pipe %d", conn.cgiData.cgi_stdin_fd);
+      SocketUtils::remove_from_poll(conn.cgiData.cgi_stdin_fd);
+      close(conn.cgiData.cgi_stdin_fd);
+      conn.cgiData.cgi_stdin_fd = -1; // Mark as closed
+      conn.closeConnection = true;
+      conn.state = CONN_CGI_SENDING;
+    } else if (currentfd.fd == conn.cgiData.cgi_stdout_fd &&
+               conn.state == CONN_CGI_SENDING) {
+      // the child exited but the pipe may still hold output: the sending
+      // loop drains it and finishes the response when read() returns 0
+      debug("POLLHUP on CGI stdout pipe %d - draining", currentfd.fd);
+    } else if (currentfd.fd == conn.cgiData.cgi_stdout_fd) {
       debug("POLLHUP on CGI stdout pipe %d", conn.cgiData.cgi_stdout_fd);
       close(conn.cgiData.cgi_stdout_fd);
       SocketUtils::remove_from_poll(conn.cgiData.cgi_stdout_fd);
@@ -15,6 +15,8 @@ void initialize();
 void setSignalHandlers();
 void handleSignal(int signal);
 void handleChild(int signal);
+int childEventFd();
+void drainChildEvents();
 void handleHangup(int signal);
 void handlePipe(int signal);
 void handleAlarm(int signal);
@@ -25,6 +27,7 @@ bool setSendRecTimeout(int clientfd);
 void checkForIdleConnections();
 void add_to_poll(int fd, short events);
 void remove_from_poll(int fd);
+void set_poll_events(int fd, short events);
 void shutdownServer();
 const char *custom_inet_ntop(int af, const void *src, char *dst,
                              socklen_t size);
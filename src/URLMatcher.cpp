@@ -1,15 +1,28 @@
 #include "URLMatcher.hpp"
+#include "BodySpool.hpp"
 #include "CGI.hpp"
+#include "CGICache.hpp"
+#include "CGIPool.hpp"
+#include "Compression.hpp"
 #include "Config.hpp" // For Config::getConfigByPort()
 #include "Constants.hpp"
+#include "DiskIO.hpp"
+#include "FastCGI.hpp"
+#include "Handlers.hpp"
+#include "Multipart.hpp"
+#include "PageCache.hpp"
+#include "Resumable.hpp"
 #include "HTTPConnxData.hpp"
 #include "HTTPServer.hpp"
 #include "Responses.hpp"
 #include "SocketUtils.hpp"
+#include "UploadStore.hpp"
 #include "Utils.hpp"
 #include "debug.h"
 #include <algorithm>
+#include <cstdlib>
 #include <fcntl.h>
+#include <sstream>
 #include <string>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -20,26 +33,37 @@ using std::string;
 namespace URLMatcher {
 
 /**
- * @brief Validates incoming request, handles file/directory serving.
- *        Prioritizes index file check, then autoindex check, then listing.
- * @param conn The connection data structure.
+ * @brief Work out what answers the request, and refuse it right away if
+ * it cannot succeed: too large a body, a method or an upload the location
+ * does not allow
+ *
+ * Runs before the body is read, so a refused client has not sent it yet.
+ * @return false if the request was answered
  */
-void validateRequest(HTTPConnxData &conn) {
-  if (!receiveAndParseRequest(conn))
-    return;
-  conn.config = Config::getConfigByPort(conn.data.port);
-  if (!handleChunkedData(conn))
-    return;
-  if (handleCookieUpdateRequest(conn))
-    return;
+static bool routeRequest(HTTPConnxData &conn) {
+  if (handleCgiStatusRequest(conn) || handleDiskIOStatusRequest(conn) ||
+      handlePageCacheStatusRequest(conn))
+    return false;
   if (!getConfigSetURLMatcherData(conn))
-    return;
+    return false;
+  if (conn.data.content_length > conn.config->maxBodySize) {
+    Responses::htmlErrorResponse(conn, 413);
+    return false;
+  }
   if (findCGIPathAlias(conn))
-    return;
+    return conn.urlMatcherData.cgi;
 
   updateWithLocationBlockConfig(conn);
   if (conn.urlMatcherData.return_directive)
-    return;
+    return false;
+  if (UploadStore::hidden(conn.urlMatcherData.full_path) ||
+      Resumable::hidden(conn.urlMatcherData.full_path)) {
+    Responses::htmlErrorResponse(conn, 404);
+    return false;
+  }
+  // HEAD only answers for resumable upload sessions
+  if (conn.data.method == "HEAD" && Resumable::query(conn))
+    return false;
 
   // Validate method is allowed
   if (std::find(conn.urlMatcherData.acceptedMethods.begin(),
@@ -49,35 +73,119 @@ void validateRequest(HTTPConnxData &conn) {
     debuglog(RED, "URLMatcher: Method '%s' not allowed",
              conn.data.method.c_str());
     Responses::htmlErrorResponse(conn, 405);
+    return false;
+  }
+
+  // Check if upload allowed
+  const string &method = conn.data.method;
+  if ((method == "POST" || method == "PUT" || method == "PATCH") &&
+      conn.urlMatcherData.fastcgi_pass.empty() &&
+      conn.urlMatcherData.handler.empty() && !conn.urlMatcherData.file_upload) {
+    debuglog(RED, "URLMatcher: File upload not allowed in location '%s'",
+             conn.urlMatcherData.full_path.c_str());
+    Responses::htmlErrorResponse(conn, 403); // Forbidden
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Run what routeRequest() chose
+ */
+static void dispatchRequest(HTTPConnxData &conn) {
+  if (conn.urlMatcherData.cgi) {
+    startCGI(conn);
+    return;
+  }
+
+  if (!conn.urlMatcherData.fastcgi_pass.empty()) {
+    FastCGI::startRequest(conn);
+    return;
+  }
+
+  if (!conn.urlMatcherData.handler.empty()) {
+    Handlers::startRequest(conn);
     return;
   }
 
   // Route to appropriate handler
   if (conn.data.method == "GET") {
     handleGETRequest(conn);
-  } else if (conn.data.method == "POST") {
+  } else if (conn.data.method == "POST" || conn.data.method == "PUT" ||
+             conn.data.method == "PATCH") {
     handlePOSTRequest(conn);
   } else if (conn.data.method == "DELETE") {
     handleDELETERequest(conn);
   }
 }
 
+/**
+ * @brief Deal with the part of the body that is not read yet, once the
+ * request is routed
+ *
+ * If the request is already answered (an error, mostly), that body is still
+ * on the socket and would be parsed as the next request, so the connection
+ * closes after the answer. Otherwise a client that sent
+ * Expect: 100-continue is told to send it now.
+ */
+static void settleUnreadBody(HTTPConnxData &conn) {
+  HTTPConnxData::ConnectionData &data = conn.data;
+  bool unread = data.chunked ||
+                (data.body_fd == -1 &&
+                 data.request.size() - data.headers_end < data.content_length);
+  if (!unread) {
+    return;
+  }
+  if (conn.state == CONN_SIMPLE_RESPONSE ||
+      conn.state == CONN_FILE_REQUEST || conn.state == CONN_DISK_IO) {
+    conn.closeConnection = true;
+  } else if (data.expect_continue && !data.continue_sent) {
+    static const char line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+    data.continue_sent = true;
+    if (send(conn.client_fd, line, sizeof(line) - 1, MSG_NOSIGNAL) < 0) {
+      perror("URLMatcher: send 100 Continue");
+    }
+  }
+}
+
+/**
+ * @brief Validates incoming request, handles file/directory serving.
+ *        Prioritizes index file check, then autoindex check, then listing.
+ *
+ * The request is routed as soon as its headers are in, before any of a
+ * chunked body is decoded; the reads that only bring more chunks skip
+ * that.
+ * @param conn The connection data structure.
+ */
+void validateRequest(HTTPConnxData &conn) {
+  if (!receiveAndParseRequest(conn))
+    return;
+  conn.config = Config::getConfigByPort(conn.data.port);
+  if ((conn.state == CONN_RECV_CHUNKS || routeRequest(conn)) &&
+      handleChunkedData(conn)) {
+    dispatchRequest(conn);
+  }
+  if (conn.client_fd != -1 && conn.data.headers_received) {
+    settleUnreadBody(conn);
+  }
+}
+
 /**
  * @brief Handles GET request for file serving
  * @param conn The connection data structure
  * @return true if the file was opened successfully, false otherwise
  */
 bool handleGETRequest(HTTPConnxData &conn) {
-  struct stat path_stat;
-  if (stat(conn.urlMatcherData.path_for_stat.c_str(), &path_stat) != 0) {
+  MetadataCache::Entry path_meta;
+  if (!MetadataCache::lookup(conn.urlMatcherData.path_for_stat, path_meta)) {
     Responses::htmlErrorResponse(conn, 404);
     return false;
   }
 
-  if (S_ISREG(path_stat.st_mode)) {
+  if (S_ISREG(path_meta.st.st_mode)) {
     return handleRegularFile(conn, conn.urlMatcherData.path_for_stat,
-                             path_stat);
-  } else if (S_ISDIR(path_stat.st_mode)) {
+                             path_meta);
+  } else if (S_ISDIR(path_meta.st.st_mode)) {
     debuglog(YELLOW, "URLMatcher: Target is a directory '%s'",
              conn.urlMatcherData.full_path.c_str());
 
@@ -89,14 +197,14 @@ bool handleGETRequest(HTTPConnxData &conn) {
     }
     index_file_path += conn.config->index;
 
-    struct stat index_stat;
+    MetadataCache::Entry index_meta;
     debuglog(YELLOW, "URLMatcher: Checking for index file at '%s'",
              index_file_path.c_str());
 
     // If index file exists, serve it
-    if (stat(index_file_path.c_str(), &index_stat) == 0 &&
-        S_ISREG(index_stat.st_mode)) {
-      handleIndexFile(conn, index_file_path, index_stat);
+    if (MetadataCache::lookup(index_file_path, index_meta) &&
+        S_ISREG(index_meta.st.st_mode)) {
+      handleIndexFile(conn, index_file_path, index_meta);
     }
     // Otherwise, try directory listing
     else {
@@ -114,38 +222,84 @@ bool handleGETRequest(HTTPConnxData &conn) {
 }
 
 /**
- * @brief Handles POST request for file upload
+ * @brief Reserve the upload's blocks up front from its Content-Length
+ *
+ * A large file written piece by piece while other uploads grow next to it
+ * ends up scattered over the disk; fallocate() hands it one extent where
+ * the filesystem can. KEEP_SIZE leaves the size at what was written, so an
+ * aborted upload does not look complete. A full disk is answered with 507
+ * before the body is read.
+ * @return false if the request was answered
+ */
+static bool preallocateUpload(HTTPConnxData &conn) {
+#ifdef __linux__
+  if (fallocate(conn.file_fd, FALLOC_FL_KEEP_SIZE, 0,
+                static_cast<off_t>(conn.data.content_length)) == 0 ||
+      (errno != ENOSPC && errno != EFBIG)) {
+    return true; // also fine where the filesystem cannot preallocate
+  }
+  int status = errno == ENOSPC ? 507 : 413;
+  perror("URLMatcher: fallocate for upload");
+  BodySpool::discard(conn.file_fd, conn.upload_temp);
+  conn.file_fd = -1;
+  conn.closeConnection = true; // the body is still on the socket
+  Responses::htmlErrorResponse(conn, status);
+  return false;
+#else
+  (void)conn;
+  return true;
+#endif
+}
+
+/**
+ * @brief Handles POST and PUT requests for file upload, and the requests of
+ * resumable uploads (see Resumable)
  * @param conn The connection data structure
  * @return true if the file was opened successfully, false otherwise
  */
 bool handlePOSTRequest(HTTPConnxData &conn) {
-  if (conn.data.content_length == 0)
-    return false;
-
-  if (conn.data.content_length > conn.config->maxBodySize) {
-    Responses::htmlErrorResponse(conn, 413);
+  // size and upload permission were checked by routeRequest()
+  debuglog(MAGENTA, "opening file for upload: %s",
+             conn.urlMatcherData.full_path.c_str());
+  if (Resumable::handles(conn)) {
+    Resumable::start(conn);
+    return true;
+  }
+  if (conn.data.method == "PATCH") {
+    Responses::htmlErrorResponse(conn, 400); // needs an offset to append at
     return false;
   }
-
-  // Check if upload allowed
-  if (!conn.urlMatcherData.file_upload) {
-    debug("file upload not allowed");
-    debuglog(RED, "URLMatcher: File upload not allowed in location '%s'",
-             conn.urlMatcherData.full_path.c_str());
-    Responses::htmlErrorResponse(conn, 403); // Forbidden
-
+  if (conn.data.content_length == 0)
     return false;
+  if (Multipart::handles(conn)) {
+    Multipart::start(conn);
+    return true;
   }
-  debuglog(MAGENTA, "opening file for upload: %s",
-             conn.urlMatcherData.full_path.c_str());
-  conn.file_fd = open(conn.urlMatcherData.full_path.c_str(),
-                      O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  BodySpool::Upload spooled;
+  spooled.fd = conn.data.body_fd;
+  spooled.path = conn.urlMatcherData.full_path;
+  if (conn.data.body_fd != -1 && !conn.urlMatcherData.upload_dedup &&
+      BodySpool::canLink(conn.data.body_fd, spooled.path) &&
+      BodySpool::complete(conn, spooled)) {
+    // the spooled body becomes the file, nothing left to copy
+    conn.data.bytes_sent = conn.data.content_length;
+    conn.uploadComplete();
+    return true;
+  }
+  // written next to the destination, which keeps its old content until
+  // uploadComplete() renames the finished file over it
+  conn.file_fd =
+      BodySpool::openFor(conn.urlMatcherData.full_path, conn.upload_temp);
+  conn.upload_digest.reset();
   if (conn.file_fd < 0) {
     perror("URLMatcher: Failed to open file for upload");
     Responses::htmlErrorResponse(conn, 500); // Internal Server Error
 
     return false;
   }
+  if (!preallocateUpload(conn)) {
+    return false;
+  }
 
   std::string payload = conn.data.request.substr(conn.data.headers_end);
   if (!payload.empty()) {
@@ -169,20 +323,32 @@ bool handleDELETERequest(HTTPConnxData &conn) {
     return false;
   }
 
-  int result = unlink(conn.urlMatcherData.full_path.c_str());
-  if (result == 0) {
-    Responses::createResponse(conn, "text/plain", "File deleted", 200);
+  if (Resumable::cancel(conn)) {
     return true;
   }
+  MetadataCache::invalidate(conn.urlMatcherData.full_path);
+  if (DiskIO::unlinkFile(conn, conn.urlMatcherData.full_path)) {
+    return true;
+  }
+  int result = UploadStore::remove(conn.urlMatcherData.full_path);
+  finishDELETERequest(conn, result == 0 ? 0 : errno);
+  return result == 0;
+}
 
-  if (errno == ENOENT) {
+/**
+ * @brief Answer a DELETE once the unlink is done
+ * @param error errno of the unlink, 0 if it worked
+ */
+void finishDELETERequest(HTTPConnxData &conn, int error) {
+  if (error == 0) {
+    Responses::createResponse(conn, "text/plain", "File deleted", 200);
+  } else if (error == ENOENT) {
     Responses::htmlErrorResponse(conn, 404);
   } else {
     Responses::createResponse(
         conn, "text/plain",
-        "Failed to delete file: " + std::string(strerror(errno)), 500);
+        "Failed to delete file: " + std::string(strerror(error)), 500);
   }
-  return false;
 }
 
 // handles %20 -> space, %2F -> /, $3F -> ?, +  -> space etc...
@@ -255,6 +421,9 @@ bool receiveAndParseRequest(HTTPConnxData &conn) {
   debuglog(YELLOW, "URLMatcher: Received %lu bytes for fd %d", bytes_read,
            conn.client_fd);
 
+  if (conn.state == CONN_RECV_CHUNKS) {
+    return true; // headers are done, handleChunkedData takes the rest
+  }
   // Remove old chunking code and just handle headers
   switch (conn.parseHeaders()) {
   case HEADERS_PARSE_SUCCESS:
@@ -317,6 +486,15 @@ bool getConfigSetURLMatcherData(HTTPConnxData &conn) {
       Utils::ensureTrailinSlash(conn.urlMatcherData.path_for_stat) + target;
   conn.urlMatcherData.autoindex = conn.config->autoindex;
   conn.urlMatcherData.acceptedMethods = conn.config->acceptedMethods;
+  conn.urlMatcherData.gzip_static = false;
+  conn.urlMatcherData.gzip = GzipSettings();
+  conn.urlMatcherData.fastcgi_pass = "";
+  conn.urlMatcherData.upload_dir = conn.config->upload_dir;
+  conn.urlMatcherData.handler = "";
+  conn.urlMatcherData.location = "";
+  conn.urlMatcherData.cgi = false;
+  conn.urlMatcherData.upload_dedup = false;
+  conn.urlMatcherData.content_encoding = "";
 
   debuglog(YELLOW, "URLMatcher: Constructed path for stat: '%s'",
            conn.urlMatcherData.path_for_stat.c_str());
@@ -364,25 +542,273 @@ void determineContentType(HTTPConnxData &conn, const string &path) {
   }
 }
 
+/**
+ * @brief Checks the conditional request headers against the file validators
+ * @param conn The connection data structure
+ * @param meta The cached metadata of the file that would be served
+ * @return true if the client copy is current and a 304 should be sent
+ *
+ * If-None-Match wins over If-Modified-Since when both are present (RFC 9110
+ * 13.2.2). ETags are compared weakly, so a W/ prefix from the client is fine.
+ */
+bool isNotModified(HTTPConnxData &conn, const MetadataCache::Entry &meta) {
+  string if_none_match;
+  if (conn.checkHeader("If-None-Match", if_none_match)) {
+    std::istringstream tags(if_none_match);
+    string tag;
+    while (std::getline(tags, tag, ',')) {
+      tag = Utils::trim(tag);
+      if (tag.compare(0, 2, "W/") == 0) {
+        tag = tag.substr(2);
+      }
+      if (tag == "*" || tag == meta.etag) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  string if_modified_since;
+  time_t since;
+  if (conn.checkHeader("If-Modified-Since", if_modified_since) &&
+      MetadataCache::parseHTTPDate(if_modified_since, since)) {
+    return meta.st.st_mtime <= since;
+  }
+  return false;
+}
+
+/**
+ * @brief Checks whether Accept-Encoding allows a content coding
+ * @param accept_encoding The Accept-Encoding header value
+ * @param coding The coding we would like to send, e.g. "gzip"
+ * @return true if the coding is listed without q=0, or if it is not listed
+ * and * is listed without q=0
+ *
+ * An explicit entry for the coding wins over *, wherever it appears, so
+ * "*;q=0, gzip" accepts gzip and "gzip;q=0, *" refuses it.
+ */
+bool acceptsEncoding(const string &accept_encoding, const string &coding) {
+  std::istringstream items(accept_encoding);
+  string item;
+  int wildcard = -1; // -1 not listed, 0 refused, 1 accepted
+  while (std::getline(items, item, ',')) {
+    string name = Utils::trim(item.substr(0, item.find(';')));
+    if (name != coding && name != "*") {
+      continue;
+    }
+    size_t q = item.find("q=");
+    bool accepted = q == string::npos || strtod(item.c_str() + q + 2, NULL) > 0;
+    if (name == coding) {
+      return accepted;
+    }
+    wildcard = accepted ? 1 : 0;
+  }
+  return wildcard == 1;
+}
+
+/**
+ * @brief Picks a precompressed sidecar of the file if the location allows it
+ * @param conn The connection data structure
+ * @param path The path of the original file
+ * @param meta In: metadata of the original. Out: metadata of the sidecar
+ * @return The path to open, either the sidecar or the original
+ *
+ * Brotli is preferred over gzip. The sidecars go through the metadata cache
+ * like every other file, so a missing .br/.gz is a cached negative entry and
+ * costs no stat() per request.
+ */
+string selectPrecompressed(HTTPConnxData &conn, const string &path,
+                           MetadataCache::Entry &meta) {
+  string accept_encoding;
+  if (!conn.urlMatcherData.gzip_static ||
+      !conn.checkHeader("Accept-Encoding", accept_encoding)) {
+    return path;
+  }
+  static const char *const codings[][2] = {{"br", ".br"}, {"gzip", ".gz"}};
+  for (size_t i = 0; i < sizeof(codings) / sizeof(codings[0]); ++i) {
+    MetadataCache::Entry sidecar;
+    string sidecar_path = path + codings[i][1];
+    if (!acceptsEncoding(accept_encoding, codings[i][0]) ||
+        !MetadataCache::lookup(sidecar_path, sidecar) ||
+        !S_ISREG(sidecar.st.st_mode)) {
+      continue;
+    }
+    debuglog(GREEN, "URLMatcher: Serving precompressed '%s'",
+             sidecar_path.c_str());
+    conn.urlMatcherData.content_encoding = codings[i][0];
+    meta = sidecar;
+    return sidecar_path;
+  }
+  return path;
+}
+
+/**
+ * @brief Parses a Range header value against the size of the file
+ * @param value The Range header, e.g. "bytes=0-99,-500"
+ * @param size The file size
+ * @param ranges The satisfiable ranges, in request order
+ * @return RANGE_NONE if the header is invalid or asks for too many ranges
+ * (the whole file is sent), RANGE_UNSATISFIABLE if no range overlaps the file
+ */
+RangeStatus parseByteRanges(const string &value, off_t size,
+                            std::vector<ByteRange> &ranges) {
+  if (value.compare(0, 6, "bytes=") != 0) {
+    return RANGE_NONE;
+  }
+  std::istringstream specs(value.substr(6));
+  string spec;
+  size_t count = 0;
+  while (std::getline(specs, spec, ',')) {
+    spec = Utils::trim(spec);
+    size_t dash = spec.find('-');
+    if (spec.empty() || dash == string::npos ||
+        spec.find_first_not_of("0123456789-") != string::npos ||
+        spec.find('-', dash + 1) != string::npos) {
+      return RANGE_NONE;
+    }
+    if (++count > Constants::max_byte_ranges) {
+      return RANGE_NONE;
+    }
+    string first_str = spec.substr(0, dash);
+    string last_str = spec.substr(dash + 1);
+    off_t first;
+    off_t last;
+    if (first_str.empty()) {
+      // suffix range: the last N bytes
+      if (last_str.empty()) {
+        return RANGE_NONE;
+      }
+      off_t suffix = static_cast<off_t>(strtoll(last_str.c_str(), NULL, 10));
+      if (suffix == 0) {
+        continue;
+      }
+      first = suffix >= size ? 0 : size - suffix;
+      last = size - 1;
+    } else {
+      first = static_cast<off_t>(strtoll(first_str.c_str(), NULL, 10));
+      last = size - 1;
+      if (!last_str.empty()) {
+        last = static_cast<off_t>(strtoll(last_str.c_str(), NULL, 10));
+        if (last < first) {
+          return RANGE_NONE;
+        }
+      }
+      if (last >= size) {
+        last = size - 1;
+      }
+    }
+    if (first >= size) {
+      continue; // this one is unsatisfiable, others may not be
+    }
+    ranges.push_back(ByteRange(first, last));
+  }
+  return ranges.empty() ? RANGE_UNSATISFIABLE : RANGE_SATISFIABLE;
+}
+
+/**
+ * @brief Decides whether the Range header applies to this file
+ * @param conn The connection data structure
+ * @param meta The cached metadata of the file being served
+ * @param ranges The satisfiable ranges
+ *
+ * With If-Range the ranges are only honored if the client still has the
+ * current version: a strong ETag match or the exact Last-Modified date.
+ */
+RangeStatus evaluateRangeRequest(HTTPConnxData &conn,
+                                 const MetadataCache::Entry &meta,
+                                 std::vector<ByteRange> &ranges) {
+  string range;
+  if (conn.data.method != "GET" || !conn.checkHeader("Range", range)) {
+    return RANGE_NONE;
+  }
+  string if_range;
+  if (conn.checkHeader("If-Range", if_range)) {
+    bool is_etag = !if_range.empty() &&
+                   (if_range[0] == '"' || if_range.compare(0, 2, "W/") == 0);
+    if ((is_etag && if_range != meta.etag) ||
+        (!is_etag && if_range != meta.last_modified)) {
+      debuglog(YELLOW, "URLMatcher: If-Range does not match, sending it all");
+      return RANGE_NONE;
+    }
+  }
+  return parseByteRanges(range, meta.st.st_size, ranges);
+}
+
+/**
+ * @brief Sets up the response for a file that was just opened
+ * @param conn The connection data structure
+ * @return false if a 416 or 500 was prepared instead
+ *
+ * The cached metadata may be up to a TTL old, so the length, ranges and
+ * validators are taken from the open descriptor: they always describe the
+ * bytes that are actually sent.
+ */
+bool prepareFileTransfer(HTTPConnxData &conn) {
+  MetadataCache::Entry meta;
+  if (fstat(conn.file_fd, &meta.st) < 0 || !S_ISREG(meta.st.st_mode)) {
+    debuglog(RED, "URLMatcher: Opened file is gone or no longer a file");
+    close(conn.file_fd);
+    conn.file_fd = -1;
+    Responses::htmlErrorResponse(conn, 500);
+    return false;
+  }
+  meta.exists = true;
+  MetadataCache::buildValidators(meta);
+
+  std::vector<ByteRange> ranges;
+  RangeStatus status = evaluateRangeRequest(conn, meta, ranges);
+  if (status == RANGE_UNSATISFIABLE) {
+    debuglog(RED, "URLMatcher: Range not satisfiable for size %ld",
+             static_cast<long>(meta.st.st_size));
+    close(conn.file_fd);
+    conn.file_fd = -1;
+    conn.data.response_headers +=
+        "Content-Range: bytes */" +
+        Utils::to_string(static_cast<long>(meta.st.st_size)) + "\r\n";
+    Responses::htmlErrorResponse(conn, 416);
+    return false;
+  }
+
+  conn.urlMatcherData.file_size = meta.st.st_size;
+  conn.state = CONN_FILE_REQUEST;
+  Responses::addValidatorHeaders(conn, meta);
+  if (status == RANGE_SATISFIABLE) {
+    Responses::preparePartialFileResponse(conn, ranges);
+  } else {
+    Responses::prepareFileResponse(conn, conn.urlMatcherData.file_size);
+  }
+  PageCache::opened(conn);
+  return true;
+}
+
 /**
  * @brief Handles serving a regular file
  * @param conn The connection data structure
  * @param path_for_stat The path to the file
- * @param path_stat The stat structure with file info
+ * @param original The cached stat data and validators of the file
  * @return true if file was opened and prepared for sending
  */
 bool handleRegularFile(HTTPConnxData &conn, const string &path_for_stat,
-                       const struct stat &path_stat) {
+                       const MetadataCache::Entry &original) {
   debuglog(GREEN, "URLMatcher: Target is a regular file. Serving '%s'",
            path_for_stat.c_str());
 
+  MetadataCache::Entry meta = original;
+  string served_path = selectPrecompressed(conn, path_for_stat, meta);
+
+  if (isNotModified(conn, meta)) {
+    debuglog(GREEN, "URLMatcher: '%s' not modified", path_for_stat.c_str());
+    Responses::notModifiedResponse(conn, meta);
+    return true;
+  }
+
   // Set the content type in the connection
   determineContentType(conn, path_for_stat);
 
   debuglog(YELLOW, "URLMatcher: File '%s' using MIME type '%s'",
            path_for_stat.c_str(), conn.urlMatcherData.content_type.c_str());
 
-  conn.file_fd = open(path_for_stat.c_str(), O_RDONLY);
+  conn.file_fd = open(served_path.c_str(), O_RDONLY | O_CLOEXEC);
   if (conn.file_fd < 0) {
     perror("URLMatcher: Failed to open file");
     Responses::htmlErrorResponse(conn, 403); // Forbidden is a common reason
@@ -390,10 +816,9 @@ bool handleRegularFile(HTTPConnxData &conn, const string &path_for_stat,
     return false;
   }
 
-  conn.urlMatcherData.file_size = path_stat.st_size;
-  conn.state = CONN_FILE_REQUEST;
-
-  Responses::prepareFileResponse(conn, conn.urlMatcherData.file_size);
+  if (!prepareFileTransfer(conn)) {
+    return false;
+  }
 
   debuglog(GREEN,
            "URLMatcher: Set state to CONN_FILE_REQUEST for fd %d, size %ld",
@@ -406,15 +831,24 @@ bool handleRegularFile(HTTPConnxData &conn, const string &path_for_stat,
  * @brief Handles serving an index file from a directory
  * @param conn The connection data structure
  * @param index_file_path The path to the index file
- * @param index_stat The stat structure with file info
+ * @param original The cached stat data and validators of the index file
  * @return true if index file was opened and prepared for sending
  */
 bool handleIndexFile(HTTPConnxData &conn, const string &index_file_path,
-                     const struct stat &index_stat) {
+                     const MetadataCache::Entry &original) {
   debuglog(GREEN, "URLMatcher: Index file found. Serving '%s'",
            index_file_path.c_str());
 
-  conn.file_fd = open(index_file_path.c_str(), O_RDONLY);
+  MetadataCache::Entry meta = original;
+  string served_path = selectPrecompressed(conn, index_file_path, meta);
+
+  if (isNotModified(conn, meta)) {
+    debuglog(GREEN, "URLMatcher: '%s' not modified", index_file_path.c_str());
+    Responses::notModifiedResponse(conn, meta);
+    return true;
+  }
+
+  conn.file_fd = open(served_path.c_str(), O_RDONLY | O_CLOEXEC);
   if (conn.file_fd < 0) {
     perror("URLMatcher: Failed to open existing index file");
     Responses::htmlErrorResponse(conn, 500); // Internal Server Error
@@ -425,11 +859,9 @@ bool handleIndexFile(HTTPConnxData &conn, const string &index_file_path,
   // Set the content type in the connection
   determineContentType(conn, index_file_path);
 
-  conn.urlMatcherData.file_size = index_stat.st_size;
-  conn.state = CONN_FILE_REQUEST;
-
-  // Use the overloaded version that doesn't need the content type parameter
-  Responses::prepareFileResponse(conn, conn.urlMatcherData.file_size);
+  if (!prepareFileTransfer(conn)) {
+    return false;
+  }
 
   debuglog(
       GREEN,
@@ -509,7 +941,8 @@ bool isAllowedCGIExtension(const HTTPConnxData &conn, const string &path) {
 /**
  * @brief Checks if the target path matches the CGI path alias
  * @param conn The connection data structure
- * @return true if CGI path alias is found, false otherwise
+ * @return true if CGI path alias is found, false otherwise; urlMatcherData.cgi
+ * tells if the script may run or the request was refused
  */
 bool findCGIPathAlias(HTTPConnxData &conn) {
   // Get CGI path mappings from config
@@ -557,18 +990,28 @@ bool findCGIPathAlias(HTTPConnxData &conn) {
         return true;
     }
 
-    // All checks passed, execute script
-    conn.state = CONN_CGI_INCOMING;
-    if (CGI::prepareCGI(conn) < 0) {
-        conn.reset();
-        Responses::createResponse(conn, "text/plain", "Failed to execute CGI script", 500);
-        return true;
-    }
+    // All checks passed, startCGI() runs the script once the body is in
+    conn.urlMatcherData.gzip = conn.config->cgiData.gzip;
+    conn.urlMatcherData.cgi = true;
     return true;
   }
   return false;
 }
 
+/**
+ * @brief Run the script findCGIPathAlias() found, on the pool, from the
+ * cache or forked
+ */
+void startCGI(HTTPConnxData &conn) {
+  if (CGIPool::handles(conn)) {
+    CGIPool::startRequest(conn);
+    return;
+  }
+  if (!CGICache::serve(conn)) {
+    CGI::startRequest(conn);
+  }
+}
+
 /**
  * @brief Updates the connection paths based on the location block
  * @param conn The connection data structure
@@ -596,18 +1039,22 @@ void updatePathsFromLocation(HTTPConnxData &conn, const Location &location,
 bool applyLocationBlockSettings(HTTPConnxData &conn, const Location &location) {
   conn.urlMatcherData.autoindex = location.autoindex;
   conn.urlMatcherData.acceptedMethods = location.acceptedMethods;
+  conn.urlMatcherData.gzip_static = location.gzip_static;
+  conn.urlMatcherData.gzip = location.gzip;
+  conn.urlMatcherData.fastcgi_pass = location.fastcgi_pass;
+  conn.urlMatcherData.upload_dir = location.upload_dir;
+  conn.urlMatcherData.handler = location.handler;
 
   if (location.return_directive.first != 0) {
     conn.urlMatcherData.return_directive = true;
-    Responses::createResponse(conn, "text/plain",
-                              location.return_directive.second,
-                              location.return_directive.first);
+    Responses::precompiledReturnResponse(conn, location);
     return true;
   }
 
   if (location.file_upload) {
     conn.urlMatcherData.file_upload = true;
   }
+  conn.urlMatcherData.upload_dedup = location.upload_dedup;
   return false;
 }
 
@@ -628,7 +1075,8 @@ void updateWithLocationBlockConfig(HTTPConnxData &conn) {
     if (conn.data.target.find(location_pair->first) != 0)
       continue;
 
-    Location location = location_pair->second;
+    const Location &location = location_pair->second;
+    conn.urlMatcherData.location = location_pair->first;
     updatePathsFromLocation(conn, location, location_pair->first);
 
     if (applyLocationBlockSettings(conn, location))
@@ -645,55 +1093,45 @@ void updateWithLocationBlockConfig(HTTPConnxData &conn) {
 }
 
 /**
- * @brief Handles cookie update requests
+ * @brief Serve the CGI gauges at /api/cgi-status
  * @param conn The connection data structure
  * @return true if the request was handled, false otherwise
  */
-bool handleCookieUpdateRequest(HTTPConnxData &conn) {
-  if (conn.data.target.find("/api/update-cookie/") == 0) {
-    debuglog(YELLOW, "Original target: '%s'", conn.data.target.c_str());
-
-    // Skip past "/api/update-cookie/"
-    size_t prefixLength = strlen("/api/update-cookie/");
-    string fullPath = conn.data.target.substr(prefixLength);
-    debuglog(YELLOW, "After prefix removal: '%s'", fullPath.c_str());
-
-    // Find the first forward slash after prefix
-    size_t separator = fullPath.find("/");
-    if (separator == string::npos) {
-      debuglog(RED, "Invalid cookie update request format");
-      Responses::simpleStatusResponse(conn, 400);
-      return true;
-    }
-
-    // Extract the name and value parts
-    string cookieName = fullPath.substr(0, separator);   // Get "buttonClicked"
-    string cookieValue = fullPath.substr(separator + 1); // Get "true"
-
-    debuglog(YELLOW, "Cookie components:");
-    debuglog(YELLOW, "  Name: '%s'", cookieName.c_str());
-    debuglog(YELLOW, "  Value: '%s'", cookieValue.c_str());
-
-    // Create session if needed
-    if (!conn.data.has_session) {
-      debuglog(MAGENTA, "Creating new session for cookie update request");
-      conn.createSession();
-    }
-
-    // Format cookie header with correct name=value format
-    string cookieHeader =
-        "Set-Cookie: " + cookieName + "=" + cookieValue + "; Path=/\r\n";
-    debuglog(YELLOW, "Generated cookie header: '%s'", cookieHeader.c_str());
+bool handleCgiStatusRequest(HTTPConnxData &conn) {
+  if (conn.data.target != "/api/cgi-status") {
+    return false;
+  }
+  Responses::createResponse(conn, "application/json", CGI::statusJson(), 200);
+  return true;
+}
 
-    conn.data.response_headers = cookieHeader;
+/**
+ * @brief Serve the disk I/O pool's latencies at /api/disk-io-status
+ * @param conn The connection data structure
+ * @return true if the request was handled, false otherwise
+ */
+bool handleDiskIOStatusRequest(HTTPConnxData &conn) {
+  if (conn.data.target != "/api/disk-io-status") {
+    return false;
+  }
+  Responses::createResponse(conn, "application/json", DiskIO::statusJson(),
+                            200);
+  return true;
+}
 
-    // Create success response
-    Responses::createResponse(conn, "application/json",
-                              "{\"status\":\"success\"}", 200);
-    debuglog(GREEN, "Cookie update request completed successfully");
-    return true;
+/**
+ * @brief Serve the page cache misses per request class at
+ * /api/page-cache-status
+ * @param conn The connection data structure
+ * @return true if the request was handled, false otherwise
+ */
+bool handlePageCacheStatusRequest(HTTPConnxData &conn) {
+  if (conn.data.target != "/api/page-cache-status") {
+    return false;
   }
-  return false;
+  Responses::createResponse(conn, "application/json",
+                            PageCache::statusJson(), 200);
+  return true;
 }
 
 /**
@@ -706,31 +1144,25 @@ bool handleChunkedData(HTTPConnxData &conn) {
     return true; // Not chunked, continue processing
   }
 
-  debuglog(YELLOW, "Processing chunked data...");
-
-  // Check for end marker
-  if (conn.data.request.find("0\r\n\r\n") == string::npos) {
+  switch (conn.decodeChunks()) {
+  case HEADERS_PARSE_INCOMPLETE:
     debuglog(YELLOW, "Still reading chunked data");
     conn.state = CONN_RECV_CHUNKS;
     return false;
+  case HEADERS_PARSE_ERROR:
+    Responses::htmlErrorResponse(conn, conn.errorStatus);
+    conn.errorStatus = 0;
+    conn.closeConnection = true;
+    return false;
+  case HEADERS_PARSE_SUCCESS:
+    break;
   }
 
-  // Get data after headers
-  string chunked_string = conn.data.request.substr(conn.data.headers_end);
-  string dechunked = conn.dechunkData(chunked_string);
-
-  // Replace the request payload with dechunked data
-  conn.data.request =
-      conn.data.request.substr(0, conn.data.headers_end) + dechunked;
-
-  // Update headers and state
+  // From here on the body looks like a plain Content-Length one
   conn.data.chunked = false;
-  conn.data.headers["Content-Length"] = Utils::to_string(dechunked.length());
-  conn.data.content_length = dechunked.length();
+  conn.data.headers["Content-Length"] = Utils::to_string(conn.data.body_size);
+  conn.data.content_length = conn.data.body_size;
   conn.data.headers.erase("Transfer-Encoding");
-
-  debuglog(GREEN, "Successfully dechunked data (size: %zu)",
-           dechunked.length());
   return true;
 }
 
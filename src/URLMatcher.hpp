@@ -2,28 +2,50 @@
 #define URL_MATCHER_HPP
 
 #include "Config.hpp" // For Location type
+#include "MetadataCache.hpp"
 #include <string>
 #include <sys/stat.h>
 
-// Forward declarations
-struct HTTPConnxData;
+#include "HTTPConnxData.hpp"
+
 namespace URLMatcher {
+
+/**
+ * @brief Outcome of looking at the Range header of a GET
+ */
+enum RangeStatus { RANGE_NONE, RANGE_SATISFIABLE, RANGE_UNSATISFIABLE };
+
 void validateRequest(HTTPConnxData &conn);
 bool receiveAndParseRequest(HTTPConnxData &conn);
 bool getConfigSetURLMatcherData(HTTPConnxData &conn);
 void determineContentType(HTTPConnxData &conn, const std::string &path);
 bool handleRegularFile(HTTPConnxData &conn, const std::string &path_for_stat,
-                       const struct stat &path_stat);
+                       const MetadataCache::Entry &meta);
 bool handleIndexFile(HTTPConnxData &conn, const std::string &index_file_path,
-                     const struct stat &index_stat);
+                     const MetadataCache::Entry &meta);
+bool isNotModified(HTTPConnxData &conn, const MetadataCache::Entry &meta);
+bool acceptsEncoding(const std::string &accept_encoding,
+                     const std::string &coding);
+std::string selectPrecompressed(HTTPConnxData &conn, const std::string &path,
+                                MetadataCache::Entry &meta);
+RangeStatus parseByteRanges(const std::string &value, off_t size,
+                            std::vector<ByteRange> &ranges);
+RangeStatus evaluateRangeRequest(HTTPConnxData &conn,
+                                 const MetadataCache::Entry &meta,
+                                 std::vector<ByteRange> &ranges);
+bool prepareFileTransfer(HTTPConnxData &conn);
 bool handleDirectoryListing(HTTPConnxData &conn);
 bool findCGIPathAlias(HTTPConnxData &conn);
+void startCGI(HTTPConnxData &conn);
 void updateWithLocationBlockConfig(HTTPConnxData &conn);
 bool handleChunkedData(HTTPConnxData &conn);
-bool handleCookieUpdateRequest(HTTPConnxData &conn);
+bool handleCgiStatusRequest(HTTPConnxData &conn);
+bool handleDiskIOStatusRequest(HTTPConnxData &conn);
+bool handlePageCacheStatusRequest(HTTPConnxData &conn);
 bool handleGETRequest(HTTPConnxData &conn);
 bool handlePOSTRequest(HTTPConnxData &conn);
 bool handleDELETERequest(HTTPConnxData &conn);
+void finishDELETERequest(HTTPConnxData &conn, int error);
 bool applyLocationBlockSettings(HTTPConnxData &conn, const Location &location);
 void updatePathsFromLocation(HTTPConnxData &conn, const Location &location,
                              const std::string &locationPath);
@@ -0,0 +1,237 @@
+#include "UploadStore.hpp"
+#include "BodySpool.hpp"
+#include "Utils.hpp"
+#include "debug.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace UploadStore {
+
+const char *const store_name = ".store";
+
+static string dirOf(const string &path) {
+  size_t slash = path.rfind('/');
+  return slash == string::npos ? "./" : path.substr(0, slash + 1);
+}
+
+/**
+ * @brief Whether path is in a store or is one, those are no files of the
+ * site: they are not served, listed, uploaded to or deleted
+ */
+bool hidden(const string &path) {
+  return ("/" + path + "/").find("/" + string(store_name) + "/") !=
+         string::npos;
+}
+
+// held around every change to a store: flush threads, disk_io workers
+// and the loop all publish, replace and delete
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief The symlink that finds an object by its inode, it points to the
+ * object's digest
+ */
+static string inodeLink(const string &store, ino_t ino) {
+  return store + "/" + Utils::to_string(static_cast<size_t>(ino)) + ".ino";
+}
+
+/**
+ * @brief objectOf() with the lock held
+ */
+static string findObject(const string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+      st.st_nlink != 2) {
+    return "";
+  }
+  string store = dirOf(path) + store_name;
+  char digest[128];
+  ssize_t len = readlink(inodeLink(store, st.st_ino).c_str(), digest,
+                         sizeof(digest) - 1);
+  if (len <= 0) {
+    return "";
+  }
+  string object = store + "/" + string(digest, static_cast<size_t>(len));
+  struct stat found;
+  if (stat(object.c_str(), &found) != 0 || found.st_ino != st.st_ino ||
+      found.st_dev != st.st_dev) {
+    return ""; // a link left from an inode that was reused
+  }
+  return object;
+}
+
+/**
+ * @brief reclaim() with the lock held
+ */
+static void dropObject(const string &object) {
+  struct stat st;
+  if (object.empty() || lstat(object.c_str(), &st) != 0 ||
+      st.st_nlink != 1 || unlink(object.c_str()) != 0) {
+    return;
+  }
+  unlink(inodeLink(object.substr(0, object.rfind('/')), st.st_ino).c_str());
+  debuglog(GREEN, "UploadStore: reclaimed %s", object.c_str());
+}
+
+/**
+ * @brief The object path is the last other name of, "" if there is none
+ *
+ * An object with one name left besides its own has a link count of 2; it
+ * is found through the <inode>.ino symlink next to it.
+ */
+string objectOf(const string &path) {
+  pthread_mutex_lock(&lock);
+  string object = findObject(path);
+  pthread_mutex_unlock(&lock);
+  return object;
+}
+
+/**
+ * @brief Remove object once no uploaded name is left, "" does nothing
+ */
+void reclaim(const string &object) {
+  pthread_mutex_lock(&lock);
+  dropObject(object);
+  pthread_mutex_unlock(&lock);
+}
+
+/**
+ * @brief unlink() path and reclaim the object it was the last name of
+ * @return 0, or -1 with errno set
+ */
+int remove(const string &path) {
+  pthread_mutex_lock(&lock);
+  string object = findObject(path);
+  int result = unlink(path.c_str());
+  int error = errno;
+  if (result == 0) {
+    dropObject(object);
+  }
+  pthread_mutex_unlock(&lock);
+  errno = error;
+  return result;
+}
+
+/**
+ * @brief Make path another name of object, replacing what is there at once
+ */
+static bool linkAs(const string &object, const string &path) {
+  string link_path = path + ".link";
+  string replaced = findObject(path);
+  unlink(link_path.c_str());
+  if (link(object.c_str(), link_path.c_str()) != 0) {
+    debuglog(RED, "UploadStore: cannot link %s: %s", path.c_str(),
+             strerror(errno));
+    return false;
+  }
+  if (rename(link_path.c_str(), path.c_str()) != 0) {
+    unlink(link_path.c_str());
+    return false;
+  }
+  dropObject(replaced);
+  return true;
+}
+
+/**
+ * @brief Give the upload its store name and path, with the lock held
+ *
+ * @param synced whether the data is on disk already, for on_complete
+ * @param created set if the object is new
+ */
+static bool place(int fd, const string &temp, const string &path,
+                  const string &object, bool synced, bool &created) {
+  struct stat st;
+  created = stat(object.c_str(), &st) != 0;
+  if (created) {
+    if (!synced && fsync(fd) != 0) {
+      perror("UploadStore: fsync");
+      return false;
+    }
+    bool named = temp.empty() ? BodySpool::linkAs(fd, object)
+                              : rename(temp.c_str(), object.c_str()) == 0;
+    if (!named || fstat(fd, &st) != 0) {
+      debuglog(RED, "UploadStore: cannot store %s: %s", object.c_str(),
+               strerror(errno));
+      return false;
+    }
+    string digest = object.substr(object.rfind('/') + 1);
+    string store = object.substr(0, object.rfind('/'));
+    unlink(inodeLink(store, st.st_ino).c_str());
+    if (symlink(digest.c_str(), inodeLink(store, st.st_ino).c_str()) != 0) {
+      perror("UploadStore: symlink"); // only reclaiming needs it
+    }
+  }
+  if (!linkAs(object, path)) {
+    if (created) {
+      dropObject(object);
+    }
+    return false;
+  }
+  if (!created && !temp.empty()) {
+    unlink(temp.c_str()); // not needed, the content is stored already
+  }
+  return true;
+}
+
+static void syncDir(const string &dir) {
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+}
+
+/**
+ * @brief Publish a finished upload under path through the store
+ *
+ * With on_complete the data is flushed first unless the object exists
+ * already, the store and path's directory after; batched is left to the
+ * caller, see BodySpool.
+ * @param temp the temp file from BodySpool::openFor(), dropped on a hit
+ * @param digest hex SHA-256 of the whole body
+ */
+bool publish(int fd, const string &temp, const string &path,
+             const string &digest, UploadFsync mode) {
+  string store = dirOf(path) + store_name;
+  if (mkdir(store.c_str(), 0755) != 0 && errno != EEXIST) {
+    perror("UploadStore: mkdir");
+    return false;
+  }
+  string object = store + "/" + digest;
+  bool flush = mode == UPLOAD_FSYNC_ON_COMPLETE;
+  bool synced = !flush;
+  struct stat st;
+  if (flush && stat(object.c_str(), &st) != 0) {
+    // outside the lock; place() only flushes if the object went meanwhile
+    if (fsync(fd) != 0) {
+      perror("UploadStore: fsync");
+      return false;
+    }
+    synced = true;
+  }
+  bool created = false;
+  pthread_mutex_lock(&lock);
+  bool ok = place(fd, temp, path, object, synced, created);
+  pthread_mutex_unlock(&lock);
+  if (!ok) {
+    return false;
+  }
+  if (!created) {
+    debuglog(GREEN, "UploadStore: %s is already stored as %s", path.c_str(),
+             digest.c_str());
+  }
+  if (flush) {
+    if (created) {
+      syncDir(store);
+    }
+    syncDir(dirOf(path));
+  }
+  return true;
+}
+
+} // namespace UploadStore
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "ServerData.hpp"
+#include <string>
+
+using std::string;
+
+/**
+ * @brief Content-addressed storage for locations with upload_dedup on
+ *
+ * The body is hashed (Sha256) while it streams into its temp file, so the
+ * digest is known the moment the upload completes. The content is kept once
+ * as .store/<sha256> in the destination's directory and the uploaded name
+ * is a hard link to it. When that object already exists the temp file is
+ * dropped unlinked, usually before writeback ever reached the disk, and
+ * the upload costs only the network transfer.
+ *
+ * An object is removed with its last name, when that is deleted (remove)
+ * or replaced by another upload; the symlink .store/<inode>.ino, pointing
+ * to the digest, finds it from that name. Flush threads, disk_io workers
+ * and the loop change the stores, one lock keeps them apart. The store is no part of the site: requests
+ * for anything in it are answered 404 and listings leave it out.
+ */
+namespace UploadStore {
+
+extern const char *const store_name;
+
+bool hidden(const string &path);
+string objectOf(const string &path);
+void reclaim(const string &object);
+int remove(const string &path);
+bool publish(int fd, const string &temp, const string &path,
+             const string &digest, UploadFsync mode);
+
+} // namespace UploadStore
@@ -0,0 +1,122 @@
+#include "WorkerPool.hpp"
+#include "SocketUtils.hpp"
+#include "debug.h"
+#include <cstdio>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using std::vector;
+
+extern "C" {
+
+static void *workerMain(void *arg) {
+  static_cast<WorkerPool *>(arg)->work();
+  return NULL;
+}
+
+} // extern "C"
+
+WorkerPool::WorkerPool(const char *name)
+    : name(name), threads(), pending(), done(), event_fd(-1), last_id(0) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&wake, NULL);
+}
+
+/**
+ * @brief Create the eventfd and up to count threads
+ * @return false if no thread started
+ */
+bool WorkerPool::start(size_t count) {
+  event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd == -1) {
+    perror("eventfd");
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, workerMain, this) != 0) {
+      break;
+    }
+    pthread_detach(thread);
+    threads.push_back(thread);
+  }
+  debuglog(GREEN, "%s: %zu worker threads", name.c_str(), threads.size());
+  return !threads.empty();
+}
+
+void WorkerPool::startPolling() {
+  if (started()) {
+    SocketUtils::add_to_poll(event_fd, POLLIN);
+  }
+}
+
+/**
+ * @brief Take the eventfd out of poll before a shutdown or reload
+ */
+void WorkerPool::stopPolling() {
+  if (event_fd != -1) {
+    SocketUtils::remove_from_poll(event_fd);
+  }
+}
+
+bool WorkerPool::owns(const pollfd &pfd) const {
+  return event_fd != -1 && pfd.fd == event_fd;
+}
+
+/**
+ * @brief Jobs no worker has taken yet
+ */
+size_t WorkerPool::queued() {
+  pthread_mutex_lock(&lock);
+  size_t waiting = pending.size();
+  pthread_mutex_unlock(&lock);
+  return waiting;
+}
+
+/**
+ * @brief Queue a job, the pool owns it until collect hands it back
+ * @return the job's id
+ */
+unsigned long WorkerPool::submit(Job *job) {
+  job->id = ++last_id;
+  pthread_mutex_lock(&lock);
+  pending.push_back(job);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  return job->id;
+}
+
+/**
+ * @brief Reset the eventfd and take the finished jobs, the caller deletes
+ * them
+ */
+void WorkerPool::collect(vector<Job *> &finished) {
+  uint64_t count;
+  ssize_t n = ::read(event_fd, &count, sizeof(count));
+  (void)n;
+  pthread_mutex_lock(&lock);
+  finished.swap(done);
+  pthread_mutex_unlock(&lock);
+}
+
+void WorkerPool::work() {
+  while (true) {
+    pthread_mutex_lock(&lock);
+    while (pending.empty()) {
+      pthread_cond_wait(&wake, &lock);
+    }
+    Job *job = pending.front();
+    pending.pop_front();
+    pthread_mutex_unlock(&lock);
+
+    job->run();
+
+    pthread_mutex_lock(&lock);
+    done.push_back(job);
+    pthread_mutex_unlock(&lock);
+    uint64_t one = 1;
+    ssize_t n = ::write(event_fd, &one, sizeof(one));
+    (void)n; // the counter is already non zero if this fails
+  }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <deque>
+#include <poll.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Detached worker threads that run jobs off the poll loop and hand
+ * them back through an eventfd
+ *
+ * The loop submits, a worker runs the job and queues it as done, then
+ * bumps the eventfd; the loop sees it readable and collects everything
+ * done so far. A job only carries copies of what it needs and never
+ * touches a connection, so one whose connection went away meanwhile is
+ * simply dropped. Workers cannot be stopped (they may be inside a blocking
+ * call), so a pool lives for the process and is polled again after a
+ * reload. Used by Handlers, DiskIO, BodySpool and Manifest.
+ */
+class WorkerPool {
+public:
+  struct Job {
+    unsigned long id; // set by submit
+    int client_fd;    // the connection it belongs to, -1 for none
+
+    Job() : id(0), client_fd(-1) {}
+    virtual ~Job() {}
+    virtual void run() = 0; // on a worker
+  };
+
+  explicit WorkerPool(const char *name);
+
+  bool start(size_t count);
+  bool started() const { return !threads.empty(); }
+  size_t size() const { return threads.size(); }
+  void startPolling();
+  void stopPolling();
+  bool owns(const pollfd &pfd) const;
+
+  size_t queued();
+  unsigned long submit(Job *job);
+  void collect(std::vector<Job *> &finished);
+
+  void work(); // the loop of each worker thread
+
+private:
+  WorkerPool(const WorkerPool &);
+  WorkerPool &operator=(const WorkerPool &);
+
+  std::string name;
+  std::vector<pthread_t> threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  std::deque<Job *> pending;
+  std::vector<Job *> done;
+  int event_fd;
+  unsigned long last_id;
+};
@@ -2,10 +2,15 @@
 #include "Constants.hpp"
 #include "HTTPServer.hpp"
 #include "debug.h"
+#include <cstdlib>
+#include <ctime>
 #include <iostream>
 #include <string>
+#include <unistd.h>
 
 int main(int argc, char *argv[]) {
+  // for Utils::generateRandomFilename
+  std::srand(static_cast<unsigned>(std::time(NULL) ^ getpid()));
   try {
     std::string configFile =
         Constants::default_config_file; // Default config path
@@ -0,0 +1,110 @@
+#!/usr/bin/env python3
+"""CPU per byte vs bandwidth saved by on-the-fly gzip.
+
+Starts ./webserv once per compression level with a generated config, sends
+the same generated responses (CGI output, directory listing, generated error
+page) and reports wire bytes against the CPU time the server process spent
+(utime + stime from /proc, Linux only). Run with `make bench`.
+"""
+import http.client
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 4290
+REQUESTS = int(os.environ.get("BENCH_REQUESTS", "100"))
+TARGETS = ["/cgi/hello.py", "/list/", "/does-not-exist"]
+
+CONFIG = """http {
+    maxBodySize 1000000;
+    server {
+        listen %(port)d;
+        server_name bench;
+        root html/www1/;
+        location /list {
+            autoindex on;
+            root html/www1/cgi-bin/;
+%(gzip)s
+        }
+        cgi {
+            cgi_path_alias /cgi "/cgi-bin"
+            file_extension .py
+            acceptedMethods GET
+%(gzip)s
+        }
+        location / {
+%(gzip)s
+        }
+    }
+}
+"""
+
+
+def server_cpu(pid):
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+
+
+def run(level):
+    gzip = ""
+    if level:
+        gzip = ("            gzip on;\n            gzip_comp_level %d;\n"
+                "            gzip_min_length 0;" % level)
+    with tempfile.NamedTemporaryFile("w", suffix=".conf", delete=False) as f:
+        f.write(CONFIG % {"port": PORT, "gzip": gzip})
+        path = f.name
+    server = subprocess.Popen(["./webserv", path], stdout=subprocess.DEVNULL,
+                              stderr=subprocess.DEVNULL)
+    try:
+        time.sleep(0.3)
+        wire = 0
+        plain = 0
+        conn = http.client.HTTPConnection("localhost", PORT, timeout=5)
+        start = server_cpu(server.pid)
+        for _ in range(REQUESTS):
+            for target in TARGETS:
+                conn.request("GET", target,
+                             headers={"Accept-Encoding": "gzip"})
+                response = conn.getresponse()
+                body = response.read()
+                wire += len(body)
+                if response.getheader("Content-Encoding") == "gzip":
+                    import zlib
+                    body = zlib.decompress(body, 16 + zlib.MAX_WBITS)
+                plain += len(body)
+        cpu = server_cpu(server.pid) - start
+        conn.close()
+    finally:
+        server.terminate()
+        try:
+            server.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            server.kill()
+            server.wait()
+        os.unlink(path)
+    return wire, plain, cpu
+
+
+def main():
+    if not os.path.exists("/proc/self/stat"):
+        sys.exit("gzip_bench needs /proc (Linux)")
+    responses = REQUESTS * len(TARGETS)
+    base_wire, _, base_cpu = run(0)
+    print("%d responses per run (%s)" % (responses, ", ".join(TARGETS)))
+    print("%-6s %12s %8s %12s %14s" %
+          ("level", "wire bytes", "saved", "cpu us/resp", "extra ns/byte"))
+    print("%-6s %12d %7.1f%% %12.1f %14s" %
+          ("off", base_wire, 0.0, base_cpu * 1e6 / responses, "-"))
+    for level in (1, 6, 9):
+        wire, plain, cpu = run(level)
+        saved = 100.0 * (base_wire - wire) / base_wire
+        extra = (cpu - base_cpu) * 1e9 / plain if plain else 0
+        print("%-6d %12d %7.1f%% %12.1f %14.2f" %
+              (level, wire, saved, cpu * 1e6 / responses, extra))
+
+
+if __name__ == "__main__":
+    main()
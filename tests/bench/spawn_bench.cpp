@@ -0,0 +1,101 @@
+/*
+ * Spawn latency against the size of the spawning process.
+ *
+ * CGI scripts used to be started with fork() + execve() straight from the
+ * server, and fork() copies the page tables of everything the server has
+ * mapped. This grows a touched heap to each size in turn and times starting
+ * (and reaping) /bin/true both ways; posix_spawn should stay flat while
+ * fork grows with the heap. Run with `make bench`.
+ *
+ *   tests/bench/spawn_bench [MB ...]   default: 0 64 256 1024
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <spawn.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+extern char **environ;
+
+static const int ROUNDS = 200;
+static const char *PROGRAM = "/bin/true";
+
+static double now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<double>(tv.tv_sec) * 1e6 + static_cast<double>(tv.tv_usec);
+}
+
+static pid_t forkExec() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    char *args[] = {const_cast<char *>(PROGRAM), NULL};
+    execve(PROGRAM, args, environ);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t posixSpawn() {
+  char *args[] = {const_cast<char *>(PROGRAM), NULL};
+  pid_t pid;
+  if (posix_spawn(&pid, PROGRAM, NULL, NULL, args, environ) != 0) {
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * @brief Mean microseconds from starting the child to having reaped it
+ */
+static double measure(pid_t (*start)()) {
+  double begin = now();
+  for (int i = 0; i < ROUNDS; ++i) {
+    pid_t pid = start();
+    if (pid < 0) {
+      perror("spawn");
+      exit(EXIT_FAILURE);
+    }
+    waitpid(pid, NULL, 0);
+  }
+  return (now() - begin) / ROUNDS;
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<size_t> sizes;
+  for (int i = 1; i < argc; ++i) {
+    sizes.push_back(static_cast<size_t>(atol(argv[i])));
+  }
+  if (sizes.empty()) {
+    sizes.push_back(0);
+    sizes.push_back(64);
+    sizes.push_back(256);
+    sizes.push_back(1024);
+  }
+
+  std::printf("%10s %16s %16s\n", "heap MB", "fork+exec us", "posix_spawn us");
+  std::vector<char *> heap;
+  size_t allocated = 0;
+  for (size_t i = 0; i < sizes.size(); ++i) {
+    // grow in 1 MB blocks and touch every page so it is really resident
+    for (; allocated < sizes[i]; ++allocated) {
+      char *block = static_cast<char *>(std::malloc(1024 * 1024));
+      if (block == NULL) {
+        perror("malloc");
+        return EXIT_FAILURE;
+      }
+      std::memset(block, 1, 1024 * 1024);
+      heap.push_back(block);
+    }
+    double forked = measure(forkExec);
+    double spawned = measure(posixSpawn);
+    std::printf("%10zu %16.0f %16.0f\n", allocated, forked, spawned);
+  }
+  for (size_t i = 0; i < heap.size(); ++i) {
+    std::free(heap[i]);
+  }
+  return EXIT_SUCCESS;
+}
@@ -55,4 +55,17 @@ def webserver_redir_config():
 def webserver_error_codes_config():
     server = start_webserver("tests/config/error_pages.conf")
     yield
-    server.terminate()
\ No newline at end of file
+    server.terminate()
+
+@pytest.fixture(scope="function")
+def webserver_cgi_pool_config():
+    server = start_webserver("tests/config/cgi_pool.conf")
+    time.sleep(0.3) # let the minimum workers start
+    yield
+    server.terminate()
+
+@pytest.fixture(scope="function")
+def webserver_cgi_limits_config():
+    server = start_webserver("tests/config/cgi_limits.conf")
+    yield
+    server.terminate()
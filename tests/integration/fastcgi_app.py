@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""Minimal FastCGI responder used by test_fastcgi.py (stdlib only).
+
+Serves every request with a JSON description of what it received, so the
+tests can check params, body forwarding and connection reuse. Requests are
+multiplexed: records of different request ids may interleave on one
+connection. /missing answers 404 with an extra header.
+
+    python3 tests/integration/fastcgi_app.py /tmp/app.sock
+"""
+import hashlib
+import itertools
+import json
+import os
+import socketserver
+import struct
+import sys
+
+BEGIN_REQUEST, ABORT_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 2, 3, 4, 5, 6
+
+connection_ids = itertools.count(1)
+
+
+def record(rtype, rid, content=b""):
+    padding = (8 - len(content) % 8) % 8
+    return (struct.pack("!BBHHBx", 1, rtype, rid, len(content), padding)
+            + content + b"\0" * padding)
+
+
+def read_length(data, pos):
+    if data[pos] < 128:
+        return data[pos], pos + 1
+    return struct.unpack("!I", data[pos:pos + 4])[0] & 0x7FFFFFFF, pos + 4
+
+
+def parse_params(data):
+    params, pos = {}, 0
+    while pos < len(data):
+        name_len, pos = read_length(data, pos)
+        value_len, pos = read_length(data, pos)
+        name = data[pos:pos + name_len].decode()
+        pos += name_len
+        params[name] = data[pos:pos + value_len].decode(errors="replace")
+        pos += value_len
+    return params
+
+
+class Handler(socketserver.BaseRequestHandler):
+    def read_exact(self, n):
+        data = b""
+        while len(data) < n:
+            chunk = self.request.recv(n - len(data))
+            if not chunk:
+                raise EOFError
+            data += chunk
+        return data
+
+    def handle(self):
+        conn_id = next(connection_ids)
+        served = 0
+        requests = {}
+        try:
+            while True:
+                header = self.read_exact(8)
+                _, rtype, rid, length, padding = struct.unpack("!BBHHBx", header)
+                content = self.read_exact(length + padding)[:length]
+                if rtype == BEGIN_REQUEST:
+                    requests[rid] = {"params": b"", "stdin": b""}
+                elif rtype == ABORT_REQUEST:
+                    requests.pop(rid, None)
+                    self.request.sendall(record(END_REQUEST, rid, b"\0" * 8))
+                elif rtype == PARAMS and rid in requests:
+                    requests[rid]["params"] += content
+                elif rtype == STDIN and rid in requests:
+                    if content:
+                        requests[rid]["stdin"] += content
+                        continue
+                    served += 1
+                    self.respond(rid, requests.pop(rid), conn_id, served,
+                                 len(requests))
+        except EOFError:
+            pass
+
+    def respond(self, rid, req, conn_id, served, in_flight):
+        params = parse_params(req["params"])
+        body = req["stdin"]
+        if params.get("SCRIPT_NAME", "").endswith("/missing"):
+            head = "Status: 404 Not Found\r\nX-App: fastcgi\r\n"
+        else:
+            head = "Status: 200 OK\r\n"
+        payload = json.dumps({
+            "method": params.get("REQUEST_METHOD"),
+            "script": params.get("SCRIPT_NAME"),
+            "query": params.get("QUERY_STRING"),
+            "user_agent": params.get("HTTP_USER_AGENT"),
+            "body_length": len(body),
+            "body_sha256": hashlib.sha256(body).hexdigest(),
+            "connection": conn_id,
+            "served_on_connection": served,
+            "other_in_flight": in_flight,
+            "pid": os.getpid(),
+        }).encode()
+        out = (head + "Content-Type: application/json\r\n\r\n").encode() + payload
+        data = b""
+        for i in range(0, len(out), 65535):
+            data += record(STDOUT, rid, out[i:i + 65535])
+        data += record(STDOUT, rid)
+        data += record(END_REQUEST, rid, b"\0" * 8)
+        self.request.sendall(data)
+
+
+class Server(socketserver.ThreadingMixIn, socketserver.UnixStreamServer):
+    daemon_threads = True
+
+
+if __name__ == "__main__":
+    path = sys.argv[1]
+    if os.path.exists(path):
+        os.unlink(path)
+    with Server(path, Handler) as server:
+        server.serve_forever()
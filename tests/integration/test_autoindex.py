@@ -0,0 +1,76 @@
+import os
+import shutil
+import time
+
+import requests
+
+DIR = "htmltest/www2/autoindex_test"
+URL = "http://localhost:4244/43/autoindex_test/"
+
+
+def make_dir(names, subdirs=()):
+    shutil.rmtree(DIR, ignore_errors=True)
+    os.makedirs(DIR)
+    for name in subdirs:
+        os.makedirs(os.path.join(DIR, name))
+    for name in names:
+        open(os.path.join(DIR, name), "w").close()
+
+
+def test_listing_sorted_and_json(webserver_normal_config):
+    """Directories first, then names in byte order, in HTML and JSON"""
+    make_dir(["b.txt", "a b.txt", "A.txt"], ["zdir"])
+    try:
+        html = requests.get(URL).text
+        hrefs = [part.split('"')[0] for part in html.split('href="')[2:]]
+        assert hrefs == ["/43/autoindex_test/../", "/43/autoindex_test/zdir/",
+                         "/43/autoindex_test/A.txt",
+                         "/43/autoindex_test/a%20b.txt",
+                         "/43/autoindex_test/b.txt"]
+        listing = requests.get(URL + "?format=json").json()
+        assert listing["path"] == "/43/autoindex_test/"
+        assert listing["entries"] == [
+            {"name": "..", "type": "dir"}, {"name": "zdir", "type": "dir"},
+            {"name": "A.txt", "type": "file"},
+            {"name": "a b.txt", "type": "file"},
+            {"name": "b.txt", "type": "file"}]
+        accepted = requests.get(URL, headers={"Accept": "application/json"})
+        assert accepted.headers["Content-Type"] == "application/json"
+        assert "Accept" in accepted.headers["Vary"].split(", ")
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
+
+
+def test_cached_listing_follows_changes(webserver_normal_config):
+    """A cached listing is used until the directory's mtime moves"""
+    make_dir(["one.txt"])
+    try:
+        old = time.time() - 10
+        os.utime(DIR, (old, old))  # old enough to be cached
+        first = requests.get(URL)
+        assert requests.get(URL).content == first.content
+        plain = requests.get(URL, headers={"Accept-Encoding": "identity"})
+        assert plain.content == first.content
+        assert "Content-Encoding" not in plain.headers
+        open(os.path.join(DIR, "two.txt"), "w").close()
+        assert "two.txt" in requests.get(URL).text
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
+
+
+def test_huge_listing_is_streamed(webserver_normal_config):
+    names = ["file%05d" % i for i in range(10050)]
+    make_dir(names)
+    try:
+        response = requests.get(URL, timeout=10)
+        assert response.headers["Transfer-Encoding"] == "chunked"
+        assert response.headers["Vary"] == "Accept"
+        assert response.text.count("<li>") == len(names) + 1
+        assert response.text.endswith("</ul></div></body></html>")
+        assert response.text.index("file00001") < response.text.index(
+            "file10049")
+        assert requests.get(URL + "?format=json",
+                            timeout=10).json()["entries"][-1] == {
+                                "name": "file10049", "type": "file"}
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
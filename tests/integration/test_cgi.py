@@ -1,3 +1,8 @@
+import http.client
+import json
+import os
+import socket
+import threading
 import requests
 import pytest 
 
@@ -206,3 +211,165 @@ def test_cgi_perl_hello(webserver_normal_config):
     assert 'Also they are made of metal, whereas man is made of skin.<br>---<br></div>' in response.text, "Missing quote fragment: Metal/Skin"
     assert 'you are a mile away from them and you have their shoes.<br>---<br></div>' in response.text, "Missing quote fragment: Shoes"
 
+
+
+# --- Streaming through the CGI pipes ---
+def test_cgi_large_download(webserver_normal_config):
+    """Output far bigger than the pipe buffers arrives complete"""
+    size = 8 * 1024 * 1024
+    response = requests.get(f'http://localhost:4244/cgi/stream.py?size={size}',
+                            timeout=10)
+    assert response.status_code == 200
+    assert len(response.content) == size
+    assert response.content == (bytes(range(256)) * (size // 256))
+
+
+def test_cgi_full_duplex_echo(webserver_normal_config):
+    """The script answers while the body is still coming in
+
+    The body is sent from a thread while the answer is read, like a client
+    that streams both ways; a server that holds the output back until the
+    body is complete stalls here once the buffers are full.
+    """
+    body = os.urandom(8 * 1024 * 1024)
+    head = (b"POST /cgi/stream.py HTTP/1.1\r\nHost: localhost:4244\r\n"
+            b"Content-Length: %d\r\n\r\n" % len(body))
+    with socket.create_connection(("localhost", 4244), timeout=10) as sock:
+        sender = threading.Thread(target=sock.sendall, args=(head + body,))
+        sender.start()
+        response = b""
+        while b"\r\n\r\n" not in response:
+            response += sock.recv(65536)
+        status, _, received = response.partition(b"\r\n\r\n")
+        while len(received) < len(body):
+            data = sock.recv(65536)
+            if not data:
+                break
+            received += data
+        sender.join()
+    assert status.startswith(b"HTTP/1.1 200")
+    assert received == body
+
+
+def test_cgi_large_upload(webserver_normal_config):
+    """A multipart upload bigger than the body buffer reaches upload.py whole"""
+    content = os.urandom(3 * 1024 * 1024).hex().encode()
+    path = 'html/www1/upload/large_cgi_upload.txt'
+    try:
+        response = requests.post('http://localhost:4244/cgi/upload.py',
+                                 files={'file': ('large_cgi_upload.txt', content,
+                                                 'text/plain')},
+                                 allow_redirects=False, timeout=10)
+        assert response.status_code == 303
+        with open(path, 'rb') as saved:
+            assert saved.read() == content
+    finally:
+        if os.path.exists(path):
+            os.remove(path)
+
+
+def test_cgi_keep_alive(webserver_normal_config):
+    """CGI responses are framed so the connection can be reused"""
+    conn = http.client.HTTPConnection("localhost", 4244, timeout=5)
+    conn.request("GET", "/cgi/hello.py")
+    response = conn.getresponse()
+    body = response.read()
+    assert response.status == 200
+    assert response.getheader("Content-Length") == str(len(body))
+    sock = conn.sock
+
+    # Status header and no Content-Length: the body goes out chunked
+    conn.request("GET", "/cgi/worker_info.py")
+    response = conn.getresponse()
+    assert response.status == 200
+    assert response.getheader("Transfer-Encoding") == "chunked"
+    assert response.getheader("Content-Type") == "application/json"
+    assert json.loads(response.read())["method"] == "GET"
+    assert conn.sock is sock
+    conn.close()
+
+
+def test_cgi_chunked_spooled_echo(webserver_normal_config):
+    """A chunked body past client_body_buffer_size is spooled, then streamed"""
+    body = os.urandom(3 * 1024 * 1024)
+    pieces = (body[i:i + 65536] for i in range(0, len(body), 65536))
+    response = requests.post('http://localhost:4244/cgi/stream.py',
+                             data=pieces, timeout=10)
+    assert response.status_code == 200
+    assert response.content == body
+
+
+def test_cgi_bad_chunk_size(webserver_normal_config):
+    """A chunk size that is not hex is a 400, not a hang"""
+    request = (b"POST /cgi/stream.py HTTP/1.1\r\nHost: localhost:4244\r\n"
+               b"Transfer-Encoding: chunked\r\n\r\nzz\r\nhello\r\n0\r\n\r\n")
+    with socket.create_connection(("localhost", 4244), timeout=5) as sock:
+        sock.sendall(request)
+        assert sock.recv(4096).startswith(b"HTTP/1.1 400")
+
+
+def test_cgi_crash_is_not_a_complete_response(webserver_normal_config):
+    """A script killed mid-body gets its connection cut, no clean last chunk"""
+    conn = http.client.HTTPConnection("localhost", 4244, timeout=5)
+    conn.request("GET", "/cgi/stream.py?crash=1&linger=0.5")
+    response = conn.getresponse()
+    assert response.status == 200
+    assert response.getheader("Transfer-Encoding") == "chunked"
+    with pytest.raises(http.client.IncompleteRead):
+        response.read()
+    conn.close()
+    # the server is fine and the next script runs normally
+    assert requests.get('http://localhost:4244/cgi/hello.py').status_code == 200
+
+
+def test_cgi_failure_counted_and_502_before_output(webserver_normal_config):
+    """A failed script is answered 502 if nothing went out yet, otherwise
+    its body is cut; failed and killed scripts are counted at
+    /api/cgi-status"""
+    for query in ("fail=1", "crash=1"):
+        conn = http.client.HTTPConnection("localhost", 4244, timeout=5)
+        conn.request("GET", "/cgi/stream.py?" + query)
+        response = conn.getresponse()
+        try:
+            response.read()
+            assert response.status == 502
+        except http.client.IncompleteRead:
+            assert response.status == 200 # the head was sent already
+        conn.close()
+    gauges = requests.get("http://localhost:4244/api/cgi-status",
+                          timeout=1).json()
+    assert gauges["failed"] == 1
+    assert gauges["signalled"] == 1
+
+def test_cgi_cache(webserver_normal_config):
+    """max-age output is served from memory, keyed by query and header"""
+    url = 'http://localhost:4244/cgi/worker_info.py?max_age=5'
+    first = requests.get(url)
+    second = requests.get(url)
+    assert first.status_code == second.status_code == 200
+    assert second.json()["pid"] == first.json()["pid"]
+    assert "Age" in second.headers
+    other = requests.get(url + '&x=1')
+    assert other.json()["pid"] != first.json()["pid"]
+    german = requests.get(url, headers={'Accept-Language': 'de'})
+    assert german.json()["pid"] != first.json()["pid"]
+    # no max-age, no caching
+    plain = 'http://localhost:4244/cgi/worker_info.py'
+    assert requests.get(plain).json()["pid"] != requests.get(plain).json()["pid"]
+
+
+def test_cgi_cache_coalesces_misses(webserver_normal_config):
+    """Concurrent misses for one key are answered by a single child"""
+    url = 'http://localhost:4244/cgi/worker_info.py?max_age=5&sleep=0.5'
+    results = [None] * 4
+
+    def fetch(index):
+        results[index] = requests.get(url, timeout=5)
+
+    threads = [threading.Thread(target=fetch, args=(i,)) for i in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert all(r.status_code == 200 for r in results)
+    assert len(set(r.json()["pid"] for r in results)) == 1
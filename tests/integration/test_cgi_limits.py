@@ -0,0 +1,52 @@
+import threading
+import time
+
+import requests
+
+SLOW = "http://localhost:4244/cgi/stream.py?size=10&sleep=0.6"
+STATUS = "http://localhost:4244/api/cgi-status"
+
+
+def fire(results, index):
+    results[index] = requests.get(SLOW, timeout=5)
+
+
+def test_cgi_limit_queues_then_sheds(webserver_cgi_limits_config):
+    """max_concurrent 1 and queue_size 1: one runs, one waits, one gets 503"""
+    results = [None] * 3
+    threads = []
+    for i in range(3):
+        thread = threading.Thread(target=fire, args=(results, i))
+        thread.start()
+        threads.append(thread)
+        time.sleep(0.1)
+    gauges = requests.get(STATUS, timeout=1).json()
+    assert gauges["active"] == 1
+    assert gauges["queued"] == 1
+    for thread in threads:
+        thread.join()
+
+    codes = sorted(r.status_code for r in results)
+    assert codes == [200, 200, 503]
+    shed = [r for r in results if r.status_code == 503][0]
+    assert shed.headers.get("Retry-After") == "1"
+    gauges = requests.get(STATUS, timeout=1).json()
+    assert gauges == {"active": 0, "queued": 0, "rejected": 1, "failed": 0,
+                      "signalled": 0}
+
+
+def test_static_files_during_cgi_storm(webserver_cgi_limits_config):
+    """Static files are served right away while CGI requests wait"""
+    results = [None] * 2
+    threads = [threading.Thread(target=fire, args=(results, i))
+               for i in range(2)]
+    for thread in threads:
+        thread.start()
+    time.sleep(0.1)
+    start = time.time()
+    response = requests.get("http://localhost:4244/", timeout=1)
+    assert response.status_code == 200
+    assert time.time() - start < 0.3
+    for thread in threads:
+        thread.join()
+    assert [r.status_code for r in results] == [200, 200]
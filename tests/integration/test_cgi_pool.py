@@ -0,0 +1,57 @@
+import threading
+
+import requests
+
+BASE = "http://localhost:4244/cgi/worker_info.py"
+
+def test_cgi_pool_reuses_worker(webserver_cgi_pool_config):
+    """Sequential requests run in the same long lived process"""
+    first = requests.get(BASE).json()
+    second = requests.get(BASE).json()
+    assert first["pid"] == second["pid"]
+    assert second["count"] == first["count"] + 1
+
+def test_cgi_pool_recycles_after_max_requests(webserver_cgi_pool_config):
+    """cgi_pool_max_requests 5 - the sixth request gets a fresh worker"""
+    pids = [requests.get(BASE).json()["pid"] for _ in range(6)]
+    assert len(set(pids[:5])) == 1
+    assert pids[5] != pids[0]
+
+def test_cgi_pool_post_body(webserver_cgi_pool_config):
+    """The body reaches the script's stdin, also past the first read"""
+    body = "x" * 200000
+    response = requests.post(BASE, data=body,
+                             headers={"Content-Type": "text/plain"})
+    assert response.status_code == 200
+    assert response.json()["method"] == "POST"
+    assert response.json()["body_length"] == len(body)
+
+def test_cgi_pool_nph_script(webserver_cgi_pool_config):
+    """Scripts printing a full HTTP status line work in a worker too"""
+    response = requests.get("http://localhost:4244/cgi/hello.py")
+    assert response.status_code == 200
+    assert "Hello, CGI-World!" in response.text
+
+def test_cgi_pool_perl_still_forked(webserver_cgi_pool_config):
+    """Only the extensions given to cgi_pool_worker go to the pool"""
+    response = requests.get("http://localhost:4244/cgi/hello.pl")
+    assert response.status_code == 200
+    assert "Ricken" in response.text
+
+def test_cgi_pool_queue_overflow(webserver_cgi_pool_config):
+    """2 workers + 2 queued are served, the rest is refused with 503"""
+    statuses = []
+    def fetch():
+        statuses.append(requests.get(BASE + "?sleep=0.3").status_code)
+    threads = [threading.Thread(target=fetch) for _ in range(7)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert statuses.count(200) == 4
+    assert statuses.count(503) == 3
+
+def test_cgi_pool_worker_crash(webserver_cgi_pool_config):
+    """A dying worker fails its request with 502 and is replaced"""
+    assert requests.get(BASE + "?crash=1").status_code == 502
+    assert requests.get(BASE).status_code == 200
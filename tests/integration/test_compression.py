@@ -0,0 +1,28 @@
+import requests
+
+def test_cgi_output_gzip_chunked(webserver_normal_config):
+    """CGI output is compressed on the fly and sent chunked"""
+    response = requests.get("http://localhost:4244/cgi/hello.py",
+                            headers={"Accept-Encoding": "gzip"})
+    assert response.status_code == 200
+    assert response.headers["Content-Encoding"] == "gzip"
+    assert response.headers["Transfer-Encoding"] == "chunked"
+    assert "Content-Length" not in response.headers
+    assert "Hello, CGI-World!" in response.text
+
+def test_cgi_output_identity(webserver_normal_config):
+    """Without gzip in Accept-Encoding the CGI output is untouched"""
+    response = requests.get("http://localhost:4244/cgi/hello.py",
+                            headers={"Accept-Encoding": "identity"})
+    assert response.status_code == 200
+    assert "Content-Encoding" not in response.headers
+    assert int(response.headers["Content-Length"]) == len(response.content)
+
+def test_directory_listing_gzip(webserver_normal_config):
+    """Generated directory listings keep a Content-Length when compressed"""
+    response = requests.get("http://localhost:4244/43/images/",
+                            headers={"Accept-Encoding": "gzip"})
+    assert response.status_code == 200
+    assert response.headers["Content-Encoding"] == "gzip"
+    assert "Content-Length" in response.headers
+    assert "Index of /43/images/" in response.text
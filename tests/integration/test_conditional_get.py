@@ -0,0 +1,58 @@
+import os
+import requests
+
+def test_validators_present(webserver_normal_config):
+    """Static files carry ETag and Last-Modified"""
+    response = requests.get("http://localhost:4244/index.html")
+    assert response.status_code == 200
+    assert "ETag" in response.headers, "Missing ETag header"
+    assert "Last-Modified" in response.headers, "Missing Last-Modified header"
+
+def test_if_none_match_304(webserver_normal_config):
+    """Matching If-None-Match gets a 304 without body"""
+    first = requests.get("http://localhost:4244/index.html")
+    etag = first.headers["ETag"]
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"If-None-Match": etag})
+    assert response.status_code == 304, f"Expected 304, got {response.status_code}"
+    assert response.text == ""
+    assert response.headers["ETag"] == etag
+
+def test_if_modified_since_304(webserver_normal_config):
+    """Index file honors If-Modified-Since"""
+    first = requests.get("http://localhost:4244/")
+    response = requests.get("http://localhost:4244/",
+                            headers={"If-Modified-Since": first.headers["Last-Modified"]})
+    assert response.status_code == 304, f"Expected 304, got {response.status_code}"
+
+def test_if_none_match_mismatch(webserver_normal_config):
+    """A stale ETag wins over If-Modified-Since and gets the full file"""
+    first = requests.get("http://localhost:4244/index.html")
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"If-None-Match": '"stale"',
+                                     "If-Modified-Since": first.headers["Last-Modified"]})
+    assert response.status_code == 200
+    assert response.text == first.text
+
+def test_headers_follow_replaced_file(webserver_error_codes_config):
+    """A file replaced within the metadata TTL is described by its new stat"""
+    path = "htmltest/www2/replaced_meta.txt"
+    with open(path, "w") as f:
+        f.write("a" * 100)
+    try:
+        first = requests.get("http://localhost:4245/replaced_meta.txt")
+        assert first.status_code == 200
+        with open(path + ".tmp", "w") as f:
+            f.write("b" * 300)
+        os.rename(path + ".tmp", path)
+        response = requests.get("http://localhost:4245/replaced_meta.txt")
+        assert response.status_code == 200
+        assert response.text == "b" * 300
+        assert response.headers["Content-Length"] == "300"
+        assert response.headers["ETag"] != first.headers["ETag"]
+        ranged = requests.get("http://localhost:4245/replaced_meta.txt",
+                              headers={"Range": "bytes=-50"})
+        assert ranged.status_code == 206
+        assert ranged.headers["Content-Range"] == "bytes 250-299/300"
+    finally:
+        os.remove(path)
@@ -0,0 +1,26 @@
+import requests
+
+STATUS = "http://localhost:4244/api/disk-io-status"
+
+
+def test_disk_io_pool_runs_file_operations(webserver_normal_config):
+    """With disk_io threads reads, upload writes, listings and unlinks go
+    through the worker pool and show up in its counters"""
+    before = requests.get(STATUS).json()
+    body = b"0123456789" * 20000
+    assert requests.post("http://localhost:4244/upload/disk_io.bin",
+                         data=body).status_code == 201
+    assert requests.get(
+        "http://localhost:4244/upload/disk_io.bin").content == body
+    listing = requests.get("http://localhost:4244/43/images/")
+    assert "Index of /43/images/" in listing.text
+    assert requests.delete(
+        "http://localhost:4244/upload/disk_io.bin").status_code == 200
+    assert requests.get(
+        "http://localhost:4244/upload/disk_io.bin").status_code == 404
+
+    after = requests.get(STATUS).json()
+    assert after["threads"] > 0
+    for op in ("read", "write", "list", "unlink"):
+        assert after[op]["jobs"] > before[op]["jobs"], op
+        assert after[op]["max_run_us"] >= after[op]["avg_run_us"]
@@ -0,0 +1,73 @@
+import socket
+
+import requests
+
+HEAD = (b"%s %s HTTP/1.1\r\nHost: localhost:4244\r\n"
+        b"Expect: 100-continue\r\n%s\r\n")
+
+
+def send_headers(method, path, extra):
+    sock = socket.create_connection(("localhost", 4244), timeout=3)
+    sock.sendall(HEAD % (method, path, extra))
+    return sock
+
+
+def read_until(sock, marker):
+    reply = b""
+    while marker not in reply:
+        data = sock.recv(4096)
+        if not data:
+            break
+        reply += data
+    return reply
+
+
+def test_continue_then_upload(webserver_normal_config):
+    """The body is asked for only once the upload is known to be allowed"""
+    sock = send_headers(b"POST", b"/upload/expect.txt",
+                        b"Content-Length: 11\r\n")
+    try:
+        assert read_until(sock, b"\r\n\r\n") == b"HTTP/1.1 100 Continue\r\n\r\n"
+        sock.sendall(b"hello world")
+        assert read_until(sock, b"uploaded").startswith(b"HTTP/1.1 201")
+    finally:
+        sock.close()
+    try:
+        assert requests.get(
+            "http://localhost:4244/upload/expect.txt").content == b"hello world"
+    finally:
+        requests.delete("http://localhost:4244/upload/expect.txt")
+
+
+def test_continue_chunked_upload(webserver_normal_config):
+    sock = send_headers(b"POST", b"/upload/expect_chunked.txt",
+                        b"Transfer-Encoding: chunked\r\n")
+    try:
+        assert read_until(sock, b"\r\n\r\n") == b"HTTP/1.1 100 Continue\r\n\r\n"
+        sock.sendall(b"5\r\nhello\r\n0\r\n\r\n")
+        assert read_until(sock, b"uploaded").startswith(b"HTTP/1.1 201")
+    finally:
+        sock.close()
+    requests.delete("http://localhost:4244/upload/expect_chunked.txt")
+
+
+def test_refused_without_continue(webserver_normal_config):
+    """Forbidden uploads and oversized bodies are answered before the body
+    is sent, and the connection is closed"""
+    cases = [(b"POST", b"/here/x.txt", b"Content-Length: 5\r\n", b"403"),
+             (b"POST", b"/upload/big.bin", b"Content-Length: 200000000\r\n",
+              b"413"),
+             (b"POST", b"/cgi/hello.py", b"Content-Length: 200000000\r\n",
+              b"413"),
+             (b"PATCH", b"/upload/missing.bin",
+              b"Upload-Offset: 0\r\nContent-Length: 5\r\n", b"404")]
+    for method, path, extra, status in cases:
+        sock = send_headers(method, path, extra)
+        try:
+            reply = read_until(sock, b"</html>")
+            assert reply.startswith(b"HTTP/1.1 " + status), reply[:40]
+            assert b"100 Continue" not in reply
+            while sock.recv(4096):  # closed by the server
+                pass
+        finally:
+            sock.close()
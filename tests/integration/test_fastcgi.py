@@ -0,0 +1,65 @@
+import hashlib
+import os
+import subprocess
+import sys
+import time
+
+import pytest
+import requests
+
+SOCKET = "/tmp/webserv_fastcgi_test.sock"
+APP = os.path.join(os.path.dirname(__file__), "fastcgi_app.py")
+
+@pytest.fixture(scope="function")
+def fastcgi_app():
+    app = subprocess.Popen([sys.executable, APP, SOCKET])
+    for _ in range(100):
+        if os.path.exists(SOCKET):
+            break
+        time.sleep(0.05)
+    yield
+    app.terminate()
+    app.wait()
+    if os.path.exists(SOCKET):
+        os.unlink(SOCKET)
+
+def test_fastcgi_get(fastcgi_app, webserver_normal_config):
+    """A GET goes to the app with the CGI params and HTTP_* headers"""
+    response = requests.get("http://localhost:4244/fcgi/info?x=1",
+                            headers={"User-Agent": "fcgi-test"})
+    assert response.status_code == 200
+    assert response.headers["Content-Type"] == "application/json"
+    assert int(response.headers["Content-Length"]) == len(response.content)
+    data = response.json()
+    assert data["method"] == "GET"
+    assert data["script"] == "/fcgi/info"
+    assert data["query"] == "x=1"
+    assert data["user_agent"] == "fcgi-test"
+
+def test_fastcgi_post_body(fastcgi_app, webserver_normal_config):
+    """A body larger than one record and one read is forwarded whole"""
+    body = os.urandom(200000)
+    response = requests.post("http://localhost:4244/fcgi/upload", data=body)
+    assert response.status_code == 200
+    data = response.json()
+    assert data["method"] == "POST"
+    assert data["body_length"] == len(body)
+    assert data["body_sha256"] == hashlib.sha256(body).hexdigest()
+
+def test_fastcgi_connection_is_reused(fastcgi_app, webserver_normal_config):
+    """Sequential requests share one pooled app connection"""
+    first = requests.get("http://localhost:4244/fcgi/a").json()
+    second = requests.get("http://localhost:4244/fcgi/b").json()
+    assert second["connection"] == first["connection"]
+    assert second["served_on_connection"] == first["served_on_connection"] + 1
+
+def test_fastcgi_status_and_headers(fastcgi_app, webserver_normal_config):
+    """Status and extra headers from the app reach the client"""
+    response = requests.get("http://localhost:4244/fcgi/missing")
+    assert response.status_code == 404
+    assert response.headers["X-App"] == "fastcgi"
+
+def test_fastcgi_app_down(webserver_normal_config):
+    """Without the app listening the request fails with 502"""
+    response = requests.get("http://localhost:4244/fcgi/info")
+    assert response.status_code == 502
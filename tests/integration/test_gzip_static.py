@@ -0,0 +1,32 @@
+import requests
+
+def test_gzip_sidecar_served(webserver_normal_config):
+    """gzip_static sends style.css.gz to clients that accept gzip"""
+    response = requests.get("http://localhost:4244/css/style.css",
+                            headers={"Accept-Encoding": "gzip"})
+    assert response.status_code == 200
+    assert response.headers["Content-Encoding"] == "gzip"
+    assert response.headers["Vary"] == "Accept-Encoding"
+    assert response.headers["Content-Type"] == "text/css"
+    # requests undoes the Content-Encoding for us
+    with open("html/www1/css/style.css", "rb") as f:
+        assert response.content == f.read()
+
+def test_gzip_sidecar_refused(webserver_normal_config):
+    """q=0 means the original file is sent"""
+    response = requests.get("http://localhost:4244/css/style.css",
+                            headers={"Accept-Encoding": "gzip;q=0"})
+    assert response.status_code == 200
+    assert "Content-Encoding" not in response.headers
+    assert response.headers["Vary"] == "Accept-Encoding"
+
+def test_gzip_listed_beats_wildcard(webserver_normal_config):
+    """An explicit gzip entry wins over * in either order"""
+    response = requests.get("http://localhost:4244/css/style.css",
+                            headers={"Accept-Encoding": "*;q=0, gzip"})
+    assert response.status_code == 200
+    assert response.headers["Content-Encoding"] == "gzip"
+    response = requests.get("http://localhost:4244/css/style.css",
+                            headers={"Accept-Encoding": "*, gzip;q=0"})
+    assert response.status_code == 200
+    assert response.headers.get("Content-Encoding") != "gzip"
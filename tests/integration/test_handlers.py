@@ -0,0 +1,64 @@
+import socket
+import threading
+import time
+
+import requests
+
+ECHO = "http://localhost:4244/api/echo"
+
+
+def test_handler_sees_request(webserver_normal_config):
+    """The blocking echo plugin gets method, path info, query, headers, body"""
+    response = requests.post(ECHO + "/some/thing?a=1", data="payload",
+                             headers={"X-Echo": "hello"}, timeout=2)
+    assert response.status_code == 200
+    assert response.headers["X-Handler"] == "echo"
+    assert response.text == "POST /some/thing?a=1\nhello\npayload"
+
+
+def test_handler_body_in_several_reads(webserver_normal_config):
+    """The handler runs once the whole body is in"""
+    sock = socket.create_connection(("localhost", 4244), timeout=2)
+    sock.sendall(b"PUT /api/echo HTTP/1.1\r\nHost: localhost:4244\r\n"
+                 b"Content-Length: 10\r\n\r\n12345")
+    time.sleep(0.2)
+    sock.sendall(b"67890")
+    reply = b""
+    while not reply.endswith(b"67890"):
+        data = sock.recv(4096)
+        if not data:
+            break
+        reply += data
+    sock.close()
+    assert reply.startswith(b"HTTP/1.1 200")
+    assert reply.endswith(b"PUT ?\n1234567890")
+
+
+def test_handler_body_too_large(webserver_normal_config):
+    response = requests.post(ECHO, data="x" * 20000, timeout=2)
+    assert response.status_code == 413
+
+
+def test_blocking_handler_does_not_stall_loop(webserver_normal_config):
+    """Static files are served while a blocking handler sleeps"""
+    result = {}
+
+    def slow():
+        result["slow"] = requests.get(ECHO + "?sleep=1", timeout=3)
+
+    thread = threading.Thread(target=slow)
+    thread.start()
+    time.sleep(0.2)
+    start = time.time()
+    response = requests.get("http://localhost:4244/", timeout=2)
+    assert response.status_code == 200
+    assert time.time() - start < 0.5
+    thread.join()
+    assert result["slow"].status_code == 200
+    assert result["slow"].text.startswith("GET ?sleep=1")
+
+
+def test_update_cookie_plugin_needs_name_and_value(webserver_normal_config):
+    response = requests.put("http://localhost:4244/api/update-cookie/novalue",
+                            timeout=2)
+    assert response.status_code == 400
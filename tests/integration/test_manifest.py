@@ -0,0 +1,86 @@
+import os
+import shutil
+
+import requests
+
+DIR = "htmltest/www2/manifest_test"
+URL = "http://localhost:4244/43/manifest_test/"
+
+
+def write(name, text):
+    with open(os.path.join(DIR, name), "w") as f:
+        f.write(text)
+
+
+def test_changes_outside_the_server_are_seen(webserver_normal_config):
+    """Files created, rewritten and removed after startup are served as they are now"""
+    shutil.rmtree(DIR, ignore_errors=True)
+    try:
+        assert requests.get(URL + "a.txt").status_code == 404
+        os.makedirs(os.path.join(DIR, "sub"))
+        write("a.txt", "one")
+        first = requests.get(URL + "a.txt")
+        assert first.status_code == 200
+        assert first.text == "one"
+
+        write("a.txt", "second version")
+        second = requests.get(URL + "a.txt")
+        assert second.text == "second version"
+        assert second.headers["ETag"] != first.headers["ETag"]
+
+        write("sub/index.html", "<p>sub</p>")
+        assert requests.get(URL + "sub/").text == "<p>sub</p>"
+        os.rename(os.path.join(DIR, "sub"), os.path.join(DIR, "moved"))
+        assert requests.get(URL + "sub/").status_code == 404
+        assert requests.get(URL + "moved/").text == "<p>sub</p>"
+
+        os.remove(os.path.join(DIR, "a.txt"))
+        assert requests.get(URL + "a.txt").status_code == 404
+        assert requests.get(URL + "a.txt/").status_code == 404
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
+
+
+def test_symlink_targets_are_not_cached(webserver_normal_config):
+    """A symlink's target can change without an event in the served tree,
+    so the link is looked at again on every request"""
+    shutil.rmtree(DIR, ignore_errors=True)
+    target = os.path.abspath("htmltest/manifest_link_target.txt")
+    try:
+        os.makedirs(DIR)
+        with open(target, "w") as f:
+            f.write("short")
+        os.symlink(target, os.path.join(DIR, "link.txt"))
+        assert requests.get(URL + "link.txt").text == "short"
+
+        with open(target, "w") as f:
+            f.write("a longer version of the target")
+        assert requests.get(URL + "link.txt").text == \
+            "a longer version of the target"
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
+        if os.path.exists(target):
+            os.remove(target)
+
+
+def test_many_files_in_a_new_directory(webserver_normal_config):
+    """Files written while a directory that was moved in is still being
+    walked are all served, with their content"""
+    stage = "htmltest/manifest_stage"
+    shutil.rmtree(DIR, ignore_errors=True)
+    shutil.rmtree(stage, ignore_errors=True)
+    try:
+        # a big tree keeps the walk busy while the files are written
+        os.makedirs(os.path.join(stage, "bulk"))
+        for i in range(5000):
+            open(os.path.join(stage, "bulk", "b%d" % i), "w").close()
+        os.rename(stage, DIR)
+        for i in range(200):
+            write("f%d.txt" % i, "file %d" % i)
+        for i in range(200):
+            response = requests.get(URL + "f%d.txt" % i)
+            assert response.status_code == 200
+            assert response.text == "file %d" % i
+    finally:
+        shutil.rmtree(DIR, ignore_errors=True)
+        shutil.rmtree(stage, ignore_errors=True)
@@ -0,0 +1,37 @@
+import os
+
+import requests
+
+STATUS = "http://localhost:4244/api/page-cache-status"
+PATH = "htmltest/www2/page_cache.bin"
+URL = "http://localhost:4244/43/page_cache.bin"
+
+
+def test_large_file_classes_and_ranges(webserver_normal_config):
+    """Files above file_drop_behind are sent whole and in ranges, and are
+    counted in their class with the pages probed on the way"""
+    body = os.urandom(6 * 1024 * 1024)
+    with open(PATH, "wb") as f:
+        f.write(body)
+        f.flush()
+        os.fsync(f.fileno())
+        os.posix_fadvise(f.fileno(), 0, 0, os.POSIX_FADV_DONTNEED)
+    try:
+        before = requests.get(STATUS).json()
+        response = requests.get(URL)
+        assert response.status_code == 200
+        assert response.content == body
+        part = requests.get(URL, headers={"Range": "bytes=5000000-5100000"})
+        assert part.status_code == 206
+        assert part.content == body[5000000:5100001]
+        assert requests.get("http://localhost:4244/index.html").status_code == 200
+
+        after = requests.get(STATUS).json()
+        drop = after["drop_behind"]
+        assert drop["requests"] == before["drop_behind"]["requests"] + 2
+        assert drop["bytes"] - before["drop_behind"]["bytes"] == len(body) + 100001
+        assert drop["pages"] > before["drop_behind"]["pages"]
+        assert drop["misses"] <= drop["pages"]
+        assert after["small"]["requests"] > before["small"]["requests"]
+    finally:
+        os.remove(PATH)
@@ -0,0 +1,43 @@
+import requests
+
+def test_single_range(webserver_normal_config):
+    """A single byte range gets a 206 with Content-Range"""
+    full = requests.get("http://localhost:4244/index.html")
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"Range": "bytes=0-9"})
+    assert response.status_code == 206, f"Expected 206, got {response.status_code}"
+    assert response.headers["Content-Range"] == f"bytes 0-9/{len(full.content)}"
+    assert response.content == full.content[:10]
+
+def test_suffix_range(webserver_normal_config):
+    """bytes=-N returns the last N bytes"""
+    full = requests.get("http://localhost:4244/index.html")
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"Range": "bytes=-5"})
+    assert response.status_code == 206
+    assert response.content == full.content[-5:]
+
+def test_multiple_ranges(webserver_normal_config):
+    """Several ranges come back as multipart/byteranges"""
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"Range": "bytes=0-3,10-12"})
+    assert response.status_code == 206
+    assert response.headers["Content-Type"].startswith("multipart/byteranges; boundary=")
+    assert int(response.headers["Content-Length"]) == len(response.content)
+    assert b"Content-Range: bytes 0-3/" in response.content
+    assert b"Content-Range: bytes 10-12/" in response.content
+
+def test_unsatisfiable_range(webserver_normal_config):
+    """A range past the end of the file is a 416"""
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"Range": "bytes=999999-"})
+    assert response.status_code == 416, f"Expected 416, got {response.status_code}"
+    assert response.headers["Content-Range"].startswith("bytes */")
+
+def test_if_range_mismatch(webserver_normal_config):
+    """A stale If-Range validator gets the whole file"""
+    full = requests.get("http://localhost:4244/index.html")
+    response = requests.get("http://localhost:4244/index.html",
+                            headers={"Range": "bytes=0-9", "If-Range": '"stale"'})
+    assert response.status_code == 200
+    assert response.content == full.content
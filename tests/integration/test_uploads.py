@@ -1,3 +1,8 @@
+import hashlib
+import os
+import shutil
+import socket
+import time
 import requests
 from urllib.parse import quote
 
@@ -156,4 +161,247 @@ def test_delete_large_file_with_space(webserver_normal_config):
     
     # Check if the file is deleted
     response = requests.get(delete_url)
-    assert response.status_code == 404, "File was not deleted successfully"
\ No newline at end of file
+    assert response.status_code == 404, "File was not deleted successfully"
+
+def test_chunked_upload_spooled(webserver_normal_config):
+    """A chunked upload bigger than the body buffer is stored whole"""
+    content = bytes(range(256)) * 8192
+    upload_url = 'http://localhost:4244/upload/chunked_spool.bin'
+    pieces = (content[i:i + 50000] for i in range(0, len(content), 50000))
+    response = requests.post(upload_url, data=pieces, timeout=5)
+    assert response.status_code == 201
+    try:
+        assert requests.get(upload_url).content == content
+    finally:
+        requests.delete(upload_url)
+
+
+def test_large_upload_then_pipelined_request(webserver_normal_config):
+    """A big Content-Length upload is stored exactly, and the request sent
+    right behind its body is still answered"""
+    content = bytes(range(251)) * 16000
+    sock = socket.create_connection(("localhost", 4244), timeout=5)
+    sock.sendall(b"POST /upload/spliced.bin HTTP/1.1\r\n"
+                 b"Host: localhost:4244\r\n"
+                 b"Content-Length: %d\r\n\r\n" % len(content) + content +
+                 b"GET /upload/spliced.bin HTTP/1.1\r\n"
+                 b"Host: localhost:4244\r\n\r\n")
+    reply = b""
+    while not reply.endswith(content[-1000:]):
+        data = sock.recv(65536)
+        if not data:
+            break
+        reply += data
+    sock.close()
+    try:
+        assert reply.startswith(b"HTTP/1.1 201")
+        assert reply.count(b"HTTP/1.1 200") == 1
+        assert reply.endswith(content)
+    finally:
+        requests.delete('http://localhost:4244/upload/spliced.bin')
+
+
+def form_body(fields, files, boundary="webservFormBoundary"):
+    """multipart/form-data body and its Content-Type header"""
+    body = b""
+    for name, value in fields.items():
+        body += (f'--{boundary}\r\nContent-Disposition: form-data; '
+                 f'name="{name}"\r\n\r\n').encode() + value.encode() + b"\r\n"
+    for name, (filename, content) in files.items():
+        body += (f'--{boundary}\r\nContent-Disposition: form-data; '
+                 f'name="{name}"; filename="{filename}"\r\n'
+                 f'Content-Type: application/octet-stream\r\n\r\n').encode()
+        body += content + b"\r\n"
+    body += f"--{boundary}--\r\n".encode()
+    return body, {'Content-Type': f'multipart/form-data; boundary={boundary}'}
+
+
+def test_multipart_form_upload(webserver_normal_config):
+    """Form uploads are split natively: files land in upload_dir, fields are
+    reported back"""
+    # "\r\n--" runs that only look like the start of a delimiter, and a
+    # payload big enough to cross many reads
+    content = (b"\r\n--" + bytes(range(256)) + b"\r\n-") * 4000
+    body, headers = form_body({'note': 'hello "world"'},
+                              {'file': ('../../form_upload.bin', content)})
+    response = requests.post('http://localhost:4244/upload/', data=body,
+                             headers=headers, timeout=5)
+    try:
+        assert response.status_code == 201
+        assert response.json() == {
+            "files": [{"field": "file", "filename": "form_upload.bin",
+                       "size": len(content)}],
+            "fields": {"note": 'hello "world"'},
+        }
+        stored = requests.get('http://localhost:4244/upload/form_upload.bin')
+        assert stored.content == content
+    finally:
+        requests.delete('http://localhost:4244/upload/form_upload.bin')
+
+
+def test_multipart_form_redirect(webserver_normal_config):
+    body, headers = form_body({'redirect': '/cgi/fileupload.py'},
+                              {'file': ('form_redirect.txt', b'some text')})
+    response = requests.post('http://localhost:4244/upload', data=body,
+                             headers=headers, allow_redirects=False, timeout=5)
+    try:
+        assert response.status_code == 303
+        assert response.headers['Location'] == '/cgi/fileupload.py'
+    finally:
+        requests.delete('http://localhost:4244/upload/form_redirect.txt')
+
+
+def test_multipart_form_truncated(webserver_normal_config):
+    """A body without its closing delimiter is refused and not stored"""
+    body = (b"--XyZ\r\nContent-Disposition: form-data; name=\"file\"; "
+            b"filename=\"form_partial.txt\"\r\n\r\npartial data")
+    response = requests.post(
+        'http://localhost:4244/upload/', data=body, timeout=5,
+        headers={'Content-Type': 'multipart/form-data; boundary=XyZ'})
+    assert response.status_code == 400
+    stored = requests.get('http://localhost:4244/upload/form_partial.txt')
+    assert stored.status_code == 404
+
+
+def test_aborted_upload_keeps_previous_file(webserver_normal_config):
+    """An upload is only published once complete: a client that goes away
+    halfway leaves the old file as it was"""
+    upload_url = 'http://localhost:4244/upload/atomic.txt'
+    response = requests.post(upload_url, data=b'old content', timeout=5,
+                             headers={'Content-Type': 'text/plain'})
+    assert response.status_code == 201
+    try:
+        sock = socket.create_connection(("localhost", 4244), timeout=5)
+        sock.sendall(b"POST /upload/atomic.txt HTTP/1.1\r\n"
+                     b"Host: localhost:4244\r\n"
+                     b"Content-Length: 100000\r\n\r\n" + b"new" * 1000)
+        sock.close()
+        time.sleep(0.5)
+        assert requests.get(upload_url).content == b'old content'
+    finally:
+        requests.delete(upload_url)
+
+
+def test_resumable_upload(webserver_normal_config):
+    """A resumable upload is created, appended to at its offset across
+    requests, and published once complete"""
+    url = 'http://localhost:4244/upload/resumed.bin'
+    content = bytes(range(256)) * 400
+    response = requests.post(url, headers={'Upload-Length': str(len(content))})
+    assert response.status_code == 201
+    assert response.headers['Upload-Offset'] == '0'
+    try:
+        response = requests.patch(url, data=content[:40000],
+                                  headers={'Upload-Offset': '0'})
+        assert response.status_code == 204
+        assert response.headers['Upload-Offset'] == '40000'
+
+        # a retry of the same piece is refused with where to go on from
+        response = requests.patch(url, data=content[:40000],
+                                  headers={'Upload-Offset': '0'})
+        assert response.status_code == 409
+        assert response.headers['Upload-Offset'] == '40000'
+
+        response = requests.head(url)
+        assert response.headers['Upload-Offset'] == '40000'
+        assert response.headers['Upload-Length'] == str(len(content))
+        assert requests.get(url).status_code == 404
+
+        # the session files are not reachable by their own names
+        for name in ('.resumed.bin.resume', '.resumed.bin.resume-length'):
+            session = 'http://localhost:4244/upload/' + name
+            assert requests.get(session).status_code == 404
+            assert requests.put(session, data=b'x').status_code == 404
+            assert requests.delete(session).status_code == 404
+        response = requests.head(url)
+        assert response.headers['Upload-Offset'] == '40000'
+
+        rest = content[40000:]
+        response = requests.put(url, data=rest, headers={
+            'Content-Range': 'bytes 40000-%d/%d' % (len(content) - 1,
+                                                    len(content))})
+        assert response.status_code == 201
+        assert requests.get(url).content == content
+    finally:
+        requests.delete(url)
+
+
+def test_resumable_upload_after_drop(webserver_normal_config):
+    """The bytes that arrived before a connection dropped are kept, and the
+    upload goes on from there"""
+    url = 'http://localhost:4244/upload/dropped.bin'
+    content = b'0123456789' * 10000
+    assert requests.post(url, headers={
+        'Upload-Length': str(len(content))}).status_code == 201
+    try:
+        sock = socket.create_connection(("localhost", 4244), timeout=5)
+        sock.sendall(b"PATCH /upload/dropped.bin HTTP/1.1\r\n"
+                     b"Host: localhost:4244\r\nUpload-Offset: 0\r\n"
+                     b"Content-Length: %d\r\n\r\n" % len(content) +
+                     content[:30000])
+        time.sleep(0.3)
+        sock.close()
+        time.sleep(0.3)
+        offset = int(requests.head(url).headers['Upload-Offset'])
+        assert offset == 30000
+        response = requests.patch(url, data=content[offset:],
+                                  headers={'Upload-Offset': str(offset)})
+        assert response.status_code == 201
+        assert requests.get(url).content == content
+    finally:
+        requests.delete(url)
+
+
+def test_dedup_upload_store(webserver_normal_config):
+    """With upload_dedup the same content uploaded under two names is stored
+    once, both names are links to .store/<sha256>"""
+    content = os.urandom(300000)
+    digest = hashlib.sha256(content).hexdigest()
+    store = 'htmltest/www1/upload/.store'
+    try:
+        for name in ('dedup_a.bin', 'dedup_b.bin'):
+            response = requests.post('http://localhost:4244/shared/' + name,
+                                     data=content, timeout=5)
+            assert response.status_code == 201
+        body, headers = form_body({}, {'file': ('dedup_c.bin', content)})
+        response = requests.post('http://localhost:4244/shared/', data=body,
+                                 headers=headers, timeout=5)
+        assert response.status_code == 201
+        assert requests.get(
+            'http://localhost:4244/shared/dedup_b.bin').content == content
+        stored = os.stat(os.path.join(store, digest))
+        assert stored.st_nlink == 4
+        assert os.stat('htmltest/www1/upload/dedup_c.bin').st_ino == \
+            stored.st_ino
+    finally:
+        for name in ('dedup_a.bin', 'dedup_b.bin', 'dedup_c.bin'):
+            requests.delete('http://localhost:4244/shared/' + name)
+        shutil.rmtree(store, ignore_errors=True)
+
+
+def test_dedup_store_hidden_and_reclaimed(webserver_normal_config):
+    """The store is not served or deleted through the site, and an object
+    goes once its last name is replaced or deleted"""
+    first = os.urandom(20000)
+    second = os.urandom(20000)
+    store = 'htmltest/www1/upload/.store'
+    url = 'http://localhost:4244/shared/dedup_r.bin'
+    try:
+        assert requests.post(url, data=first, timeout=5).status_code == 201
+        digest = hashlib.sha256(first).hexdigest()
+        stored = 'http://localhost:4244/shared/.store/' + digest
+        assert requests.get(stored).status_code == 404
+        assert requests.delete(stored).status_code == 404
+        assert os.path.exists(os.path.join(store, digest))
+
+        assert requests.post(url, data=second, timeout=5).status_code == 201
+        assert not os.path.exists(os.path.join(store, digest))
+        digest = hashlib.sha256(second).hexdigest()
+        assert os.path.exists(os.path.join(store, digest))
+
+        assert requests.delete(url).status_code == 200
+        assert not os.path.exists(os.path.join(store, digest))
+        assert os.listdir(store) == []
+    finally:
+        requests.delete(url)
+        shutil.rmtree(store, ignore_errors=True)